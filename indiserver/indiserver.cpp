@@ -33,6 +33,22 @@
  * 2017-01-29 JM: Added option to drop stream blobs if client blob queue is
  * higher than maxstreamsiz bytes
  *
+ * Optionally (-c), a setXXXVector queued for a client and not yet being sent
+ * is replaced in place by a newer one for the same property, so slow clients
+ * converge to the current state instead of being shut down.
+ *
+ * Clients may limit the rate of setXXXVector they receive per property
+ * (maxUpdateRate message, -s default). Intermediate updates are coalesced
+ * and the last one is always delivered.
+ *
+ * TCP clients on the same host may upgrade to shared buffer BLOBs: on
+ * <sharedBufferRequest/>, a <sharedBufferReply path='p' token='t'/> is sent
+ * (no attributes if not possible). The client connects to the local socket
+ * p and sends <sharedBufferAttach token='t'/> on it, which is confirmed with
+ * <sharedBufferAttached/> on the TCP connection. From then on, BLOBs sent
+ * attached='true' on TCP have their buffer fds passed on the local socket,
+ * each with one byte, before the XML that refers to them.
+ *
  * Implementation notes:
  *
  * We fork each driver and open a server socket listening for INDI clients.
@@ -42,13 +58,21 @@
  * one client or device, they are queued and only removed after the last
  * consumer is finished. XMLEle are converted to linear strings before being
  * sent to optimize write system calls and avoid blocking to slow clients.
- * Clients that get more than maxqsiz bytes behind are shut down.
+ * Clients that get more than maxqsiz bytes behind are shut down, unless the
+ * message only replaces a queued update (conflation mode).
+ *
+ * With -t n, reading and parsing the XML of each connection, and writing to
+ * it, run on one of n I/O threads, the same one for the life of the
+ * connection. The main loop still watches all the fds and hands the ready
+ * ones over. Routing and queues are shared under one mutex, which the I/O
+ * threads only release for the read, the parsing and the write.
  */
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE // needed for siginfo_t and sigaction
 #endif
 
 #include "config.h"
+#include <algorithm>
 #include <set>
 #include <string>
 #include <list>
@@ -57,6 +81,10 @@
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <random>
 
 #include <assert.h>
 
@@ -68,6 +96,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <libgen.h>
 #include <netdb.h>
 #include <signal.h>
@@ -90,6 +119,7 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #ifdef MSG_ERRQUEUE
 #include <linux/errqueue.h>
 #endif
@@ -99,12 +129,16 @@
 #define INDIPORT      7624    /* default TCP/IP port to listen */
 #define INDIUNIXSOCK "/tmp/indiserver" /* default unix socket path (local connections) */
 #define MAXSBUF       512
-#define MAXRBUF       49152 /* max read buffering here */
-#define MAXWSIZ       49152 /* max bytes/write */
+#define MAXRBUF       49152 /* initial read buffering here */
+#define MAXRBUFMAX    (4 * 1024 * 1024) /* max read buffering, while reads keep filling it */
+#define RBUFIDLE      64    /* short reads before the read buffer shrinks back */
+#define MAXWSIZ       49152 /* max bytes/write, per queue and writable event */
+#define MAXWIOV       128   /* max chunks gathered in one write */
 #define SHORTMSGSIZ   2048  /* buf size for most messages */
 #define DEFMAXQSIZ    128   /* default max q behind, MB */
 #define DEFMAXSSIZ    5     /* default max stream behind, MB */
 #define DEFMAXRESTART 10    /* default max restarts */
+#define DEFIOTHREADS  0     /* default I/O threads, 0 to do all io on the main loop */
 #define MAXFD_PER_MESSAGE 16 /* No more than 16 buffer attached to a message */
 #ifdef OSX_EMBEDED_MODE
 #define LOGNAME  "/Users/%s/Library/Logs/indiserver.log"
@@ -244,6 +278,13 @@ class Collectable
                 }
         };
 
+    public:
+        /* Identifier within the current ConcurrentSet, 0 if not in any */
+        unsigned long getId() const
+        {
+            return id;
+        }
+
     protected:
         /* heartbeat.alive will return true as long as this item has not changed collection.
          * Also detect deletion of the Collectable */
@@ -253,6 +294,47 @@ class Collectable
         }
 };
 
+class MsgQueue;
+
+/* One of the -t I/O threads. It runs the reads and writes posted for the
+ * connections it was given, in order.
+ */
+class IoThread
+{
+        std::deque<std::pair<MsgQueue *, int>> jobs;    /* queue and EV_READ/EV_WRITE to run */
+        std::condition_variable wakeup;
+        std::thread thread;
+
+        void run();
+    public:
+        IoThread();
+
+        /* run the io of q for revents on this thread. ioMutex must be held */
+        void post(MsgQueue * q, int revents);
+};
+
+/* Held by the main loop except while it polls, and by I/O threads except while they read, parse or write */
+static std::mutex ioMutex;
+static std::vector<IoThread *> ioThreads;
+static ev::async ioWakeup;      /* makes the main loop see watchers changed by I/O threads */
+
+/* Releases ioMutex for its scope when on an I/O thread */
+class IoUnlocked
+{
+    public:
+        IoUnlocked()
+        {
+            if (!ioThreads.empty())
+                ioMutex.unlock();
+        }
+
+        ~IoUnlocked()
+        {
+            if (!ioThreads.empty())
+                ioMutex.lock();
+        }
+};
+
 /**
  * A MsgChunk is either:
  *  a raw xml fragment
@@ -522,21 +604,70 @@ class MsgQueue: public Collectable
         // Update the status of FD read/write ability
         void updateIos();
 
+        // With I/O threads: the one of this queue, and its reads and writes posted or running there
+        int ioThread = -1;
+        bool reading = false, writing = false;
+        bool waitWritable = false;      /* last write was short, the main loop watches wFd */
+        bool closing = false;           /* close requested while reading or writing, done after */
+        size_t writingMsgs = 0;         /* messages from the head that a running write may send from */
+        void postIo(int revents);
+
         std::set<SerializedMsg*> readBlocker;     /* The message that block this queue */
 
         std::list<SerializedMsg*> msgq;           /* To send msg queue */
+        int sideFd = -1;                          /* local socket for the shared buffers, if wFd can't pass them */
+        ev::io sideIo;                            /* waits for sideFd while it is full */
+        bool sideFdsSent = false;                 /* buffers of the head chunk went on sideFd, its bytes not yet */
+        void sideCb(ev::io &watcher, int revents);
         std::list<int> incomingSharedBuffers; /* During reception, fds accumulate here */
 
         // Position in the head message
         MsgChunckIterator nsent;
 
+        // Queued updates that a newer one may replace (conflation), by device/property key
+        struct PendingUpdate
+        {
+            std::list<SerializedMsg*>::iterator pos;
+            size_t signature;
+        };
+        std::unordered_map<std::string, PendingUpdate> pendingUpdates;
+        std::unordered_map<const SerializedMsg*, std::string> pendingUpdateKeys;
+
+        void forgetPendingUpdate(const SerializedMsg * msg);
+
+        // Updates held back by a max update rate, by device/property key
+        struct ThrottledUpdate
+        {
+            double lastSent = 0;
+            double due = 0;                 /* when held may be queued */
+            SerializedMsg * held = nullptr;
+            size_t signature = 0;
+        };
+        std::unordered_map<std::string, ThrottledUpdate> throttledUpdates;
+        ev::timer throttleTimer;            /* runs while any update is held, until the first due */
+        double throttleDue = 0;
+        void throttleCb();
+        void releaseThrottledUpdates();
+
+        /* true if an update for key with signature would replace the queued one (conflation) */
+        bool canReplaceQueued(const std::string &key, size_t signature) const;
+
+        /* Add msg to queue, replacing the queued update for key if conflating. Does not update ios */
+        void queueUpdate(SerializedMsg * msg, const std::string &key, size_t signature, bool replaceable);
+
+        // Read buffer. Doubles while reads fill it (BLOB uploads), back to MAXRBUF after RBUFIDLE short reads
+        std::unique_ptr<char[]> readBuffer;
+        size_t readBufferSize = 0;
+        int readBufferIdle = 0;
+
         // Handle fifo or socket case
         size_t doRead(char * buff, size_t len);
         void readFromFd();
 
-        /* write the next chunk of the current message in the queue to the given
-         * client. pop message from queue when complete and free the message if we are
-         * the last one to use it. shut down this client if trouble.
+        /* write the next chunks of the messages in the queue to the given client, as
+         * many as are ready and fit in MAXWSIZ, in one writev/sendmsg. pop messages from
+         * queue when complete and free them if we are the last one to use them. shut down
+         * this client if trouble.
          */
         void writeToFd();
 
@@ -557,6 +688,9 @@ class MsgQueue: public Collectable
         /* Close the connection. (May be restarted later depending on driver logic) */
         virtual void close() = 0;
 
+        /* true if close must wait for the running read or write, it is done when that ends */
+        bool deferClose();
+
         /* Close the writing part of the connection. By default, shutdown the write part, but keep on reading. May delete this */
         virtual void closeWritePart();
 
@@ -574,6 +708,21 @@ class MsgQueue: public Collectable
 
         void pushMsg(Msg * msg);
 
+        /* push msg, or replace in place an update queued with the same key and signature that
+         * is not being sent yet (conflation). msg itself may be replaced later only if replaceable.
+         * if interval > 0, msg is held until interval seconds after the previous one for key,
+         * a newer one replaces it meanwhile.
+         * if replaceOnly, msg is only taken if it replaces a queued or held update, else false is returned
+         * and msg is left alone.
+         */
+        bool pushUpdate(Msg * msg, const std::string &key, size_t signature, bool replaceable, double interval,
+                        bool replaceOnly);
+
+        /* queued updates may not be replaced anymore, a message changing their order is about to be
+         * queued. held ones are queued now.
+         */
+        void clearPendingUpdates();
+
         /* return storage size of all Msqs on the given q */
         unsigned long msgQSize() const;
 
@@ -585,8 +734,14 @@ class MsgQueue: public Collectable
 
         void messageMayHaveProgressed(const SerializedMsg * msg);
 
+        /* on the I/O thread of the queue: read or write as posted */
+        void runIo(int revents);
+
         void setFds(int rFd, int wFd);
 
+        /* pass shared buffers on fd from now on, wFd only gets the XML. fd is closed with the others */
+        void setSideFd(int fd);
+
         virtual bool acceptSharedBuffers() const
         {
             return useSharedBuffer;
@@ -606,6 +761,39 @@ class Property
         Property(const std::string &dev, const std::string &name): dev(dev), name(name) {}
 };
 
+/* Property subscriptions of a set of queues (clients or snooping drivers), indexed by device.
+ * Routing a message only walks the subscriptions registered for its device.
+ */
+class PropertyIndex
+{
+    public:
+        struct Entry
+        {
+            unsigned long id;   /* id of the subscribing queue in its ConcurrentSet */
+            Property * prop;
+        };
+
+    private:
+        std::unordered_map<std::string, std::vector<Entry>> byDevice;
+
+    public:
+        /* Entries are kept in registration order */
+        void add(unsigned long id, Property * prop)
+        {
+            byDevice[prop->dev].push_back({id, prop});
+        }
+
+        /* Drop every subscription of id. props are the one that were added for it */
+        void remove(unsigned long id, const std::list<Property*> &props);
+
+        /* return the subscriptions for dev, or nullptr if none */
+        const std::vector<Entry> * find(const std::string &dev) const
+        {
+            auto it = byDevice.find(dev);
+            return it == byDevice.end() ? nullptr : &it->second;
+        }
+};
+
 
 class Fifo
 {
@@ -651,6 +839,35 @@ class ClInfo: public MsgQueue
         /* close down the given client */
         virtual void close();
 
+        /* Update allprops and the index of clients that want all devices */
+        void setAllProps(int allprops);
+
+        /* max update rates requested by the client, last one first */
+        struct UpdateRate
+        {
+            std::string dev;    /* pattern, empty for all */
+            std::string name;   /* pattern, empty for all */
+            double interval;    /* min seconds between updates, 0 for no limit */
+        };
+        std::list<UpdateRate> updateRates;
+
+        /* Update the client max update rate of matching properties */
+        void crackUpdateRate(const std::string &dev, const std::string &name, const char *rate);
+
+        /* min seconds between two updates of dev/name sent to this client, 0 for no limit */
+        double updateInterval(const std::string &dev, const std::string &name) const;
+
+        /* token given to this TCP client to attach a local socket for its shared buffers */
+        std::string sharedBufferToken;
+
+        /* reply to sharedBufferRequest, with a token if this is a TCP client on the same host */
+        void offerSharedBuffer();
+
+        /* sharedBufferAttach on a local socket: it becomes the side socket of the TCP client
+         * given the token. this connection is closed
+         */
+        void attachSharedBufferClient(const std::string &token);
+
     public:
         std::list<Property*> props;     /* props we want */
         int allprops = 0;               /* saw getProperties w/o device */
@@ -680,6 +897,12 @@ class ClInfo: public MsgQueue
 
         /* Reference to all active clients */
         static ConcurrentSet<ClInfo> clients;
+
+        /* props of all clients, by device */
+        static PropertyIndex subscriptions;
+
+        /* ids of clients with allprops set */
+        static std::set<unsigned long> allPropsClients;
 };
 
 /* info for each connected driver */
@@ -748,6 +971,9 @@ class DvrInfo: public MsgQueue
         /* Reference to all active drivers */
         static ConcurrentSet<DvrInfo> drivers;
 
+        /* sprops of all drivers, by device */
+        static PropertyIndex snoopers;
+
         // decoding of attached blobs from driver is not supported ATM. Be conservative here
         virtual bool acceptSharedBuffers() const
         {
@@ -880,6 +1106,9 @@ static char *ldir;                                     /* where to log driver me
 static unsigned int maxqsiz  = (DEFMAXQSIZ * 1024 * 1024); /* kill if these bytes behind */
 static unsigned int maxstreamsiz  = (DEFMAXSSIZ * 1024 * 1024); /* drop blobs if these bytes behind while streaming*/
 static int maxrestarts   = DEFMAXRESTART;
+static int conflate;                                   /* replace queued setXXXVector by newer ones for clients */
+static double defupdateinterval;                       /* min seconds between updates of a property per client, 0 for no limit */
+static int nioThreads    = DEFIOTHREADS;               /* threads for the connections io, 0 for the main loop */
 
 static std::vector<XMLEle *> findBlobElements(XMLEle * root);
 
@@ -889,6 +1118,7 @@ static void noSIGPIPE(void);
 static char *indi_tstamp(char *s);
 static void logDMsg(XMLEle *root, const char *dev);
 static void Bye(void);
+static void startIoThreads(int count);
 
 static int readFdError(int
                        fd);                       /* Read a pending error condition on the given fd. Return errno value or 0 if none */
@@ -961,6 +1191,18 @@ int main(int ac, char *av[])
                     maxstreamsiz = 1024 * 1024 * atoi(*++av);
                     ac--;
                     break;
+                case 'c':
+                    conflate = 1;
+                    break;
+                case 's':
+                    if (ac < 2)
+                    {
+                        fprintf(stderr, "-s requires max updates per second\n");
+                        usage();
+                    }
+                    defupdateinterval = atof(*++av) > 0 ? 1 / atof(*av) : 0;
+                    ac--;
+                    break;
 #ifdef ENABLE_INDI_SHARED_MEMORY
                 case 'u':
                     if (ac < 2)
@@ -992,6 +1234,17 @@ int main(int ac, char *av[])
                         maxrestarts = 0;
                     ac--;
                     break;
+                case 't':
+                    if (ac < 2)
+                    {
+                        fprintf(stderr, "-t requires number of I/O threads\n");
+                        usage();
+                    }
+                    nioThreads = atoi(*++av);
+                    if (nioThreads < 0)
+                        nioThreads = 0;
+                    ac--;
+                    break;
                 case 'v':
                     verbose++;
                     break;
@@ -1008,6 +1261,10 @@ int main(int ac, char *av[])
     /* take care of some unixisms */
     noSIGPIPE();
 
+    /* connections created from now on get an I/O thread */
+    if (nioThreads > 0)
+        startIoThreads(nioThreads);
+
     /* start each driver */
     while (ac-- > 0)
     {
@@ -1077,11 +1334,16 @@ static void usage(void)
     fprintf(stderr,
             " -d m     : drop streaming blobs if client gets more than this many MB behind, default %d. 0 to disable\n",
             DEFMAXSSIZ);
+    fprintf(stderr, " -c       : replace updates queued for a client by newer ones of the same property\n");
+    fprintf(stderr, " -s r     : max updates per second of a property sent to a client, default unlimited. Clients may\n");
+    fprintf(stderr, "            set their own with <maxUpdateRate [device='d'] [name='n']>r</maxUpdateRate>, d/n are patterns\n");
 #ifdef ENABLE_INDI_SHARED_MEMORY
     fprintf(stderr, " -u path  : Path for the local connection socket (abstract), default %s\n", INDIUNIXSOCK);
 #endif
     fprintf(stderr, " -p p     : alternate IP port, default %d\n", INDIPORT);
     fprintf(stderr, " -r r     : maximum driver restarts on error, default %d\n", DEFMAXRESTART);
+    fprintf(stderr, " -t n     : threads reading, parsing and writing the connections, default %d (main loop)\n",
+            DEFIOTHREADS);
     fprintf(stderr, " -f path  : Path to fifo for dynamic startup and shutdown of drivers.\n");
     fprintf(stderr, " -v       : show key events, no traffic\n");
     fprintf(stderr, " -vv      : -v + key message content\n");
@@ -1091,6 +1353,34 @@ static void usage(void)
     exit(2);
 }
 
+static void ioRelease(struct ev_loop *) noexcept
+{
+    ioMutex.unlock();
+}
+
+static void ioAcquire(struct ev_loop *) noexcept
+{
+    ioMutex.lock();
+}
+
+static void ioWakeupCb(ev::async &, int)
+{
+    // Nothing to do: the loop looks at the watchers again
+}
+
+/* the main loop keeps ioMutex, but for polling */
+static void startIoThreads(int count)
+{
+    ioMutex.lock();
+    ev_set_loop_release_cb(loop, ioRelease, ioAcquire);
+
+    ioWakeup.set<ioWakeupCb>();
+    ioWakeup.start();
+
+    for (int i = 0; i < count; ++i)
+        ioThreads.push_back(new IoThread());
+}
+
 /* turn off SIGPIPE on bad write so we can handle it inline */
 static void noSIGPIPE()
 {
@@ -1867,6 +2157,25 @@ void ClInfo::onMessage(XMLEle * root, std::list<int> &sharedBuffers)
     const char *name = findXMLAttValu(root, "name");
     int isblob       = !strcmp(tagXMLEle(root), "setBLOBVector");
 
+    /* for us only, it must not subscribe to dev */
+    if (!strcmp(roottag, "maxUpdateRate"))
+    {
+        crackUpdateRate(dev, name, pcdataXMLEle(root));
+        return;
+    }
+
+    if (!strcmp(roottag, "sharedBufferRequest"))
+    {
+        offerSharedBuffer();
+        return;
+    }
+
+    if (!strcmp(roottag, "sharedBufferAttach"))
+    {
+        attachSharedBufferClient(findXMLAttValu(root, "token"));
+        return;
+    }
+
     /* snag interested properties.
      * N.B. don't open to alldevs if seen specific dev already, else
      *   remote client connections start returning too much.
@@ -1876,12 +2185,12 @@ void ClInfo::onMessage(XMLEle * root, std::list<int> &sharedBuffers)
         // Signature for CHAINED SERVER
         // Not a regular client.
         if (dev[0] == '*' && !this->props.size())
-            this->allprops = 2;
+            setAllProps(2);
         else
             addDevice(dev, name, isblob);
     }
     else if (!strcmp(roottag, "getProperties") && !this->props.size() && this->allprops != 2)
-        this->allprops = 1;
+        setAllProps(1);
 
     /* snag enableBLOB -- send to remote drivers too */
     if (!strcmp(roottag, "enableBLOB"))
@@ -2019,6 +2328,9 @@ void DvrInfo::closeWritePart()
 
 void ClInfo::close()
 {
+    if (deferClose())
+        return;
+
     if (verbose > 0)
         log("shut down complete - bye!\n");
 
@@ -2032,6 +2344,9 @@ void ClInfo::close()
 
 void DvrInfo::close()
 {
+    if (deferClose())
+        return;
+
     // Tell client driver is dead.
     for (auto dev : dev)
     {
@@ -2138,17 +2453,27 @@ void DvrInfo::q2RDrivers(const std::string &dev, Msg *mp, XMLEle *root)
 
 void DvrInfo::q2SDrivers(DvrInfo *me, int isblob, const std::string &dev, const std::string &name, Msg *mp, XMLEle *root)
 {
+    auto entries = snoopers.find(dev);
+    if (entries == nullptr)
+        return;
+
+    /* first snooped property of each driver matching dev/name, as findSDevice would return */
+    std::map<unsigned long, Property *> snooping;
+    for (auto &e : *entries)
+    {
+        if (e.prop->name.empty() || e.prop->name == name)
+            snooping.insert({e.id, e.prop});
+    }
+
     std::string meRemoteServerUid = me ? me->remoteServerUid() : "";
-    for (auto dpId : drivers.ids())
+    for (auto &it : snooping)
     {
-        auto dp = drivers[dpId];
+        auto dp = drivers[it.first];
         if (dp == nullptr) continue;
 
-        Property *sp = dp->findSDevice(dev, name);
+        Property *sp = it.second;
 
-        /* nothing for dp if not snooping for dev/name or wrong BLOB mode */
-        if (!sp)
-            continue;
+        /* nothing for dp if wrong BLOB mode */
         if ((isblob && sp->blob == B_NEVER) || (!isblob && sp->blob == B_ONLY))
             continue;
 
@@ -2182,6 +2507,7 @@ void DvrInfo::addSDevice(const std::string &dev, const std::string &name)
     sp = new Property(dev, name);
     sp->blob = B_NEVER;
     sprops.push_back(sp);
+    snoopers.add(getId(), sp);
 
     if (verbose)
         log(fmt("snooping on %s.%s\n", dev.c_str(), name.c_str()));
@@ -2200,17 +2526,63 @@ Property * DvrInfo::findSDevice(const std::string &dev, const std::string &name)
 
 void ClInfo::q2Clients(ClInfo *notme, int isblob, const std::string &dev, const std::string &name, Msg *mp, XMLEle *root)
 {
+    /* collect interested clients, with their exact dev/name subscription if any */
+    std::map<unsigned long, Property *> subscribers;
+    if (dev.empty())
+    {
+        for (auto cpId : clients.ids())
+            subscribers[cpId] = nullptr;
+    }
+    else
+    {
+        for (auto cpId : allPropsClients)
+            subscribers[cpId] = nullptr;
+    }
+
+    auto entries = subscriptions.find(dev);
+    if (entries != nullptr)
+    {
+        for (auto &e : *entries)
+        {
+            if (e.prop->name == name)
+                subscribers[e.id] = e.prop;
+            else if (e.prop->name.empty())
+                subscribers.insert({e.id, nullptr});
+        }
+    }
+
+    /* with conflation or a max update rate, a setXXXVector may replace a queued or held one with
+     * the same elements. One carrying a message must still be delivered, it replaces but can't be replaced.
+     * def and del change what a queued update applies to, queued ones are not replaced anymore.
+     */
+    const char *tag = tagXMLEle(root);
+    bool isupdate = !isblob && !strncmp(tag, "set", 3);
+    bool reorders = !strncmp(tag, "def", 3) || !strcmp(tag, "delProperty");
+    std::string updateKey;
+    size_t updateSignature = 0;
+    auto crackUpdate = [&]()
+    {
+        if (!updateKey.empty())
+            return;
+        updateKey = dev + '\0' + name;
+        std::string elements = tag;
+        for (XMLEle *ep = nextXMLEle(root, 1); ep; ep = nextXMLEle(root, 0))
+        {
+            elements += '\0';
+            elements += findXMLAttValu(ep, "name");
+        }
+        updateSignature = std::hash<std::string>()(elements);
+    };
+
     /* queue message to each interested client */
-    for (auto cpId : clients.ids())
+    for (auto &it : subscribers)
     {
-        auto cp = clients[cpId];
+        auto cp = clients[it.first];
         if (cp == nullptr) continue;
 
-        /* cp in use? notme? want this dev/name? blob? */
+        /* cp in use? notme? blob? */
         if (cp == notme)
             continue;
-        if (cp->findDevice(dev, name) < 0)
-            continue;
 
         //if ((isblob && cp->blob==B_NEVER) || (!isblob && cp->blob==B_ONLY))
         if (!isblob && cp->blob == B_ONLY)
@@ -2220,15 +2592,7 @@ void ClInfo::q2Clients(ClInfo *notme, int isblob, const std::string &dev, const
         {
             if (cp->props.size() > 0)
             {
-                Property *blobp = nullptr;
-                for (auto pp : cp->props)
-                {
-                    if (pp->dev == dev && pp->name == name)
-                    {
-                        blobp = pp;
-                        break;
-                    }
-                }
+                Property *blobp = it.second;
 
                 if ((blobp && blobp->blob == B_NEVER) || (!blobp && cp->blob == B_NEVER))
                     continue;
@@ -2265,7 +2629,10 @@ void ClInfo::q2Clients(ClInfo *notme, int isblob, const std::string &dev, const
                 continue;
             }
         }
-        if (ql > maxqsiz)
+        /* an update that replaces a pending one is let through */
+        double interval = isupdate ? cp->updateInterval(dev, name) : 0;
+        bool mayReplace = isupdate && (conflate || interval > 0);
+        if (ql > maxqsiz && !mayReplace)
         {
             if (verbose)
                 cp->log(fmt("%ld bytes behind, shutting down\n", ql));
@@ -2278,7 +2645,22 @@ void ClInfo::q2Clients(ClInfo *notme, int isblob, const std::string &dev, const
                         tagXMLEle(root), findXMLAttValu(root, "device"), findXMLAttValu(root, "name")));
 
         // pushmsg can kill cp. do at end
-        cp->pushMsg(mp);
+        if (mayReplace)
+        {
+            crackUpdate();
+            if (!cp->pushUpdate(mp, updateKey, updateSignature, !findXMLAtt(root, "message"), interval, ql > maxqsiz))
+            {
+                if (verbose)
+                    cp->log(fmt("%ld bytes behind, shutting down\n", ql));
+                cp->close();
+            }
+        }
+        else
+        {
+            if (reorders)
+                cp->clearPendingUpdates();
+            cp->pushMsg(mp);
+        }
     }
 
     return;
@@ -2345,9 +2727,10 @@ void ClInfo::q2Servers(DvrInfo *me, Msg *mp, XMLEle *root)
 void MsgQueue::writeToFd()
 {
     ssize_t nw;
+    int error;
     void * data;
     ssize_t nsend;
-    std::vector<int> sharedBuffers;
+    std::vector<int> sharedBuffers, chunckBuffers;
 
     /* get current message */
     auto mp = headMsg();
@@ -2357,88 +2740,187 @@ void MsgQueue::writeToFd()
         return;
     }
 
+    /* gather the ready chunks from the current position on, across messages, never more
+     * than MAXWSIZ to reduce blocking. Shared buffers go with the first chunk only: a chunk
+     * attaching some starts the next write.
+     */
+    struct iovec iov[MAXWIOV];
+    int iovMsg[MAXWIOV];    /* index of the message of each chunck in the queue */
+    int iovCount = 0;
+    int msgIndex = 0;
+    ssize_t total = 0;
 
-    do
+    MsgChunckIterator position = nsent;
+    auto it = msgq.begin();
+    while (it != msgq.end() && iovCount < MAXWIOV && total < MAXWSIZ)
     {
-        if (!mp->getContent(nsent, data, nsend, sharedBuffers))
+        if (!(*it)->getContent(position, data, nsend, chunckBuffers))
         {
-            wio.stop();
-            return;
+            if (iovCount == 0)
+            {
+                wio.stop();
+                return;
+            }
+            break;
         }
 
         if (nsend == 0)
         {
-            consumeHeadMsg();
-            mp = headMsg();
-            if (mp == nullptr)
+            if (iovCount == 0)
             {
-                return;
+                consumeHeadMsg();
+                it = msgq.begin();
+                position = nsent;
+                continue;
+            }
+
+            // Production of following messages starts as they are reached
+            msgIndex++;
+            if (++it != msgq.end())
+            {
+                position.reset();
+                (*it)->requestContent(position);
             }
+            continue;
         }
+
+        if (!chunckBuffers.empty())
+        {
+            if (iovCount > 0)
+                break;
+            sharedBuffers = chunckBuffers;
+        }
+
+        if (nsend > MAXWSIZ - total)
+            nsend = MAXWSIZ - total;
+
+        iov[iovCount].iov_base = data;
+        iov[iovCount].iov_len = nsend;
+        iovMsg[iovCount] = msgIndex;
+        iovCount++;
+        total += nsend;
+
+        (*it)->advance(position, nsend);
     }
-    while(nsend == 0);
 
-    /* send next chunk, never more than MAXWSIZ to reduce blocking */
-    if (nsend > MAXWSIZ)
-        nsend = MAXWSIZ;
+    if (iovCount == 0)
+        return;
 
-    if (!useSharedBuffer)
+    if (useSharedBuffer && sharedBuffers.size() > MAXFD_PER_MESSAGE)
     {
-        nw = write(wFd, data, nsend);
+        log(fmt("attempt to send too many FD\n"));
+        close();
+        return;
     }
-    else
+
+    /* the gathered messages stay queued meanwhile: only consumeHeadMsg removes some,
+     * and conflation does not replace them
+     */
+    writingMsgs = iovMsg[iovCount - 1] + 1;
+    bool sideFull = false;
+
+    /* another client may attach our side socket meanwhile (sharedBufferAttach) */
+    bool sharing = useSharedBuffer;
+    int side = sideFd;
+    bool sideSent = sideFdsSent;
     {
-        struct msghdr msgh;
-        struct iovec iov[1];
-        int cmsghdrlength;
-        struct cmsghdr * cmsgh;
+        IoUnlocked unlocked;
 
-        int fdCount = sharedBuffers.size();
-        if (fdCount > 0)
+        if (!sharing || (side != -1 && sharedBuffers.empty()))
+        {
+            nw = writev(wFd, iov, iovCount);
+        }
+        else
         {
-            if (fdCount > MAXFD_PER_MESSAGE)
+            struct msghdr msgh;
+            int cmsghdrlength;
+            struct cmsghdr * cmsgh;
+
+            int fdCount = sharedBuffers.size();
+            if (fdCount > 0)
             {
-                log(fmt("attempt to send too many FD\n"));
-                close();
-                return;
+                cmsghdrlength = CMSG_SPACE((fdCount * sizeof(int)));
+                // FIXME: abort on alloc error here
+                cmsgh = (struct cmsghdr*)malloc(cmsghdrlength);
+                memset(cmsgh, 0, cmsghdrlength);
+
+                /* Write the fd as ancillary data */
+                cmsgh->cmsg_len = CMSG_LEN(fdCount * sizeof(int));
+                cmsgh->cmsg_level = SOL_SOCKET;
+                cmsgh->cmsg_type = SCM_RIGHTS;
+                msgh.msg_control = cmsgh;
+                msgh.msg_controllen = cmsghdrlength;
+                for(int i = 0; i < fdCount; ++i)
+                {
+                    ((int *) CMSG_DATA(CMSG_FIRSTHDR(&msgh)))[i] = sharedBuffers[i];
+                }
             }
+            else
+            {
+                cmsgh = NULL;
+                cmsghdrlength = 0;
+                msgh.msg_control = cmsgh;
+                msgh.msg_controllen = cmsghdrlength;
+            }
+
+            msgh.msg_flags = 0;
+            msgh.msg_name = NULL;
+            msgh.msg_namelen = 0;
+            msgh.msg_iov = iov;
+            msgh.msg_iovlen = iovCount;
 
-            cmsghdrlength = CMSG_SPACE((fdCount * sizeof(int)));
-            // FIXME: abort on alloc error here
-            cmsgh = (struct cmsghdr*)malloc(cmsghdrlength);
-            memset(cmsgh, 0, cmsghdrlength);
-
-            /* Write the fd as ancillary data */
-            cmsgh->cmsg_len = CMSG_LEN(fdCount * sizeof(int));
-            cmsgh->cmsg_level = SOL_SOCKET;
-            cmsgh->cmsg_type = SCM_RIGHTS;
-            msgh.msg_control = cmsgh;
-            msgh.msg_controllen = cmsghdrlength;
-            for(int i = 0; i < fdCount; ++i)
+            if (side == -1)
             {
-                ((int *) CMSG_DATA(CMSG_FIRSTHDR(&msgh)))[i] = sharedBuffers[i];
+                nw = sendmsg(wFd, &msgh,  MSG_NOSIGNAL);
+            }
+            else
+            {
+                /* the fds go first on the side socket, with one byte. Once, even if wFd is not ready for the chunk */
+                nw = 0;
+                if (!sideSent)
+                {
+                    char mark = 0;
+                    struct iovec markIov = { &mark, 1 };
+                    msgh.msg_iov = &markIov;
+                    msgh.msg_iovlen = 1;
+
+                    nw = sendmsg(side, &msgh, MSG_NOSIGNAL);
+                    if (nw < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        sideFull = true;
+                    else
+                        sideSent = nw > 0;
+                }
+                if (sideSent)
+                    nw = writev(wFd, iov, iovCount);
             }
-        }
-        else
-        {
-            cmsgh = NULL;
-            cmsghdrlength = 0;
-            msgh.msg_control = cmsgh;
-            msgh.msg_controllen = cmsghdrlength;
-        }
 
-        iov[0].iov_base = data;
-        iov[0].iov_len = nsend;
+            error = errno;
+            free(cmsgh);
+            errno = error;
+        }
 
-        msgh.msg_flags = 0;
-        msgh.msg_name = NULL;
-        msgh.msg_namelen = 0;
-        msgh.msg_iov = iov;
-        msgh.msg_iovlen = 1;
+        // errno must survive taking the lock back
+        error = errno;
+    }
+    writingMsgs = 0;
+    if (side == sideFd)
+        sideFdsSent = sideSent;
+    errno = error;
 
-        nw = sendmsg(wFd, &msgh,  MSG_NOSIGNAL);
+    if (sideFull)
+    {
+        /* the side socket is full: wait for it rather than for wFd */
+        wio.stop();
+        sideIo.set(sideFd, ev::WRITE);
+        sideIo.start();
+        return;
+    }
 
-        free(cmsgh);
+    /* retry when writable again */
+    if (nw < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        waitWritable = true;
+        return;
     }
 
     /* shut down if trouble */
@@ -2454,23 +2936,46 @@ void MsgQueue::writeToFd()
         return;
     }
 
+    /* the socket is full, wait until it is writable again */
+    waitWritable = nw < total;
+
     /* trace */
-    if (verbose > 2)
-    {
-        log(fmt("sending msg nq %ld:\n%.*s\n",
-                msgq.size(), (int)nw, data));
-    }
-    else if (verbose > 1)
+    if (verbose > 1)
     {
-        log(fmt("sending %.*s\n", (int)nw, data));
+        ssize_t left = nw;
+        for (int i = 0; i < iovCount && left > 0; i++)
+        {
+            int len = (int)std::min<ssize_t>(left, iov[i].iov_len);
+            if (verbose > 2)
+                log(fmt("sending msg nq %ld:\n%.*s\n", msgq.size(), len, (char *)iov[i].iov_base));
+            else
+                log(fmt("sending %.*s\n", len, (char *)iov[i].iov_base));
+            left -= len;
+        }
     }
 
-    /* update amount sent. when complete: free message if we are the last
-     * to use it and pop from our queue.
+    /* the first chunk, that had the buffers if any, is started */
+    sideFdsSent = false;
+
+    /* update amount sent. when complete: free messages if we are the last
+     * to use them and pop from our queue.
      */
-    mp->advance(nsent, nw);
-    if (nsent.done())
-        consumeHeadMsg();
+    int consumed = 0;
+    for (int i = 0; i < iovCount && nw > 0; i++)
+    {
+        // Messages before this chunck were sent completely
+        for (; consumed < iovMsg[i]; consumed++)
+            consumeHeadMsg();
+
+        ssize_t sent = std::min<ssize_t>(nw, iov[i].iov_len);
+        headMsg()->advance(nsent, sent);
+        nw -= sent;
+        if (nsent.done())
+        {
+            consumeHeadMsg();
+            consumed++;
+        }
+    }
 }
 
 void MsgQueue::log(const std::string &str) const
@@ -2511,6 +3016,16 @@ void ClInfo::addDevice(const std::string &dev, const std::string &name, int isbl
     /* add */
     Property *pp = new Property(dev, name);
     props.push_back(pp);
+    subscriptions.add(getId(), pp);
+}
+
+void ClInfo::setAllProps(int allprops)
+{
+    this->allprops = allprops;
+    if (allprops >= 1)
+        allPropsClients.insert(getId());
+    else
+        allPropsClients.erase(getId());
 }
 
 void MsgQueue::crackBLOB(const char *enableBLOB, BLOBHandling *bp)
@@ -2523,6 +3038,125 @@ void MsgQueue::crackBLOB(const char *enableBLOB, BLOBHandling *bp)
         *bp = B_NEVER;
 }
 
+void ClInfo::crackUpdateRate(const std::string &dev, const std::string &name, const char *rate)
+{
+    double r = atof(rate);
+    double interval = r > 0 ? 1 / r : 0;
+
+    updateRates.remove_if([&](const UpdateRate & u)
+    {
+        return u.dev == dev && u.name == name;
+    });
+    updateRates.push_front({dev, name, interval});
+
+    if (verbose > 0)
+        log(fmt("max update rate of '%s' '%s': %g/s\n", dev.c_str(), name.c_str(), r > 0 ? r : 0));
+}
+
+double ClInfo::updateInterval(const std::string &dev, const std::string &name) const
+{
+    for (auto &u : updateRates)
+    {
+        if ((u.dev.empty() || !fnmatch(u.dev.c_str(), dev.c_str(), 0)) &&
+                (u.name.empty() || !fnmatch(u.name.c_str(), name.c_str(), 0)))
+            return u.interval;
+    }
+
+    /* chained servers forward to their own clients */
+    return allprops == 2 ? 0 : defupdateinterval;
+}
+
+#ifdef ENABLE_INDI_SHARED_MEMORY
+/* return true if the peer of the TCP socket fd is on this host */
+static bool isLoopbackPeer(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    if (getpeername(fd, (struct sockaddr *)&addr, &len) < 0)
+        return false;
+
+    if (addr.ss_family == AF_INET)
+        return (ntohl(((struct sockaddr_in *)&addr)->sin_addr.s_addr) >> 24) == 127;
+
+    if (addr.ss_family == AF_INET6)
+    {
+        const struct in6_addr *a = &((struct sockaddr_in6 *)&addr)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(a) || (IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127);
+    }
+
+    return false;
+}
+#endif
+
+void ClInfo::offerSharedBuffer()
+{
+    XMLEle *root = addXMLEle(NULL, "sharedBufferReply");
+
+#ifdef ENABLE_INDI_SHARED_MEMORY
+    if (!useSharedBuffer && isLoopbackPeer(getRFd()))
+    {
+        std::random_device rd;
+        sharedBufferToken = fmt("%08x%08x%08x%08x", rd(), rd(), rd(), rd());
+
+        addXMLAtt(root, "path", UnixServer::unixSocketPath.c_str());
+        addXMLAtt(root, "token", sharedBufferToken.c_str());
+    }
+#endif
+
+    if (verbose > 0)
+        log(sharedBufferToken.empty() ? "shared buffers not available\n" : "shared buffers offered\n");
+
+    Msg *mp = new Msg(this, root);
+    pushMsg(mp);
+    mp->queuingDone();
+}
+
+void ClInfo::attachSharedBufferClient(const std::string &token)
+{
+    ClInfo *tcp = nullptr;
+
+    for (auto cpId : clients.ids())
+    {
+        auto cp = clients[cpId];
+        if (cp != nullptr && cp != this && !token.empty() && cp->sharedBufferToken == token)
+        {
+            tcp = cp;
+            break;
+        }
+    }
+
+    if (tcp == nullptr || !useSharedBuffer)
+    {
+        log("invalid shared buffer token, closing\n");
+        close();
+        return;
+    }
+
+    int fd = dup(getRFd());
+    if (fd == -1)
+    {
+        log(fmt("dup: %s\n", strerror(errno)));
+        close();
+        return;
+    }
+
+    tcp->sharedBufferToken.clear();
+    tcp->setSideFd(fd);
+    tcp->useSharedBuffer = true;
+
+    if (verbose > 0)
+        tcp->log("shared buffers attached\n");
+
+    // pushmsg can kill tcp
+    Msg *mp = new Msg(nullptr, addXMLEle(NULL, "sharedBufferAttached"));
+    tcp->pushMsg(mp);
+    mp->queuingDone();
+
+    /* the connection lives on as the side socket of tcp */
+    close();
+}
+
 void ClInfo::crackBLOBHandling(const std::string &dev, const std::string &name, const char *enableBLOB)
 {
     /* If we have EnableBLOB with property name, we add it to Client device list */
@@ -2588,14 +3222,14 @@ void MsgQueue::traceMsg(const std::string &logMsg, XMLEle *root)
 static char *indi_tstamp(char *s)
 {
     static char sbuf[64];
-    struct tm *tp;
+    struct tm tm;
     time_t t;
 
     time(&t);
-    tp = gmtime(&t);
+    gmtime_r(&t, &tm);
     if (!s)
         s = sbuf;
-    strftime(s, sizeof(sbuf), "%Y-%m-%dT%H:%M:%S", tp);
+    strftime(s, sizeof(sbuf), "%Y-%m-%dT%H:%M:%S", &tm);
     return (s);
 }
 
@@ -2654,6 +3288,7 @@ DvrInfo::DvrInfo(const DvrInfo &model):
 
 DvrInfo::~DvrInfo()
 {
+    snoopers.remove(getId(), sprops);
     drivers.erase(this);
     for(auto prop : sprops)
     {
@@ -2676,6 +3311,7 @@ void DvrInfo::log(const std::string &str) const
 }
 
 ConcurrentSet<DvrInfo> DvrInfo::drivers;
+PropertyIndex DvrInfo::snoopers;
 
 LocalDvrInfo::LocalDvrInfo(): DvrInfo(true)
 {
@@ -2813,6 +3449,9 @@ ClInfo::ClInfo(bool useSharedBuffer) : MsgQueue(useSharedBuffer)
 
 ClInfo::~ClInfo()
 {
+    subscriptions.remove(getId(), props);
+    allPropsClients.erase(getId());
+
     for(auto prop : props)
     {
         delete prop;
@@ -2829,6 +3468,30 @@ void ClInfo::log(const std::string &str) const
 }
 
 ConcurrentSet<ClInfo> ClInfo::clients;
+PropertyIndex ClInfo::subscriptions;
+std::set<unsigned long> ClInfo::allPropsClients;
+
+void PropertyIndex::remove(unsigned long id, const std::list<Property*> &props)
+{
+    for (auto prop : props)
+    {
+        auto it = byDevice.find(prop->dev);
+        if (it == byDevice.end())
+            continue;
+
+        auto &entries = it->second;
+        for (auto e = entries.begin(); e != entries.end();)
+        {
+            if (e->id == id)
+                e = entries.erase(e);
+            else
+                ++e;
+        }
+
+        if (entries.empty())
+            byDevice.erase(it);
+    }
+}
 
 SerializedMsg::SerializedMsg(Msg * parent) : asyncProgress(), owner(parent), awaiters(), chuncks(), ownBuffers()
 {
@@ -3610,13 +4273,51 @@ void SerializedMsgWithSharedBuffer::generateContent()
     async_done();
 }
 
+IoThread::IoThread()
+{
+    thread = std::thread(&IoThread::run, this);
+    thread.detach();
+}
+
+void IoThread::post(MsgQueue * q, int revents)
+{
+    jobs.push_back({q, revents});
+    wakeup.notify_one();
+}
+
+void IoThread::run()
+{
+    std::unique_lock<std::mutex> lock(ioMutex);
+    for (;;)
+    {
+        wakeup.wait(lock, [this]()
+        {
+            return !jobs.empty();
+        });
+
+        auto job = jobs.front();
+        jobs.pop_front();
+        job.first->runIo(job.second);
+
+        ioWakeup.send();
+    }
+}
+
 MsgQueue::MsgQueue(bool useSharedBuffer): useSharedBuffer(useSharedBuffer)
 {
     lp = newLilXML();
+    setArenaLilXML(lp, 1);
     rio.set<MsgQueue, &MsgQueue::ioCb>(this);
     wio.set<MsgQueue, &MsgQueue::ioCb>(this);
+    throttleTimer.set<MsgQueue, &MsgQueue::throttleCb>(this);
+    sideIo.set<MsgQueue, &MsgQueue::sideCb>(this);
     rFd = -1;
     wFd = -1;
+
+    // Connections are spread over the I/O threads, and stay on theirs
+    static unsigned int nextIoThread = 0;
+    if (!ioThreads.empty())
+        ioThread = nextIoThread++ % ioThreads.size();
 }
 
 MsgQueue::~MsgQueue()
@@ -3674,8 +4375,24 @@ void MsgQueue::closeWritePart()
     }
 }
 
+void MsgQueue::setSideFd(int fd)
+{
+    sideIo.stop();
+    if (sideFd != -1)
+        ::close(sideFd);
+    sideFd = fd;
+    sideFdsSent = false;
+}
+
+void MsgQueue::sideCb(ev::io &, int)
+{
+    sideIo.stop();
+    updateIos();
+}
+
 void MsgQueue::setFds(int rFd, int wFd)
 {
+    setSideFd(-1);
     if (this->rFd != -1)
     {
         rio.stop();
@@ -3719,6 +4436,7 @@ SerializedMsg * MsgQueue::headMsg() const
 void MsgQueue::consumeHeadMsg()
 {
     auto msg = headMsg();
+    forgetPendingUpdate(msg);
     msgq.pop_front();
     msg->release(this);
     nsent.reset();
@@ -3729,7 +4447,7 @@ void MsgQueue::consumeHeadMsg()
 void MsgQueue::pushMsg(Msg * mp)
 {
     // Don't write messages to client that have been disconnected
-    if (wFd == -1)
+    if (wFd == -1 || closing)
     {
         return;
     }
@@ -3743,25 +4461,255 @@ void MsgQueue::pushMsg(Msg * mp)
     updateIos();
 }
 
+bool MsgQueue::pushUpdate(Msg * mp, const std::string &key, size_t signature, bool replaceable, double interval,
+                          bool replaceOnly)
+{
+    if (wFd == -1 || closing)
+    {
+        return true;
+    }
+
+    auto held = throttledUpdates.find(key);
+    bool holding = held != throttledUpdates.end() && held->second.held != nullptr;
+    double now = loop.now();
+
+    // Decide before mp gets a serialization for us: refusing must leave it untouched
+    if (replaceOnly)
+    {
+        bool replaces;
+        if (interval > 0 && holding)
+            replaces = held->second.signature == signature;
+        else if (interval > 0 && replaceable && held != throttledUpdates.end() && now < held->second.lastSent + interval)
+            replaces = false;
+        else
+            replaces = canReplaceQueued(key, signature);
+        if (!replaces)
+            return false;
+    }
+
+    auto serialized = mp->serialize(this);
+    serialized->addAwaiter(this);
+
+    if (interval > 0)
+    {
+        auto &t = throttledUpdates[key];
+
+        // Superseded, unless it has other elements
+        if (t.held && t.signature == signature)
+            t.held->release(this);
+        else if (t.held)
+            queueUpdate(t.held, key, t.signature, true);
+        t.held = nullptr;
+
+        if (replaceable && now < t.lastSent + interval)
+        {
+            t.held = serialized;
+            t.signature = signature;
+            t.due = t.lastSent + interval;
+            if (!throttleTimer.is_active() || t.due < throttleDue)
+            {
+                throttleDue = t.due;
+                throttleTimer.start(throttleDue - now);
+            }
+            return true;
+        }
+        t.lastSent = now;
+    }
+
+    queueUpdate(serialized, key, signature, replaceable);
+
+    // Register for client write
+    updateIos();
+    return true;
+}
+
+bool MsgQueue::canReplaceQueued(const std::string &key, size_t signature) const
+{
+    auto it = pendingUpdates.find(key);
+    if (!conflate || it == pendingUpdates.end() || it->second.signature != signature)
+        return false;
+
+    // The head may be partially sent already, and a running write sends from the next ones too
+    auto sending = msgq.begin();
+    for (size_t i = 0; i < std::max<size_t>(writingMsgs, 1) && sending != msgq.end(); ++i, ++sending)
+    {
+        if (it->second.pos == sending)
+            return false;
+    }
+    return true;
+}
+
+void MsgQueue::queueUpdate(SerializedMsg * serialized, const std::string &key, size_t signature, bool replaceable)
+{
+    auto it = pendingUpdates.find(key);
+    if (canReplaceQueued(key, signature))
+    {
+        SerializedMsg * old = *it->second.pos;
+        *it->second.pos = serialized;
+        pendingUpdateKeys.erase(old);
+        old->release(this);
+    }
+    else
+    {
+        if (it != pendingUpdates.end())
+            pendingUpdateKeys.erase(*it->second.pos);
+        msgq.push_back(serialized);
+        pendingUpdates[key] = { std::prev(msgq.end()), signature };
+    }
+
+    if (replaceable && conflate)
+        pendingUpdateKeys[serialized] = key;
+    else
+        pendingUpdates.erase(key);
+}
+
+void MsgQueue::throttleCb()
+{
+    double now = loop.now();
+    double next = 0;
+
+    for (auto &it : throttledUpdates)
+    {
+        auto &t = it.second;
+        if (!t.held)
+            continue;
+        if (t.due <= now)
+        {
+            queueUpdate(t.held, it.first, t.signature, true);
+            t.held = nullptr;
+            t.lastSent = now;
+        }
+        else if (next == 0 || t.due < next)
+        {
+            next = t.due;
+        }
+    }
+
+    if (next > 0)
+    {
+        throttleDue = next;
+        throttleTimer.start(throttleDue - now);
+    }
+
+    updateIos();
+}
+
+void MsgQueue::releaseThrottledUpdates()
+{
+    throttleTimer.stop();
+    for (auto &it : throttledUpdates)
+    {
+        if (it.second.held)
+            it.second.held->release(this);
+    }
+    throttledUpdates.clear();
+}
+
+void MsgQueue::forgetPendingUpdate(const SerializedMsg * msg)
+{
+    if (pendingUpdateKeys.empty())
+        return;
+
+    auto it = pendingUpdateKeys.find(msg);
+    if (it != pendingUpdateKeys.end())
+    {
+        pendingUpdates.erase(it->second);
+        pendingUpdateKeys.erase(it);
+    }
+}
+
+void MsgQueue::clearPendingUpdates()
+{
+    pendingUpdates.clear();
+    pendingUpdateKeys.clear();
+
+    for (auto &it : throttledUpdates)
+    {
+        auto &t = it.second;
+        if (t.held)
+        {
+            msgq.push_back(t.held);
+            t.held = nullptr;
+            t.lastSent = loop.now();
+        }
+    }
+    throttleTimer.stop();
+}
+
 void MsgQueue::updateIos()
 {
-    if (wFd != -1)
+    // A running read or write updates them when done
+    if (closing)
+    {
+        return;
+    }
+
+    if (wFd != -1 && !writing)
     {
         if (msgq.empty() || !msgq.front()->requestContent(nsent))
         {
             wio.stop();
         }
-        else
+        else if (ioThread == -1 || waitWritable)
         {
             wio.start();
         }
+        else
+        {
+            postIo(EV_WRITE);
+        }
     }
-    if (rFd != -1)
+    if (rFd != -1 && !reading)
     {
         rio.start();
     }
 }
 
+void MsgQueue::postIo(int revents)
+{
+    if (revents & EV_READ)
+    {
+        rio.stop();
+        reading = true;
+    }
+    if (revents & EV_WRITE)
+    {
+        wio.stop();
+        writing = true;
+    }
+    ioThreads[ioThread]->post(this, revents);
+}
+
+void MsgQueue::runIo(int revents)
+{
+    if (!closing)
+    {
+        if (revents & EV_READ)
+            readFromFd();
+        if (revents & EV_WRITE)
+            writeToFd();
+    }
+
+    if (revents & EV_READ)
+        reading = false;
+    if (revents & EV_WRITE)
+        writing = false;
+
+    if (!closing)
+        updateIos();
+    else if (!reading && !writing)
+        close();
+}
+
+bool MsgQueue::deferClose()
+{
+    if (!reading && !writing)
+        return false;
+
+    closing = true;
+    return true;
+}
+
 void MsgQueue::messageMayHaveProgressed(const SerializedMsg * msg)
 {
     if ((!msgq.empty()) && (msgq.front() == msg))
@@ -3773,6 +4721,8 @@ void MsgQueue::messageMayHaveProgressed(const SerializedMsg * msg)
 void MsgQueue::clearMsgQueue()
 {
     nsent.reset();
+    releaseThrottledUpdates();
+    clearPendingUpdates();
 
     auto queueCopy = msgq;
     for(auto mp : queueCopy)
@@ -3817,6 +4767,17 @@ void MsgQueue::ioCb(ev::io &, int revents)
         }
     }
 
+    if (revents & EV_WRITE)
+        waitWritable = false;
+
+    // The read or write waits for the thread of this queue
+    if (ioThread != -1)
+    {
+        if (revents & (EV_READ | EV_WRITE))
+            postIo(revents & (EV_READ | EV_WRITE));
+        return;
+    }
+
     if (revents & EV_READ)
         readFromFd();
 
@@ -3829,7 +4790,7 @@ size_t MsgQueue::doRead(char * buf, size_t nr)
     if (!useSharedBuffer)
     {
         /* read client - works for all kinds of fds incl pipe*/
-        return read(rFd, buf, sizeof(buf));
+        return read(rFd, buf, nr);
     }
     else
     {
@@ -3897,26 +4858,38 @@ size_t MsgQueue::doRead(char * buf, size_t nr)
 
 void MsgQueue::readFromFd()
 {
-    char buf[MAXRBUF];
     ssize_t nr;
 
-    /* read client */
-    nr = doRead(buf, sizeof(buf));
+    if (readBufferSize == 0)
+    {
+        readBuffer.reset(new char[MAXRBUF]);
+        readBufferSize = MAXRBUF;
+    }
+
+    /* read client and process XML chunk. The buffer and the parser are only used here */
+    char *buf = readBuffer.get();
+    char err[1024];
+    XMLEle **nodes = nullptr;
+    int error;
+    {
+        IoUnlocked unlocked;
+        nr = doRead(buf, readBufferSize);
+        error = errno;
+        if (nr > 0)
+            nodes = parseXMLChunk(lp, buf, nr, err);
+    }
     if (nr <= 0)
     {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+        if (error == EAGAIN || error == EWOULDBLOCK) return;
 
         if (nr < 0)
-            log(fmt("read: %s\n", strerror(errno)));
+            log(fmt("read: %s\n", strerror(error)));
         else if (verbose > 0)
             log(fmt("read EOF\n"));
         close();
         return;
     }
 
-    /* process XML chunk */
-    char err[1024];
-    XMLEle **nodes = parseXMLChunk(lp, buf, nr, err);
     if (!nodes)
     {
         log(fmt("XML error: %s\n", err));
@@ -3925,6 +4898,25 @@ void MsgQueue::readFromFd()
         return;
     }
 
+    /* size the buffer for the next read. The parser copied what it needs. */
+    if ((size_t)nr == readBufferSize && readBufferSize < MAXRBUFMAX)
+    {
+        readBuffer.reset();
+        readBufferSize *= 2;
+        readBuffer.reset(new char[readBufferSize]);
+        readBufferIdle = 0;
+    }
+    else if (readBufferSize > MAXRBUF && (size_t)nr < readBufferSize / 4 && ++readBufferIdle >= RBUFIDLE)
+    {
+        readBuffer.reset(new char[MAXRBUF]);
+        readBufferSize = MAXRBUF;
+        readBufferIdle = 0;
+    }
+    else if ((size_t)nr >= readBufferSize / 4)
+    {
+        readBufferIdle = 0;
+    }
+
     int inode = 0;
 
     XMLEle *root = nodes[inode];
@@ -3932,7 +4924,7 @@ void MsgQueue::readFromFd()
     auto hb = heartBeat();
     while (root)
     {
-        if (hb.alive())
+        if (hb.alive() && !closing)
         {
             if (verbose > 2)
                 traceMsg("read ", root);
@@ -3971,7 +4963,9 @@ static std::vector<XMLEle *> findBlobElements(XMLEle * root)
 
 static void log(const std::string &log)
 {
-    fprintf(stderr, "%s: ", indi_tstamp(NULL));
+    // Called from several threads
+    char ts[64];
+    fprintf(stderr, "%s: ", indi_tstamp(ts));
     fprintf(stderr, "%s", log.c_str());
 }
 
@@ -282,6 +282,20 @@ std::string ConnectionMock::expectBase64() {
 }
 
 
+std::string ConnectionMock::expectUntil(char end) {
+    std::string result;
+
+    while(true) {
+        char c = readChar(std::string("until ") + end);
+        if (c == end) break;
+
+        result += c;
+    }
+
+    return result;
+}
+
+
 void ConnectionMock::expectXml(const std::string &expected)
 {
     std::string expectedCanonical = parseXmlFragmentFromString(expected);
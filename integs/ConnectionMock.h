@@ -53,6 +53,8 @@ class ConnectionMock
         void expect(const std::string &content);
         void expectXml(const std::string &xml);
         std::string expectBase64();
+        // Read anything up to end, which is consumed but not returned
+        std::string expectUntil(char end);
         void send(const std::string &content);
         void send(const std::string &content, const SharedBuffer &buff);
         void send(const std::string &content, const SharedBuffer ** buffers);
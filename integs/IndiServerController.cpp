@@ -47,6 +47,10 @@ void IndiServerController::setFifo(bool fifo) {
     this->fifo = fifo;
 }
 
+void IndiServerController::addArgs(const std::vector<std::string> & args) {
+    extraArgs.insert(extraArgs.end(), args.begin(), args.end());
+}
+
 void IndiServerController::start(const std::vector<std::string> & args) {
     ProcessController::start("../indiserver/indiserver", args);
 }
@@ -66,6 +70,7 @@ void IndiServerController::startDriver(const std::string & path) {
         args.push_back("-f");
         args.push_back(TEST_INDI_FIFO);
     }
+    args.insert(args.end(), extraArgs.begin(), extraArgs.end());
     args.push_back(path);
 
     start(args);
@@ -32,10 +32,13 @@
 class IndiServerController : public ProcessController
 {
         bool fifo;
+        std::vector<std::string> extraArgs;
     public:
         IndiServerController();
         ~IndiServerController();
         void setFifo(bool enable);
+        // Options passed to indiserver before the driver, by startDriver
+        void addArgs(const std::vector<std::string> & args);
         void start(const std::vector<std::string> & args);
 
         void startDriver(const std::string & driver);
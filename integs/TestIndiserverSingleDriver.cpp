@@ -16,6 +16,8 @@
  Boston, MA 02110-1301, USA.
 *******************************************************************************/
 
+#include <algorithm>
+#include <cctype>
 #include <stdexcept>
 #include <stdio.h>
 #include <unistd.h>
@@ -158,6 +160,49 @@ void connectFakeDev1Client(IndiServerController &, DriverMock &fakeDriver, IndiC
     indiClient.cnx.expectXml("</defBLOBVector>");
 }
 
+static void driverDefineNumber(DriverMock &fakeDriver)
+{
+    fakeDriver.cnx.send("<defNumberVector device='fakedev1' name='testnumber' label='test label' group='test_group' state='Idle' perm='ro' timeout='100' timestamp='2018-01-01T00:00:00'>\n");
+    fakeDriver.cnx.send("<defNumber name='a' label='a' format='%g' min='0' max='0' step='0'>0</defNumber>\n");
+    fakeDriver.cnx.send("<defNumber name='b' label='b' format='%g' min='0' max='0' step='0'>0</defNumber>\n");
+    fakeDriver.cnx.send("</defNumberVector>\n");
+}
+
+static void clientExpectNumberDef(IndiClientMock &indiClient)
+{
+    indiClient.cnx.expectXml("<defNumberVector device='fakedev1' name='testnumber' label='test label' group='test_group' state='Idle' perm='ro' timeout='100' timestamp='2018-01-01T00:00:00'>");
+    indiClient.cnx.expectXml("<defNumber name='a' label='a' format='%g' min='0' max='0' step='0'>");
+    indiClient.cnx.expect("\n0");
+    indiClient.cnx.expectXml("</defNumber>");
+    indiClient.cnx.expectXml("<defNumber name='b' label='b' format='%g' min='0' max='0' step='0'>");
+    indiClient.cnx.expect("\n0");
+    indiClient.cnx.expectXml("</defNumber>");
+    indiClient.cnx.expectXml("</defNumberVector>");
+}
+
+static void defineFakeDev1Number(DriverMock &fakeDriver, IndiClientMock &indiClient)
+{
+    fprintf(stderr, "Driver defines a number vector\n");
+    driverDefineNumber(fakeDriver);
+    clientExpectNumberDef(indiClient);
+}
+
+static void driverSendNumber(DriverMock &fakeDriver, const std::string &element, const std::string &value, const std::string &message = "")
+{
+    fakeDriver.cnx.send("<setNumberVector device='fakedev1' name='testnumber' state='Ok'" + (message.empty() ? "" : " message='" + message + "'") + ">\n");
+    fakeDriver.cnx.send("<oneNumber name='" + element + "'>" + value + "</oneNumber>\n");
+    fakeDriver.cnx.send("</setNumberVector>\n");
+}
+
+static void clientExpectNumber(IndiClientMock &indiClient, const std::string &element, const std::string &value, const std::string &message = "")
+{
+    indiClient.cnx.expectXml("<setNumberVector device='fakedev1' name='testnumber' state='Ok'" + (message.empty() ? "" : " message='" + message + "'") + ">");
+    indiClient.cnx.expectXml("<oneNumber name='" + element + "'>");
+    indiClient.cnx.expect("\n" + value);
+    indiClient.cnx.expectXml("</oneNumber>");
+    indiClient.cnx.expectXml("</setNumberVector>");
+}
+
 TEST(IndiserverSingleDriver, DontLeakFds)
 {
     DriverMock fakeDriver;
@@ -335,6 +380,209 @@ TEST(IndiserverSingleDriver, ForwardBase64BlobToIPClient)
 }
 
 
+TEST(IndiserverSingleDriver, ForwardLargeBlobFromIPClient)
+{
+    // This tests bulk reads from a TCP client: a message spanning many reads
+    DriverMock fakeDriver;
+    IndiServerController indiServer;
+
+    startFakeDev1(indiServer, fakeDriver);
+
+    IndiClientMock indiClient;
+
+    indiClient.connectTcp(indiServer);
+
+    connectFakeDev1Client(indiServer, fakeDriver, indiClient);
+
+    // 2MB of "0123456789" repeated, base64 encoded in lines of 72 chars
+    const std::string pattern = "MDEyMzQ1Njc4OTAxMjM0NTY3ODkwMTIzNDU2Nzg5";
+    const size_t repeat = 2 * 1024 * 1024 / 30;
+    const size_t size = repeat * 30;
+    std::string base64;
+    base64.reserve(repeat * pattern.size());
+    for (size_t i = 0; i < repeat; ++i)
+        base64 += pattern;
+    std::string lines;
+    for (size_t i = 0; i < base64.size(); i += 72)
+        lines += base64.substr(i, 72) + "\n";
+
+    fprintf(stderr, "Client sends a large blob\n");
+    indiClient.cnx.send("<newBLOBVector device='fakedev1' name='testblob' timestamp='2018-01-01T00:01:00'>\n");
+    indiClient.cnx.send("<oneBLOB name='content' size='" + std::to_string(size) + "' format='.fits' enclen='" + std::to_string(base64.size()) + "'>\n");
+    indiClient.cnx.send(lines);
+    indiClient.cnx.send("</oneBLOB>\n");
+    indiClient.cnx.send("</newBLOBVector>\n");
+
+    fprintf(stderr, "Driver receives the blob\n");
+    fakeDriver.cnx.expectXml("<newBLOBVector device='fakedev1' name='testblob' timestamp='2018-01-01T00:01:00'>");
+    fakeDriver.cnx.expectXml("<oneBLOB name='content' size='" + std::to_string(size) + "' format='.fits' enclen='" + std::to_string(base64.size()) + "'>");
+    std::string received = fakeDriver.cnx.expectBase64();
+    received.erase(std::remove_if(received.begin(), received.end(), ::isspace), received.end());
+    EXPECT_EQ(received, base64);
+    fakeDriver.cnx.expectXml("</oneBLOB>");
+    fakeDriver.cnx.expectXml("</newBLOBVector>");
+
+    fakeDriver.terminateDriver();
+    // Exit code 1 is expected when driver stopped
+    indiServer.waitProcessEnd(1);
+}
+
+static std::string largeBase64Lines(size_t &size, std::string &base64)
+{
+    // 1MB of "0123456789" repeated, base64 encoded in lines of 72 chars
+    const std::string pattern = "MDEyMzQ1Njc4OTAxMjM0NTY3ODkwMTIzNDU2Nzg5";
+    const size_t repeat = 1024 * 1024 / 30;
+    size = repeat * 30;
+    base64.clear();
+    base64.reserve(repeat * pattern.size());
+    for (size_t i = 0; i < repeat; ++i)
+        base64 += pattern;
+    std::string lines;
+    for (size_t i = 0; i < base64.size(); i += 72)
+        lines += base64.substr(i, 72) + "\n";
+    return lines;
+}
+
+static std::string expectLargeBase64(ConnectionMock &cnx)
+{
+    std::string received = cnx.expectBase64();
+    received.erase(std::remove_if(received.begin(), received.end(), ::isspace), received.end());
+    return received;
+}
+
+TEST(IndiserverSingleDriver, ForwardTrafficOnIoThreads)
+{
+    // This tests -t: the driver and the two clients are read, parsed and written on
+    // different I/O threads, each message still reaches every destination in order
+    DriverMock fakeDriver;
+    IndiServerController indiServer;
+
+    indiServer.addArgs({ "-t", "2" });
+    startFakeDev1(indiServer, fakeDriver);
+    // Its first property is not for the clients
+    fakeDriver.ping();
+
+    IndiClientMock indiClient1, indiClient2;
+
+    indiClient1.connectTcp(indiServer);
+    connectFakeDev1Client(indiServer, fakeDriver, indiClient1);
+
+    indiClient2.connectTcp(indiServer);
+    connectFakeDev1Client(indiServer, fakeDriver, indiClient2);
+    // The first client got the properties again
+    indiClient1.cnx.expectXml("<defBLOBVector device=\"fakedev1\" name=\"testblob\" label=\"test label\" group=\"test_group\" state=\"Idle\" perm=\"ro\" timeout=\"100\" timestamp=\"2018-01-01T00:00:00\">");
+    indiClient1.cnx.expectXml("<defBLOB name=\"content\" label=\"content\"/>");
+    indiClient1.cnx.expectXml("</defBLOBVector>");
+
+    fprintf(stderr, "Clients ask blobs\n");
+    indiClient1.cnx.send("<enableBLOB device='fakedev1' name='testblob'>Also</enableBLOB>\n");
+    indiClient1.ping();
+    indiClient2.cnx.send("<enableBLOB device='fakedev1' name='testblob'>Also</enableBLOB>\n");
+    indiClient2.ping();
+
+    fprintf(stderr, "Driver defines a number vector\n");
+    driverDefineNumber(fakeDriver);
+    clientExpectNumberDef(indiClient1);
+    clientExpectNumberDef(indiClient2);
+
+    size_t size;
+    std::string base64;
+    std::string lines = largeBase64Lines(size, base64);
+
+    const int count = 1000;
+    fprintf(stderr, "Driver sends %d updates and a large blob\n", count);
+    for (int i = 0; i < count; ++i)
+        driverSendNumber(fakeDriver, "a", std::to_string(i));
+    fakeDriver.cnx.send("<setBLOBVector device='fakedev1' name='testblob' timestamp='2018-01-01T00:01:00'>\n");
+    fakeDriver.cnx.send("<oneBLOB name='content' size='" + std::to_string(size) + "' format='.fits' enclen='" + std::to_string(base64.size()) + "'>\n");
+    fakeDriver.cnx.send(lines);
+    fakeDriver.cnx.send("</oneBLOB>\n");
+    fakeDriver.cnx.send("</setBLOBVector>\n");
+    fakeDriver.ping();
+
+    for (auto indiClient : { &indiClient1, &indiClient2 })
+    {
+        fprintf(stderr, "Client receives the updates then the blob\n");
+        for (int i = 0; i < count; ++i)
+            clientExpectNumber(*indiClient, "a", std::to_string(i));
+        indiClient->cnx.expectXml("<setBLOBVector device='fakedev1' name='testblob' timestamp='2018-01-01T00:01:00'>");
+        indiClient->cnx.expectXml("<oneBLOB name='content' size='" + std::to_string(size) + "' format='.fits' enclen='" + std::to_string(base64.size()) + "'>");
+        EXPECT_EQ(expectLargeBase64(indiClient->cnx), base64);
+        indiClient->cnx.expectXml("</oneBLOB>");
+        indiClient->cnx.expectXml("</setBLOBVector>");
+        indiClient->ping();
+    }
+
+    fprintf(stderr, "A client sends a large blob, the driver receives it\n");
+    indiClient2.cnx.send("<newBLOBVector device='fakedev1' name='testblob' timestamp='2018-01-01T00:02:00'>\n");
+    indiClient2.cnx.send("<oneBLOB name='content' size='" + std::to_string(size) + "' format='.fits' enclen='" + std::to_string(base64.size()) + "'>\n");
+    indiClient2.cnx.send(lines);
+    indiClient2.cnx.send("</oneBLOB>\n");
+    indiClient2.cnx.send("</newBLOBVector>\n");
+
+    fakeDriver.cnx.expectXml("<newBLOBVector device='fakedev1' name='testblob' timestamp='2018-01-01T00:02:00'>");
+    fakeDriver.cnx.expectXml("<oneBLOB name='content' size='" + std::to_string(size) + "' format='.fits' enclen='" + std::to_string(base64.size()) + "'>");
+    EXPECT_EQ(expectLargeBase64(fakeDriver.cnx), base64);
+    fakeDriver.cnx.expectXml("</oneBLOB>");
+    fakeDriver.cnx.expectXml("</newBLOBVector>");
+
+    fakeDriver.terminateDriver();
+    // Exit code 1 is expected when driver stopped
+    indiServer.waitProcessEnd(1);
+}
+
+TEST(IndiserverSingleDriver, ThrottleUpdatesToIPClient)
+{
+    // This tests max update rate: the last of coalesced updates is delivered once the interval
+    // elapsed, or before a def or del that follows it
+    DriverMock fakeDriver;
+    IndiServerController indiServer;
+
+    startFakeDev1(indiServer, fakeDriver);
+
+    IndiClientMock indiClient;
+
+    indiClient.connectTcp(indiServer);
+
+    connectFakeDev1Client(indiServer, fakeDriver, indiClient);
+    defineFakeDev1Number(fakeDriver, indiClient);
+
+    fprintf(stderr, "Client asks one update every 2s\n");
+    indiClient.cnx.send("<maxUpdateRate device='fakedev1' name='testnumber'>0.5</maxUpdateRate>\n");
+    indiClient.ping();
+
+    fprintf(stderr, "Driver sends updates\n");
+    driverSendNumber(fakeDriver, "a", "1");
+    driverSendNumber(fakeDriver, "a", "2");
+    driverSendNumber(fakeDriver, "a", "3");
+    fakeDriver.ping();
+
+    fprintf(stderr, "Client receives the first and the last update\n");
+    clientExpectNumber(indiClient, "a", "1");
+    clientExpectNumber(indiClient, "a", "3");
+
+    fprintf(stderr, "Driver sends an update then defines the property again\n");
+    driverSendNumber(fakeDriver, "a", "4");
+    driverDefineNumber(fakeDriver);
+    fakeDriver.ping();
+
+    clientExpectNumber(indiClient, "a", "4");
+    clientExpectNumberDef(indiClient);
+
+    fprintf(stderr, "Driver sends an update then deletes the property\n");
+    driverSendNumber(fakeDriver, "a", "5");
+    fakeDriver.cnx.send("<delProperty device='fakedev1' name='testnumber'/>\n");
+    fakeDriver.ping();
+
+    clientExpectNumber(indiClient, "a", "5");
+    indiClient.cnx.expectXml("<delProperty device='fakedev1' name='testnumber'/>");
+    indiClient.ping();
+
+    fakeDriver.terminateDriver();
+    // Exit code 1 is expected when driver stopped
+    indiServer.waitProcessEnd(1);
+}
+
 TEST(IndiserverSingleDriver, SnoopDriverPropertie)
 {
     // This tests snooping simple property from driver to driver
@@ -419,6 +667,91 @@ TEST(IndiserverSingleDriver, ForwardBase64BlobToUnixClient)
     indiServer.waitProcessEnd(1);
 }
 
+TEST(IndiserverSingleDriver, ForwardManyUpdatesToSlowUnixClient)
+{
+    // This tests gathered writes to a client that does not keep up: they stop at any
+    // offset, inside a message or between two, and resume from there
+    DriverMock fakeDriver;
+    IndiServerController indiServer;
+
+    startFakeDev1(indiServer, fakeDriver);
+
+    IndiClientMock indiClient;
+
+    indiClient.connectUnix(indiServer);
+
+    connectFakeDev1Client(indiServer, fakeDriver, indiClient);
+    defineFakeDev1Number(fakeDriver, indiClient);
+
+    // Far more than the socket holds, in messages of varying length
+    const int count = 10000;
+    fprintf(stderr, "Driver sends %d updates\n", count);
+    for (int i = 0; i < count; ++i)
+        driverSendNumber(fakeDriver, "a", std::to_string(i * 7919));
+    fakeDriver.ping();
+
+    fprintf(stderr, "Client receives all updates, in order\n");
+    for (int i = 0; i < count; ++i)
+        clientExpectNumber(indiClient, "a", std::to_string(i * 7919));
+    indiClient.ping();
+
+    fakeDriver.terminateDriver();
+    // Exit code 1 is expected when driver stopped
+    indiServer.waitProcessEnd(1);
+}
+
+TEST(IndiserverSingleDriver, ConflateUpdatesForSlowUnixClient)
+{
+    // This tests conflation: a queued update is replaced by a newer one with the same elements,
+    // unless either carries a message
+    DriverMock fakeDriver;
+    IndiServerController indiServer;
+
+    indiServer.addArgs({ "-c" });
+    startFakeDev1(indiServer, fakeDriver);
+
+    IndiClientMock indiClient;
+
+    indiClient.connectUnix(indiServer);
+
+    connectFakeDev1Client(indiServer, fakeDriver, indiClient);
+    defineFakeDev1Number(fakeDriver, indiClient);
+
+    // Fill the client socket, so that the updates stay queued
+    const int fillCount = 1000;
+    const std::string filler(1000, 'x');
+    fprintf(stderr, "Driver sends messages the client does not read yet\n");
+    for (int i = 0; i < fillCount; ++i)
+        fakeDriver.cnx.send("<message device='fakedev1' message='" + filler + "'/>\n");
+
+    fprintf(stderr, "Driver sends updates\n");
+    driverSendNumber(fakeDriver, "a", "1");
+    driverSendNumber(fakeDriver, "a", "2");
+    driverSendNumber(fakeDriver, "a", "3");
+    driverSendNumber(fakeDriver, "b", "10");
+    driverSendNumber(fakeDriver, "a", "4");
+    driverSendNumber(fakeDriver, "a", "5", "hello");
+    driverSendNumber(fakeDriver, "a", "6");
+    driverSendNumber(fakeDriver, "a", "7");
+    fakeDriver.ping();
+
+    for (int i = 0; i < fillCount; ++i)
+        indiClient.cnx.expectXml("<message device='fakedev1' message='" + filler + "'/>");
+
+    fprintf(stderr, "Client receives the conflated updates\n");
+    // a=3 replaced a=1 and a=2; b=10 has other elements
+    clientExpectNumber(indiClient, "a", "3");
+    clientExpectNumber(indiClient, "b", "10");
+    // a=5 replaced a=4 but, carrying a message, was not replaced by a=6
+    clientExpectNumber(indiClient, "a", "5", "hello");
+    clientExpectNumber(indiClient, "a", "7");
+    indiClient.ping();
+
+    fakeDriver.terminateDriver();
+    // Exit code 1 is expected when driver stopped
+    indiServer.waitProcessEnd(1);
+}
+
 void driverSendAttachedBlob(DriverMock &fakeDriver, ssize_t size)
 {
     fprintf(stderr, "Driver send new blob value as attachment\n");
@@ -540,6 +873,59 @@ TEST(IndiserverSingleDriver, ForwardAttachedBlobToIPClient)
     indiServer.waitProcessEnd(1);
 }
 
+TEST(IndiserverSingleDriver, ForwardAttachedBlobToUpgradedIPClient)
+{
+    // This tests shared buffer pass through to a local IP client, via its side unix connection
+    DriverMock fakeDriver;
+    IndiServerController indiServer;
+
+    startFakeDev1(indiServer, fakeDriver);
+
+    IndiClientMock indiClient;
+
+    indiClient.connectTcp(indiServer);
+
+    connectFakeDev1Client(indiServer, fakeDriver, indiClient);
+
+    fprintf(stderr, "Client asks shared buffers\n");
+    indiClient.cnx.send("<sharedBufferRequest/>\n");
+    indiClient.cnx.expect("\n<sharedBufferReply path=\"" + indiServer.getUnixSocketPath() + "\" token=\"");
+    std::string token = indiClient.cnx.expectUntil('"');
+    indiClient.cnx.expect("/>\n");
+
+    IndiClientMock sideClient;
+    sideClient.connectUnix(indiServer);
+    sideClient.cnx.send("<sharedBufferAttach token='" + token + "'/>\n");
+    indiClient.cnx.expectXml("<sharedBufferAttached/>");
+
+    fprintf(stderr, "Client ask blobs\n");
+    indiClient.cnx.send("<enableBLOB device='fakedev1' name='testblob'>Also</enableBLOB>\n");
+
+    for(int i = 0; i < BLOB_REPEAT_COUNT; ++i) {
+        indiClient.ping();
+
+        ssize_t size = 32;
+        driverSendAttachedBlob(fakeDriver, size);
+
+        // Now receive on client side, the buffer on the side connection
+        fprintf(stderr, "Client receive blob\n");
+        indiClient.cnx.expectXml("<setBLOBVector device='fakedev1' name='testblob' timestamp='2018-01-01T00:01:00'>");
+        indiClient.cnx.expectXml("<oneBLOB name='content' size='" + std::to_string(size) + "' format='.fits' attached='true'/>");
+        indiClient.cnx.expectXml("</setBLOBVector>");
+
+        sideClient.cnx.allowBufferReceive(true);
+        sideClient.cnx.expect(std::string(1, '\0'));
+        SharedBuffer receivedFd;
+        sideClient.cnx.expectBuffer(receivedFd);
+        sideClient.cnx.allowBufferReceive(false);
+
+        EXPECT_GE( receivedFd.getSize(), size);
+    }
+    fakeDriver.terminateDriver();
+    // Exit code 1 is expected when driver stopped
+    indiServer.waitProcessEnd(1);
+}
+
 
 TEST(IndiserverSingleDriver, ForwardAttachedBlobToDriver)
 {
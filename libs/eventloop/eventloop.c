@@ -32,6 +32,7 @@
  #define MAIN_TEST for a stand-alone test program.
  */
 
+#include <errno.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -45,6 +46,11 @@
 #include <sys/select.h>
 #endif
 
+#if defined(__linux__)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #include "eventloop.h"
 
 /* info about one registered callback.
@@ -57,29 +63,45 @@ typedef struct
     int fd;     /* fd descriptor to watch for read */
     void *ud;   /* user's data handle */
     CBF *fp;    /* callback function */
+#ifdef USE_EPOLL
+    int always; /* fd can't be polled (regular file), always ready as with select */
+#endif
 } CB;
 static CB *cback;    /* malloced list of callbacks */
 static int ncback;   /* n entries in cback[] */
 static int ncbinuse; /* n entries in cback[] marked in_use */
 static int lastcb;   /* cback index of last cb called */
 
+#ifdef USE_EPOLL
+#define MAXEVENTS 64
+static int epfd = -1;   /* epoll instance watching the fds of the callbacks, shared by callbacks on the same fd */
+static int nalways;     /* n callbacks with always set */
+#endif
+
 /* info about one registered timer function.
- * the entries are kept sorted by increasing time from epoch, ie,
- *   the next entry to fire is at the begin of the list.
+ * pending timers are kept in a binary heap ordered by trigger time, ie,
+ *   the next entry to fire is at heap[0]. all timers are also hashed by id.
  */
 typedef struct TF
 {
-    double tgo;       /* trigger time, ms from epoch */
+    double tgo;       /* trigger time, ms from an arbitrary monotonic origin */
     int interval;     /* repeat timer if interval > 0, ms */
     void *ud;         /* user's data handle */
     TCF *fp;          /* timer function */
     int tid;          /* unique id for this timer */
-    struct TF *next;  /* pointer to next item */
+    unsigned seq;     /* insertion order, keeps equal tgo first come first served */
+    int hidx;         /* index in heap, -1 while running */
+    int removed;      /* removed while running */
+    struct TF *hnext; /* next in hash bucket */
 } TF;
-static TF  timefunc_null = {0, 0, NULL, NULL, 0, NULL};
-static TF *timefunc = &timefunc_null;  /* list of timer functions */
+static TF **heap;      /* timers by increasing tgo */
+static int nheap;      /* n entries in heap[] */
+static int mheap;      /* room in heap[] */
+static TF **thash;     /* buckets of timers by tid */
+static int nthash;     /* n buckets, power of 2 */
+static int ntimers;    /* n timers in thash */
 static int tid = 0;    /* source of unique timer ids */
-#define EPOCHDT(tp) /* ms from epoch to timeval *tp */ (((tp)->tv_usec) / 1000.0 + ((tp)->tv_sec) * 1000.0)
+static unsigned tseq;  /* source of seq */
 
 /* info about one registered work procedure.
  * the malloced array wproc is never shrunk, entries are reused. new id's are
@@ -97,12 +119,25 @@ static int nwpinuse; /* n entries in wproc[] marked in-use */
 static int lastwp;   /* wproc index of last workproc called*/
 
 static void runWorkProc(void);
-static void callCallback(fd_set *rfdp);
 static void checkTimer();
 static void oneLoop(void);
 static void deferTO(void *p);
 static void runImmediates();
 
+/* ms from an arbitrary origin, not affected by changes of the wall clock */
+static double nowMs()
+{
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0);
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0);
+#endif
+}
+
 /* inf loop to dispatch callbacks, work procs and timers as necessary.
  * never returns.
  */
@@ -174,6 +209,7 @@ int addCallback(int fd, CBF *fp, void *ud)
     {
         cback = realloc(cback, (ncback + 1) * sizeof(CB));
         cp    = &cback[ncback++];
+        memset(cp, 0, sizeof(CB));
     }
 
     /* init new entry */
@@ -183,10 +219,49 @@ int addCallback(int fd, CBF *fp, void *ud)
     cp->fd     = fd;
     ncbinuse++;
 
+#ifdef USE_EPOLL
+    {
+        struct epoll_event ev;
+
+        if (epfd < 0 && (epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        {
+            perror("epoll_create1");
+            exit(1);
+        }
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events  = EPOLLIN;
+        ev.data.fd = fd;
+        cp->always = 0;
+        /* EEXIST: another callback already watches fd */
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0 && errno != EEXIST)
+        {
+            if (errno == EPERM)
+            {
+                cp->always = 1;
+                nalways++;
+            }
+            else
+                perror("epoll_ctl");
+        }
+    }
+#endif
+
     /* id is index into array */
     return (cp - cback);
 }
 
+#ifdef USE_EPOLL
+/* whether a callback in use still needs epoll to watch fd */
+static int fdWatched(int fd)
+{
+    for (CB *cp = cback; cp < &cback[ncback]; cp++)
+        if (cp->in_use && !cp->always && cp->fd == fd)
+            return 1;
+    return 0;
+}
+#endif
+
 /* remove the callback with the given id, as returned from addCallback().
  * silently ignore if id not valid.
  */
@@ -204,36 +279,149 @@ void rmCallback(int cid)
     /* mark for reuse */
     cp->in_use = 0;
     ncbinuse--;
+
+#ifdef USE_EPOLL
+    if (cp->always)
+        nalways--;
+    else if (!fdWatched(cp->fd))
+    {
+        /* fd may be closed already, epoll then forgot it by itself */
+        epoll_ctl(epfd, EPOLL_CTL_DEL, cp->fd, NULL);
+    }
+#endif
 }
 
-/* insert maintaining sort */
-static void insertTimer(TF *node)
+/* timer ids hash */
+static TF **hashSlot(int timer_id)
 {
-    TF *it = timefunc;
+    TF **slot = &thash[timer_id & (nthash - 1)];
+    while (*slot && (*slot)->tid != timer_id)
+        slot = &(*slot)->hnext;
+    return slot;
+}
 
-    for(; ; it = it->next)
+static void hashTimer(TF *node)
+{
+    if (ntimers >= nthash)
     {
-        if (it->next == NULL || node->tgo < it->next->tgo)
+        /* rehash in twice as many buckets */
+        int n = nthash ? 2 * nthash : 64;
+        TF **old = thash;
+        int nold = nthash;
+
+        thash  = (TF **)calloc(n, sizeof(TF *));
+        nthash = n;
+        for (int i = 0; i < nold; i++)
         {
-            node->next = it->next;
-            it->next = node;
-            break;
+            TF *it = old[i];
+            while (it)
+            {
+                TF *next = it->hnext;
+                TF **slot = &thash[it->tid & (nthash - 1)];
+                it->hnext = *slot;
+                *slot = it;
+                it = next;
+            }
         }
+        free(old);
+    }
+
+    node->hnext = thash[node->tid & (nthash - 1)];
+    thash[node->tid & (nthash - 1)] = node;
+    ntimers++;
+}
+
+static void unhashTimer(TF *node)
+{
+    TF **slot = hashSlot(node->tid);
+    *slot = node->hnext;
+    ntimers--;
+}
+
+/* find the timer by id */
+static TF *findTimer(int timer_id)
+{
+    return nthash ? *hashSlot(timer_id) : NULL;
+}
+
+/* heap of pending timers */
+static int timerBefore(const TF *a, const TF *b)
+{
+    return (a->tgo < b->tgo || (a->tgo == b->tgo && (int)(a->seq - b->seq) < 0));
+}
+
+static void heapSet(int i, TF *node)
+{
+    heap[i]    = node;
+    node->hidx = i;
+}
+
+static void siftUp(int i)
+{
+    TF *node = heap[i];
+    while (i > 0 && timerBefore(node, heap[(i - 1) / 2]))
+    {
+        heapSet(i, heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
     }
+    heapSet(i, node);
+}
+
+static void siftDown(int i)
+{
+    TF *node = heap[i];
+    while (1)
+    {
+        int c = 2 * i + 1;
+        if (c >= nheap)
+            break;
+        if (c + 1 < nheap && timerBefore(heap[c + 1], heap[c]))
+            c++;
+        if (!timerBefore(heap[c], node))
+            break;
+        heapSet(i, heap[c]);
+        i = c;
+    }
+    heapSet(i, node);
+}
+
+/* insert maintaining heap order */
+static void insertTimer(TF *node)
+{
+    if (nheap == mheap)
+    {
+        mheap = mheap ? 2 * mheap : 64;
+        heap  = (TF **)realloc(heap, mheap * sizeof(TF *));
+    }
+    node->seq = tseq++;
+    heapSet(nheap++, node);
+    siftUp(node->hidx);
+}
+
+/* take the timer out of the heap */
+static void dettachTimer(TF *node)
+{
+    int i = node->hidx;
+    TF *last = heap[--nheap];
+
+    node->hidx = -1;
+    if (last == node)
+        return;
+    heapSet(i, last);
+    if (i > 0 && timerBefore(last, heap[(i - 1) / 2]))
+        siftUp(i);
+    else
+        siftDown(i);
 }
 
 /* register a new timer function, fp, to be called with ud as arg after ms
- * milliseconds. add to list in order of increasing time from epoch, ie,
+ * milliseconds. add to heap in order of increasing time, ie,
  * first entry runs soonest. return id for use with rmTimer().
  */
 static int addTimerImpl(int delay, int interval, TCF *fp, void *ud)
 {
-    struct timeval t;
     TF *node;
 
-    /* get time now */
-    gettimeofday(&t, NULL);
-
     /* create entry */
     node = (TF*)malloc(sizeof(TF));
 
@@ -241,10 +429,12 @@ static int addTimerImpl(int delay, int interval, TCF *fp, void *ud)
     node->ud  = ud;
     node->fp  = fp;
     node->tid = ++tid; /* store new unique id */
-    node->tgo = EPOCHDT(&t) + delay;
+    node->tgo = nowMs() + delay;
     node->interval = interval;
+    node->removed  = 0;
 
     insertTimer(node);
+    hashTimer(node);
 
     return node->tid;
 }
@@ -259,54 +449,32 @@ int addPeriodicTimer(int ms, TCF *fp, void *ud)
     return addTimerImpl(ms, ms, fp, ud);
 }
 
-/* find the timer and remove from list */
-static TF *dettachTimer(TF *node)
-{
-    TF *it = timefunc;
-    for(; it->next != NULL; it = it->next)
-    {
-        if (it->next == node)
-        {
-            it->next = node->next;
-            return node;
-        }
-    }
-    return NULL;
-}
-
-/* find the timer by id */
-static TF *findTimer(int timer_id)
-{
-    TF *it = timefunc->next;
-    for(; it != NULL; it = it->next)
-        if (it->tid == timer_id)
-            return it;
-    return NULL;
-}
-
 /* remove the timer with the given id, as returned from addTimer().
  * silently ignore if id not found.
  */
 void rmTimer(int timer_id)
 {
-    TF *node, *it = timefunc;
-    for(; (node = it->next) != NULL; it = it->next)
+    TF *node = findTimer(timer_id);
+
+    if (node == NULL || node->removed)
+        return;
+
+    if (node->hidx < 0)
     {
-        if (node->tid == timer_id)
-        {
-            it->next = node->next;
-            free(node);
-            break;
-        }
+        /* running, checkTimer() frees it when done */
+        node->removed = 1;
+        return;
     }
+
+    dettachTimer(node);
+    unhashTimer(node);
+    free(node);
 }
 
 /* Returns the timer's remaining value in milliseconds left until the timeout. */
 static double remainingTimerNode(TF *node)
 {
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    return (node->tgo - EPOCHDT(&now));
+    return (node->tgo - nowMs());
 }
 
 /* Returns the timer's remaining value in milliseconds left until the timeout.
@@ -393,6 +561,127 @@ static void runWorkProc()
     (*wp->fp)(wp->ud);
 }
 
+/* run the next timer callback whose time has come, if any. all we have to do
+ * is is check the first entry in heap because it is ordered by increasing
+ * time to run, ie, first entry runs soonest.
+ */
+static void checkTimer()
+{
+    TF *node = nheap ? heap[0] : NULL;
+
+    if (node == NULL || remainingTimerNode(node) > 0)
+        return;
+
+    dettachTimer(node);
+
+    (*node->fp)(node->ud);
+
+    if (node->interval > 0 && !node->removed)
+    {
+        node->tgo += node->interval;
+        insertTimer(node);
+    } else {
+        unhashTimer(node);
+        free(node);
+    }
+}
+
+/* ms to wait for fds:
+ * if there are work procs
+ *   delay = 0
+ * else if there is at least one timer func
+ *   delay = time until soonest timer func expires
+ * else
+ *   delay = forever, -1
+ */
+static double loopDelay()
+{
+    double late;
+
+    if (nwpinuse > 0)
+        return 0;
+    if (nheap == 0)
+        return -1;
+
+    late = remainingTimerNode(heap[0]);
+    return late < 0 ? 0 : late;
+}
+
+#ifdef USE_EPOLL
+
+/* whether fd is among the ns ready events */
+static int fdReady(int fd, const struct epoll_event *events, int ns)
+{
+    for (int i = 0; i < ns; i++)
+        if (events[i].data.fd == fd)
+            return 1;
+    return 0;
+}
+
+/* run next callback whose fd is among the ready events, or can't be polled */
+static int callCallback(const struct epoll_event *events, int ns)
+{
+    CB *cp;
+
+    for (int i = 0; i < ncback; i++)
+    {
+        lastcb = (lastcb + 1) % ncback;
+        cp     = &cback[lastcb];
+        if (cp->in_use && (cp->always || fdReady(cp->fd, events, ns)))
+        {
+            (*cp->fp)(cp->fd, cp->ud);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* wait for fds with epoll, call one ready callback, taking turns among them */
+static void oneLoop()
+{
+    struct epoll_event events[MAXEVENTS];
+    double delay = loopDelay();
+    int ns;
+
+    if (nalways > 0)
+        delay = 0;
+
+    if (epfd >= 0)
+    {
+        /* round up, waking early would only spin until the timer is due */
+        ns = epoll_wait(epfd, events, MAXEVENTS, delay < 0 ? -1 : (int)ceil(delay));
+        if (ns < 0)
+        {
+            if (errno != EINTR)
+                perror("epoll_wait");
+            return;
+        }
+    }
+    else
+    {
+        /* no callback ever registered */
+        if (delay != 0)
+        {
+            struct timespec ts;
+            if (delay < 0)
+                delay = 1000;
+            ts.tv_sec  = (time_t)(delay / 1000);
+            ts.tv_nsec = (long)((delay - ts.tv_sec * 1000.0) * 1000000.0);
+            nanosleep(&ts, NULL);
+        }
+        ns = 0;
+    }
+
+    /* dispatch */
+    checkTimer();
+    if ((ns == 0 && nalways == 0) || !callCallback(events, ns))
+        runWorkProc();
+
+    runImmediates();
+}
+
+#else
+
 /* run next callback whose fd is listed as ready to go in rfdp */
 static void callCallback(fd_set *rfdp)
 {
@@ -413,33 +702,6 @@ static void callCallback(fd_set *rfdp)
     (*cp->fp)(cp->fd, cp->ud);
 }
 
-/* run the next timer callback whose time has come, if any. all we have to do
- * is is check the first entry in timefunc because it is sorted in increasing
- * order of time from epoch to run, ie, first entry runs soonest.
- */
-static void checkTimer()
-{
-    TF *node = timefunc->next;
-
-    if (node == NULL || remainingTimerNode(node) > 0)
-        return;
-
-    (*node->fp)(node->ud);
-
-    node = dettachTimer(node);
-
-    if (node == NULL)
-        return;
-
-    if (node->interval > 0)
-    {
-        node->tgo += node->interval;
-        insertTimer(node);
-    } else {
-        free(node);
-    }
-}
-
 /* check fd's from each active callback.
  * if any ready, call their callbacks else call each registered work procedure.
  */
@@ -449,6 +711,7 @@ static void oneLoop()
     fd_set rfd;
     CB *cp;
     int maxfd, ns;
+    double delay = loopDelay();
 
     /* build list of callback file descriptors to check */
     FD_ZERO(&rfd);
@@ -463,28 +726,12 @@ static void oneLoop()
         }
     }
 
-    /* determine timeout:
-	 * if there are work procs
-	 *   set delay = 0
-	 * else if there is at least one timer func
-	 *   set delay = time until soonest timer func expires
-	 * else
-	 *   set delay = forever
-	 */
-    if (nwpinuse > 0)
-    {
-        tvp         = &tv;
-        tvp->tv_sec = tvp->tv_usec = 0;
-    }
-    else if (timefunc->next != NULL)
+    if (delay >= 0)
     {
-        double late = remainingTimerNode(timefunc->next); /* ms late */
-        if (late < 0)
-            late = 0;
-        late /= 1000.0; /* secs late */
+        delay /= 1000.0; /* secs late */
         tvp          = &tv;
-        tvp->tv_sec  = (long)floor(late);
-        tvp->tv_usec = (long)floor((late - tvp->tv_sec) * 1000000.0);
+        tvp->tv_sec  = (long)floor(delay);
+        tvp->tv_usec = (long)floor((delay - tvp->tv_sec) * 1000000.0);
     }
     else
         tvp = NULL;
@@ -507,6 +754,8 @@ static void oneLoop()
     runImmediates();
 }
 
+#endif
+
 /* timer callback used to implement deferLoop().
  * arg is pointer to int which we set to 1
  */
@@ -62,6 +62,8 @@ extern void eventLoop();
 * \param fp a pointer to the callback function.
 * \param ud a pointer to be passed to the callback function when called.
 * \return a unique callback id for use with rmCallback().
+* \note Remove the callback with rmCallback() before closing \e fd. If \e fd is closed and
+* reopened, even with the same number, it must be registered again.
 */
 extern int addCallback(int fd, CBF *fp, void *ud);
 
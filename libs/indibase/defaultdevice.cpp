@@ -280,7 +280,7 @@ bool DefaultDevice::saveConfig(bool silent, const char *property)
 
     if (property == nullptr)
     {
-        fp = IUGetConfigFP(nullptr, getDeviceName(), "w", errmsg);
+        fp = IUGetConfigTmpFP(nullptr, getDeviceName(), errmsg);
 
         if (fp == nullptr)
         {
@@ -295,8 +295,12 @@ bool DefaultDevice::saveConfig(bool silent, const char *property)
 
         IUSaveConfigTag(fp, 1, getDeviceName(), silent ? 1 : 0);
 
-        fflush(fp);
-        fclose(fp);
+        if (IUCommitConfigFP(fp, errmsg) < 0)
+        {
+            if (!silent)
+                LOGF_WARN("Failed to save configuration. %s", errmsg);
+            return false;
+        }
 
         if (d->isDefaultConfigLoaded == false)
         {
@@ -416,11 +420,20 @@ bool DefaultDevice::saveConfig(bool silent, const char *property)
 
         if (propertySaved)
         {
-            fp = IUGetConfigFP(nullptr, getDeviceName(), "w", errmsg);
+            fp = IUGetConfigTmpFP(nullptr, getDeviceName(), errmsg);
+            if (fp == nullptr)
+            {
+                LOGF_WARN("Failed to save configuration. %s", errmsg);
+                delXMLEle(root);
+                return false;
+            }
             prXMLEle(fp, root, 0);
-            fflush(fp);
-            fclose(fp);
             delXMLEle(root);
+            if (IUCommitConfigFP(fp, errmsg) < 0)
+            {
+                LOGF_WARN("Failed to save configuration. %s", errmsg);
+                return false;
+            }
             LOGF_DEBUG("Configuration successfully saved for %s.", property);
             return true;
         }
@@ -26,6 +26,7 @@
 #include "indicom.h"
 #include "libastro.h"
 #include "indiutility.h"
+#include "fileindex.h"
 
 #include <fitsio.h>
 
@@ -33,9 +34,6 @@
 #include <libnova/ln_types.h>
 #include <libnova/precession.h>
 
-#include <regex>
-
-#include <dirent.h>
 #include <cerrno>
 #include <locale.h>
 #include <cstdio>
@@ -46,13 +44,6 @@
 #include <unistd.h>
 #include <fcntl.h>
 
-static std::string regex_replace_compat(const std::string &input, const std::string &pattern, const std::string &replace)
-{
-    std::stringstream s;
-    std::regex_replace(std::ostreambuf_iterator<char>(s), input.begin(), input.end(), std::regex(pattern), replace);
-    return s.str();
-}
-
 namespace DSP
 {
 const char *DSP_TAB = "Signal Processing";
@@ -501,40 +492,42 @@ bool Interface::uploadFile(const void *fitsData, size_t totalBytes, bool sendCap
 
         FILE *fp = nullptr;
 
+        std::string dir    = m_Device->getText("UPLOAD_SETTINGS")[0].getText();
         std::string prefix = m_Device->getText("UPLOAD_SETTINGS")[1].getText();
 
-        int maxIndex = getFileIndex(m_Device->getText("UPLOAD_SETTINGS")[0].getText(), prefix.c_str(),
-                                    format);
+        char ts[32];
+        struct tm *tp;
+        time_t t;
+        time(&t);
+        tp = localtime(&t);
+        strftime(ts, sizeof(ts), "%Y-%m-%dT%H-%M-%S", tp);
 
-        if (maxIndex < 0)
-        {
-            DEBUGF(INDI::Logger::DBG_ERROR, "Error iterating directory %s. %s", m_Device->getText("UPLOAD_SETTINGS")[0].getText(),
-                   strerror(errno));
-            return false;
-        }
+        // Outputs of each plugin count apart from the frames the CCD saves with the same prefix
+        std::string suffix = std::string("_") + m_Name;
+
+        char processedFileName[MAXINDINAME];
+        int maxIndex = INDI::nextFileIndex(dir, prefix, suffix);
 
         if (maxIndex > 0)
         {
-            char ts[32];
-            struct tm *tp;
-            time_t t;
-            time(&t);
-            tp = localtime(&t);
-            strftime(ts, sizeof(ts), "%Y-%m-%dT%H-%M-%S", tp);
-            std::string filets(ts);
-            prefix = std::regex_replace(prefix, std::regex("ISO8601"), filets);
-
-            char indexString[8];
-            snprintf(indexString, 8, "%03d", maxIndex);
-            std::string prefixIndex = indexString;
-            //prefix.replace(prefix.find("XXX"), std::string::npos, prefixIndex);
-            prefix = std::regex_replace(prefix, std::regex("XXX"), prefixIndex);
-        }
+            snprintf(processedFileName, MAXINDINAME, "%s/%s%s.%s", dir.c_str(),
+                     INDI::expandFilePrefix(prefix, ts, maxIndex).c_str(), suffix.c_str(), format);
 
-        char processedFileName[MAXINDINAME];
+            // The cached index is stale if something else saved into the sequence, rescan once
+            if (prefix.find("XXX") != std::string::npos && access(processedFileName, F_OK) == 0)
+            {
+                INDI::resetFileIndex(dir, prefix, suffix);
+                maxIndex = INDI::nextFileIndex(dir, prefix, suffix);
+                snprintf(processedFileName, MAXINDINAME, "%s/%s%s.%s", dir.c_str(),
+                         INDI::expandFilePrefix(prefix, ts, maxIndex).c_str(), suffix.c_str(), format);
+            }
+        }
 
-        snprintf(processedFileName, MAXINDINAME, "%s/%s_%s.%s", m_Device->getText("UPLOAD_SETTINGS")[0].getText(), prefix.c_str(),
-                 m_Name, format);
+        if (maxIndex < 0)
+        {
+            DEBUGF(INDI::Logger::DBG_ERROR, "Error iterating directory %s. %s", dir.c_str(), strerror(errno));
+            return false;
+        }
 
         fp = fopen(processedFileName, "w");
         if (fp == nullptr)
@@ -568,61 +561,6 @@ bool Interface::uploadFile(const void *fitsData, size_t totalBytes, bool sendCap
     return true;
 }
 
-int Interface::getFileIndex(const char *dir, const char *prefix, const char *ext)
-{
-    INDI_UNUSED(ext);
-
-    DIR *dpdf = nullptr;
-    struct dirent *epdf = nullptr;
-    std::vector<std::string> files = std::vector<std::string>();
-
-    std::string prefixIndex = prefix;
-    prefixIndex             = regex_replace_compat(prefixIndex, "_ISO8601", "");
-    prefixIndex             = regex_replace_compat(prefixIndex, "_XXX", "");
-
-    // Create directory if does not exist
-    struct stat st;
-
-    if (stat(dir, &st) == -1)
-    {
-        LOGF_DEBUG("Creating directory %s...", dir);
-        if (INDI::mkpath(dir, 0755) == -1)
-            LOGF_ERROR("Error creating directory %s (%s)", dir, strerror(errno));
-    }
-
-    dpdf = opendir(dir);
-    if (dpdf != nullptr)
-    {
-        while ((epdf = readdir(dpdf)))
-        {
-            if (strstr(epdf->d_name, prefixIndex.c_str()))
-                files.push_back(epdf->d_name);
-        }
-        closedir(dpdf);
-    }
-    else
-        return -1;
-
-    int maxIndex = 0;
-
-    for (unsigned long i = 0; i < static_cast<unsigned long>(files.size()); i++)
-    {
-        int index = -1;
-
-        std::string file  = files.at(i);
-        std::size_t start = file.find_last_of("_");
-        std::size_t end   = file.find_last_of(".");
-        if (start != std::string::npos)
-        {
-            index = atoi(file.substr(start + 1, end).c_str());
-            if (index > maxIndex)
-                maxIndex = index;
-        }
-    }
-
-    return (maxIndex + 1);
-}
-
 bool Interface::setStream(void *buf, uint32_t dims, int *sizes, int bits_per_sample)
 {
     stream->sizes = (int*)realloc(stream->sizes, sizeof(int));
@@ -223,6 +223,5 @@ class Interface
         void addFITSKeywords(fitsfile *fptr);
         bool sendFITS(uint8_t *buf, bool sendCapture, bool saveCapture);
         bool uploadFile(const void *fitsData, size_t totalBytes, bool sendIntegration, bool saveIntegration, const char* format);
-        int getFileIndex(const char *dir, const char *prefix, const char *ext);
 };
 }
@@ -0,0 +1,130 @@
+/**  INDI LIB
+ *   Sequential file index for local uploads
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "fileindex.h"
+#include "indiutility.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+namespace
+{
+
+std::mutex fileIndexMutex;
+// Next index keyed by directory, prefix stem and suffix
+std::unordered_map<std::string, int> fileIndexCache;
+
+std::string prefixStem(const std::string &prefix)
+{
+    std::string stem = prefix;
+    INDI::replace_all(stem, "_ISO8601", "");
+    INDI::replace_all(stem, "_XXX", "");
+    return stem;
+}
+
+std::string cacheKey(const std::string &dir, const std::string &prefix, const std::string &suffix)
+{
+    return dir + '\0' + prefixStem(prefix) + '\0' + suffix;
+}
+
+// Highest index of the files containing stem (and suffix if any), plus one.
+// The index follows the last underscore before the suffix, or in the whole name without one.
+int scanDirectory(const std::string &dir, const std::string &stem, const std::string &suffix)
+{
+    DIR *dpdf = opendir(dir.c_str());
+    if (dpdf == nullptr)
+        return -1;
+
+    int maxIndex = 0;
+    struct dirent *epdf = nullptr;
+    while ((epdf = readdir(dpdf)))
+    {
+        std::string name = epdf->d_name;
+        if (name.find(stem) == std::string::npos)
+            continue;
+
+        size_t end = suffix.empty() ? name.size() : name.rfind(suffix);
+        if (end == std::string::npos || end == 0)
+            continue;
+
+        size_t start = name.rfind('_', end - 1);
+        if (start != std::string::npos)
+            maxIndex = std::max(maxIndex, atoi(name.c_str() + start + 1));
+    }
+    closedir(dpdf);
+
+    return maxIndex + 1;
+}
+
+}
+
+namespace INDI
+{
+
+int nextFileIndex(const std::string &dir, const std::string &prefix, const std::string &suffix)
+{
+    std::string key = cacheKey(dir, prefix, suffix);
+    std::lock_guard<std::mutex> lock(fileIndexMutex);
+
+    // Create directory if does not exist, the sequence restarts if it was removed
+    struct stat st;
+    if (stat(dir.c_str(), &st) == -1)
+    {
+        if (errno != ENOENT || INDI::mkpath(dir, 0755) == -1)
+            return -1;
+        fileIndexCache.erase(key);
+    }
+
+    auto it = fileIndexCache.find(key);
+    if (it == fileIndexCache.end())
+    {
+        int index = scanDirectory(dir, prefixStem(prefix), suffix);
+        if (index < 0)
+            return -1;
+        it = fileIndexCache.emplace(key, index).first;
+    }
+
+    return it->second++;
+}
+
+void resetFileIndex(const std::string &dir, const std::string &prefix, const std::string &suffix)
+{
+    std::lock_guard<std::mutex> lock(fileIndexMutex);
+    fileIndexCache.erase(cacheKey(dir, prefix, suffix));
+}
+
+std::string expandFilePrefix(const std::string &prefix, const std::string &timestamp, int index)
+{
+    char indexString[16];
+    snprintf(indexString, sizeof(indexString), "%03d", index);
+
+    std::string result = prefix;
+    INDI::replace_all(result, "ISO8601", timestamp);
+    INDI::replace_all(result, "XXX", indexString);
+    return result;
+}
+
+}
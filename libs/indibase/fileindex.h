@@ -0,0 +1,51 @@
+/**  INDI LIB
+ *   Sequential file index for local uploads
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <string>
+
+namespace INDI
+{
+
+/**
+ * @brief Return the index for the next file saved in dir with the given upload prefix.
+ * The directory is created if needed and scanned once per directory and prefix for the highest index
+ * of the files matching the prefix (without its _ISO8601 and _XXX placeholders). Later calls count up
+ * from the cached index.
+ * @param suffix What the caller appends to the expanded prefix, e.g. _<name> for the outputs of a DSP
+ * plugin. Files with different suffixes, and those without one, count in separate sequences.
+ * @return The next index, or -1 if the directory can't be read (errno is set).
+ */
+int nextFileIndex(const std::string &dir, const std::string &prefix, const std::string &suffix = "");
+
+/**
+ * @brief Forget the cached index of dir, prefix and suffix, the next call to nextFileIndex rescans the directory.
+ * Call it when the expanded file name turns out to be taken.
+ */
+void resetFileIndex(const std::string &dir, const std::string &prefix, const std::string &suffix = "");
+
+/**
+ * @brief Expand the ISO8601 and XXX placeholders of an upload prefix.
+ * @param prefix Upload prefix, e.g. IMAGE_XXX or IMAGE_ISO8601_XXX
+ * @param timestamp Replaces ISO8601
+ * @param index Replaces XXX, zero padded to three digits
+ */
+std::string expandFilePrefix(const std::string &prefix, const std::string &timestamp, int index);
+
+}
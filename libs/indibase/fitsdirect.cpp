@@ -0,0 +1,325 @@
+/**  INDI LIB
+ *   Direct to disk FITS writer for local uploads
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "fitsdirect.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace
+{
+
+constexpr size_t FITS_BLOCK = 2880;
+constexpr size_t DIRECT_ALIGN = 4096;
+
+size_t roundUp(size_t size, size_t block)
+{
+    return (size + block - 1) / block * block;
+}
+
+inline uint16_t toBigEndian(uint16_t value)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap16(value);
+#else
+    return value;
+#endif
+}
+
+inline uint32_t toBigEndian(uint32_t value)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap32(value);
+#else
+    return value;
+#endif
+}
+
+struct FITSLayout
+{
+    const char *header;
+    size_t headerSize;
+    size_t headerEnd;   // header padded to a FITS block
+    const void *samples;
+    size_t dataEnd;     // end of the samples in the file
+    size_t fileSize;    // data padded to a FITS block
+    int bpp;
+};
+
+// Signed FITS samples with BZERO, i.e. the sign bit flipped, big endian
+void convertSamples(uint8_t *out, const void *samples, size_t first, size_t count, int bpp)
+{
+    switch (bpp)
+    {
+        case 8:
+            memcpy(out, static_cast<const uint8_t *>(samples) + first, count);
+            break;
+
+        case 16:
+        {
+            const uint16_t *in = static_cast<const uint16_t *>(samples) + first;
+            for (size_t i = 0; i < count; i++)
+            {
+                uint16_t value = toBigEndian(static_cast<uint16_t>(in[i] ^ 0x8000));
+                memcpy(out + 2 * i, &value, 2);
+            }
+        }
+        break;
+
+        case 32:
+        {
+            const uint32_t *in = static_cast<const uint32_t *>(samples) + first;
+            for (size_t i = 0; i < count; i++)
+            {
+                uint32_t value = toBigEndian(in[i] ^ 0x80000000u);
+                memcpy(out + 4 * i, &value, 4);
+            }
+        }
+        break;
+    }
+}
+
+// Produce bytes [offset, offset + size) of the file
+void fillRange(uint8_t *out, size_t offset, size_t size, const FITSLayout &layout)
+{
+    size_t end = offset + size;
+    size_t sampleSize = layout.bpp / 8;
+
+    while (offset < end)
+    {
+        size_t n;
+        if (offset < layout.headerSize)
+        {
+            n = std::min(end, layout.headerSize) - offset;
+            memcpy(out, layout.header + offset, n);
+        }
+        else if (offset < layout.headerEnd)
+        {
+            n = std::min(end, layout.headerEnd) - offset;
+            memset(out, ' ', n);
+        }
+        else if (offset < layout.dataEnd)
+        {
+            n = std::min(end, layout.dataEnd) - offset;
+            convertSamples(out, layout.samples, (offset - layout.headerEnd) / sampleSize, n / sampleSize, layout.bpp);
+        }
+        else
+        {
+            n = end - offset;
+            memset(out, 0, n);
+        }
+        out += n;
+        offset += n;
+    }
+}
+
+int writeAll(int fd, const uint8_t *buffer, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t n = pwrite(fd, buffer, size, offset);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buffer += n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+}
+
+namespace INDI
+{
+
+FITSDirectWriter::~FITSDirectWriter()
+{
+    abort();
+}
+
+int FITSDirectWriter::open(const char *path, const char *header, size_t headerSize, size_t count, int bpp,
+                           FITSDirectMode mode)
+{
+    if ((bpp != 8 && bpp != 16 && bpp != 32) || headerSize % 80 != 0 || m_FD >= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    m_Path      = path;
+    m_Header.assign(header, headerSize);
+    m_HeaderEnd = roundUp(headerSize, FITS_BLOCK);
+    m_DataEnd   = m_HeaderEnd + count * (bpp / 8);
+    m_FileSize  = roundUp(m_DataEnd, FITS_BLOCK);
+    m_BPP       = bpp;
+
+    int flags = O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC;
+    m_DirectIO = false;
+#ifdef O_DIRECT
+    if (mode == FITS_DIRECT_IO)
+        m_DirectIO = true;
+#endif
+
+    m_FD = ::open(path, flags | (m_DirectIO ? O_DIRECT : 0), 0666);
+    if (m_FD < 0 && m_DirectIO && errno == EINVAL)
+    {
+        m_DirectIO = false;
+        m_FD = ::open(path, flags, 0666);
+    }
+    if (m_FD < 0)
+        return -1;
+
+#ifdef __linux__
+    if (mode == FITS_DIRECT_MAPPED)
+    {
+        // Reserve the blocks up front so running out of space fails here rather than as SIGBUS in the mapping
+        int rc = posix_fallocate(m_FD, 0, m_FileSize);
+        if (rc == ENOSPC || rc == EFBIG || rc == EIO)
+        {
+            abort();
+            errno = rc;
+            return -1;
+        }
+        if (rc == 0)
+        {
+            void *map = mmap(nullptr, m_FileSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_FD, 0);
+            if (map != MAP_FAILED)
+            {
+                madvise(map, m_FileSize, MADV_SEQUENTIAL);
+                m_Map = map;
+                return 0;
+            }
+        }
+        // The file system can't do it, write instead
+    }
+#endif
+
+    // O_DIRECT wants whole blocks, the tail is cut off by close()
+    m_BufferSize = m_DirectIO ? roundUp(m_FileSize, DIRECT_ALIGN) : m_FileSize;
+    if (posix_memalign(&m_Buffer, DIRECT_ALIGN, m_BufferSize) != 0)
+    {
+        m_Buffer = nullptr;
+        abort();
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(static_cast<uint8_t *>(m_Buffer) + m_FileSize, 0, m_BufferSize - m_FileSize);
+    return 0;
+}
+
+void FITSDirectWriter::convert(const void *samples)
+{
+    FITSLayout layout;
+    layout.header     = m_Header.data();
+    layout.headerSize = m_Header.size();
+    layout.headerEnd  = m_HeaderEnd;
+    layout.samples    = samples;
+    layout.dataEnd    = m_DataEnd;
+    layout.fileSize   = m_FileSize;
+    layout.bpp        = m_BPP;
+
+    if (m_Map != nullptr)
+        fillRange(static_cast<uint8_t *>(m_Map), 0, m_FileSize, layout);
+    else if (m_Buffer != nullptr)
+        fillRange(static_cast<uint8_t *>(m_Buffer), 0, m_FileSize, layout);
+}
+
+int FITSDirectWriter::close()
+{
+    if (m_FD < 0)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    int rc = 0;
+    if (m_Map != nullptr)
+    {
+        munmap(m_Map, m_FileSize);
+        m_Map = nullptr;
+    }
+    else
+    {
+        const uint8_t *buffer = static_cast<const uint8_t *>(m_Buffer);
+        rc = writeAll(m_FD, buffer, m_BufferSize, 0);
+#ifdef O_DIRECT
+        // Some file systems only reject O_DIRECT on the first write, carry on with the page cache
+        if (rc < 0 && errno == EINVAL && m_DirectIO)
+        {
+            fcntl(m_FD, F_SETFL, fcntl(m_FD, F_GETFL) & ~O_DIRECT);
+            m_DirectIO = false;
+            rc = writeAll(m_FD, buffer, m_FileSize, 0);
+        }
+#endif
+        if (rc == 0 && m_DirectIO)
+            rc = ftruncate(m_FD, m_FileSize);
+    }
+
+    if (rc < 0)
+    {
+        int error = errno;
+        abort();
+        errno = error;
+        return -1;
+    }
+
+    free(m_Buffer);
+    m_Buffer = nullptr;
+    rc = ::close(m_FD);
+    m_FD = -1;
+    return rc;
+}
+
+void FITSDirectWriter::abort()
+{
+    if (m_Map != nullptr)
+        munmap(m_Map, m_FileSize);
+    m_Map = nullptr;
+    free(m_Buffer);
+    m_Buffer = nullptr;
+    if (m_FD >= 0)
+    {
+        ::close(m_FD);
+        unlink(m_Path.c_str());
+    }
+    m_FD = -1;
+}
+
+int writeFITSDirect(const char *path, const char *header, size_t headerSize, const void *samples, size_t count,
+                    int bpp, FITSDirectMode mode)
+{
+    FITSDirectWriter writer;
+
+    if (writer.open(path, header, headerSize, count, bpp, mode) < 0)
+        return -1;
+    writer.convert(samples);
+    return writer.close();
+}
+
+}
@@ -0,0 +1,99 @@
+/**  INDI LIB
+ *   Direct to disk FITS writer for local uploads
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace INDI
+{
+
+enum FITSDirectMode
+{
+    FITS_DIRECT_MAPPED, /*!< Preallocate the file and convert the samples into a shared mapping of it. */
+    FITS_DIRECT_IO      /*!< Convert the samples into an aligned buffer written with O_DIRECT, bypassing the page cache. */
+};
+
+/**
+ * @brief A single image FITS file written without building it in memory first.
+ *
+ * The samples are converted once, straight into the room prepared by open(): a shared mapping of the
+ * preallocated file, or an aligned buffer for O_DIRECT (or plain writes where mapping is unsupported).
+ * This lets a caller convert a frame while it holds it, and leave the disk writes to another thread.
+ */
+class FITSDirectWriter
+{
+    public:
+        FITSDirectWriter() = default;
+        FITSDirectWriter(const FITSDirectWriter &) = delete;
+        FITSDirectWriter &operator=(const FITSDirectWriter &) = delete;
+        /** Unlinks the file if it was opened and not closed successfully */
+        ~FITSDirectWriter();
+
+        /**
+         * @brief Create the file and make room for its content.
+         * @param path File to create or truncate.
+         * @param header Header cards, a multiple of 80 characters ending with the END card, as returned by
+         * fits_hdr2str. Copied.
+         * @param headerSize Length of header in bytes.
+         * @param count Number of samples.
+         * @param bpp Bits per sample, 8, 16 or 32. Deeper samples are stored with the usual BZERO offset, which
+         * the header must declare.
+         * @param mode How the data reaches the disk. Both modes fall back to plain writes where unsupported.
+         * @return 0 on success, -1 on failure with errno set.
+         */
+        int open(const char *path, const char *header, size_t headerSize, size_t count, int bpp, FITSDirectMode mode);
+
+        /**
+         * @brief Convert the samples into the file, the only pass over them.
+         * @param samples Native endian unsigned samples of the frame, count of them as given to open().
+         */
+        void convert(const void *samples);
+
+        /**
+         * @brief Write out what is not on disk yet and close the file.
+         * @return 0 on success, -1 on failure with errno set, the file is then removed.
+         */
+        int close();
+
+    private:
+        void abort();
+
+        std::string m_Path;
+        std::string m_Header;
+        size_t m_HeaderEnd {0};
+        size_t m_DataEnd {0};
+        size_t m_FileSize {0};
+        int m_BPP {0};
+        int m_FD {-1};
+        bool m_DirectIO {false};
+        void *m_Map {nullptr};      // shared mapping of the file
+        void *m_Buffer {nullptr};   // or the aligned content to write
+        size_t m_BufferSize {0};
+};
+
+/**
+ * @brief Write a single image FITS file without building it in memory first.
+ * @see FITSDirectWriter, this opens, converts and closes in one go.
+ * @return 0 on success, -1 on failure with errno set.
+ */
+int writeFITSDirect(const char *path, const char *header, size_t headerSize, const void *samples, size_t count,
+                    int bpp, FITSDirectMode mode);
+
+}
@@ -30,9 +30,13 @@
 #include "indiccd.h"
 
 #include "fpack/fpack.h"
+#include "fileindex.h"
+#include "fitsdirect.h"
+#include "indiblobcodec.h"
 #include "indicom.h"
 #include "locale_compat.h"
 #include "indiutility.h"
+#include "sharedblob.h"
 
 #ifdef HAVE_XISF
 #include <libxisf.h>
@@ -48,16 +52,17 @@
 #include <libastro.h>
 
 #include <iomanip>
+#include <algorithm>
 #include <cmath>
 #include <regex>
 #include <iterator>
 #include <variant>
 
-#include <dirent.h>
 #include <cerrno>
 #include <cstdlib>
 #include <zlib.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 const char * IMAGE_SETTINGS_TAB = "Image Settings";
 const char * IMAGE_INFO_TAB     = "Image Info";
@@ -131,6 +136,9 @@ CCD::CCD() : GI(this)
 
 CCD::~CCD()
 {
+    // Normally stopped on disconnect already, before derived drivers are torn down
+    stopUploadThread();
+
     // Only update if index is different.
     if (m_ConfigFastExposureIndex != IUFindOnSwitchIndex(&FastExposureToggleSP))
         saveConfig(true, FastExposureToggleSP.name);
@@ -214,6 +222,18 @@ bool CCD::initProperties()
     IUFillNumberVector(&PrimaryCCD.ImagePixelSizeNP, PrimaryCCD.ImagePixelSizeN, 6, getDeviceName(), "CCD_INFO",
                        "CCD Information", IMAGE_INFO_TAB, IP_RO, 60, IPS_IDLE);
 
+    // Primary CCD Image Statistics
+    IUFillNumber(&PrimaryCCD.ImageStatisticsN[CCDChip::STAT_MIN], "STAT_MIN", "Minimum", "%.f", 0, 4294967295., 0, 0);
+    IUFillNumber(&PrimaryCCD.ImageStatisticsN[CCDChip::STAT_MAX], "STAT_MAX", "Maximum", "%.f", 0, 4294967295., 0, 0);
+    IUFillNumber(&PrimaryCCD.ImageStatisticsN[CCDChip::STAT_MEAN], "STAT_MEAN", "Mean", "%.2f", 0, 4294967295., 0, 0);
+    IUFillNumber(&PrimaryCCD.ImageStatisticsN[CCDChip::STAT_STDDEV], "STAT_STDDEV", "Std. Deviation", "%.2f", 0,
+                 4294967295., 0, 0);
+    IUFillNumber(&PrimaryCCD.ImageStatisticsN[CCDChip::STAT_MEDIAN], "STAT_MEDIAN", "Median", "%.f", 0, 4294967295., 0, 0);
+    IUFillNumber(&PrimaryCCD.ImageStatisticsN[CCDChip::STAT_SATURATED], "STAT_SATURATED", "Saturated", "%.f", 0, 1e12, 0,
+                 0);
+    IUFillNumberVector(&PrimaryCCD.ImageStatisticsNP, PrimaryCCD.ImageStatisticsN, 6, getDeviceName(),
+                       "CCD_IMAGE_STATISTICS", "Statistics", IMAGE_INFO_TAB, IP_RO, 60, IPS_IDLE);
+
     // Primary CCD Compression Options
     IUFillSwitch(&PrimaryCCD.CompressS[INDI_ENABLED], "INDI_ENABLED", "Enabled", ISS_OFF);
     IUFillSwitch(&PrimaryCCD.CompressS[INDI_DISABLED], "INDI_DISABLED", "Disabled", ISS_ON);
@@ -289,6 +309,17 @@ bool CCD::initProperties()
     IUFillNumberVector(&GuideCCD.ImagePixelSizeNP, GuideCCD.ImagePixelSizeN, 6, getDeviceName(), "GUIDER_INFO",
                        "Info", IMAGE_INFO_TAB, IP_RO, 60, IPS_IDLE);
 
+    IUFillNumber(&GuideCCD.ImageStatisticsN[CCDChip::STAT_MIN], "STAT_MIN", "Minimum", "%.f", 0, 4294967295., 0, 0);
+    IUFillNumber(&GuideCCD.ImageStatisticsN[CCDChip::STAT_MAX], "STAT_MAX", "Maximum", "%.f", 0, 4294967295., 0, 0);
+    IUFillNumber(&GuideCCD.ImageStatisticsN[CCDChip::STAT_MEAN], "STAT_MEAN", "Mean", "%.2f", 0, 4294967295., 0, 0);
+    IUFillNumber(&GuideCCD.ImageStatisticsN[CCDChip::STAT_STDDEV], "STAT_STDDEV", "Std. Deviation", "%.2f", 0,
+                 4294967295., 0, 0);
+    IUFillNumber(&GuideCCD.ImageStatisticsN[CCDChip::STAT_MEDIAN], "STAT_MEDIAN", "Median", "%.f", 0, 4294967295., 0, 0);
+    IUFillNumber(&GuideCCD.ImageStatisticsN[CCDChip::STAT_SATURATED], "STAT_SATURATED", "Saturated", "%.f", 0, 1e12, 0,
+                 0);
+    IUFillNumberVector(&GuideCCD.ImageStatisticsNP, GuideCCD.ImageStatisticsN, 6, getDeviceName(),
+                       "GUIDER_IMAGE_STATISTICS", "Statistics", IMAGE_INFO_TAB, IP_RO, 60, IPS_IDLE);
+
     IUFillSwitch(&GuideCCD.FrameTypeS[0], "FRAME_LIGHT", "Light", ISS_ON);
     IUFillSwitch(&GuideCCD.FrameTypeS[1], "FRAME_BIAS", "Bias", ISS_OFF);
     IUFillSwitch(&GuideCCD.FrameTypeS[2], "FRAME_DARK", "Dark", ISS_OFF);
@@ -379,6 +410,17 @@ bool CCD::initProperties()
     EncodeFormatSP.fill(getDeviceName(), "CCD_TRANSFER_FORMAT", "Encode", IMAGE_SETTINGS_TAB, IP_RW, ISR_1OFMANY, 60,
                         IPS_IDLE);
 
+    // Compression Codec
+    CompressionCodecSP[CODEC_DEFAULT].fill("CODEC_DEFAULT", "Default", ISS_ON);
+    CompressionCodecSP[CODEC_ZLIB].fill("CODEC_ZLIB", "Fast zlib", ISS_OFF);
+    CompressionCodecSP[CODEC_ZSTD].fill("CODEC_ZSTD", "Zstd", ISS_OFF);
+    CompressionCodecSP.fill(getDeviceName(), "CCD_COMPRESSION_CODEC", "Codec", IMAGE_SETTINGS_TAB, IP_RW, ISR_1OFMANY, 60,
+                            IPS_IDLE);
+
+    CompressionLevelNP[0].fill("LEVEL", "Level", "%.f", -7, 19, 1, 1);
+    CompressionLevelNP.fill(getDeviceName(), "CCD_COMPRESSION_LEVEL", "Codec Level", IMAGE_SETTINGS_TAB, IP_RW, 60,
+                            IPS_IDLE);
+
     /**********************************************/
     /************** Upload Settings ***************/
     /**********************************************/
@@ -396,6 +438,16 @@ bool CCD::initProperties()
     IUFillTextVector(&UploadSettingsTP, UploadSettingsT, 2, getDeviceName(), "UPLOAD_SETTINGS", "Upload Settings",
                      OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
 
+    // Local Write
+    LocalWriteSP[LOCAL_WRITE_BUFFERED].fill("LOCAL_WRITE_BUFFERED", "Buffered", ISS_ON);
+    LocalWriteSP[LOCAL_WRITE_MAPPED].fill("LOCAL_WRITE_MAPPED", "Mapped", ISS_OFF);
+    LocalWriteSP[LOCAL_WRITE_DIRECT].fill("LOCAL_WRITE_DIRECT", "Direct I/O", ISS_OFF);
+    LocalWriteSP.fill(getDeviceName(), "CCD_LOCAL_WRITE", "Local Write", OPTIONS_TAB, IP_RW, ISR_1OFMANY, 60, IPS_IDLE);
+
+    // Upload Queue
+    UploadQueueNP[0].fill("MAX_PENDING", "Max pending", "%.f", 1, 100, 1, 2);
+    UploadQueueNP.fill(getDeviceName(), "CCD_UPLOAD_QUEUE", "Upload Queue", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
     // Upload File Path
     IUFillText(&FileNameT[0], "FILE_PATH", "Path", "");
     IUFillTextVector(&FileNameTP, FileNameT, 1, getDeviceName(), "CCD_FILE_PATH", "Filename", IMAGE_INFO_TAB, IP_RO, 60,
@@ -566,13 +618,17 @@ bool CCD::updateProperties()
         defineProperty(EncodeFormatSP);
 
         defineProperty(&PrimaryCCD.ImagePixelSizeNP);
+        defineProperty(&PrimaryCCD.ImageStatisticsNP);
         if (HasGuideHead())
         {
             defineProperty(&GuideCCD.ImagePixelSizeNP);
+            defineProperty(&GuideCCD.ImageStatisticsNP);
             if (CanBin())
                 defineProperty(&GuideCCD.ImageBinNP);
         }
         defineProperty(&PrimaryCCD.CompressSP);
+        defineProperty(CompressionCodecSP);
+        defineProperty(CompressionLevelNP);
         defineProperty(&PrimaryCCD.FitsBP);
         if (HasGuideHead())
         {
@@ -616,6 +672,8 @@ bool CCD::updateProperties()
         if (UploadSettingsT[UPLOAD_DIR].text == nullptr)
             IUSaveText(&UploadSettingsT[UPLOAD_DIR], getenv("HOME"));
         defineProperty(&UploadSettingsTP);
+        defineProperty(LocalWriteSP);
+        defineProperty(UploadQueueNP);
 
 #ifdef HAVE_WEBSOCKET
         if (HasWebSocket())
@@ -627,11 +685,15 @@ bool CCD::updateProperties()
     }
     else
     {
+        // Let queued frames go out while the driver and its properties are still intact
+        stopUploadThread();
+
         deleteProperty(PrimaryCCD.ImageFrameNP.name);
         if (CanBin() || CanSubFrame())
             deleteProperty(PrimaryCCD.ResetSP.name);
 
         deleteProperty(PrimaryCCD.ImagePixelSizeNP.name);
+        deleteProperty(PrimaryCCD.ImageStatisticsNP.name);
 
         deleteProperty(CaptureFormatSP.getName());
         deleteProperty(EncodeFormatSP.getName());
@@ -644,6 +706,8 @@ bool CCD::updateProperties()
             deleteProperty(PrimaryCCD.AbortExposureSP.name);
         deleteProperty(PrimaryCCD.FitsBP.name);
         deleteProperty(PrimaryCCD.CompressSP.name);
+        deleteProperty(CompressionCodecSP);
+        deleteProperty(CompressionLevelNP);
 
 #if 0
         deleteProperty(PrimaryCCD.RapidGuideSP.name);
@@ -663,6 +727,7 @@ bool CCD::updateProperties()
                 deleteProperty(GuideCCD.AbortExposureSP.name);
             deleteProperty(GuideCCD.ImageFrameNP.name);
             deleteProperty(GuideCCD.ImagePixelSizeNP.name);
+            deleteProperty(GuideCCD.ImageStatisticsNP.name);
 
             deleteProperty(GuideCCD.FitsBP.name);
             if (CanBin())
@@ -700,6 +765,8 @@ bool CCD::updateProperties()
         deleteProperty(WorldCoordSP.name);
         deleteProperty(UploadSP.name);
         deleteProperty(UploadSettingsTP.name);
+        deleteProperty(LocalWriteSP);
+        deleteProperty(UploadQueueNP);
 
 #ifdef HAVE_WEBSOCKET
         if (HasWebSocket())
@@ -1002,9 +1069,9 @@ bool CCD::ISNewText(const char * dev, const char * name, char * texts[], char *
                 else if (name.empty() == false && value.empty() == false)
                 {
                     // Double regex
-                    std::regex checkDouble("^[-+]?([0-9]*?[.,][0-9]+|[0-9]+)$");
+                    static const std::regex checkDouble("^[-+]?([0-9]*?[.,][0-9]+|[0-9]+)$");
                     // Integer regex
-                    std::regex checkInteger("^[-+]?([0-9]*)$");
+                    static const std::regex checkInteger("^[-+]?([0-9]*)$");
 
                     try
                     {
@@ -1084,6 +1151,8 @@ bool CCD::ISNewNumber(const char * dev, const char * name, double values[], char
     {
         if (!strcmp(name, "CCD_EXPOSURE"))
         {
+            newExposureSequence(&PrimaryCCD);
+
             if (PrimaryCCD.getFrameType() != CCDChip::BIAS_FRAME &&
                     (values[0] < PrimaryCCD.ImageExposureN[0].min || values[0] > PrimaryCCD.ImageExposureN[0].max))
             {
@@ -1121,6 +1190,8 @@ bool CCD::ISNewNumber(const char * dev, const char * name, double values[], char
 
         if (!strcmp(name, "GUIDER_EXPOSURE"))
         {
+            newExposureSequence(&GuideCCD);
+
             if (GuideCCD.getFrameType() != CCDChip::BIAS_FRAME &&
                     (values[0] < GuideCCD.ImageExposureN[0].min || values[0] > GuideCCD.ImageExposureN[0].max))
             {
@@ -1231,6 +1302,31 @@ bool CCD::ISNewNumber(const char * dev, const char * name, double values[], char
             return true;
         }
 
+        // Compression Level
+        if (CompressionLevelNP.isNameMatch(name))
+        {
+            CompressionLevelNP.update(values, names, n);
+            CompressionLevelNP.setState(IPS_OK);
+            CompressionLevelNP.apply();
+            saveConfig(true, CompressionLevelNP.getName());
+            return true;
+        }
+
+        // Upload Queue
+        if (UploadQueueNP.isNameMatch(name))
+        {
+            std::unique_lock<std::mutex> lock(m_UploadMutex);
+            UploadQueueNP.update(values, names, n);
+            UploadQueueNP.setState(IPS_OK);
+            UploadQueueNP.apply();
+            lock.unlock();
+
+            // Frames waiting for room may fit now
+            m_UploadCondition.notify_all();
+            saveConfig(true, UploadQueueNP.getName());
+            return true;
+        }
+
         // Scope Information
         if (ScopeInfoNP.isNameMatch(name))
         {
@@ -1591,6 +1687,7 @@ bool CCD::ISNewSwitch(const char * dev, const char * name, ISState * states, cha
         if (strcmp(name, PrimaryCCD.AbortExposureSP.name) == 0)
         {
             IUResetSwitch(&PrimaryCCD.AbortExposureSP);
+            newExposureSequence(&PrimaryCCD);
 
             if (AbortExposure())
             {
@@ -1625,6 +1722,7 @@ bool CCD::ISNewSwitch(const char * dev, const char * name, ISState * states, cha
         if (strcmp(name, GuideCCD.AbortExposureSP.name) == 0)
         {
             IUResetSwitch(&GuideCCD.AbortExposureSP);
+            newExposureSequence(&GuideCCD);
 
             if (AbortGuideExposure())
             {
@@ -1757,6 +1855,36 @@ bool CCD::ISNewSwitch(const char * dev, const char * name, ISState * states, cha
             return true;
         }
 
+        // Local Write
+        if (LocalWriteSP.isNameMatch(name))
+        {
+            LocalWriteSP.update(states, names, n);
+            LocalWriteSP.setState(IPS_OK);
+            LocalWriteSP.apply();
+            saveConfig(true, LocalWriteSP.getName());
+            return true;
+        }
+
+        // Compression Codec
+        if (CompressionCodecSP.isNameMatch(name))
+        {
+            auto previous = CompressionCodecSP.findOnSwitchIndex();
+            CompressionCodecSP.update(states, names, n);
+            if (CompressionCodecSP[CODEC_ZSTD].getState() == ISS_ON && !isBlobCodecAvailable(BLOB_CODEC_ZSTD))
+            {
+                LOG_ERROR("Zstd compression is not supported by this build.");
+                CompressionCodecSP.reset();
+                CompressionCodecSP[previous].setState(ISS_ON);
+                CompressionCodecSP.setState(IPS_ALERT);
+                CompressionCodecSP.apply();
+                return true;
+            }
+            CompressionCodecSP.setState(IPS_OK);
+            CompressionCodecSP.apply();
+            saveConfig(true, CompressionCodecSP.getName());
+            return true;
+        }
+
         // Encode Format
         if (EncodeFormatSP.isNameMatch(name))
         {
@@ -2030,16 +2158,21 @@ void CCD::addFITSKeywords(CCDChip * targetChip, std::vector<FITSRecord> &fitsKey
         fitsKeywords.push_back({"FILTER", FilterNames.at(CurrentFilterSlot - 1).c_str(), "Filter"});
     }
 
-#ifdef WITH_MINMAX
-    if (targetChip->getNAxis() == 2)
+    const CCDChip::ImageStatistics &stats = targetChip->getImageStatistics();
+    if (stats.count > 0)
     {
-        double min_val, max_val;
-        getMinMax(&min_val, &max_val, targetChip);
-
-        fitsKeywords.push_back({"DATAMIN", min_val, 6, "Minimum value"});
-        fitsKeywords.push_back({"DATAMAX", max_val, 6, "Maximum value"});
-    }
+#ifdef WITH_MINMAX
+        if (targetChip->getNAxis() == 2)
+        {
+            fitsKeywords.push_back({"DATAMIN", stats.min, 6, "Minimum value"});
+            fitsKeywords.push_back({"DATAMAX", stats.max, 6, "Maximum value"});
+        }
 #endif
+        fitsKeywords.push_back({"DATAMEAN", stats.mean, 6, "Mean value"});
+        fitsKeywords.push_back({"DATASTDV", stats.stddev, 6, "Standard deviation"});
+        fitsKeywords.push_back({"DATAMED", stats.median, 6, "Median value"});
+        fitsKeywords.push_back({"DATASAT", static_cast<int64_t>(stats.saturated), "Saturated samples"});
+    }
 
     if (HasBayer() && targetChip->getNAxis() == 2)
     {
@@ -2243,13 +2376,38 @@ bool CCD::ExposureComplete(CCDChip * targetChip)
     // Reset POLLMS to default value
     setCurrentPollingPeriod(getPollingPeriod());
 
+    uint32_t sequence;
+    {
+        std::unique_lock<std::mutex> guard(m_ExposureStateMutex);
+        sequence = targetChip->ExposureSequence;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(m_UploadMutex);
+        m_PendingExposures++;
+    }
+
     // Run async
-    std::thread(&CCD::ExposureCompletePrivate, this, targetChip).detach();
+    std::thread([this, targetChip, sequence]
+    {
+        ExposureCompletePrivate(targetChip, sequence);
+
+        // Notify under the lock, the upload thread may return and the device go away right after
+        std::unique_lock<std::mutex> lock(m_UploadMutex);
+        m_PendingExposures--;
+        m_UploadCondition.notify_all();
+    }).detach();
 
     return true;
 }
 
-bool CCD::ExposureCompletePrivate(CCDChip * targetChip)
+void CCD::newExposureSequence(CCDChip * targetChip)
+{
+    std::unique_lock<std::mutex> guard(m_ExposureStateMutex);
+    targetChip->ExposureSequence++;
+}
+
+bool CCD::ExposureCompletePrivate(CCDChip * targetChip, uint32_t sequence)
 {
     LOG_DEBUG("Exposure complete");
 
@@ -2266,6 +2424,27 @@ bool CCD::ExposureCompletePrivate(CCDChip * targetChip)
         free(buf);
     }
 
+    // One pass over the frame so clients can evaluate it without downloading it
+    if (targetChip->getFrameBufferSize() > 0)
+    {
+        bool rc;
+        {
+            std::unique_lock<std::mutex> guard(ccdBufferLock);
+            rc = targetChip->updateImageStatistics();
+        }
+
+        const CCDChip::ImageStatistics &stats = targetChip->getImageStatistics();
+        INumber *values = targetChip->ImageStatisticsN;
+        values[CCDChip::STAT_MIN].value       = stats.min;
+        values[CCDChip::STAT_MAX].value       = stats.max;
+        values[CCDChip::STAT_MEAN].value      = stats.mean;
+        values[CCDChip::STAT_STDDEV].value    = stats.stddev;
+        values[CCDChip::STAT_MEDIAN].value    = stats.median;
+        values[CCDChip::STAT_SATURATED].value = stats.saturated;
+        targetChip->ImageStatisticsNP.s = rc ? IPS_OK : IPS_ALERT;
+        IDSetNumber(&targetChip->ImageStatisticsNP, nullptr);
+    }
+
     if (processFastExposure(targetChip) == false)
         return false;
 
@@ -2325,6 +2504,16 @@ bool CCD::ExposureCompletePrivate(CCDChip * targetChip)
             /*DEBUGF(Logger::DBG_DEBUG, "Exposure complete. Image Depth: %s. Width: %d Height: %d nelements: %d", bit_depth.c_str(), naxes[0],
                     naxes[1], nelements);*/
 
+            // Local only saves may skip the in-memory FITS file, the raw frame is converted once straight into the file
+            if (saveImage && !sendImage && LocalWriteSP[LOCAL_WRITE_BUFFERED].getState() != ISS_ON)
+            {
+                if (queueFITSDirect(targetChip, sequence, img_type, naxis, naxes, nelements))
+                    return true;
+
+                finishUpload(targetChip, sequence, false, FastExposureToggleS[INDI_ENABLED].s == ISS_ON);
+                return false;
+            }
+
             std::unique_lock<std::mutex> guard(ccdBufferLock);
 
             // 8640 = 2880 * 3 which is sufficient for most cases.
@@ -2351,41 +2540,7 @@ bool CCD::ExposureCompletePrivate(CCDChip * targetChip)
                 return false;
             }
 
-            std::vector<FITSRecord> fitsKeywords;
-
-            addFITSKeywords(targetChip, fitsKeywords);
-
-            // Add all custom keywords next
-            for (auto &record : m_CustomFITSKeywords)
-                fitsKeywords.push_back(record.second);
-
-            for (auto &keyword : fitsKeywords)
-            {
-                int key_status = 0;
-                switch(keyword.type())
-                {
-                    case INDI::FITSRecord::VOID:
-                        break;
-                    case INDI::FITSRecord::COMMENT:
-                        fits_write_comment(fptr, keyword.comment().c_str(), &key_status);
-                        break;
-                    case INDI::FITSRecord::STRING:
-                        fits_update_key_str(fptr, keyword.key().c_str(), keyword.valueString().c_str(), keyword.comment().c_str(), &key_status);
-                        break;
-                    case INDI::FITSRecord::LONGLONG:
-                        fits_update_key_lng(fptr, keyword.key().c_str(), keyword.valueInt(), keyword.comment().c_str(), &key_status);
-                        break;
-                    case INDI::FITSRecord::DOUBLE:
-                        fits_update_key_dbl(fptr, keyword.key().c_str(), keyword.valueDouble(), keyword.decimal(), keyword.comment().c_str(),
-                                            &key_status);
-                        break;
-                }
-                if (key_status)
-                {
-                    fits_get_errstatus(key_status, error_status);
-                    LOGF_ERROR("FITS key %s Error: %s", keyword.key().c_str(), error_status);
-                }
-            }
+            writeFITSKeywords(fptr, targetChip);
 
             fits_write_img(fptr, byte_type, 1, nelements, targetChip->getFrameBuffer(), &status);
             targetChip->finishFITSFile(status);
@@ -2399,18 +2554,17 @@ bool CCD::ExposureCompletePrivate(CCDChip * targetChip)
             }
 
 
-            bool rc = uploadFile(targetChip, *(targetChip->fitsMemoryBlockPointer()), *(targetChip->fitsMemorySizePointer()), sendImage,
-                                 saveImage);
+            // The upload thread takes over the FITS memory block
+            void * fitsData = *(targetChip->fitsMemoryBlockPointer());
+            size_t fitsSize = *(targetChip->fitsMemorySizePointer());
+            *(targetChip->fitsMemoryBlockPointer()) = nullptr;
 
             targetChip->closeFITSFile();
 
             guard.unlock();
 
-            if (rc == false)
-            {
-                targetChip->setExposureFailed();
-                return false;
-            }
+            queueUpload(targetChip, sequence, fitsData, fitsSize, sendImage, saveImage);
+            return true;
         }
 #ifdef HAVE_XISF
         else if (EncodeFormatSP[FORMAT_XISF].getState() == ISS_ON)
@@ -2487,14 +2641,22 @@ bool CCD::ExposureCompletePrivate(CCDChip * targetChip)
                 std::memcpy(image.imageData(), targetChip->getFrameBuffer(), image.imageDataSize());
                 xisfWriter.writeImage(image);
 
+                guard.unlock();
+
                 LibXISF::ByteArray xisfFile;
                 xisfWriter.save(xisfFile);
-                bool rc = uploadFile(targetChip, xisfFile.data(), xisfFile.size(), sendImage, saveImage);
-                if (rc == false)
+
+                void * xisfData = IDSharedBlobAlloc(xisfFile.size());
+                if (xisfData == nullptr)
                 {
-                    targetChip->setExposureFailed();
+                    LOG_ERROR("Error: Ran out of memory encoding image");
+                    finishUpload(targetChip, sequence, false, FastExposureToggleS[INDI_ENABLED].s == ISS_ON);
                     return false;
                 }
+                memcpy(xisfData, xisfFile.data(), xisfFile.size());
+
+                queueUpload(targetChip, sequence, xisfData, xisfFile.size(), sendImage, saveImage);
+                return true;
             }
             catch (LibXISF::Error &error)
             {
@@ -2508,78 +2670,386 @@ bool CCD::ExposureCompletePrivate(CCDChip * targetChip)
             // If image extension was set to fits (default), change if bin if not already set to another format by the driver.
             if (!strcmp(targetChip->getImageExtension(), "fits"))
                 targetChip->setImageExtension("bin");
+            // Copy, the frame buffer gets overwritten by the next exposure
             std::unique_lock<std::mutex> guard(ccdBufferLock);
-            bool rc = uploadFile(targetChip, targetChip->getFrameBuffer(), targetChip->getFrameBufferSize(), sendImage,
-                                 saveImage);
-            guard.unlock();
-
-            if (rc == false)
+            size_t size = targetChip->getFrameBufferSize();
+            void * data = IDSharedBlobAlloc(size);
+            if (data == nullptr)
             {
-                targetChip->setExposureFailed();
+                LOG_ERROR("Error: Ran out of memory copying image");
+                finishUpload(targetChip, sequence, false, FastExposureToggleS[INDI_ENABLED].s == ISS_ON);
                 return false;
             }
+            memcpy(data, targetChip->getFrameBuffer(), size);
+            guard.unlock();
+
+            queueUpload(targetChip, sequence, data, size, sendImage, saveImage);
+            return true;
         }
     }
 
-    if (FastExposureToggleS[INDI_ENABLED].s != ISS_ON)
-        targetChip->setExposureComplete();
-
-    UploadComplete(targetChip);
+    finishUpload(targetChip, sequence, true, FastExposureToggleS[INDI_ENABLED].s == ISS_ON);
     return true;
 }
 
-bool CCD::uploadFile(CCDChip * targetChip, const void * fitsData, size_t totalBytes, bool sendImage,
-                     bool saveImage)
+void CCD::finishUpload(CCDChip * targetChip, uint32_t sequence, bool success, bool fastExposure)
 {
-    uint8_t * compressedData = nullptr;
+    {
+        // Once the frame is out a client may start the next exposure before we get here, leave its state alone
+        std::unique_lock<std::mutex> guard(m_ExposureStateMutex);
+        if (sequence == targetChip->ExposureSequence)
+        {
+            if (success == false)
+                targetChip->setExposureFailed();
+            else if (!fastExposure)
+                targetChip->setExposureComplete();
+        }
+    }
 
-    DEBUGF(Logger::DBG_DEBUG, "Uploading file. Ext: %s, Size: %d, sendImage? %s, saveImage? %s",
-           targetChip->getImageExtension(), totalBytes, sendImage ? "Yes" : "No", saveImage ? "Yes" : "No");
+    if (success)
+        UploadComplete(targetChip);
+}
+
+void CCD::writeFITSKeywords(fitsfile * fptr, CCDChip * targetChip)
+{
+    char error_status[MAXRBUF];
+    std::vector<FITSRecord> fitsKeywords;
+
+    addFITSKeywords(targetChip, fitsKeywords);
+
+    // Add all custom keywords next
+    for (auto &record : m_CustomFITSKeywords)
+        fitsKeywords.push_back(record.second);
+
+    for (auto &keyword : fitsKeywords)
+    {
+        int key_status = 0;
+        switch(keyword.type())
+        {
+            case INDI::FITSRecord::VOID:
+                break;
+            case INDI::FITSRecord::COMMENT:
+                fits_write_comment(fptr, keyword.comment().c_str(), &key_status);
+                break;
+            case INDI::FITSRecord::STRING:
+                fits_update_key_str(fptr, keyword.key().c_str(), keyword.valueString().c_str(), keyword.comment().c_str(), &key_status);
+                break;
+            case INDI::FITSRecord::LONGLONG:
+                fits_update_key_lng(fptr, keyword.key().c_str(), keyword.valueInt(), keyword.comment().c_str(), &key_status);
+                break;
+            case INDI::FITSRecord::DOUBLE:
+                fits_update_key_dbl(fptr, keyword.key().c_str(), keyword.valueDouble(), keyword.decimal(), keyword.comment().c_str(),
+                                    &key_status);
+                break;
+        }
+        if (key_status)
+        {
+            fits_get_errstatus(key_status, error_status);
+            LOGF_ERROR("FITS key %s Error: %s", keyword.key().c_str(), error_status);
+        }
+    }
+}
+
+bool CCD::queueFITSDirect(CCDChip * targetChip, uint32_t sequence, int img_type, int naxis, long * naxes, int nelements)
+{
+    int status = 0;
+    char error_status[MAXRBUF];
+
+    // Only the header goes through cfitsio, in a small memory file of its own
+    size_t memorySize = 2880;
+    void * memory = malloc(memorySize);
+    fitsfile * fptr = nullptr;
+    char * header = nullptr;
+    int nkeys = 0;
+
+    fits_create_memfile(&fptr, &memory, &memorySize, 2880, realloc, &status);
+    fits_create_img(fptr, img_type, naxis, naxes, &status);
+    if (status == 0)
+        writeFITSKeywords(fptr, targetChip);
+    fits_hdr2str(fptr, 0, nullptr, 0, &header, &nkeys, &status);
+    if (status)
+    {
+        fits_get_errstatus(status, error_status);
+        LOGF_ERROR("FITS Error: %s", error_status);
+    }
 
-    if (saveImage)
+    // Drop the image before closing so that cfitsio does not pad out its data unit
+    int close_status = 0;
+    if (fptr != nullptr)
     {
-        targetChip->FitsB.blob    = const_cast<void *>(fitsData);
-        targetChip->FitsB.bloblen = totalBytes;
-        snprintf(targetChip->FitsB.format, MAXINDIBLOBFMT, ".%s", targetChip->getImageExtension());
+        fits_delete_hdu(fptr, nullptr, &close_status);
+        close_status = 0;
+        fits_close_file(fptr, &close_status);
+    }
+    free(memory);
 
-        FILE * fp = nullptr;
+    if (status)
+    {
+        fits_free_memory(header, &close_status);
+        return false;
+    }
+
+    std::string fitsHeader(header, nkeys * 80);
+    fits_free_memory(header, &close_status);
+
+    char imageFileName[MAXRBUF];
+    if (nextImageFileName(".fits", imageFileName, MAXRBUF) == false)
+        return false;
+
+    // The frame lock is only held for the conversion into the file, the upload thread writes it out
+    auto writer = std::make_shared<FITSDirectWriter>();
+    FITSDirectMode mode = LocalWriteSP[LOCAL_WRITE_DIRECT].getState() == ISS_ON ? FITS_DIRECT_IO : FITS_DIRECT_MAPPED;
+    if (writer->open(imageFileName, fitsHeader.data(), fitsHeader.size(), nelements, targetChip->getBPP(), mode) < 0)
+    {
+        LOGF_ERROR("Unable to save image file (%s). %s", imageFileName, strerror(errno));
+        return false;
+    }
+    {
+        std::unique_lock<std::mutex> guard(ccdBufferLock);
+        writer->convert(targetChip->getFrameBuffer());
+    }
+
+    UploadJob job {targetChip, nullptr, 0, false, true, sequence};
+    job.extension  = "fits";
+    job.isFITS     = true;
+    job.compress   = false;
+    job.codec      = -1;
+    job.level      = 0;
+    job.bpp        = targetChip->getBPP();
+    job.fitsWriter = std::move(writer);
+    job.fileName   = imageFileName;
+
+    snapshotUpload(job);
+    pushUpload(std::move(job));
+    return true;
+}
+
+bool CCD::saveFITSDirect(const UploadJob &job)
+{
+    const char * imageFileName = job.fileName.c_str();
+
+    if (job.fitsWriter->close() < 0)
+    {
+        LOGF_ERROR("Unable to save image file (%s). %s", imageFileName, strerror(errno));
+        return false;
+    }
+
+    // Save image file path
+    IUSaveText(&FileNameT[0], imageFileName);
+
+    DEBUGF(Logger::DBG_SESSION, "Image saved to %s", imageFileName);
+    FileNameTP.s = IPS_OK;
+    IDSetText(&FileNameTP, nullptr);
+    return true;
+}
+
+void CCD::queueUpload(CCDChip * targetChip, uint32_t sequence, void * data, size_t size, bool sendImage, bool saveImage)
+{
+    UploadJob job {targetChip, data, size, sendImage, saveImage, sequence};
+    job.extension = targetChip->getImageExtension();
+    job.isFITS    = EncodeFormatSP[FORMAT_FITS].getState() == ISS_ON && job.extension == "fits";
+    job.compress  = targetChip->SendCompressed && EncodeFormatSP[FORMAT_XISF].getState() != ISS_ON;
+    job.codec     = CompressionCodecSP.findOnSwitchIndex();
+    job.level     = static_cast<int>(CompressionLevelNP[0].getValue());
+    job.bpp       = targetChip->getBPP();
+
+    snapshotUpload(job);
+    pushUpload(std::move(job));
+}
+
+void CCD::snapshotUpload(UploadJob &job)
+{
+    job.fastExposure = FastExposureToggleS[INDI_ENABLED].s == ISS_ON;
+#ifdef HAVE_WEBSOCKET
+    job.webSocket = HasWebSocket() && WebSocketS[WEBSOCKET_ENABLED].s == ISS_ON;
+#endif
+    job.blobVector = job.targetChip->FitsBP;
+    job.blob       = job.targetChip->FitsB;
+
+    // Named in queue order, from the upload settings of now
+    if (job.saveImage && job.fileName.empty())
+    {
         char imageFileName[MAXRBUF];
+        char imageExtension[MAXINDIBLOBFMT];
+
+        snprintf(imageExtension, MAXINDIBLOBFMT, ".%s", job.extension.c_str());
+        if (nextImageFileName(imageExtension, imageFileName, MAXRBUF))
+            job.fileName = imageFileName;
+        else
+            job.failed = true;
+    }
+}
+
+void CCD::pushUpload(UploadJob &&job)
+{
+    std::unique_lock<std::mutex> lock(m_UploadMutex);
 
-        std::string prefix = UploadSettingsT[UPLOAD_PREFIX].text;
-        int maxIndex       = getFileIndex(UploadSettingsT[UPLOAD_DIR].text, UploadSettingsT[UPLOAD_PREFIX].text,
-                                          targetChip->FitsB.format);
+    if (!m_UploadThread.joinable())
+        m_UploadThread = std::thread(&CCD::uploadThreadEntry, this);
 
-        if (maxIndex < 0)
+    auto pending = [this]
+    {
+        return static_cast<size_t>(std::count_if(m_UploadQueue.begin(), m_UploadQueue.end(), [](const UploadJob & queued)
         {
-            LOGF_ERROR("Error iterating directory %s. %s", UploadSettingsT[0].text,
-                       strerror(errno));
-            return false;
-        }
+            return !queued.failed;
+        }));
+    };
+    auto maxPending = [this]
+    {
+        return static_cast<size_t>(UploadQueueNP[0].getValue());
+    };
+
+    if (!job.failed && !job.fastExposure)
+    {
+        // The client paces the exposures, this frame may wait for room rather than get lost
+        uint64_t ticket = m_UploadTickets++;
+        m_UploadCondition.wait(lock, [&]
+        {
+            return ticket == m_UploadTurn && (pending() < maxPending() || m_UploadExit);
+        });
+        m_UploadTurn++;
+    }
+    else if (!job.failed && pending() >= maxPending())
+    {
+        // The camera is already exposing the next frame, waiting would only delay it
+        LOGF_WARN("Frame dropped, %zu previous frames are still being saved or sent.", pending());
+        UploadQueueNP.setState(IPS_ALERT);
+        UploadQueueNP.apply();
+        job.failed = true;
+    }
+    if (job.failed)
+    {
+        IDSharedBlobFree(job.data);
+        job.data = nullptr;
+        job.fitsWriter.reset();
+    }
+
+    m_UploadQueue.push_back(std::move(job));
+    lock.unlock();
+    m_UploadCondition.notify_all();
+}
+
+void CCD::stopUploadThread()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_UploadMutex);
+        m_UploadExit = true;
+
+        // Frames still being read out go out as well
+        if (!m_UploadThread.joinable() && m_PendingExposures > 0)
+            m_UploadThread = std::thread(&CCD::uploadThreadEntry, this);
+    }
+    m_UploadCondition.notify_all();
+
+    // The thread drains the queue before it returns
+    if (m_UploadThread.joinable())
+        m_UploadThread.join();
+
+    std::unique_lock<std::mutex> lock(m_UploadMutex);
+    m_UploadExit = false;
+}
+
+void CCD::uploadThreadEntry()
+{
+    std::unique_lock<std::mutex> lock(m_UploadMutex);
+
+    for (;;)
+    {
+        m_UploadCondition.wait(lock, [&]
+        {
+            return !m_UploadQueue.empty() || (m_UploadExit && m_PendingExposures == 0);
+        });
 
-        if (maxIndex > 0)
+        if (m_UploadQueue.empty())
+            return;
+
+        UploadJob job = std::move(m_UploadQueue.front());
+        m_UploadQueue.pop_front();
+        lock.unlock();
+        m_UploadCondition.notify_all();
+
+        bool rc = false;
+        if (!job.failed)
         {
-            auto now = std::chrono::system_clock::now();
-            std::time_t time = std::chrono::system_clock::to_time_t(now);
-            std::tm* now_tm = std::localtime(&time);
-            long long timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
+            auto start = std::chrono::steady_clock::now();
+            rc = job.fitsWriter ? saveFITSDirect(job) : uploadFile(job);
+            IDSharedBlobFree(job.data);
+            auto end = std::chrono::steady_clock::now();
 
-            std::stringstream stream;
-            // JM 2023.08.31 Make timestamps OS friendly (Windows)
-            stream    << std::setfill('0')
-                      << std::put_time(now_tm, "%FT%H-%M-")
-                      << std::setw(2) << (timestamp / 1000) % 60 << '.'
-                      << std::setw(3) << timestamp % 1000;
+            m_UploadTime = std::chrono::duration<double>(end - start).count();
+            LOGF_DEBUG("Image upload/save took %.3f seconds.", m_UploadTime.load());
+        }
 
-            prefix = std::regex_replace(prefix, std::regex("ISO8601"), stream.str());
+        finishUpload(job.targetChip, job.exposureSequence, rc, job.fastExposure);
+
+        lock.lock();
+    }
+}
+
+bool CCD::nextImageFileName(const char * extension, char * fileName, size_t size)
+{
+    auto now = std::chrono::system_clock::now();
+    std::time_t time = std::chrono::system_clock::to_time_t(now);
+    std::tm* now_tm = std::localtime(&time);
+    long long timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
+
+    std::stringstream stream;
+    // JM 2023.08.31 Make timestamps OS friendly (Windows)
+    stream    << std::setfill('0')
+              << std::put_time(now_tm, "%FT%H-%M-")
+              << std::setw(2) << (timestamp / 1000) % 60 << '.'
+              << std::setw(3) << timestamp % 1000;
+
+    std::string prefix = UploadSettingsT[UPLOAD_PREFIX].text;
+    int maxIndex       = nextFileIndex(UploadSettingsT[UPLOAD_DIR].text, prefix);
+
+    if (maxIndex > 0)
+    {
+        snprintf(fileName, size, "%s/%s%s", UploadSettingsT[0].text,
+                 expandFilePrefix(prefix, stream.str(), maxIndex).c_str(), extension);
 
-            char indexString[8];
-            snprintf(indexString, 8, "%03d", maxIndex);
-            std::string prefixIndex = indexString;
-            //prefix.replace(prefix.find("XXX"), std::string::npos, prefixIndex);
-            prefix = std::regex_replace(prefix, std::regex("XXX"), prefixIndex);
+        // The cached index is stale if something else saved into the sequence, rescan once
+        if (prefix.find("XXX") != std::string::npos && access(fileName, F_OK) == 0)
+        {
+            resetFileIndex(UploadSettingsT[UPLOAD_DIR].text, prefix);
+            maxIndex = nextFileIndex(UploadSettingsT[UPLOAD_DIR].text, prefix);
+            snprintf(fileName, size, "%s/%s%s", UploadSettingsT[0].text,
+                     expandFilePrefix(prefix, stream.str(), maxIndex).c_str(), extension);
         }
+    }
+
+    if (maxIndex < 0)
+    {
+        LOGF_ERROR("Error iterating directory %s. %s", UploadSettingsT[0].text,
+                   strerror(errno));
+        return false;
+    }
+
+    return true;
+}
 
-        snprintf(imageFileName, MAXRBUF, "%s/%s%s", UploadSettingsT[0].text, prefix.c_str(), targetChip->FitsB.format);
+bool CCD::uploadFile(UploadJob &job)
+{
+    const void * fitsData = job.data;
+    size_t totalBytes     = job.size;
+    const char * extension = job.extension.c_str();
+    uint8_t * compressedData = nullptr;
+    std::vector<uint8_t> chunkedData;
+
+    DEBUGF(Logger::DBG_DEBUG, "Uploading file. Ext: %s, Size: %d, sendImage? %s, saveImage? %s",
+           extension, totalBytes, job.sendImage ? "Yes" : "No", job.saveImage ? "Yes" : "No");
+
+    // The chip's own BLOB may be touched by the main thread meanwhile, send the copy taken when queued
+    IBLOBVectorProperty &blobVector = job.blobVector;
+    IBLOB &blob = job.blob;
+    blobVector.bp  = &blob;
+    blobVector.nbp = 1;
+    blob.bvp       = &blobVector;
+
+    if (job.saveImage)
+    {
+        FILE * fp = nullptr;
+        const char * imageFileName = job.fileName.c_str();
 
         fp = fopen(imageFileName, "w");
         if (fp == nullptr)
@@ -2588,9 +3058,9 @@ bool CCD::uploadFile(CCDChip * targetChip, const void * fitsData, size_t totalBy
             return false;
         }
 
-        int n = 0;
-        for (int nr = 0; nr < targetChip->FitsB.bloblen; nr += n)
-            n = fwrite((static_cast<char *>(targetChip->FitsB.blob) + nr), 1, targetChip->FitsB.bloblen - nr, fp);
+        size_t n = 0;
+        for (size_t nr = 0; nr < totalBytes; nr += n)
+            n = fwrite((static_cast<const char *>(fitsData) + nr), 1, totalBytes - nr, fp);
 
         fclose(fp);
 
@@ -2602,9 +3072,24 @@ bool CCD::uploadFile(CCDChip * targetChip, const void * fitsData, size_t totalBy
         IDSetText(&FileNameTP, nullptr);
     }
 
-    if (targetChip->SendCompressed && EncodeFormatSP[FORMAT_XISF].getState() != ISS_ON)
+    if (job.compress)
     {
-        if (EncodeFormatSP[FORMAT_FITS].getState() == ISS_ON && !strcmp(targetChip->getImageExtension(), "fits"))
+        if (job.codec == CODEC_ZLIB || job.codec == CODEC_ZSTD)
+        {
+            // FITS data is aligned to the header blocks, so samples can be shuffled in place
+            size_t elementSize = job.isFITS ? std::max(1, job.bpp / 8) : 1;
+            if (!compressBlob(fitsData, totalBytes, chunkedData, job.codec == CODEC_ZSTD ? BLOB_CODEC_ZSTD : BLOB_CODEC_ZLIB,
+                              job.level, elementSize))
+            {
+                LOG_ERROR("Error: Failed to compress image");
+                return false;
+            }
+
+            blob.blob    = chunkedData.data();
+            blob.bloblen = chunkedData.size();
+            snprintf(blob.format, MAXINDIBLOBFMT, ".%s%s", extension, BLOB_CHUNKED_SUFFIX);
+        }
+        else if (job.isFITS)
         {
             fpstate	fpvar;
             fp_init (&fpvar);
@@ -2618,9 +3103,9 @@ bool CCD::uploadFile(CCDChip * targetChip, const void * fitsData, size_t totalBy
                 return false;
             }
 
-            targetChip->FitsB.blob    = compressedData;
-            targetChip->FitsB.bloblen = compressedBytes;
-            snprintf(targetChip->FitsB.format, MAXINDIBLOBFMT, ".%s.fz", targetChip->getImageExtension());
+            blob.blob    = compressedData;
+            blob.bloblen = compressedBytes;
+            snprintf(blob.format, MAXINDIBLOBFMT, ".%s.fz", extension);
         }
         else
         {
@@ -2644,31 +3129,31 @@ bool CCD::uploadFile(CCDChip * targetChip, const void * fitsData, size_t totalBy
                 return false;
             }
 
-            targetChip->FitsB.blob    = compressedData;
-            targetChip->FitsB.bloblen = compressedBytes;
-            snprintf(targetChip->FitsB.format, MAXINDIBLOBFMT, ".%s.z", targetChip->getImageExtension());
+            blob.blob    = compressedData;
+            blob.bloblen = compressedBytes;
+            snprintf(blob.format, MAXINDIBLOBFMT, ".%s.z", extension);
         }
     }
     else
     {
-        targetChip->FitsB.blob    = const_cast<void *>(fitsData);
-        targetChip->FitsB.bloblen = totalBytes;
-        snprintf(targetChip->FitsB.format, MAXINDIBLOBFMT, ".%s", targetChip->getImageExtension());
+        blob.blob    = const_cast<void *>(fitsData);
+        blob.bloblen = totalBytes;
+        snprintf(blob.format, MAXINDIBLOBFMT, ".%s", extension);
     }
 
-    targetChip->FitsB.size = totalBytes;
-    targetChip->FitsBP.s   = IPS_OK;
+    blob.size    = totalBytes;
+    blobVector.s = IPS_OK;
 
-    if (sendImage)
+    if (job.sendImage)
     {
 #ifdef HAVE_WEBSOCKET
-        if (HasWebSocket() && WebSocketS[WEBSOCKET_ENABLED].s == ISS_ON)
+        if (job.webSocket)
         {
             auto start = std::chrono::high_resolution_clock::now();
 
             // Send format/size/..etc first later
-            wsServer.send_text(std::string(targetChip->FitsB.format));
-            wsServer.send_binary(targetChip->FitsB.blob, targetChip->FitsB.bloblen);
+            wsServer.send_text(std::string(blob.format));
+            wsServer.send_binary(blob.blob, blob.bloblen);
 
             auto end = std::chrono::high_resolution_clock::now();
             std::chrono::duration<double> diff = end - start;
@@ -2678,7 +3163,7 @@ bool CCD::uploadFile(CCDChip * targetChip, const void * fitsData, size_t totalBy
 #endif
         {
             auto start = std::chrono::high_resolution_clock::now();
-            IDSetBLOB(&targetChip->FitsBP, nullptr);
+            IDSetBLOB(&blobVector, nullptr);
             auto end = std::chrono::high_resolution_clock::now();
             std::chrono::duration<double> diff = end - start;
             LOGF_DEBUG("BLOB transfer took %g seconds", diff.count());
@@ -2704,30 +3189,16 @@ bool CCD::processFastExposure(CCDChip * targetChip)
         // Check fast exposure count
         if (FastExposureCountN[0].value > 1)
         {
-            if (UploadS[UPLOAD_LOCAL].s != ISS_ON)
-            {
-                if (FastExposureCountNP.s != IPS_BUSY)
-                {
-                    FastExposureToggleStartup = std::chrono::system_clock::now();
-                }
-                else
-                {
-                    auto end = std::chrono::system_clock::now();
-
-                    m_UploadTime = (std::chrono::duration_cast<std::chrono::milliseconds>(end - FastExposureToggleStartup)).count() / 1000.0 -
-                                   duration;
-                    LOGF_DEBUG("Image download and upload/save took %.3f seconds.", m_UploadTime);
-
-                    FastExposureToggleStartup = end;
-                }
-            }
-
+            // Uploads run in the background while the next frame is exposed, so
+            // m_UploadTime (measured by the upload thread) only has to keep up
+            // with the exposure time.
             FastExposureCountNP.s = IPS_BUSY;
             FastExposureCountN[0].value--;
             IDSetNumber(&FastExposureCountNP, nullptr);
 
             if (UploadS[UPLOAD_LOCAL].s == ISS_ON || m_UploadTime < duration)
             {
+                newExposureSequence(targetChip);
                 if (StartExposure(duration))
                     PrimaryCCD.ImageExposureNP.s = IPS_BUSY;
                 else
@@ -2738,7 +3209,7 @@ bool CCD::processFastExposure(CCDChip * targetChip)
             else
             {
                 LOGF_ERROR("Rapid exposure not possible since upload time is %.2f seconds while exposure time is %.2f seconds.",
-                           m_UploadTime,
+                           m_UploadTime.load(),
                            duration);
                 PrimaryCCD.ImageExposureNP.s = IPS_ALERT;
                 IDSetNumber(&PrimaryCCD.ImageExposureNP, nullptr);
@@ -2787,6 +3258,8 @@ bool CCD::saveConfigItems(FILE * fp)
     ActiveDeviceTP.save(fp);
     IUSaveConfigSwitch(fp, &UploadSP);
     IUSaveConfigText(fp, &UploadSettingsTP);
+    LocalWriteSP.save(fp);
+    UploadQueueNP.save(fp);
     IUSaveConfigSwitch(fp, &FastExposureToggleSP);
 
     IUSaveConfigSwitch(fp, &PrimaryCCD.CompressSP);
@@ -2796,6 +3269,8 @@ bool CCD::saveConfigItems(FILE * fp)
 
     CaptureFormatSP.save(fp);
     EncodeFormatSP.save(fp);
+    CompressionCodecSP.save(fp);
+    CompressionLevelNP.save(fp);
 
     if (HasCooler())
         TemperatureRampNP.save(fp);
@@ -2854,142 +3329,6 @@ IPState CCD::GuideWest(uint32_t ms)
     return IPS_ALERT;
 }
 
-void CCD::getMinMax(double * min, double * max, CCDChip * targetChip)
-{
-    int ind         = 0, i, j;
-    int imageHeight = targetChip->getSubH() / targetChip->getBinY();
-    int imageWidth  = targetChip->getSubW() / targetChip->getBinX();
-    double lmin = 0, lmax = 0;
-
-    switch (targetChip->getBPP())
-    {
-        case 8:
-        {
-            uint8_t * imageBuffer = targetChip->getFrameBuffer();
-            lmin = lmax = imageBuffer[0];
-
-            for (i = 0; i < imageHeight; i++)
-                for (j = 0; j < imageWidth; j++)
-                {
-                    ind = (i * imageWidth) + j;
-                    if (imageBuffer[ind] < lmin)
-                        lmin = imageBuffer[ind];
-                    else if (imageBuffer[ind] > lmax)
-                        lmax = imageBuffer[ind];
-                }
-        }
-        break;
-
-        case 16:
-        {
-            uint16_t * imageBuffer = reinterpret_cast<uint16_t*>(targetChip->getFrameBuffer());
-            lmin = lmax = imageBuffer[0];
-
-            for (i = 0; i < imageHeight; i++)
-                for (j = 0; j < imageWidth; j++)
-                {
-                    ind = (i * imageWidth) + j;
-                    if (imageBuffer[ind] < lmin)
-                        lmin = imageBuffer[ind];
-                    else if (imageBuffer[ind] > lmax)
-                        lmax = imageBuffer[ind];
-                }
-        }
-        break;
-
-        case 32:
-        {
-            uint32_t * imageBuffer = reinterpret_cast<uint32_t*>(targetChip->getFrameBuffer());
-            lmin = lmax = imageBuffer[0];
-
-            for (i = 0; i < imageHeight; i++)
-                for (j = 0; j < imageWidth; j++)
-                {
-                    ind = (i * imageWidth) + j;
-                    if (imageBuffer[ind] < lmin)
-                        lmin = imageBuffer[ind];
-                    else if (imageBuffer[ind] > lmax)
-                        lmax = imageBuffer[ind];
-                }
-        }
-        break;
-    }
-    *min = lmin;
-    *max = lmax;
-}
-
-std::string regex_replace_compat(const std::string &input, const std::string &pattern, const std::string &replace)
-{
-    std::stringstream s;
-    std::regex_replace(std::ostreambuf_iterator<char>(s), input.begin(), input.end(), std::regex(pattern), replace);
-    return s.str();
-}
-
-int CCD::getFileIndex(const char * dir, const char * prefix, const char * ext)
-{
-    INDI_UNUSED(ext);
-
-    DIR * dpdf = nullptr;
-    struct dirent * epdf = nullptr;
-    std::vector<std::string> files = std::vector<std::string>();
-
-    std::string prefixIndex = prefix;
-    prefixIndex             = regex_replace_compat(prefixIndex, "_ISO8601", "");
-    prefixIndex             = regex_replace_compat(prefixIndex, "_XXX", "");
-
-    // Create directory if does not exist
-    struct stat st;
-
-    if (stat(dir, &st) == -1)
-    {
-        if (errno == ENOENT)
-        {
-            DEBUGF(Logger::DBG_DEBUG, "Creating directory %s...", dir);
-            if (INDI::mkpath(dir, 0755) == -1)
-                LOGF_ERROR("Error creating directory %s (%s)", dir, strerror(errno));
-        }
-        else
-        {
-            LOGF_ERROR("Couldn't stat directory %s: %s", dir, strerror(errno));
-            return -1;
-        }
-    }
-
-    dpdf = opendir(dir);
-    if (dpdf != nullptr)
-    {
-        while ((epdf = readdir(dpdf)))
-        {
-            if (strstr(epdf->d_name, prefixIndex.c_str()))
-                files.push_back(epdf->d_name);
-        }
-    }
-    else
-    {
-        closedir(dpdf);
-        return -1;
-    }
-    int maxIndex = 0;
-
-    for (uint32_t i = 0; i < files.size(); i++)
-    {
-        int index = -1;
-
-        std::string file  = files.at(i);
-        std::size_t start = file.find_last_of("_");
-        std::size_t end   = file.find_last_of(".");
-        if (start != std::string::npos)
-        {
-            index = atoi(file.substr(start + 1, end).c_str());
-            if (index > maxIndex)
-                maxIndex = index;
-        }
-    }
-
-    closedir(dpdf);
-    return (maxIndex + 1);
-}
-
 void CCD::GuideComplete(INDI_EQ_AXIS axis)
 {
     GuiderInterface::GuideComplete(axis);
@@ -49,6 +49,10 @@
 #include <stdint.h>
 #include <mutex>
 #include <thread>
+#include <deque>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
 
 extern const char * IMAGE_SETTINGS_TAB;
 extern const char * IMAGE_INFO_TAB;
@@ -64,6 +68,7 @@ namespace INDI
 
 class StreamManager;
 class XISFWrapper;
+class FITSDirectWriter;
 
 /**
  * \class CCD
@@ -535,6 +540,9 @@ class CCD : public DefaultDevice, GuiderInterface
          * @brief UploadComplete Signal that capture is completed and image was uploaded and/or saved successfully.
          * @param targetChip Active exposure chip
          * @note Child camera should override this function to receive notification on exposure upload completion.
+         * @note Frames are saved and sent by an upload thread, this is called from that thread. It must not wait
+         * for the driver thread, which may be queuing the next frame meanwhile. By then a client may have
+         * started the next exposure already.
          */
         virtual void UploadComplete(CCDChip *) {}
 
@@ -710,6 +718,18 @@ class CCD : public DefaultDevice, GuiderInterface
             FORMAT_XISF      /*!< Save Image as XISF format  */
         };
 
+        /// Codec used when compression is enabled, the default keeps fpack/zlib for compatibility with older clients.
+        INDI::PropertySwitch CompressionCodecSP {3};
+        enum
+        {
+            CODEC_DEFAULT, /*!< fpack for FITS, zlib level 9 otherwise. */
+            CODEC_ZLIB,    /*!< Chunked, byte shuffled zlib compressed in parallel. */
+            CODEC_ZSTD     /*!< Chunked, byte shuffled zstd compressed in parallel. */
+        };
+
+        /// Level of the chunked codecs, lower is faster.
+        INDI::PropertyNumber CompressionLevelNP {1};
+
         ISwitch UploadS[3];
         ISwitchVectorProperty UploadSP;
 
@@ -721,6 +741,18 @@ class CCD : public DefaultDevice, GuiderInterface
             UPLOAD_PREFIX
         };
 
+        /// Specifies how FITS frames uploaded locally only are written to disk.
+        INDI::PropertySwitch LocalWriteSP {3};
+        enum
+        {
+            LOCAL_WRITE_BUFFERED, /*!< Build the FITS file in memory and save it from the upload thread. */
+            LOCAL_WRITE_MAPPED,   /*!< Convert the frame once into a preallocated, memory mapped file. */
+            LOCAL_WRITE_DIRECT    /*!< Convert the frame once and write it with O_DIRECT, bypassing the page cache. */
+        };
+
+        /// Frames that may wait for the upload thread, alert once one was dropped.
+        INDI::PropertyNumber UploadQueueNP {1};
+
         // Telescope Information
         INDI::PropertyNumber ScopeInfoNP {2};
         enum
@@ -762,7 +794,8 @@ class CCD : public DefaultDevice, GuiderInterface
         // Fast Exposure Frame Count
         INumber FastExposureCountN[1];
         INumberVectorProperty FastExposureCountNP;
-        double m_UploadTime = { 0 };
+        // Written by the upload thread
+        std::atomic<double> m_UploadTime { 0 };
         std::chrono::system_clock::time_point FastExposureToggleStartup;
 
         INDI::PropertyText FITSHeaderTP {3};
@@ -786,10 +819,72 @@ class CCD : public DefaultDevice, GuiderInterface
         ///////////////////////////////////////////////////////////////////////////////
         /// Utility Functions
         ///////////////////////////////////////////////////////////////////////////////
-        bool uploadFile(CCDChip * targetChip, const void * fitsData, size_t totalBytes, bool sendImage, bool saveImage);
-        void getMinMax(double * min, double * max, CCDChip * targetChip);
-        int getFileIndex(const char * dir, const char * prefix, const char * ext);
-        bool ExposureCompletePrivate(CCDChip * targetChip);
+        bool nextImageFileName(const char * extension, char * fileName, size_t size);
+        void writeFITSKeywords(fitsfile * fptr, CCDChip * targetChip);
+        bool queueFITSDirect(CCDChip * targetChip, uint32_t sequence, int img_type, int naxis, long * naxes, int nelements);
+        bool ExposureCompletePrivate(CCDChip * targetChip, uint32_t sequence);
+        void newExposureSequence(CCDChip * targetChip);
+
+        ///////////////////////////////////////////////////////////////////////////////
+        /// Upload pipeline
+        /// Encoded frames are compressed, saved and sent by a single upload thread so
+        /// the next exposure can be read out meanwhile. The upload thread only reads
+        /// the job, never the properties. At most UploadQueueNP frames wait for it:
+        /// without fast exposure the next frame waits for room, with fast exposure the
+        /// camera is already exposing again and the frame is dropped instead, fails in
+        /// its turn and turns UploadQueueNP to alert. Stopping the thread drains the
+        /// queue, including frames still being read out (m_PendingExposures).
+        /// A frame only sets the exposure state if no other exposure was started since
+        /// it completed, under m_ExposureStateMutex.
+        ///////////////////////////////////////////////////////////////////////////////
+        struct UploadJob
+        {
+            CCDChip * targetChip;
+            void * data;    // IDSharedBlobAlloc'ed, owned by the job
+            size_t size;
+            bool sendImage;
+            bool saveImage;
+            uint32_t exposureSequence;  // of the exposure the frame belongs to
+
+            // Settings at the time the frame was queued, the properties may change meanwhile
+            std::string extension;
+            bool isFITS;
+            bool compress;
+            int codec;
+            int level;
+            int bpp;
+            bool fastExposure;
+            bool webSocket;
+            std::string fileName;   // where to save the image, if saveImage
+            IBLOBVectorProperty blobVector;
+            IBLOB blob;
+
+            // Local saves written straight to disk: the frame is already converted into the file, no data
+            std::shared_ptr<FITSDirectWriter> fitsWriter;
+
+            // Dropped, only reports the exposure as failed
+            bool failed;
+        };
+        void queueUpload(CCDChip * targetChip, uint32_t sequence, void * data, size_t size, bool sendImage, bool saveImage);
+        void snapshotUpload(UploadJob &job);
+        void pushUpload(UploadJob &&job);
+        void stopUploadThread();
+        void uploadThreadEntry();
+        bool uploadFile(UploadJob &job);
+        bool saveFITSDirect(const UploadJob &job);
+        void finishUpload(CCDChip * targetChip, uint32_t sequence, bool success, bool fastExposure);
+
+        std::deque<UploadJob> m_UploadQueue;
+        std::mutex m_UploadMutex;
+        std::condition_variable m_UploadCondition;
+        std::thread m_UploadThread;
+        bool m_UploadExit {false};
+        // Completed exposures not queued yet
+        int m_PendingExposures {0};
+        // Frames waiting for room take turns
+        uint64_t m_UploadTickets {0};
+        uint64_t m_UploadTurn {0};
+        std::mutex m_ExposureStateMutex;
 
         // Threading for Websocket
 #ifdef HAVE_WEBSOCKET
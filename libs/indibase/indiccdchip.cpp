@@ -20,8 +20,374 @@
 #include "sharedblob.h"
 #include "locale_compat.h"
 
+#include <algorithm>
+#include <cmath>
 #include <cstring>
 #include <ctime>
+#include <limits>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace
+{
+// Software binning kernels.
+// Each output row is built by adding its input rows into a row of wider
+// accumulators, then adding up groups of columns of that row. The vertical
+// pass does most of the work and is vectorized, the rows are split over
+// threads for large frames.
+
+template <typename T>
+struct BinJob
+{
+    using Acc = typename std::conditional<sizeof(T) == 4, uint64_t, uint32_t>::type;
+
+    const T *raw;
+    T *out;
+    uint32_t subW, subH;    // input frame
+    uint32_t outW, outH;    // output frame
+    int binX, binY;
+    Acc divisor;            // average 8 bit mono frames, 0 for none
+    const uint8_t *lut;     // per pixel division of 8 bit Bayer frames, nullptr for none
+
+    T finish(Acc sum) const
+    {
+        constexpr Acc max = std::numeric_limits<T>::max();
+        if (divisor)
+            return sum > max * divisor ? max : sum / divisor;
+        return sum > max ? max : sum;
+    }
+};
+
+// acc[j] += row[j]
+inline void addRow(uint32_t *acc, const uint8_t *row, uint32_t n)
+{
+    uint32_t j = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; j + 16 <= n; j += 16)
+    {
+        __m128i v  = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + j));
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        __m128i *a = reinterpret_cast<__m128i *>(acc + j);
+        _mm_storeu_si128(a + 0, _mm_add_epi32(_mm_loadu_si128(a + 0), _mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_si128(a + 2, _mm_add_epi32(_mm_loadu_si128(a + 2), _mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_si128(a + 3, _mm_add_epi32(_mm_loadu_si128(a + 3), _mm_unpackhi_epi16(hi, zero)));
+    }
+#elif defined(__ARM_NEON)
+    for (; j + 16 <= n; j += 16)
+    {
+        uint8x16_t v  = vld1q_u8(row + j);
+        uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+        uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+        vst1q_u32(acc + j + 0, vaddw_u16(vld1q_u32(acc + j + 0), vget_low_u16(lo)));
+        vst1q_u32(acc + j + 4, vaddw_u16(vld1q_u32(acc + j + 4), vget_high_u16(lo)));
+        vst1q_u32(acc + j + 8, vaddw_u16(vld1q_u32(acc + j + 8), vget_low_u16(hi)));
+        vst1q_u32(acc + j + 12, vaddw_u16(vld1q_u32(acc + j + 12), vget_high_u16(hi)));
+    }
+#endif
+    for (; j < n; j++)
+        acc[j] += row[j];
+}
+
+inline void addRow(uint32_t *acc, const uint16_t *row, uint32_t n)
+{
+    uint32_t j = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; j + 8 <= n; j += 8)
+    {
+        __m128i v  = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + j));
+        __m128i *a = reinterpret_cast<__m128i *>(acc + j);
+        _mm_storeu_si128(a + 0, _mm_add_epi32(_mm_loadu_si128(a + 0), _mm_unpacklo_epi16(v, zero)));
+        _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_unpackhi_epi16(v, zero)));
+    }
+#elif defined(__ARM_NEON)
+    for (; j + 8 <= n; j += 8)
+    {
+        uint16x8_t v = vld1q_u16(row + j);
+        vst1q_u32(acc + j + 0, vaddw_u16(vld1q_u32(acc + j + 0), vget_low_u16(v)));
+        vst1q_u32(acc + j + 4, vaddw_u16(vld1q_u32(acc + j + 4), vget_high_u16(v)));
+    }
+#endif
+    for (; j < n; j++)
+        acc[j] += row[j];
+}
+
+inline void addRow(uint64_t *acc, const uint32_t *row, uint32_t n)
+{
+    uint32_t j = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; j + 4 <= n; j += 4)
+    {
+        __m128i v  = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + j));
+        __m128i *a = reinterpret_cast<__m128i *>(acc + j);
+        _mm_storeu_si128(a + 0, _mm_add_epi64(_mm_loadu_si128(a + 0), _mm_unpacklo_epi32(v, zero)));
+        _mm_storeu_si128(a + 1, _mm_add_epi64(_mm_loadu_si128(a + 1), _mm_unpackhi_epi32(v, zero)));
+    }
+#elif defined(__ARM_NEON)
+    for (; j + 4 <= n; j += 4)
+    {
+        uint32x4_t v = vld1q_u32(row + j);
+        vst1q_u64(acc + j + 0, vaddw_u32(vld1q_u64(acc + j + 0), vget_low_u32(v)));
+        vst1q_u64(acc + j + 2, vaddw_u32(vld1q_u64(acc + j + 2), vget_high_u32(v)));
+    }
+#endif
+    for (; j < n; j++)
+        acc[j] += row[j];
+}
+
+// acc[j] += lut[row[j]]
+inline void addRow(uint32_t *acc, const uint8_t *row, const uint8_t *lut, uint32_t n)
+{
+    for (uint32_t j = 0; j < n; j++)
+        acc[j] += lut[row[j]];
+}
+
+// Bin output rows [first, last). Mono frames sum BinX x BinX squares, Bayer frames
+// sum the BinX x BinY pixels of the same color, keeping the 2x2 pattern.
+// BX is the horizontal bin factor if known at compile time, 0 otherwise.
+template <typename T, bool Bayer, int BX>
+void binRows(const BinJob<T> &job, uint32_t first, uint32_t last)
+{
+    using Acc = typename BinJob<T>::Acc;
+    const uint32_t binX = BX ? BX : job.binX;
+    const uint32_t step = Bayer ? 2 : 1;
+    std::vector<Acc> acc(job.subW);
+
+    for (uint32_t r = first; r < last; r++)
+    {
+        std::fill(acc.begin(), acc.end(), 0);
+
+        for (int t = 0; t < job.binY; t++)
+        {
+            uint32_t i = Bayer ? (r & ~1u) * job.binY + (r & 1) + 2 * t : r * job.binY + t;
+            if (i >= job.subH)
+                break;
+
+            const T *row = job.raw + size_t(i) * job.subW;
+            if constexpr (sizeof(T) == 1)
+            {
+                if (job.lut)
+                {
+                    addRow(acc.data(), row, job.lut, job.subW);
+                    continue;
+                }
+            }
+            addRow(acc.data(), row, job.subW);
+        }
+
+        T *dst = job.out + size_t(r) * job.outW;
+        for (uint32_t c = 0; c < job.outW; c++)
+        {
+            uint32_t j = Bayer ? (c & ~1u) * binX + (c & 1) : c * binX;
+            Acc sum = 0;
+
+            if (j + step * (binX - 1) < job.subW)
+            {
+                for (uint32_t u = 0; u < binX; u++)
+                    sum += acc[j + step * u];
+            }
+            else
+            {
+                for (uint32_t u = 0; u < binX && j + step * u < job.subW; u++)
+                    sum += acc[j + step * u];
+            }
+
+            dst[c] = job.finish(sum);
+        }
+    }
+}
+
+template <typename T, bool Bayer>
+void binFrame(const BinJob<T> &job)
+{
+    void (*kernel)(const BinJob<T> &, uint32_t, uint32_t);
+
+    switch (job.binX)
+    {
+        case 2:
+            kernel = binRows<T, Bayer, 2>;
+            break;
+        case 3:
+            kernel = binRows<T, Bayer, 3>;
+            break;
+        case 4:
+            kernel = binRows<T, Bayer, 4>;
+            break;
+        default:
+            kernel = binRows<T, Bayer, 0>;
+            break;
+    }
+
+    // Threads only pay off for large frames, about 1M input pixels per thread
+    size_t pixels    = size_t(job.subW) * job.subH;
+    uint32_t threads = std::min<size_t>({ std::max(1u, std::thread::hardware_concurrency()), pixels / (1 << 20) + 1, job.outH });
+
+    if (threads <= 1)
+    {
+        kernel(job, 0, job.outH);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    uint32_t rows = (job.outH + threads - 1) / threads;
+    for (uint32_t first = rows; first < job.outH; first += rows)
+        workers.emplace_back(kernel, std::cref(job), first, std::min(first + rows, job.outH));
+    kernel(job, 0, std::min(rows, job.outH));
+
+    for (auto &worker : workers)
+        worker.join();
+}
+
+/**
+ * Histogram and moments of a range of samples. Deep frames are histogrammed on their upper 16 bits,
+ * so their extrema and moments are accumulated exactly on the side.
+ */
+struct StatPartial
+{
+    std::vector<uint64_t> histogram;
+    double sum {0}, sumsq {0};
+    uint32_t min {std::numeric_limits<uint32_t>::max()}, max {0};
+    uint64_t saturated {0};
+};
+
+template <typename T>
+void histogramRange(const T *data, size_t first, size_t last, StatPartial &part)
+{
+    constexpr uint32_t bins  = sizeof(T) == 1 ? 256 : 65536;
+    constexpr uint32_t shift = sizeof(T) == 4 ? 16 : 0;
+
+    // Four interleaved sub-histograms so that runs of equal values do not serialize on one counter
+    std::vector<uint32_t> sub(bins * 4);
+    part.histogram.assign(bins, 0);
+
+    while (first < last)
+    {
+        // Flush before the 32 bit counters can overflow
+        size_t end = first + std::min<size_t>(last - first, std::numeric_limits<uint32_t>::max());
+        std::fill(sub.begin(), sub.end(), 0);
+
+        size_t i = first;
+        for (; i + 4 <= end; i += 4)
+        {
+            sub[data[i] >> shift]++;
+            sub[bins + (data[i + 1] >> shift)]++;
+            sub[2 * bins + (data[i + 2] >> shift)]++;
+            sub[3 * bins + (data[i + 3] >> shift)]++;
+        }
+        for (; i < end; i++)
+            sub[data[i] >> shift]++;
+
+        if constexpr (sizeof(T) == 4)
+        {
+            double sum = 0, sumsq = 0;
+            uint32_t lmin = part.min, lmax = part.max;
+            for (i = first; i < end; i++)
+            {
+                double value = data[i];
+                sum   += value;
+                sumsq += value * value;
+                lmin = std::min(lmin, data[i]);
+                lmax = std::max(lmax, data[i]);
+                part.saturated += data[i] == std::numeric_limits<uint32_t>::max();
+            }
+            part.sum   += sum;
+            part.sumsq += sumsq;
+            part.min = lmin;
+            part.max = lmax;
+        }
+
+        for (uint32_t b = 0; b < bins; b++)
+            part.histogram[b] += uint64_t(sub[b]) + sub[bins + b] + sub[2 * bins + b] + sub[3 * bins + b];
+        first = end;
+    }
+}
+
+template <typename T>
+void imageStatistics(const T *data, size_t count, INDI::CCDChip::ImageStatistics &stats)
+{
+    // Each thread keeps its own histogram, about 4M samples per thread keeps the merge cheap
+    uint32_t threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), count / (1 << 22) + 1);
+    std::vector<StatPartial> parts(threads);
+    std::vector<std::thread> workers;
+    size_t chunk = (count + threads - 1) / threads;
+
+    for (uint32_t t = 1; t < threads; t++)
+        workers.emplace_back(histogramRange<T>, data, std::min(t * chunk, count), std::min((t + 1) * chunk, count),
+                             std::ref(parts[t]));
+    histogramRange<T>(data, 0, std::min(chunk, count), parts[0]);
+    for (auto &worker : workers)
+        worker.join();
+
+    StatPartial &total = parts[0];
+    for (uint32_t t = 1; t < threads; t++)
+    {
+        for (size_t b = 0; b < total.histogram.size(); b++)
+            total.histogram[b] += parts[t].histogram[b];
+        total.sum += parts[t].sum;
+        total.sumsq += parts[t].sumsq;
+        total.min = std::min(total.min, parts[t].min);
+        total.max = std::max(total.max, parts[t].max);
+        total.saturated += parts[t].saturated;
+    }
+
+    std::vector<uint64_t> &histogram = total.histogram;
+    stats.count = count;
+
+    // Median is the lower middle sample, to within a histogram bin for deep frames
+    uint64_t middle = (count - 1) / 2, seen = 0;
+    size_t medianBin = 0;
+    while (seen + histogram[medianBin] <= middle)
+        seen += histogram[medianBin++];
+
+    if constexpr (sizeof(T) == 4)
+    {
+        stats.min       = total.min;
+        stats.max       = total.max;
+        stats.mean      = total.sum / count;
+        stats.stddev    = std::sqrt(std::max(0.0, total.sumsq / count - stats.mean * stats.mean));
+        stats.median    = std::clamp((medianBin << 16) + 32767.5, stats.min, stats.max);
+        stats.saturated = total.saturated;
+    }
+    else
+    {
+        // The histogram is exact, derive everything from it
+        size_t first = 0, last = histogram.size() - 1;
+        while (histogram[first] == 0)
+            first++;
+        while (histogram[last] == 0)
+            last--;
+
+        double sum = 0;
+        for (size_t b = first; b <= last; b++)
+            sum += double(histogram[b]) * b;
+        stats.mean = sum / count;
+
+        double variance = 0;
+        for (size_t b = first; b <= last; b++)
+            variance += histogram[b] * (b - stats.mean) * (b - stats.mean);
+
+        stats.min       = first;
+        stats.max       = last;
+        stats.stddev    = std::sqrt(variance / count);
+        stats.median    = medianBin;
+        stats.saturated = histogram.back();
+    }
+
+    stats.histogram = std::move(histogram);
+}
+
+}
 
 namespace INDI
 {
@@ -297,72 +663,38 @@ void CCDChip::binFrame()
             BinFrame = static_cast<uint8_t*>(IDSharedBlobAlloc(RawFrameSize));
     }
 
-    memset(BinFrame, 0, RawFrameSize);
+    uint32_t outW = SubW / BinX, outH = SubH / BinX;
 
     switch (getBPP())
     {
         case 8:
-        {
-            uint8_t *bin_buf = BinFrame;
             // Try to average pixels since in 8bit they get saturated pretty quickly
-            double factor      = (BinX * BinX) / 2;
-            double accumulator;
-
-            for (uint32_t i = 0; i < SubH; i += BinX)
-                for (uint32_t j = 0; j < SubW; j += BinX)
-                {
-                    accumulator = 0;
-                    for (int k = 0; k < BinX; k++)
-                    {
-                        for (int l = 0; l < BinX; l++)
-                        {
-                            accumulator += *(RawFrame + j + (i + k) * SubW + l);
-                        }
-                    }
-
-                    accumulator /= factor;
-                    if (accumulator > UINT8_MAX)
-                        *bin_buf = UINT8_MAX;
-                    else
-                        *bin_buf += static_cast<uint8_t>(accumulator);
-                    bin_buf++;
-                }
-        }
-        break;
+            ::binFrame<uint8_t, false>({RawFrame, BinFrame, SubW, SubH, outW, outH, BinX, BinX,
+                                        static_cast<uint32_t>(BinX * BinX / 2), nullptr});
+            break;
 
         case 16:
-        {
-            uint16_t *bin_buf    = reinterpret_cast<uint16_t *>(BinFrame);
-            uint16_t *RawFrame16 = reinterpret_cast<uint16_t *>(RawFrame);
-            uint16_t val;
+            ::binFrame<uint16_t, false>({reinterpret_cast<uint16_t *>(RawFrame), reinterpret_cast<uint16_t *>(BinFrame),
+                                         SubW, SubH, outW, outH, BinX, BinX, 0, nullptr});
+            break;
 
-            for (uint32_t i = 0; i < SubH; i += BinX)
-                for (uint32_t j = 0; j < SubW; j += BinX)
-                {
-                    for (int k = 0; k < BinX; k++)
-                    {
-                        for (int l = 0; l < BinX; l++)
-                        {
-                            val = *(RawFrame16 + j + (i + k) * SubW + l);
-                            if (val + *bin_buf > UINT16_MAX)
-                                *bin_buf = UINT16_MAX;
-                            else
-                                *bin_buf += val;
-                        }
-                    }
-                    bin_buf++;
-                }
-        }
-        break;
+        case 32:
+            ::binFrame<uint32_t, false>({reinterpret_cast<uint32_t *>(RawFrame), reinterpret_cast<uint32_t *>(BinFrame),
+                                         SubW, SubH, outW, outH, BinX, BinX, 0, nullptr});
+            break;
 
         default:
             return;
     }
 
+    // Clear the rest of the buffer
+    size_t binSize = size_t(outW) * outH * (getBPP() / 8);
+    if (binSize < RawFrameSize)
+        memset(BinFrame + binSize, 0, RawFrameSize - binSize);
+
     // Swap frame pointers
     uint8_t *rawFramePointer = RawFrame;
     RawFrame                 = BinFrame;
-    // We just memset it next time we use it
     BinFrame = rawFramePointer;
 }
 
@@ -390,85 +722,78 @@ void CCDChip::binBayerFrame()
             BinFrame = static_cast<uint8_t*>(IDSharedBlobAlloc(RawFrameSize));
     }
 
-    memset(BinFrame, 0, RawFrameSize);
+    uint32_t outW = SubW / BinX, outH = SubH / BinY;
 
     switch (getBPP())
     {
         // 8 bpp frame
         case 8:
         {
-            uint32_t BinFrameOffset;
-            uint32_t val;
-            uint32_t BinW = SubW / BinX;
+            // each pixel is averaged before being added, and the sum capped
             uint8_t BinFactor = BinX * BinY;
-            uint32_t RawOffset = 0;
-            uint32_t BinOffsetH;
+            uint8_t lut[256];
+            for (int i = 0; i < 256; i++)
+                lut[i] = i / BinFactor;
 
-            // for each raw frame row
-            for (uint32_t i = 0; i < SubH; i++)
-            {
-                // find the binned frame row
-                BinOffsetH = (((i / BinY) & 0xFFFFFFFE) + (i & 0x00000001)) * BinW;
-                // for each raw column
-                for (uint32_t j = 0; j < SubW; j++)
-                {
-                    // find the proper position in the binned frame
-                    BinFrameOffset = BinOffsetH + ((j / BinX) & 0xFFFFFFFE) + (j & 0x00000001);
-                    // get the existing value in the binned frame
-                    val = BinFrame[BinFrameOffset];
-                    // add the new value, averaged and caped
-                    val += RawFrame[RawOffset] / BinFactor;
-                    if(val > UINT8_MAX)
-                        val = UINT8_MAX;
-                    // write back into the binned frame
-                    BinFrame[BinFrameOffset] = static_cast<uint8_t>(val);
-                    // next binned frame pixel
-                    RawOffset++;
-                }
-            }
+            ::binFrame<uint8_t, true>({RawFrame, BinFrame, SubW, SubH, outW, outH, BinX, static_cast<int>(BinY), 0, lut});
         }
         break;
 
         // 16 bpp frame
         case 16:
-        {
-            // works the same as the 8 bits version, without averaging but
-            // mapped onto 16 bits pixel
-            uint16_t *RawFrame16 = reinterpret_cast<uint16_t *>(RawFrame);
-            uint16_t *BinFrame16 = reinterpret_cast<uint16_t *>(BinFrame);
-
-            uint32_t BinFrameOffset;
-            uint32_t val;
-            uint32_t BinW = SubW / BinX;
-            uint32_t RawOffset = 0;
+            // works the same as the 8 bits version, without averaging
+            ::binFrame<uint16_t, true>({reinterpret_cast<uint16_t *>(RawFrame), reinterpret_cast<uint16_t *>(BinFrame),
+                                        SubW, SubH, outW, outH, BinX, static_cast<int>(BinY), 0, nullptr});
+            break;
 
-            for (uint32_t i = 0; i < SubH; i++)
-            {
-                uint32_t BinOffsetH = (((i / BinY) & 0xFFFFFFFE) + (i & 0x00000001)) * BinW;
-                for (uint32_t j = 0; j < SubW; j++)
-                {
-                    BinFrameOffset = BinOffsetH + ((j / BinX) & 0xFFFFFFFE) + (j & 0x00000001);
-                    val = BinFrame16[BinFrameOffset];
-                    val += RawFrame16[RawOffset];
-                    if(val > UINT16_MAX)
-                        val = UINT16_MAX;
-                    BinFrame16[BinFrameOffset] = (uint16_t)val;
-                    RawOffset++;
-                }
-            }
-
-        }
-        break;
+        // 32 bpp frame
+        case 32:
+            ::binFrame<uint32_t, true>({reinterpret_cast<uint32_t *>(RawFrame), reinterpret_cast<uint32_t *>(BinFrame),
+                                        SubW, SubH, outW, outH, BinX, static_cast<int>(BinY), 0, nullptr});
+            break;
 
         default:
             return;
     }
 
+    // Clear the rest of the buffer
+    size_t binSize = size_t(outW) * outH * (getBPP() / 8);
+    if (binSize < RawFrameSize)
+        memset(BinFrame + binSize, 0, RawFrameSize - binSize);
+
     // Swap frame pointers
     uint8_t *rawFramePointer = RawFrame;
     RawFrame                 = BinFrame;
-    // We just memset it next time we use it
     BinFrame = rawFramePointer;
 }
 
+bool CCDChip::updateImageStatistics()
+{
+    m_ImageStatistics = ImageStatistics();
+
+    size_t count = size_t(SubW / BinX) * (SubH / BinY) * (NAxis == 3 ? 3 : 1);
+    if (RawFrame == nullptr || count == 0 || count * (getBPP() / 8) > RawFrameSize)
+        return false;
+
+    switch (getBPP())
+    {
+        case 8:
+            ::imageStatistics(RawFrame, count, m_ImageStatistics);
+            break;
+
+        case 16:
+            ::imageStatistics(reinterpret_cast<uint16_t *>(RawFrame), count, m_ImageStatistics);
+            break;
+
+        case 32:
+            ::imageStatistics(reinterpret_cast<uint32_t *>(RawFrame), count, m_ImageStatistics);
+            break;
+
+        default:
+            return false;
+    }
+
+    return true;
+}
+
 }
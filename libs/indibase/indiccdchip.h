@@ -24,6 +24,7 @@
 #include <sys/time.h>
 #include <stdint.h>
 #include <fitsio.h>
+#include <vector>
 
 namespace INDI
 {
@@ -49,6 +50,33 @@ class CCDChip
             CCD_PIXEL_SIZE_Y,
             CCD_BITSPERPIXEL
         } CCD_INFO_INDEX;
+        typedef enum
+        {
+            STAT_MIN,
+            STAT_MAX,
+            STAT_MEAN,
+            STAT_STDDEV,
+            STAT_MEDIAN,
+            STAT_SATURATED
+        } CCD_STATISTICS_INDEX;
+
+        /**
+         * @brief The ImageStatistics struct holds the statistics of the last frame.
+         */
+        struct ImageStatistics
+        {
+            /// Number of samples, 0 if no statistics are available.
+            uint64_t count {0};
+            double min {0};
+            double max {0};
+            double mean {0};
+            double stddev {0};
+            double median {0};
+            /// Number of samples at the maximum value of the pixel depth.
+            uint64_t saturated {0};
+            /// Sample counts by value, 256 bins for 8 bit frames, 65536 for deeper frames.
+            std::vector<uint64_t> histogram;
+        };
 
         /**
          * @brief openFITSFile Allocate memory buffer for internal FITS file structure and open
@@ -413,6 +441,21 @@ class CCDChip
          */
         void binBayerFrame();
 
+        /**
+         * @brief updateImageStatistics Compute the statistics of the frame buffer in a single pass.
+         * The frame is expected to be SubW/BinX by SubH/BinY, with NAxis planes.
+         * @return True if successful, false if the frame is empty or the pixel depth unsupported.
+         */
+        bool updateImageStatistics();
+
+        /**
+         * @return Statistics computed by the last call to updateImageStatistics().
+         */
+        const ImageStatistics &getImageStatistics() const
+        {
+            return m_ImageStatistics;
+        }
+
         fitsfile **fitsFilePointer()
         {
             return &m_FITSFilePointer;
@@ -477,6 +520,9 @@ class CCDChip
         void * m_FITSMemoryBlock {nullptr};
         size_t m_FITSMemorySize {2880};
         fitsfile * m_FITSFilePointer {nullptr};
+        ImageStatistics m_ImageStatistics;
+        // Incremented when an exposure is started or aborted, a frame only reports on its own exposure
+        uint32_t ExposureSequence {0};
 
         /////////////////////////////////////////////////////////////////////////////////////////
         /// Chip Properties
@@ -512,6 +558,12 @@ class CCDChip
         INumberVectorProperty ImagePixelSizeNP;
         INumber ImagePixelSizeN[6];
 
+        /////////////////////////////////////////////////////////////////////////////////////////
+        /// Statistics of the last frame
+        /////////////////////////////////////////////////////////////////////////////////////////
+        INumberVectorProperty ImageStatisticsNP;
+        INumber ImageStatisticsN[6];
+
         /////////////////////////////////////////////////////////////////////////////////////////
         /// Frame Type (Light, Bias..etc)
         /////////////////////////////////////////////////////////////////////////////////////////
@@ -64,55 +64,145 @@ INDI_UNKNOWN
 
 extern void waitPingReply(const char *);
 
-// TODO use fast map
-/* insure RO properties are never modified. RO Sanity Check */
-typedef struct {
+/* insure RO properties are never modified. RO Sanity Check.
+ * entries are hashed by (device, name) and never move nor get freed, so a
+ * pointer returned by rosc_find() stays valid after the lock is released.
+ */
+typedef struct ROSC {
     char propName[MAXINDINAME];
     char devName[MAXINDIDEVICE];
     IPerm perm;
     const void *ptr;
     int type;
+    unsigned int hash;
+    struct ROSC *next;  /* next in hash bucket */
 } ROSC;
 
-static pthread_mutex_t rosc_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define ROSC_BLOCK 64   /* entries allocated at once */
+
+static pthread_rwlock_t rosc_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static ROSC **propHash = NULL;
+static int nPropHash = 0;   /* # of buckets in propHash, power of 2 */
+static int nPropCache = 0;  /* # of elements in propHash */
+static ROSC *propBlock = NULL;
+static int nPropBlock = 0;  /* # of unused elements left in propBlock */
 
-static ROSC *propCache = NULL;
-static int nPropCache = 0; /* # of elements in roCheck */
+static unsigned int rosc_hash(const char *propName, const char *devName)
+{
+    /* FNV-1a over device, separator and name */
+    unsigned int h = 2166136261u;
+    for (const char *c = devName; *c; c++)
+        h = (h ^ (unsigned char)*c) * 16777619u;
+    h = (h ^ '.') * 16777619u;
+    for (const char *c = propName; *c; c++)
+        h = (h ^ (unsigned char)*c) * 16777619u;
+    return h;
+}
+
+/* names are cached truncated to the entry sizes, keys of lookups must be truncated the same way */
+static void rosc_key(const char *propName, const char *devName, char name[MAXINDINAME], char dev[MAXINDIDEVICE])
+{
+    strncpy(name, propName, MAXINDINAME - 1);
+    name[MAXINDINAME - 1] = '\0';
+    strncpy(dev, devName, MAXINDIDEVICE - 1);
+    dev[MAXINDIDEVICE - 1] = '\0';
+}
 
 static ROSC *rosc_new()
 {
-    assert_mem(propCache = (ROSC *)(realloc(propCache, (nPropCache + 1) * sizeof *propCache)));
-    return &propCache[nPropCache++];
+    if (nPropBlock == 0)
+    {
+        assert_mem(propBlock = (ROSC *)malloc(ROSC_BLOCK * sizeof *propBlock));
+        nPropBlock = ROSC_BLOCK;
+    }
+    nPropBlock--;
+    return propBlock++;
+}
+
+static void rosc_grow()
+{
+    int n = nPropHash ? 2 * nPropHash : 64;
+    ROSC **hash;
+
+    assert_mem(hash = (ROSC **)calloc(n, sizeof *hash));
+    for (int i = 0; i < nPropHash; i++)
+    {
+        for (ROSC *SC = propHash[i], *next; SC; SC = next)
+        {
+            next = SC->next;
+            SC->next = hash[SC->hash & (n - 1)];
+            hash[SC->hash & (n - 1)] = SC;
+        }
+    }
+    free(propHash);
+    propHash  = hash;
+    nPropHash = n;
 }
 
-static void rosc_add(const char *propName, const char *devName, IPerm perm, const void *ptr, int type)
+static void rosc_add(const char *propName, const char *devName, IPerm perm, const void *ptr, int type, unsigned int hash)
 {
     ROSC *SC = rosc_new();
-    strcpy(SC->propName, propName);
-    strcpy(SC->devName, devName);
+    rosc_key(propName, devName, SC->propName, SC->devName);
     SC->perm = perm;
     SC->ptr  = ptr;
     SC->type = type;
+    SC->hash = hash;
+
+    if (nPropCache >= nPropHash)
+        rosc_grow();
+    SC->next = propHash[hash & (nPropHash - 1)];
+    propHash[hash & (nPropHash - 1)] = SC;
+    nPropCache++;
 }
 
 /* Return pointer of property if already cached, NULL otherwise */
-static ROSC *rosc_find(const char *propName, const char *devName)
+static ROSC *rosc_find_hash(const char *propName, const char *devName, unsigned int hash)
 {
-    for (int i = 0; i < nPropCache; i++)
-        if (!strcmp(propName, propCache[i].propName) && !strcmp(devName, propCache[i].devName))
-            return &propCache[i];
+    if (nPropHash == 0)
+        return NULL;
+
+    for (ROSC *SC = propHash[hash & (nPropHash - 1)]; SC; SC = SC->next)
+        if (SC->hash == hash && !strcmp(propName, SC->propName) && !strcmp(devName, SC->devName))
+            return SC;
 
     return NULL;
 }
 
+static ROSC *rosc_find(const char *propName, const char *devName)
+{
+    char name[MAXINDINAME], dev[MAXINDIDEVICE];
+    ROSC *SC;
+
+    rosc_key(propName, devName, name, dev);
+
+    pthread_rwlock_rdlock(&rosc_lock);
+    SC = rosc_find_hash(name, dev, rosc_hash(name, dev));
+    pthread_rwlock_unlock(&rosc_lock);
+
+    return SC;
+}
+
 static void rosc_add_unique(const char *propName, const char *devName, IPerm perm, const void *ptr, int type)
 {
-    pthread_mutex_lock(&rosc_mutex);
+    char name[MAXINDINAME], dev[MAXINDIDEVICE];
+
+    rosc_key(propName, devName, name, dev);
+    unsigned int hash = rosc_hash(name, dev);
+
+    /* defXXX of an already known property is the common case, skip the write lock */
+    pthread_rwlock_rdlock(&rosc_lock);
+    ROSC *SC = rosc_find_hash(name, dev, hash);
+    pthread_rwlock_unlock(&rosc_lock);
+    if (SC != NULL)
+        return;
+
+    pthread_rwlock_wrlock(&rosc_lock);
 
-    if (rosc_find(propName, devName) == NULL)
-        rosc_add(propName, devName, perm, ptr, type);
+    if (rosc_find_hash(name, dev, hash) == NULL)
+        rosc_add(name, dev, perm, ptr, type, hash);
 
-    pthread_mutex_unlock(&rosc_mutex);
+    pthread_rwlock_unlock(&rosc_lock);
 }
 
 /* tell Client to delete the property with given name on given device, or
@@ -213,10 +303,7 @@ int dispatch(XMLEle *root, char msg[])
 
         if (name && dev)
         {
-            pthread_mutex_lock(&rosc_mutex);
             ROSC *prop = rosc_find(valuXMLAtt(name), valuXMLAtt(dev));
-            // This is unsafe... prop may be modified concurrently here
-            pthread_mutex_unlock(&rosc_mutex);
 
             if (prop == NULL)
                 return 0;
@@ -270,28 +357,18 @@ int dispatch(XMLEle *root, char msg[])
     if (crackDN(root, &dev, &name, msg) < 0)
         return (-1);
 
-    pthread_mutex_lock(&rosc_mutex);
-    if (rosc_find(name, dev) == NULL)
+    ROSC *prop = rosc_find(name, dev);
+    if (prop == NULL)
     {
-        pthread_mutex_unlock(&rosc_mutex);
         snprintf(msg, MAXRBUF, "Property %s is not defined in %s.", name, dev);
         return -1;
     }
-    pthread_mutex_unlock(&rosc_mutex);
 
     /* ensure property is not RO */
-    for (int i = 0; i < nPropCache; i++)
+    if (prop->perm == IP_RO)
     {
-        if (!strcmp(propCache[i].propName, name) && !strcmp(propCache[i].devName, dev))
-        {
-            if (propCache[i].perm == IP_RO)
-            {
-                snprintf(msg, MAXRBUF, "Cannot set read-only property %s", name);
-                return -1;
-            }
-            else
-                break;
-        }
+        snprintf(msg, MAXRBUF, "Cannot set read-only property %s", name);
+        return -1;
     }
 
     /* check tag in surmised decreasing order of likelihood */
@@ -482,59 +559,300 @@ int dispatch(XMLEle *root, char msg[])
     return (1);
 }
 
-int IUReadConfig(const char *filename, const char *dev, const char *property, int silent, char errmsg[])
+/* configuration files are parsed once and kept until they change on disk or
+ * get written or purged through the functions below. the top level elements
+ * are hashed by (device, name).
+ */
+typedef struct
+{
+    XMLEle *ep;         /* newXXXVector element */
+    const char *dev;
+    const char *name;
+    unsigned int hash;
+    XMLEle **members;   /* oneXXX elements in file order */
+    int nmembers;
+} ConfigProp;
+
+typedef struct ConfigFile
+{
+    char path[MAXRBUF];
+    struct stat st;     /* of path when parsed */
+    XMLEle *root;
+    ConfigProp *props;  /* in file order */
+    int nprops;
+    int *slots;         /* index in props by hash, -1 if empty */
+    int nslots;         /* power of 2 */
+    int refs;           /* 1 while cached, plus 1 per user */
+    struct ConfigFile *next;
+} ConfigFile;
+
+/* temporary file being written by IUGetConfigTmpFP() */
+typedef struct ConfigTmp
+{
+    FILE *fp;
+    char path[MAXRBUF];
+    char tmp[MAXRBUF];
+    struct ConfigTmp *next;
+} ConfigTmp;
+
+static pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ConfigFile *configFiles = NULL;
+static ConfigTmp *configTmps = NULL;
+
+/* resolve the configuration file name as described in indidriver.h */
+static void config_path(const char *filename, const char *dev, char path[MAXRBUF])
 {
-    char *rname, *rdev;
-    XMLEle *root = NULL, *fproot = NULL;
-    LilXML *lp = newLilXML();
+    if (filename)
+        snprintf(path, MAXRBUF, "%s", filename);
+    else if (getenv("INDICONFIG"))
+        snprintf(path, MAXRBUF, "%s", getenv("INDICONFIG"));
+    else
+        snprintf(path, MAXRBUF, "%s/.indi/%s_config.xml", getenv("HOME"), dev);
+}
 
-    FILE *fp = IUGetConfigFP(filename, dev, "r", errmsg);
+/* make sure the config directory exists and path is not owned by root */
+static int config_check(const char *path, char errmsg[])
+{
+    char configDir[MAXRBUF];
+    struct stat st;
 
-    if (fp == NULL)
+    snprintf(configDir, MAXRBUF, "%s/.indi/", getenv("HOME"));
+
+    if (stat(configDir, &st) != 0)
+    {
+        if (mkdir(configDir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) < 0)
+        {
+            snprintf(errmsg, MAXRBUF, "Unable to create config directory. Error %s: %s", configDir, strerror(errno));
+            return -1;
+        }
+    }
+
+    /* If file is owned by root and current user is NOT root then abort */
+    if (stat(path, &st) == 0 && ((st.st_uid == 0 && getuid() != 0) || (st.st_gid == 0 && getgid() != 0)))
+    {
+        strncpy(errmsg,
+                "Config file is owned by root! This will lead to serious errors. To fix this, run: sudo chown -R $USER:$USER ~/.indi",
+                MAXRBUF);
         return -1;
+    }
 
-    char whynot[MAXRBUF];
-    fproot = readXMLFile(fp, lp, whynot);
+    return 0;
+}
 
+/* drop a reference, config_mutex held */
+static void config_unref(ConfigFile *cf)
+{
+    if (--cf->refs > 0)
+        return;
+
+    for (int i = 0; i < cf->nprops; i++)
+        free(cf->props[i].members);
+    free(cf->props);
+    free(cf->slots);
+    delXMLEle(cf->root);
+    free(cf);
+}
+
+/* forget the parsed copy of path, config_mutex held */
+static void config_invalidate(const char *path)
+{
+    for (ConfigFile **cfp = &configFiles; *cfp; cfp = &(*cfp)->next)
+    {
+        if (!strcmp((*cfp)->path, path))
+        {
+            ConfigFile *cf = *cfp;
+            *cfp = cf->next;
+            config_unref(cf);
+            return;
+        }
+    }
+}
+
+static const ConfigProp *config_find(const ConfigFile *cf, const char *dev, const char *name)
+{
+    unsigned int hash = rosc_hash(name, dev);
+
+    for (int i = hash & (cf->nslots - 1); cf->slots[i] >= 0; i = (i + 1) & (cf->nslots - 1))
+    {
+        const ConfigProp *prop = &cf->props[cf->slots[i]];
+        if (prop->hash == hash && !strcmp(prop->name, name) && !strcmp(prop->dev, dev))
+            return prop;
+    }
+
+    return NULL;
+}
+
+static ConfigFile *config_parse(const char *path, const struct stat *st, char errmsg[])
+{
+    ConfigFile *cf;
+    XMLEle *root, *ep;
+    LilXML *lp;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL)
+    {
+        snprintf(errmsg, MAXRBUF, "Unable to open config file. Error loading file %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    char whynot[MAXRBUF] = "";
+    lp   = newLilXML();
+    root = readXMLFile(fp, lp, whynot);
     delLilXML(lp);
+    fclose(fp);
 
-    if (fproot == NULL)
+    if (root == NULL)
     {
-        snprintf(errmsg, MAXRBUF, "Unable to parse config XML: %s", whynot);
-        fclose(fp);
-        return -1;
+        snprintf(errmsg, MAXRBUF, "Unable to parse config XML: %s", whynot[0] ? whynot : "no root element");
+        return NULL;
     }
 
-    if (nXMLEle(fproot) > 0 && silent != 1)
-        IDMessage(dev, "[INFO] Loading device configuration...");
+    assert_mem(cf = (ConfigFile *)calloc(1, sizeof *cf));
+    snprintf(cf->path, MAXRBUF, "%s", path);
+    cf->st   = *st;
+    cf->root = root;
+    cf->refs = 1;
+
+    int n = nXMLEle(root);
+    for (cf->nslots = 16; cf->nslots < 2 * n; cf->nslots *= 2)
+        ;
+    assert_mem(cf->props = (ConfigProp *)calloc(n + 1, sizeof *cf->props));
+    assert_mem(cf->slots = (int *)malloc(cf->nslots * sizeof *cf->slots));
+    memset(cf->slots, -1, cf->nslots * sizeof *cf->slots);
 
-    for (root = nextXMLEle(fproot, 1); root != NULL; root = nextXMLEle(fproot, 0))
+    for (ep = nextXMLEle(root, 1); ep != NULL; ep = nextXMLEle(root, 0))
     {
+        ConfigProp *prop = &cf->props[cf->nprops];
+        char *dev, *name;
+
         /* pull out device and name */
-        if (crackDN(root, &rdev, &rname, errmsg) < 0)
+        if (crackDN(ep, &dev, &name, errmsg) < 0)
         {
-            fclose(fp);
-            delXMLEle(fproot);
-            return -1;
+            config_unref(cf);
+            return NULL;
         }
 
-        // It doesn't belong to our device??
-        if (strcmp(dev, rdev))
-            continue;
+        prop->ep   = ep;
+        prop->dev  = dev;
+        prop->name = name;
+        prop->hash = rosc_hash(name, dev);
+        assert_mem(prop->members = (XMLEle **)malloc((nXMLEle(ep) + 1) * sizeof *prop->members));
+        for (XMLEle *member = nextXMLEle(ep, 1); member != NULL; member = nextXMLEle(ep, 0))
+            prop->members[prop->nmembers++] = member;
 
-        if ((property && !strcmp(property, rname)) || property == NULL)
+        /* first occurrence wins */
+        if (config_find(cf, dev, name) == NULL)
         {
+            int i = prop->hash & (cf->nslots - 1);
+            while (cf->slots[i] >= 0)
+                i = (i + 1) & (cf->nslots - 1);
+            cf->slots[i] = cf->nprops;
+        }
+        cf->nprops++;
+    }
+
+    return cf;
+}
+
+/* return the parsed configuration file, parsing it if not cached or changed.
+ * release with config_release().
+ */
+static ConfigFile *config_acquire(const char *filename, const char *dev, char errmsg[])
+{
+    char path[MAXRBUF];
+    struct stat st;
+    ConfigFile *cf;
+
+    config_path(filename, dev, path);
+    if (config_check(path, errmsg) < 0)
+        return NULL;
+
+    pthread_mutex_lock(&config_mutex);
+
+    if (stat(path, &st) != 0)
+    {
+        config_invalidate(path);
+        pthread_mutex_unlock(&config_mutex);
+        snprintf(errmsg, MAXRBUF, "Unable to open config file. Error loading file %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    for (cf = configFiles; cf; cf = cf->next)
+        if (!strcmp(cf->path, path))
+            break;
+
+    if (cf && (cf->st.st_ino != st.st_ino || cf->st.st_size != st.st_size || cf->st.st_mtime != st.st_mtime))
+    {
+        /* changed behind our back */
+        config_invalidate(path);
+        cf = NULL;
+    }
+
+    if (cf == NULL && (cf = config_parse(path, &st, errmsg)) != NULL)
+    {
+        cf->next    = configFiles;
+        configFiles = cf;
+    }
+
+    if (cf)
+        cf->refs++;
+
+    pthread_mutex_unlock(&config_mutex);
+
+    return cf;
+}
+
+static void config_release(ConfigFile *cf)
+{
+    pthread_mutex_lock(&config_mutex);
+    config_unref(cf);
+    pthread_mutex_unlock(&config_mutex);
+}
+
+/* the named property of dev, or its first one if property is NULL */
+static const ConfigProp *config_property(const ConfigFile *cf, const char *dev, const char *property)
+{
+    if (property)
+        return config_find(cf, dev, property);
+
+    for (int i = 0; i < cf->nprops; i++)
+        if (!strcmp(cf->props[i].dev, dev))
+            return &cf->props[i];
+
+    return NULL;
+}
+
+int IUReadConfig(const char *filename, const char *dev, const char *property, int silent, char errmsg[])
+{
+    ConfigFile *cf = config_acquire(filename, dev, errmsg);
+
+    if (cf == NULL)
+        return -1;
+
+    if (cf->nprops > 0 && silent != 1)
+        IDMessage(dev, "[INFO] Loading device configuration...");
+
+    /* dispatch copies, the driver may save or reload the configuration meanwhile */
+    for (int i = 0; i < cf->nprops; i++)
+    {
+        const ConfigProp *prop = property ? config_find(cf, dev, property) : &cf->props[i];
+
+        // It doesn't belong to our device??
+        if (prop != NULL && !strcmp(dev, prop->dev))
+        {
+            XMLEle *root = cloneXMLEle(prop->ep, NULL, NULL);
             dispatch(root, errmsg);
-            if (property)
-                break;
+            delXMLEle(root);
         }
+
+        if (property)
+            break;
     }
 
-    if (nXMLEle(fproot) > 0 && silent != 1)
+    if (cf->nprops > 0 && silent != 1)
         IDMessage(dev, "[INFO] Device configuration applied.");
 
-    fclose(fp);
-    delXMLEle(fproot);
+    config_release(cf);
 
     return (0);
 }
@@ -543,15 +861,7 @@ int IUSaveDefaultConfig(const char *source_config, const char *dest_config, cons
 {
     char configFileName[MAXRBUF], configDefaultFileName[MAXRBUF];
 
-    if (source_config)
-        strncpy(configFileName, source_config, MAXRBUF);
-    else
-    {
-        if (getenv("INDICONFIG"))
-            strncpy(configFileName, getenv("INDICONFIG"), MAXRBUF);
-        else
-            snprintf(configFileName, MAXRBUF, "%s/.indi/%s_config.xml", getenv("HOME"), dev);
-    }
+    config_path(source_config, dev, configFileName);
 
     if (dest_config)
         strncpy(configDefaultFileName, dest_config, MAXRBUF);
@@ -591,379 +901,164 @@ int IUSaveDefaultConfig(const char *source_config, const char *dest_config, cons
 
 int IUGetConfigOnSwitch(const ISwitchVectorProperty *property, int *index)
 {
-    char *rname, *rdev;
-    XMLEle *root = NULL, *fproot = NULL;
     char errmsg[MAXRBUF];
-    LilXML *lp = newLilXML();
-    int propertyFound = 0;
     *index = -1;
 
-    FILE *fp = IUGetConfigFP(NULL, property->device, "r", errmsg);
+    ConfigFile *cf = config_acquire(NULL, property->device, errmsg);
 
-    if (fp == NULL)
-    {
-        delLilXML(lp);
+    if (cf == NULL)
         return -1;
-    }
 
-    fproot = readXMLFile(fp, lp, errmsg);
-
-    if (fproot == NULL)
-    {
-        delLilXML(lp);
-        fclose(fp);
-        return -1;
-    }
+    const ConfigProp *prop = config_find(cf, property->device, property->name);
+    ISState oneSwitchState;
 
-    for (root = nextXMLEle(fproot, 1); root != NULL; root = nextXMLEle(fproot, 0))
+    for (int i = 0; prop && i < prop->nmembers; i++)
     {
-        /* pull out device and name */
-        if (crackDN(root, &rdev, &rname, errmsg) < 0)
-        {
-            fclose(fp);
-            delXMLEle(fproot);
-            return -1;
-        }
-
-        // It doesn't belong to our device??
-        if (strcmp(property->device, rdev))
-            continue;
-
-        if (!strcmp(property->name, rname))
+        if (crackISState(pcdataXMLEle(prop->members[i]), &oneSwitchState) == 0 && oneSwitchState == ISS_ON)
         {
-            propertyFound = 1;
-            XMLEle *oneSwitch = NULL;
-            int oneSwitchIndex = 0;
-            ISState oneSwitchState;
-            for (oneSwitch = nextXMLEle(root, 1); oneSwitch != NULL; oneSwitch = nextXMLEle(root, 0), oneSwitchIndex++)
-            {
-                if (crackISState(pcdataXMLEle(oneSwitch), &oneSwitchState) == 0 && oneSwitchState == ISS_ON)
-                {
-                    *index = oneSwitchIndex;
-                    break;
-                }
-            }
+            *index = i;
             break;
         }
     }
 
-    fclose(fp);
-    delXMLEle(fproot);
-    delLilXML(lp);
+    config_release(cf);
 
-    return (propertyFound ? 0 : -1);
+    return (prop ? 0 : -1);
 }
 
 int IUGetConfigSwitch(const char *dev, const char *property, const char *member, ISState *value)
 {
-    char *rname, *rdev;
-    XMLEle *root = NULL, *fproot = NULL;
     char errmsg[MAXRBUF];
-    LilXML *lp = newLilXML();
     int valueFound = 0;
 
-    FILE *fp = IUGetConfigFP(NULL, dev, "r", errmsg);
+    ConfigFile *cf = config_acquire(NULL, dev, errmsg);
 
-    if (fp == NULL)
-    {
-        delLilXML(lp);
+    if (cf == NULL)
         return -1;
-    }
-
-    fproot = readXMLFile(fp, lp, errmsg);
 
-    if (fproot == NULL)
-    {
-        fclose(fp);
-        delLilXML(lp);
-        return -1;
-    }
+    const ConfigProp *prop = config_property(cf, dev, property);
 
-    for (root = nextXMLEle(fproot, 1); root != NULL; root = nextXMLEle(fproot, 0))
+    for (int i = 0; prop && i < prop->nmembers; i++)
     {
-        /* pull out device and name */
-        if (crackDN(root, &rdev, &rname, errmsg) < 0)
+        if (!strcmp(member, findXMLAttValu(prop->members[i], "name")))
         {
-            fclose(fp);
-            delXMLEle(fproot);
-            return -1;
-        }
-
-        // It doesn't belong to our device??
-        if (strcmp(dev, rdev))
-            continue;
-
-        if ((property && !strcmp(property, rname)) || property == NULL)
-        {
-            XMLEle *oneSwitch = NULL;
-            for (oneSwitch = nextXMLEle(root, 1); oneSwitch != NULL; oneSwitch = nextXMLEle(root, 0))
-            {
-                if (!strcmp(member, findXMLAttValu(oneSwitch, "name")))
-                {
-                    if (crackISState(pcdataXMLEle(oneSwitch), value) == 0)
-                        valueFound = 1;
-                    break;
-                }
-            }
+            if (crackISState(pcdataXMLEle(prop->members[i]), value) == 0)
+                valueFound = 1;
             break;
         }
     }
 
-    fclose(fp);
-    delXMLEle(fproot);
-    delLilXML(lp);
+    config_release(cf);
 
     return (valueFound == 1 ? 0 : -1);
 }
 
 int IUGetConfigOnSwitchIndex(const char *dev, const char *property, int *index)
 {
-    char *rname, *rdev;
-    XMLEle *root = NULL, *fproot = NULL;
     char errmsg[MAXRBUF];
-    LilXML *lp = newLilXML();
     int valueFound = 0;
 
-    FILE *fp = IUGetConfigFP(NULL, dev, "r", errmsg);
+    ConfigFile *cf = config_acquire(NULL, dev, errmsg);
 
-    if (fp == NULL)
-    {
-        delLilXML(lp);
+    if (cf == NULL)
         return -1;
-    }
 
-    fproot = readXMLFile(fp, lp, errmsg);
+    const ConfigProp *prop = config_property(cf, dev, property);
 
-    if (fproot == NULL)
+    for (int i = 0; prop && i < prop->nmembers; i++)
     {
-        delLilXML(lp);
-        fclose(fp);
-        return -1;
-    }
-
-    for (root = nextXMLEle(fproot, 1); root != NULL; root = nextXMLEle(fproot, 0))
-    {
-        /* pull out device and name */
-        if (crackDN(root, &rdev, &rname, errmsg) < 0)
-        {
-            fclose(fp);
-            delXMLEle(fproot);
-            return -1;
-        }
-
-        // It doesn't belong to our device??
-        if (strcmp(dev, rdev))
-            continue;
-
-        if ((property && !strcmp(property, rname)) || property == NULL)
+        ISState s = ISS_OFF;
+        if (crackISState(pcdataXMLEle(prop->members[i]), &s) == 0 && s == ISS_ON)
         {
-            XMLEle *oneSwitch = NULL;
-            int currentIndex = 0;
-            for (oneSwitch = nextXMLEle(root, 1); oneSwitch != NULL; oneSwitch = nextXMLEle(root, 0), currentIndex++)
-            {
-                ISState s = ISS_OFF;
-                if (crackISState(pcdataXMLEle(oneSwitch), &s) == 0 && s == ISS_ON)
-                {
-                    *index = currentIndex;
-                    valueFound = 1;
-                    break;
-                }
-            }
+            *index = i;
+            valueFound = 1;
             break;
         }
     }
 
-    fclose(fp);
-    delXMLEle(fproot);
-    delLilXML(lp);
+    config_release(cf);
 
     return (valueFound == 1 ? 0 : -1);
 }
 
 int IUGetConfigOnSwitchName(const char *dev, const char *property, char *name, size_t size)
 {
-    char *rname, *rdev;
-    XMLEle *root = NULL, *fproot = NULL;
     char errmsg[MAXRBUF];
-    LilXML *lp = newLilXML();
     int found = -1;
 
-    FILE *fp = IUGetConfigFP(NULL, dev, "r", errmsg);
+    ConfigFile *cf = config_acquire(NULL, dev, errmsg);
 
-    if (fp == NULL)
-    {
-        delLilXML(lp);
+    if (cf == NULL)
         return -1;
-    }
-
-    fproot = readXMLFile(fp, lp, errmsg);
 
-    if (fproot == NULL)
-    {
-        delLilXML(lp);
-        fclose(fp);
-        return -1;
-    }
+    const ConfigProp *prop = config_property(cf, dev, property);
 
-    for (root = nextXMLEle(fproot, 1); root != NULL; root = nextXMLEle(fproot, 0))
+    for (int i = 0; prop && i < prop->nmembers; i++)
     {
-        /* pull out device and name */
-        if (crackDN(root, &rdev, &rname, errmsg) < 0)
+        ISState s = ISS_OFF;
+        if (crackISState(pcdataXMLEle(prop->members[i]), &s) == 0 && s == ISS_ON)
         {
-            fclose(fp);
-            delXMLEle(fproot);
-            return -1;
-        }
-
-        // It doesn't belong to our device??
-        if (strcmp(dev, rdev))
-            continue;
-
-        if ((property && !strcmp(property, rname)) || property == NULL)
-        {
-            XMLEle *oneSwitch = NULL;
-            int currentIndex = 0;
-            for (oneSwitch = nextXMLEle(root, 1); oneSwitch != NULL; oneSwitch = nextXMLEle(root, 0), currentIndex++)
-            {
-                ISState s = ISS_OFF;
-                if (crackISState(pcdataXMLEle(oneSwitch), &s) == 0 && s == ISS_ON)
-                {
-                    found = 0;
-                    strncpy(name, findXMLAttValu(oneSwitch, "name"), size);
-                    break;
-                }
-            }
+            found = 0;
+            strncpy(name, findXMLAttValu(prop->members[i], "name"), size);
             break;
         }
     }
 
-    fclose(fp);
-    delXMLEle(fproot);
-    delLilXML(lp);
+    config_release(cf);
 
     return found;
 }
 
 int IUGetConfigNumber(const char *dev, const char *property, const char *member, double *value)
 {
-    char *rname, *rdev;
-    XMLEle *root = NULL, *fproot = NULL;
     char errmsg[MAXRBUF];
-    LilXML *lp = newLilXML();
     int valueFound = 0;
 
-    FILE *fp = IUGetConfigFP(NULL, dev, "r", errmsg);
+    ConfigFile *cf = config_acquire(NULL, dev, errmsg);
 
-    if (fp == NULL)
-    {
-        delLilXML(lp);
+    if (cf == NULL)
         return -1;
-    }
 
-    fproot = readXMLFile(fp, lp, errmsg);
+    const ConfigProp *prop = config_property(cf, dev, property);
 
-    if (fproot == NULL)
+    for (int i = 0; prop && i < prop->nmembers; i++)
     {
-        fclose(fp);
-        delLilXML(lp);
-        return -1;
-    }
-
-    for (root = nextXMLEle(fproot, 1); root != NULL; root = nextXMLEle(fproot, 0))
-    {
-        /* pull out device and name */
-        if (crackDN(root, &rdev, &rname, errmsg) < 0)
-        {
-            fclose(fp);
-            delXMLEle(fproot);
-            return -1;
-        }
-
-        // It doesn't belong to our device??
-        if (strcmp(dev, rdev))
-            continue;
-
-        if ((property && !strcmp(property, rname)) || property == NULL)
+        if (!strcmp(member, findXMLAttValu(prop->members[i], "name")))
         {
-            XMLEle *oneNumber = NULL;
-            for (oneNumber = nextXMLEle(root, 1); oneNumber != NULL; oneNumber = nextXMLEle(root, 0))
-            {
-                if (!strcmp(member, findXMLAttValu(oneNumber, "name")))
-                {
-                    *value = atof(pcdataXMLEle(oneNumber));
-                    valueFound = 1;
-                    break;
-                }
-            }
+            *value = atof(pcdataXMLEle(prop->members[i]));
+            valueFound = 1;
             break;
         }
     }
 
-    fclose(fp);
-    delXMLEle(fproot);
-    delLilXML(lp);
+    config_release(cf);
 
     return (valueFound == 1 ? 0 : -1);
 }
 
 int IUGetConfigText(const char *dev, const char *property, const char *member, char *value, int len)
 {
-    char *rname, *rdev;
-    XMLEle *root = NULL, *fproot = NULL;
     char errmsg[MAXRBUF];
-    LilXML *lp = newLilXML();
     int valueFound = 0;
 
-    FILE *fp = IUGetConfigFP(NULL, dev, "r", errmsg);
+    ConfigFile *cf = config_acquire(NULL, dev, errmsg);
 
-    if (fp == NULL)
-    {
-        delLilXML(lp);
+    if (cf == NULL)
         return -1;
-    }
-
-    fproot = readXMLFile(fp, lp, errmsg);
 
-    if (fproot == NULL)
-    {
-        delLilXML(lp);
-        fclose(fp);
-        return -1;
-    }
+    const ConfigProp *prop = config_property(cf, dev, property);
 
-    for (root = nextXMLEle(fproot, 1); root != NULL; root = nextXMLEle(fproot, 0))
+    for (int i = 0; prop && i < prop->nmembers; i++)
     {
-        /* pull out device and name */
-        if (crackDN(root, &rdev, &rname, errmsg) < 0)
+        if (!strcmp(member, findXMLAttValu(prop->members[i], "name")))
         {
-            fclose(fp);
-            delXMLEle(fproot);
-            return -1;
-        }
-
-        // It doesn't belong to our device??
-        if (strcmp(dev, rdev))
-            continue;
-
-        if ((property && !strcmp(property, rname)) || property == NULL)
-        {
-            XMLEle *oneText = NULL;
-            for (oneText = nextXMLEle(root, 1); oneText != NULL; oneText = nextXMLEle(root, 0))
-            {
-                if (!strcmp(member, findXMLAttValu(oneText, "name")))
-                {
-                    strncpy(value, pcdataXMLEle(oneText), len);
-                    valueFound = 1;
-                    break;
-                }
-            }
+            strncpy(value, pcdataXMLEle(prop->members[i]), len);
+            valueFound = 1;
             break;
         }
     }
 
-    fclose(fp);
-    delXMLEle(fproot);
-    delLilXML(lp);
+    config_release(cf);
 
     return (valueFound == 1 ? 0 : -1);
 }
@@ -992,19 +1087,12 @@ void IDMessage(const char *dev, const char *fmt, ...)
 int IUPurgeConfig(const char *filename, const char *dev, char errmsg[])
 {
     char configFileName[MAXRBUF];
-    char configDir[MAXRBUF];
 
-    snprintf(configDir, MAXRBUF, "%s/.indi/", getenv("HOME"));
+    config_path(filename, dev, configFileName);
 
-    if (filename)
-        strncpy(configFileName, filename, MAXRBUF);
-    else
-    {
-        if (getenv("INDICONFIG"))
-            strncpy(configFileName, getenv("INDICONFIG"), MAXRBUF);
-        else
-            snprintf(configFileName, MAXRBUF, "%s%s_config.xml", configDir, dev);
-    }
+    pthread_mutex_lock(&config_mutex);
+    config_invalidate(configFileName);
+    pthread_mutex_unlock(&config_mutex);
 
     if (remove(configFileName) != 0)
     {
@@ -1018,50 +1106,110 @@ int IUPurgeConfig(const char *filename, const char *dev, char errmsg[])
 FILE *IUGetConfigFP(const char *filename, const char *dev, const char *mode, char errmsg[])
 {
     char configFileName[MAXRBUF];
-    char configDir[MAXRBUF];
-    struct stat st;
     FILE *fp = NULL;
 
-    snprintf(configDir, MAXRBUF, "%s/.indi/", getenv("HOME"));
+    config_path(filename, dev, configFileName);
+    if (config_check(configFileName, errmsg) < 0)
+        return NULL;
 
-    if (filename)
-        strncpy(configFileName, filename, MAXRBUF);
-    else
+    /* the cached copy is stale as soon as the file may be written */
+    if (strpbrk(mode, "wa+"))
     {
-        if (getenv("INDICONFIG"))
-            strncpy(configFileName, getenv("INDICONFIG"), MAXRBUF);
-        else
-            snprintf(configFileName, MAXRBUF, "%s%s_config.xml", configDir, dev);
+        pthread_mutex_lock(&config_mutex);
+        config_invalidate(configFileName);
+        pthread_mutex_unlock(&config_mutex);
     }
 
-    if (stat(configDir, &st) != 0)
+    fp = fopen(configFileName, mode);
+    if (fp == NULL)
     {
-        if (mkdir(configDir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) < 0)
-        {
-            snprintf(errmsg, MAXRBUF, "Unable to create config directory. Error %s: %s", configDir, strerror(errno));
-            return NULL;
-        }
+        snprintf(errmsg, MAXRBUF, "Unable to open config file. Error loading file %s: %s", configFileName,
+                 strerror(errno));
+        return NULL;
     }
 
-    stat(configFileName, &st);
-    /* If file is owned by root and current user is NOT root then abort */
-    if ( (st.st_uid == 0 && getuid() != 0) || (st.st_gid == 0 && getgid() != 0) )
+    return fp;
+}
+
+FILE *IUGetConfigTmpFP(const char *filename, const char *dev, char errmsg[])
+{
+    ConfigTmp *ct;
+    int fd;
+
+    assert_mem(ct = (ConfigTmp *)calloc(1, sizeof *ct));
+    config_path(filename, dev, ct->path);
+    if (config_check(ct->path, errmsg) < 0)
     {
-        strncpy(errmsg,
-                "Config file is owned by root! This will lead to serious errors. To fix this, run: sudo chown -R $USER:$USER ~/.indi",
-                MAXRBUF);
+        free(ct);
         return NULL;
     }
 
-    fp = fopen(configFileName, mode);
-    if (fp == NULL)
+    /* same directory, so rename() can replace the file atomically */
+    snprintf(ct->tmp, MAXRBUF, "%s.XXXXXX", ct->path);
+    fd = mkstemp(ct->tmp);
+    if (fd < 0 || (ct->fp = fdopen(fd, "w")) == NULL)
     {
-        snprintf(errmsg, MAXRBUF, "Unable to open config file. Error loading file %s: %s", configFileName,
-                 strerror(errno));
+        snprintf(errmsg, MAXRBUF, "Unable to open config file. Error creating file %s: %s", ct->tmp, strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(ct->tmp);
+        }
+        free(ct);
         return NULL;
     }
+    fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 
-    return fp;
+    pthread_mutex_lock(&config_mutex);
+    ct->next   = configTmps;
+    configTmps = ct;
+    pthread_mutex_unlock(&config_mutex);
+
+    return ct->fp;
+}
+
+int IUCommitConfigFP(FILE *fp, char errmsg[])
+{
+    ConfigTmp *ct = NULL;
+    int rc = 0;
+
+    pthread_mutex_lock(&config_mutex);
+    for (ConfigTmp **ctp = &configTmps; *ctp; ctp = &(*ctp)->next)
+    {
+        if ((*ctp)->fp == fp)
+        {
+            ct   = *ctp;
+            *ctp = ct->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&config_mutex);
+
+    if (ct == NULL)
+    {
+        snprintf(errmsg, MAXRBUF, "Not a temporary config file.");
+        return -1;
+    }
+
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+        rc = -1;
+    if (fclose(fp) != 0)
+        rc = -1;
+
+    pthread_mutex_lock(&config_mutex);
+    if (rc == 0 && rename(ct->tmp, ct->path) != 0)
+        rc = -1;
+    config_invalidate(ct->path);
+    pthread_mutex_unlock(&config_mutex);
+
+    if (rc < 0)
+    {
+        snprintf(errmsg, MAXRBUF, "Unable to save config file %s: %s", ct->path, strerror(errno));
+        unlink(ct->tmp);
+    }
+
+    free(ct);
+    return rc;
 }
 
 void IUSaveConfigTag(FILE *fp, int ctag, const char *dev, int silent)
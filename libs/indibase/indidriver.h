@@ -78,6 +78,23 @@ extern int dispatch(XMLEle *root, char msg[]);
  */
 extern FILE *IUGetConfigFP(const char *filename, const char *dev, const char *mode, char errmsg[]);
 
+/** @brief Open a temporary file to write a new configuration file into.
+ *  The file is created next to the configuration file and replaces it only once IUCommitConfigFP is called, so readers
+ *  never see a partially written configuration, even if the driver dies while saving.
+ *  @param filename full path of the configuration file, or NULL to generate it as described in the <b>Detailed Description</b> introduction.
+ *  @param dev device name. This is used if the filename parameter is NULL, and INDICONFIG environment variable is not set.
+ *  @param errmsg In case of errors, store the error message in this buffer. The size of the buffer must be at least MAXRBUF.
+ *  @return pointer to FILE open for writing, otherwise NULL and errmsg is set.
+ */
+extern FILE *IUGetConfigTmpFP(const char *filename, const char *dev, char errmsg[]);
+
+/** @brief Close a file returned by IUGetConfigTmpFP and atomically rename it over the configuration file.
+ *  @param fp file pointer returned by IUGetConfigTmpFP. It is closed in any case.
+ *  @param errmsg In case of errors, store the error message in this buffer. The size of the buffer must be at least MAXRBUF.
+ *  @return 0 on success, -1 on failure, the configuration file is then left untouched.
+ */
+extern int IUCommitConfigFP(FILE *fp, char errmsg[]);
+
 /**
  *  @param filename full path of the configuration file. If set, it will be deleted from disk.
  *         If set to NULL, it will attempt to generate the filename as described in the <b>Detailed Description</b> introduction and then delete it.
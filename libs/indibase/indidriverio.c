@@ -30,6 +30,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110 - 1301  USA
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <errno.h>
 #include <pthread.h>
@@ -51,6 +52,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110 - 1301  USA
 #define MAXFD_PER_MESSAGE 16
 
 static void driverio_flush(driverio * dio, const void * additional, size_t add_size);
+static int is_unix_io();
 
 static pthread_mutex_t stdout_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -60,12 +62,7 @@ static unsigned int outBuffRequired(unsigned int storage)
     return (storage + OUTPUTBUFF_ALLOC - 1) & ~(OUTPUTBUFF_ALLOC - 1);
 }
 
-static int outBuffAllocated(struct driverio * dio)
-{
-    return outBuffRequired(dio->outPos);
-}
-
-static void outBuffGrow(struct driverio * dio, int required)
+static void outBuffGrow(struct driverio * dio, unsigned int required)
 {
     dio->outBuff = realloc(dio->outBuff, required);
     if (dio->outBuff == NULL)
@@ -73,6 +70,7 @@ static void outBuffGrow(struct driverio * dio, int required)
         perror("malloc");
         _exit(1);
     }
+    dio->outSize = required;
 }
 
 static ssize_t driverio_write(void *user, const void * ptr, size_t count)
@@ -85,9 +83,8 @@ static ssize_t driverio_write(void *user, const void * ptr, size_t count)
     }
     else
     {
-        unsigned int allocated = outBuffAllocated(dio);
         unsigned int required = outBuffRequired(dio->outPos + count);
-        if (required != allocated)
+        if (required > dio->outSize)
         {
             outBuffGrow(dio, required);
         }
@@ -104,12 +101,14 @@ static int driverio_vprintf(void *user, const char * fmt, va_list arg)
     int available;
     int size = 0;
 
-    unsigned int allocated = outBuffAllocated(dio);
     while(1)
     {
-        available = allocated - dio->outPos;
+        va_list ap;
+        available = dio->outSize - dio->outPos;
         /* Determine required size */
-        size = vsnprintf(dio->outBuff + dio->outPos, available, fmt, arg);
+        va_copy(ap, arg);
+        size = vsnprintf(dio->outBuff + dio->outPos, available, fmt, ap);
+        va_end(ap);
 
         if (size < 0)
             return size;
@@ -118,13 +117,36 @@ static int driverio_vprintf(void *user, const char * fmt, va_list arg)
         {
             break;
         }
-        allocated = outBuffRequired(available + size + 1);
-        outBuffGrow(dio, allocated);
+        outBuffGrow(dio, outBuffRequired(dio->outPos + size + 1));
     }
     dio->outPos += size;
     return size;
 }
 
+/* Give room for count bytes at the end of the buffer, sending what is already there if it would go over the threshold */
+static void *driverio_reserve(void *user, size_t count)
+{
+    struct driverio * dio = (struct driverio*) user;
+
+    if (dio->outPos > 0 && dio->outPos + count > OUTPUTBUFF_FLUSH_THRESOLD)
+    {
+        driverio_flush(dio, NULL, 0);
+    }
+
+    unsigned int required = outBuffRequired(dio->outPos + count);
+    if (required > dio->outSize)
+    {
+        outBuffGrow(dio, required);
+    }
+    return dio->outBuff + dio->outPos;
+}
+
+static void driverio_commit(void *user, size_t count)
+{
+    struct driverio * dio = (struct driverio*) user;
+    dio->outPos += count;
+}
+
 static void driverio_join(void * user, const char * xml, void * blob, size_t bloblen)
 {
     struct driverio * dio = (struct driverio*) user;
@@ -138,6 +160,33 @@ static void driverio_join(void * user, const char * xml, void * blob, size_t blo
     driverio_write(user, xml, strlen(xml));
 }
 
+/* Write all the iovecs to stdout, resuming after short writes */
+static void driverio_writev(struct iovec * iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t ret = writev(1, iov, iovcnt);
+        if (ret == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("writev");
+            exit(1);
+        }
+
+        while (iovcnt > 0 && (size_t)ret >= iov->iov_len)
+        {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+}
 
 static void driverio_flush(driverio * dio, const void * additional, size_t add_size)
 {
@@ -219,20 +268,29 @@ static void driverio_flush(driverio * dio, const void * additional, size_t add_s
         {
             pthread_mutex_lock(&stdout_mutex);
             dio->locked = 1;
+            /* Whatever went through stdio must go before us */
+            fflush(stdout);
         }
 
-        ret = sendmsg(1, &msgh, 0);
-        if (ret == -1)
+        if (!is_unix_io())
         {
-            perror("sendmsg");
-            // FIXME: exiting the driver seems abrupt. Is this the right thing to do ? what about cleanup ?
-            exit(1);
+            driverio_writev(iov, msgh.msg_iovlen);
         }
-        else if ((unsigned)ret != dio->outPos + add_size)
+        else
         {
-            // This is not expected on blocking socket
-            fprintf(stderr, "short write\n");
-            exit(1);
+            ret = sendmsg(1, &msgh, 0);
+            if (ret == -1)
+            {
+                perror("sendmsg");
+                // FIXME: exiting the driver seems abrupt. Is this the right thing to do ? what about cleanup ?
+                exit(1);
+            }
+            else if ((unsigned)ret != dio->outPos + add_size)
+            {
+                // This is not expected on blocking socket
+                fprintf(stderr, "short write\n");
+                exit(1);
+            }
         }
 
         if (fdCount > 0)
@@ -260,13 +318,10 @@ static void driverio_flush(driverio * dio, const void * additional, size_t add_s
         free(dio->joinSizes);
     }
     dio->joinSizes = NULL;
+    dio->joinCount = 0;
 
-    if (dio->outBuff != NULL)
-    {
-        free(dio->outBuff);
-    }
+    /* Keep the buffer for the rest of the message */
     dio->outPos = 0;
-
 }
 
 
@@ -318,12 +373,13 @@ static int is_unix_io()
     return driverio_is_unix;
 }
 
-/* Unix io allow attaching buffer in ancillary data. */
-static void driverio_init_unix(driverio * dio)
+static void driverio_init_buffer(driverio * dio)
 {
     dio->userio.vprintf = &driverio_vprintf;
     dio->userio.write = &driverio_write;
-    dio->userio.joinbuff = &driverio_join;
+    dio->userio.joinbuff = NULL;
+    dio->userio.reserve = &driverio_reserve;
+    dio->userio.commit = &driverio_commit;
     dio->user = (void*)dio;
     dio->joins = NULL;
     dio->joinSizes = NULL;
@@ -331,30 +387,20 @@ static void driverio_init_unix(driverio * dio)
     dio->joinCount = 0;
     dio->outBuff = NULL;
     dio->outPos = 0;
+    dio->outSize = 0;
 }
 
-static void driverio_finish_unix(driverio * dio)
+/* Unix io allow attaching buffer in ancillary data. */
+static void driverio_init_unix(driverio * dio)
 {
-    driverio_flush(dio, NULL, 0);
-    if (dio->locked)
-    {
-        pthread_mutex_unlock(&stdout_mutex);
-        dio->locked = 0;
-    }
+    driverio_init_buffer(dio);
+    dio->userio.joinbuff = &driverio_join;
 }
 
+/* Plain stdout is buffered the same way, and flushed with writev */
 static void driverio_init_stdout(driverio * dio)
 {
-    dio->userio = *userio_file();
-    dio->user = stdout;
-    pthread_mutex_lock(&stdout_mutex);
-}
-
-static void driverio_finish_stdout(driverio * dio)
-{
-    (void)dio;
-    fflush(stdout);
-    pthread_mutex_unlock(&stdout_mutex);
+    driverio_init_buffer(dio);
 }
 
 void driverio_init(driverio * dio)
@@ -371,12 +417,13 @@ void driverio_init(driverio * dio)
 
 void driverio_finish(driverio * dio)
 {
-    if (is_unix_io())
-    {
-        driverio_finish_unix(dio);
-    }
-    else
+    driverio_flush(dio, NULL, 0);
+    if (dio->locked)
     {
-        driverio_finish_stdout(dio);
+        pthread_mutex_unlock(&stdout_mutex);
+        dio->locked = 0;
     }
+    free(dio->outBuff);
+    dio->outBuff = NULL;
+    dio->outSize = 0;
 }
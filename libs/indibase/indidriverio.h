@@ -34,6 +34,7 @@ typedef struct driverio
     int locked;
     char * outBuff;
     unsigned int outPos;
+    unsigned int outSize;
 } driverio;
 
 void driverio_init(driverio * dio);
@@ -27,6 +27,7 @@
 #include "stream/streammanager.h"
 #include "locale_compat.h"
 #include "indiutility.h"
+#include "fileindex.h"
 
 #include <fitsio.h>
 
@@ -34,14 +35,12 @@
 #include <libnova/ln_types.h>
 #include <libnova/precession.h>
 
-#include <regex>
-
-#include <dirent.h>
 #include <cerrno>
 #include <locale.h>
 #include <cstdlib>
 #include <zlib.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 namespace INDI
 {
@@ -954,9 +953,30 @@ bool SensorInterface::uploadFile(const void *fitsData, size_t totalBytes, bool s
         FILE *fp = nullptr;
         char integrationFileName[MAXRBUF];
 
+        char ts[32];
+        struct tm *tp;
+        time_t t;
+        time(&t);
+        tp = localtime(&t);
+        strftime(ts, sizeof(ts), "%Y-%m-%dT%H-%M-%S", tp);
+
         std::string prefix = UploadSettingsT[UPLOAD_PREFIX].text;
-        int maxIndex       = getFileIndex(UploadSettingsT[UPLOAD_DIR].text, UploadSettingsT[UPLOAD_PREFIX].text,
-                                          FitsB.format);
+        int maxIndex       = nextFileIndex(UploadSettingsT[UPLOAD_DIR].text, prefix);
+
+        if (maxIndex > 0)
+        {
+            snprintf(integrationFileName, MAXRBUF, "%s/%s%s", UploadSettingsT[0].text,
+                     expandFilePrefix(prefix, ts, maxIndex).c_str(), FitsB.format);
+
+            // The cached index is stale if something else saved into the sequence, rescan once
+            if (prefix.find("XXX") != std::string::npos && access(integrationFileName, F_OK) == 0)
+            {
+                resetFileIndex(UploadSettingsT[UPLOAD_DIR].text, prefix);
+                maxIndex = nextFileIndex(UploadSettingsT[UPLOAD_DIR].text, prefix);
+                snprintf(integrationFileName, MAXRBUF, "%s/%s%s", UploadSettingsT[0].text,
+                         expandFilePrefix(prefix, ts, maxIndex).c_str(), FitsB.format);
+            }
+        }
 
         if (maxIndex < 0)
         {
@@ -965,26 +985,6 @@ bool SensorInterface::uploadFile(const void *fitsData, size_t totalBytes, bool s
             return false;
         }
 
-        if (maxIndex > 0)
-        {
-            char ts[32];
-            struct tm *tp;
-            time_t t;
-            time(&t);
-            tp = localtime(&t);
-            strftime(ts, sizeof(ts), "%Y-%m-%dT%H-%M-%S", tp);
-            std::string filets(ts);
-            prefix = std::regex_replace(prefix, std::regex("ISO8601"), filets);
-
-            char indexString[8];
-            snprintf(indexString, 8, "%03d", maxIndex);
-            std::string prefixIndex = indexString;
-            //prefix.replace(prefix.find("XXX"), std::string::npos, prefixIndex);
-            prefix = std::regex_replace(prefix, std::regex("XXX"), prefixIndex);
-        }
-
-        snprintf(integrationFileName, MAXRBUF, "%s/%s%s", UploadSettingsT[0].text, prefix.c_str(), FitsB.format);
-
         fp = fopen(integrationFileName, "w");
         if (fp == nullptr)
         {
@@ -1166,68 +1166,6 @@ void SensorInterface::getMinMax(double *min, double *max, uint8_t *buf, int len,
     *max = lmax;
 }
 
-std::string regex_replace_compat2(const std::string &input, const std::string &pattern, const std::string &replace)
-{
-    std::stringstream s;
-    std::regex_replace(std::ostreambuf_iterator<char>(s), input.begin(), input.end(), std::regex(pattern), replace);
-    return s.str();
-}
-
-int SensorInterface::getFileIndex(const char *dir, const char *prefix, const char *ext)
-{
-    INDI_UNUSED(ext);
-
-    DIR *dpdf = nullptr;
-    struct dirent *epdf = nullptr;
-    std::vector<std::string> files = std::vector<std::string>();
-
-    std::string prefixIndex = prefix;
-    prefixIndex             = regex_replace_compat2(prefixIndex, "_ISO8601", "");
-    prefixIndex             = regex_replace_compat2(prefixIndex, "_XXX", "");
-
-    // Create directory if does not exist
-    struct stat st;
-
-    if (stat(dir, &st) == -1)
-    {
-        LOGF_DEBUG("Creating directory %s...", dir);
-        if (INDI::mkpath(dir, 0755) == -1)
-            LOGF_ERROR("Error creating directory %s (%s)", dir, strerror(errno));
-    }
-
-    dpdf = opendir(dir);
-    if (dpdf != nullptr)
-    {
-        while ((epdf = readdir(dpdf)))
-        {
-            if (strstr(epdf->d_name, prefixIndex.c_str()))
-                files.push_back(epdf->d_name);
-        }
-        closedir(dpdf);
-    }
-    else
-        return -1;
-
-    int maxIndex = 0;
-
-    for (int i = 0; i < static_cast<int>(files.size()); i++)
-    {
-        int index = -1;
-
-        std::string file  = files.at(i);
-        std::size_t start = file.find_last_of("_");
-        std::size_t end   = file.find_last_of(".");
-        if (start != std::string::npos)
-        {
-            index = atoi(file.substr(start + 1, end).c_str());
-            if (index > maxIndex)
-                maxIndex = index;
-        }
-    }
-
-    return (maxIndex + 1);
-}
-
 void SensorInterface::setBPS(int bps)
 {
     BPS = bps;
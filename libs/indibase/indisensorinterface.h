@@ -554,7 +554,6 @@ class SensorInterface : public DefaultDevice
 
         bool uploadFile(const void *fitsData, size_t totalBytes, bool sendIntegration, bool saveIntegration);
         void getMinMax(double *min, double *max, uint8_t *buf, int len, int bpp);
-        int getFileIndex(const char *dir, const char *prefix, const char *ext);
 
         bool IntegrationCompletePrivate();
         void* sendFITS(uint8_t* buf, int len);
@@ -22,41 +22,270 @@
 #include "mjpegencoder.h"
 #include "stream/streammanager.h"
 #include "indiccd.h"
+
+#include <algorithm>
 #include <cmath>
-#include <zlib.h>
+#include <condition_variable>
+#include <csetjmp>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include <jpeglib.h>
 #include <jerror.h>
 
-static void init_destination(j_compress_ptr cinfo)
+namespace
+{
+
+// libjpeg reports fatal errors by calling error_exit, which must not return
+struct ErrorManager
+{
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+    char message[JMSG_LENGTH_MAX];
+};
+
+void errorExit(j_common_ptr cinfo)
+{
+    ErrorManager *error = reinterpret_cast<ErrorManager *>(cinfo->err);
+    (*cinfo->err->format_message)(cinfo, error->message);
+    longjmp(error->jump, 1);
+}
+
+// Destination growing a buffer kept between frames
+struct Destination
+{
+    struct jpeg_destination_mgr pub;
+    std::vector<uint8_t> output;
+    size_t length = 0;
+};
+
+void initDestination(j_compress_ptr cinfo)
 {
-    INDI_UNUSED(cinfo);
-    /* No work necessary here */
+    Destination *dest = reinterpret_cast<Destination *>(cinfo->dest);
+    if (dest->output.size() < 65536)
+        dest->output.resize(65536);
+    dest->pub.next_output_byte = dest->output.data();
+    dest->pub.free_in_buffer = dest->output.size();
 }
 
-static boolean empty_output_buffer(j_compress_ptr cinfo)
+boolean emptyOutputBuffer(j_compress_ptr cinfo)
 {
-    INDI_UNUSED(cinfo);
-    /* No work necessary here */
+    Destination *dest = reinterpret_cast<Destination *>(cinfo->dest);
+    size_t used = dest->output.size();
+    dest->output.resize(used * 2);
+    dest->pub.next_output_byte = dest->output.data() + used;
+    dest->pub.free_in_buffer = used;
     return TRUE;
 }
 
-static void term_destination(j_compress_ptr cinfo)
+void termDestination(j_compress_ptr cinfo)
 {
-    INDI_UNUSED(cinfo);
-    /* no work necessary here */
+    Destination *dest = reinterpret_cast<Destination *>(cinfo->dest);
+    dest->length = dest->output.size() - dest->pub.free_in_buffer;
+}
+
+// A compressor kept from frame to frame, encoding one stripe
+struct Stripe
+{
+    struct jpeg_compress_struct cinfo;
+    ErrorManager error;
+    Destination destination;
+    bool ok = false;
+
+    Stripe()
+    {
+        cinfo.err = jpeg_std_error(&error.pub);
+        jpeg_create_compress(&cinfo);
+        error.pub.error_exit = errorExit;
+
+        destination.pub.init_destination = initDestination;
+        destination.pub.empty_output_buffer = emptyOutputBuffer;
+        destination.pub.term_destination = termDestination;
+        cinfo.dest = &destination.pub;
+    }
+
+    ~Stripe()
+    {
+        jpeg_destroy_compress(&cinfo);
+    }
+
+    Stripe(const Stripe &) = delete;
+    Stripe &operator=(const Stripe &) = delete;
+};
+
+// Returns the offset of the entropy coded data, after the SOS header, or 0 if not found.
+// The image height in the frame header is changed to height if it is not 0.
+size_t scanHeaders(uint8_t *data, size_t length, uint16_t height)
+{
+    size_t pos = 2; // SOI
+    while (pos + 4 <= length && data[pos] == 0xFF)
+    {
+        uint8_t marker = data[pos + 1];
+        size_t segment = data[pos + 2] << 8 | data[pos + 3];
+
+        if (marker >= 0xC0 && marker <= 0xC2 && height != 0 && pos + 7 <= length)
+        {
+            data[pos + 5] = height >> 8;
+            data[pos + 6] = height & 0xFF;
+        }
+        if (marker == 0xDA)
+            return pos + 2 + segment <= length ? pos + 2 + segment : 0;
+
+        pos += 2 + segment;
+    }
+    return 0;
+}
+
 }
 
 namespace INDI
 {
 
+struct MJPEGEncoder::Context
+{
+    std::vector<std::unique_ptr<Stripe>> stripes;
+    std::vector<uint8_t> frame; // stripes joined together
+    const uint8_t *result = nullptr;
+    size_t resultLength = 0;
+
+    // Current frame
+    const uint8_t *src = nullptr;
+    uint16_t width = 0;
+    int components = 1, quality = 85;
+    size_t stripeRows = 0, rows = 0;
+    unsigned int restartInterval = 0;
+
+    // Workers encoding stripes along the calling thread
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable wake, finished;
+    size_t jobs = 0, nextJob = 0, doneJobs = 0;
+    uint64_t generation = 0;
+    bool quit = false;
+
+    ~Context()
+    {
+        stopWorkers();
+    }
+
+    void encode(size_t index)
+    {
+        Stripe &stripe = *stripes[index];
+        j_compress_ptr cinfo = &stripe.cinfo;
+        size_t first = index * stripeRows;
+        size_t height = std::min(stripeRows, rows - first);
+
+        stripe.ok = false;
+        if (setjmp(stripe.error.jump))
+        {
+            jpeg_abort_compress(cinfo);
+            return;
+        }
+
+        cinfo->image_width = width;
+        cinfo->image_height = height;
+        cinfo->input_components = components;
+        cinfo->in_color_space = components == 3 ? JCS_RGB : JCS_GRAYSCALE;
+        jpeg_set_defaults(cinfo);
+        jpeg_set_quality(cinfo, quality, TRUE);
+        // The fast DCT loses too much precision at high qualities
+        cinfo->dct_method = quality > 90 ? JDCT_ISLOW : JDCT_IFAST;
+        cinfo->optimize_coding = FALSE;
+        cinfo->restart_interval = restartInterval;
+
+        jpeg_start_compress(cinfo, TRUE);
+        size_t stride = size_t(width) * components;
+        JSAMPROW lines[16];
+        while (cinfo->next_scanline < cinfo->image_height)
+        {
+            JDIMENSION count = std::min<JDIMENSION>(16, cinfo->image_height - cinfo->next_scanline);
+            for (JDIMENSION i = 0; i < count; i++)
+                lines[i] = const_cast<JSAMPROW>(src + (first + cinfo->next_scanline + i) * stride);
+            jpeg_write_scanlines(cinfo, lines, count);
+        }
+        jpeg_finish_compress(cinfo);
+        stripe.ok = true;
+    }
+
+    // Run encode() for all stripes, on the workers and the calling thread
+    void run(size_t count)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        jobs = count;
+        nextJob = 0;
+        doneJobs = 0;
+        ++generation;
+        wake.notify_all();
+
+        work(guard);
+        finished.wait(guard, [this]()
+        {
+            return doneJobs == jobs;
+        });
+    }
+
+    void work(std::unique_lock<std::mutex> &guard)
+    {
+        while (nextJob < jobs)
+        {
+            size_t index = nextJob++;
+            guard.unlock();
+            encode(index);
+            guard.lock();
+            if (++doneJobs == jobs)
+                finished.notify_all();
+        }
+    }
+
+    void startWorkers(size_t count)
+    {
+        if (workers.size() == count)
+            return;
+
+        stopWorkers();
+        quit = false;
+        for (size_t i = 0; i < count; i++)
+            workers.emplace_back([this]()
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            uint64_t seen = generation;
+            for (;;)
+            {
+                wake.wait(guard, [&]()
+                {
+                    return quit || generation != seen;
+                });
+                if (quit)
+                    return;
+                seen = generation;
+                work(guard);
+            }
+        });
+    }
+
+    void stopWorkers()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            quit = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers)
+            worker.join();
+        workers.clear();
+    }
+};
+
 MJPEGEncoder::MJPEGEncoder()
+    : context(new Context)
 {
     name = "MJPEG";
 }
 
 MJPEGEncoder::~MJPEGEncoder()
 {
-    delete [] jpegBuffer;
 }
 
 const char *MJPEGEncoder::getDeviceName()
@@ -64,6 +293,29 @@ const char *MJPEGEncoder::getDeviceName()
     return currentDevice->getDeviceName();
 }
 
+void MJPEGEncoder::setQuality(int quality)
+{
+    maxQuality = std::max(1, std::min(100, quality));
+    currentQuality = maxBandwidth > 0 ? std::min<int>(currentQuality, maxQuality) : maxQuality.load();
+}
+
+void MJPEGEncoder::setMaxBandwidth(double bytesPerSecond)
+{
+    maxBandwidth = std::max(0.0, bytesPerSecond);
+    if (bytesPerSecond <= 0)
+        currentQuality = maxQuality.load();
+}
+
+void MJPEGEncoder::setThreads(int count)
+{
+    threads = std::max(1, count);
+}
+
+int MJPEGEncoder::getCurrentQuality() const
+{
+    return currentQuality;
+}
+
 bool MJPEGEncoder::upload(INDI::WidgetViewBlob *bp, const uint8_t *buffer, uint32_t nbytes, bool isCompressed)
 {
     // We do not support compression
@@ -74,133 +326,121 @@ bool MJPEGEncoder::upload(INDI::WidgetViewBlob *bp, const uint8_t *buffer, uint3
     }
 
     INDI_UNUSED(nbytes);
-    int bufsize = rawWidth * rawHeight * ((pixelFormat == INDI_RGB) ? 3 : 1);
-    if (bufsize != jpegBufferSize)
-    {
-        delete [] jpegBuffer;
-        jpegBuffer = new uint8_t[bufsize];
-        jpegBufferSize = bufsize;
-    }
 
-    // Scale image DOWN by this factor
-    // 640 is now selected arbitrary to test mpeg streaming performance
-    int scale = std::max(1, static_cast<int>(std::floor(rawWidth / SCALE_WIDTH)));
-    if (pixelFormat == INDI_RGB)
-        jpeg_compress_8u_rgb(buffer, rawWidth, rawHeight, rawWidth * 3, scale, jpegBuffer, &bufsize, 85);
-    else
-        jpeg_compress_8u_gray(buffer, rawWidth, rawHeight, rawWidth, scale, jpegBuffer, &bufsize, 85);
-
-    bp->setBlob(jpegBuffer);
-    bp->setBlobLen(bufsize);
-    bp->setSize(bufsize);
+    if (!compress(buffer, rawWidth, rawHeight, (pixelFormat == INDI_RGB) ? 3 : 1, currentQuality))
+        return false;
+
+    bp->setBlob(const_cast<uint8_t *>(context->result));
+    bp->setBlobLen(context->resultLength);
+    bp->setSize(context->resultLength);
     bp->setFormat(".stream_jpg");
 
+    adaptQuality(context->resultLength);
     return true;
 }
 
-/*
-FROM: https://svn.csail.mit.edu/rrg_pods/jpeg-utils/
+bool MJPEGEncoder::compress(const uint8_t *src, uint16_t width, uint16_t height, int components, int quality)
+{
+    Context &c = *context;
+    c.src = src;
+    c.width = width;
+    c.rows = height;
+    c.components = components;
+    c.quality = quality;
+
+    // Stripes are whole MCU rows. They are joined with restart markers, so a stripe must fit in one restart
+    // interval.
+    size_t mcuSize = components == 3 ? 16 : 8;
+    size_t mcusPerRow = (width + mcuSize - 1) / mcuSize;
+    size_t maxRows = 65535 / std::max<size_t>(1, mcusPerRow) * mcuSize;
+    size_t threadCount = std::max(1, threads.load());
+
+    c.stripeRows = height;
+    if (threadCount > 1 && maxRows >= mcuSize && height >= 2 * mcuSize)
+    {
+        size_t rows = (height + threadCount - 1) / threadCount;
+        c.stripeRows = std::min((rows + mcuSize - 1) / mcuSize * mcuSize, maxRows);
+    }
+    size_t count = (height + c.stripeRows - 1) / std::max<size_t>(1, c.stripeRows);
+    c.restartInterval = count > 1 ? mcusPerRow * c.stripeRows / mcuSize : 0;
 
-Name:         jpeg-utils
-Maintainers:  Albert Huang <albert@csail.mit.edu>
-Summary:      Wrapper functions around libjpeg to simplify JPEG compression and
-              decompression with in-memory buffers.
-Description:
-  note: This is a simple enough library that you could just copy the .c
-  and .h files in to your own programs.
+    while (c.stripes.size() < count)
+        c.stripes.emplace_back(new Stripe);
 
-  To use the library, link against -ljpeg-utils, or use
-  pkg-config --cflags --libs jpeg-utils
+    c.startWorkers(std::min(threadCount, count) - 1);
+    c.run(count);
 
-Requirements:
-  libjpeg62
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!c.stripes[i]->ok)
+        {
+            LOGF_ERROR("JPEG compression failed: %s", c.stripes[i]->error.message);
+            return false;
+        }
+    }
 
-  For faster performance, install libjpeg-turbo, an SSE-accelerated
-  library that is ABI compatible with libjpeg62.
-*/
+    Destination &first = c.stripes[0]->destination;
+    if (count == 1)
+    {
+        c.result = first.output.data();
+        c.resultLength = first.length;
+        return true;
+    }
 
-int MJPEGEncoder::jpeg_compress_8u_gray (const uint8_t * src, uint16_t width, uint16_t height, int stride, int scale,
-        uint8_t * dest,
-        int * destsize, int quality)
-{
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    struct jpeg_destination_mgr jdest;
-    int out_size = *destsize;
-
-    cinfo.err = jpeg_std_error (&jerr);
-    jpeg_create_compress (&cinfo);
-    jdest.next_output_byte = dest;
-    jdest.free_in_buffer = out_size;
-    jdest.init_destination = init_destination;
-    jdest.empty_output_buffer = empty_output_buffer;
-    jdest.term_destination = term_destination;
-    cinfo.dest = &jdest;
-
-    cinfo.image_width = width;
-    cinfo.image_height = height;
-#if JPEG_LIB_VERSION >= 70
-    cinfo.scale_denom = scale;
-#else
-    INDI_UNUSED(scale);
-#endif
-    cinfo.input_components = 1;
-    cinfo.in_color_space = JCS_GRAYSCALE;
-    jpeg_set_defaults (&cinfo);
-    jpeg_set_quality (&cinfo, quality, TRUE);
-
-    jpeg_start_compress (&cinfo, TRUE);
-    while (cinfo.next_scanline < height)
+    // Headers of the first stripe with the height of the whole frame, then the data of each stripe
+    // after a restart marker, RST0 to RST7 in turn
+    c.frame.assign(first.output.data(), first.output.data() + first.length - 2);
+    if (scanHeaders(c.frame.data(), c.frame.size(), height) == 0)
     {
-        JSAMPROW row = (JSAMPROW)(src + cinfo.next_scanline * stride);
-        jpeg_write_scanlines (&cinfo, &row, 1);
+        LOG_ERROR("JPEG compression failed: invalid stripe headers.");
+        return false;
     }
 
-    jpeg_finish_compress (&cinfo);
-    *destsize = out_size - jdest.free_in_buffer;
-    jpeg_destroy_compress (&cinfo);
-    return 0;
+    for (size_t i = 1; i < count; i++)
+    {
+        Destination &stripe = c.stripes[i]->destination;
+        size_t start = scanHeaders(stripe.output.data(), stripe.length, 0);
+        if (start == 0 || start + 2 > stripe.length)
+        {
+            LOG_ERROR("JPEG compression failed: invalid stripe headers.");
+            return false;
+        }
+        c.frame.push_back(0xFF);
+        c.frame.push_back(0xD0 + ((i - 1) & 7));
+        c.frame.insert(c.frame.end(), stripe.output.data() + start, stripe.output.data() + stripe.length - 2);
+    }
+    c.frame.push_back(0xFF);
+    c.frame.push_back(0xD9);
+
+    c.result = c.frame.data();
+    c.resultLength = c.frame.size();
+    return true;
 }
 
-int MJPEGEncoder::jpeg_compress_8u_rgb (const uint8_t * src, uint16_t width, uint16_t height, int stride, int scale,
-                                        uint8_t * dest, int * destsize, int quality)
+void MJPEGEncoder::adaptQuality(size_t frameSize)
 {
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    struct jpeg_destination_mgr jdest;
-    int out_size = *destsize;
-
-    cinfo.err = jpeg_std_error (&jerr);
-    jpeg_create_compress (&cinfo);
-    jdest.next_output_byte = dest;
-    jdest.free_in_buffer = out_size;
-    jdest.init_destination = init_destination;
-    jdest.empty_output_buffer = empty_output_buffer;
-    jdest.term_destination = term_destination;
-    cinfo.dest = &jdest;
-
-    cinfo.image_width = width;
-    cinfo.image_height = height;
-#if JPEG_LIB_VERSION >= 70
-    cinfo.scale_denom = scale;
-#else
-    INDI_UNUSED(scale);
-#endif
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
-    jpeg_set_defaults (&cinfo);
-    jpeg_set_quality (&cinfo, quality, TRUE);
-
-    jpeg_start_compress (&cinfo, TRUE);
-    while (cinfo.next_scanline < height)
-    {
-        JSAMPROW row = (JSAMPROW)(src + cinfo.next_scanline * stride);
-        jpeg_write_scanlines (&cinfo, &row, 1);
-    }
-    jpeg_finish_compress (&cinfo);
-    *destsize = out_size - jdest.free_in_buffer;
-    jpeg_destroy_compress (&cinfo);
-    return 0;
+    auto now = std::chrono::steady_clock::now();
+    double interval = std::chrono::duration<double>(now - lastFrameTime).count();
+    bool first = lastFrameTime.time_since_epoch().count() == 0 || interval > 10;
+    lastFrameTime = now;
+
+    double bandwidth = maxBandwidth;
+    if (bandwidth <= 0)
+        return;
+
+    // Smoothed preview rate, frames can't be budgeted before it is known
+    if (first)
+        return;
+    frameInterval = frameInterval > 0 ? 0.8 * frameInterval + 0.2 * interval : interval;
+
+    double budget = bandwidth * std::max(frameInterval, 0.001);
+    int quality = currentQuality;
+    if (frameSize > budget)
+        quality -= std::max(1, std::min(10, static_cast<int>(10 * (frameSize / budget - 1))));
+    else if (frameSize < 0.8 * budget)
+        quality += 1;
+
+    currentQuality = std::max(std::min<int>(MIN_QUALITY, maxQuality), std::min<int>(quality, maxQuality));
 }
 
 }
@@ -23,13 +23,19 @@
 
 #include "encoderinterface.h"
 
+#include <atomic>
+#include <chrono>
+#include <memory>
+
 namespace INDI
 {
 
 /**
  * @brief The MJPEGEncoder class encodes frames in JPEG format before transmitting them to the client.
  *
- * The quality is now hard-coded at 70 when encoding the JPEG image. Further compression is not supported.
+ * The compressor is kept between frames. Frames may be cut into horizontal stripes encoded in parallel,
+ * which are joined into one baseline JPEG with restart markers. With a bandwidth limit the quality is
+ * lowered until the frames fit in it at the current preview rate. Further compression is not supported.
  */
 class MJPEGEncoder : public EncoderInterface
 {
@@ -39,16 +45,43 @@ class MJPEGEncoder : public EncoderInterface
 
         virtual bool upload(INDI::WidgetViewBlob *bp, const uint8_t *buffer, uint32_t nbytes, bool isCompressed = false) override;
 
+        /**
+         * @brief Set the JPEG quality, 1 to 100. With a bandwidth limit it is the highest quality used.
+         */
+        void setQuality(int quality);
+
+        /**
+         * @brief Set the bandwidth the preview should stay under, in bytes per second. 0 keeps the quality fixed.
+         */
+        void setMaxBandwidth(double bytesPerSecond);
+
+        /**
+         * @brief Set the number of threads encoding stripes of a frame, 1 encodes on the calling thread only.
+         */
+        void setThreads(int threads);
+
+        /**
+         * @return The quality of the last frame.
+         */
+        int getCurrentQuality() const;
+
     private:
         const char *getDeviceName();
-        int jpeg_compress_8u_gray (const uint8_t * src, uint16_t width, uint16_t height, int stride, int scale, uint8_t * dest,
-                                   int * destsize, int quality);
-        int jpeg_compress_8u_rgb (const uint8_t * src, uint16_t width, uint16_t height, int stride, int scale, uint8_t * dest,
-                                  int * destsize, int quality);
-        uint8_t *jpegBuffer = nullptr;
-        uint16_t jpegBufferSize = 1;
-
-        static const int SCALE_WIDTH = 640;
+        bool compress(const uint8_t *src, uint16_t width, uint16_t height, int components, int quality);
+        void adaptQuality(size_t frameSize);
+
+        struct Context;
+        std::unique_ptr<Context> context;
+
+        std::atomic<int> maxQuality {85};
+        std::atomic<int> currentQuality {85};
+        std::atomic<double> maxBandwidth {0};
+        std::atomic<int> threads {1};
+
+        std::chrono::steady_clock::time_point lastFrameTime;
+        double frameInterval = 0;
+
+        static constexpr int MIN_QUALITY = 10;
 
 };
 
@@ -22,6 +22,7 @@
 #include "rawencoder.h"
 #include "stream/streammanager.h"
 #include "indiccd.h"
+#include "indiblobcodec.h"
 
 #include <zlib.h>
 
@@ -47,6 +48,28 @@ bool RawEncoder::upload(INDI::WidgetViewBlob *bp, const uint8_t *buffer, uint32_
     // Do we want to compress ?
     if (isCompressed)
     {
+        // Use the chunked codec if the camera selected one
+        auto codec = currentDevice->getSwitch("CCD_COMPRESSION_CODEC");
+        auto level = currentDevice->getNumber("CCD_COMPRESSION_LEVEL");
+        auto onSwitch = codec.isValid() ? codec.findOnSwitch() : nullptr;
+        bool zstd = onSwitch && onSwitch->isNameMatch("CODEC_ZSTD");
+        if (zstd || (onSwitch && onSwitch->isNameMatch("CODEC_ZLIB")))
+        {
+            if (!compressBlob(buffer, nbytes, compressedFrame,
+                              zstd ? BLOB_CODEC_ZSTD : BLOB_CODEC_ZLIB,
+                              level.isValid() ? static_cast<int>(level[0].getValue()) : 1, pixelDepth > 8 ? 2 : 1))
+            {
+                LOG_ERROR("internal error - chunked compression failed");
+                return false;
+            }
+
+            bp->setBlob(compressedFrame.data());
+            bp->setBlobLen(compressedFrame.size());
+            bp->setSize(nbytes);
+            bp->setFormat(std::string(".stream") + BLOB_CHUNKED_SUFFIX);
+            return true;
+        }
+
         // Compress frame
         compressedFrame.resize(nbytes + nbytes / 64 + 16 + 3);
         uLongf compressedBytes = compressedFrame.size();
@@ -0,0 +1,175 @@
+/*
+    Frame Buffer Pool
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#include "framepool.h"
+
+#include <map>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace INDI
+{
+
+// Capacities are rounded to this, so frames of about the same size share a bucket
+static constexpr size_t FRAME_POOL_UNIT = 64 * 1024;
+// Buffers are aligned for vectorized processing
+static constexpr std::align_val_t FRAME_POOL_ALIGNMENT { 64 };
+
+struct FramePool::State
+{
+    mutable std::mutex lock;
+    std::map<size_t, std::vector<uint8_t *>> idle;
+    size_t idleSize = 0;
+    size_t maxIdleSize = 256 * 1024 * 1024;
+    size_t allocations = 0;
+
+    void put(uint8_t *data, size_t capacity)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (idleSize + capacity <= maxIdleSize)
+            {
+                idle[capacity].push_back(data);
+                idleSize += capacity;
+                return;
+            }
+        }
+        ::operator delete[](data, FRAME_POOL_ALIGNMENT);
+    }
+
+    ~State()
+    {
+        for (auto &bucket : idle)
+            for (uint8_t *data : bucket.second)
+                ::operator delete[](data, FRAME_POOL_ALIGNMENT);
+    }
+};
+
+FramePool::Buffer::~Buffer()
+{
+    release();
+}
+
+FramePool::Buffer::Buffer(Buffer &&other) noexcept
+    : mState(std::move(other.mState))
+    , mData(std::exchange(other.mData, nullptr))
+    , mSize(std::exchange(other.mSize, 0))
+    , mCapacity(std::exchange(other.mCapacity, 0))
+{ }
+
+FramePool::Buffer &FramePool::Buffer::operator=(Buffer &&other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        mState    = std::move(other.mState);
+        mData     = std::exchange(other.mData, nullptr);
+        mSize     = std::exchange(other.mSize, 0);
+        mCapacity = std::exchange(other.mCapacity, 0);
+    }
+    return *this;
+}
+
+void FramePool::Buffer::release()
+{
+    if (mData != nullptr)
+        mState->put(mData, mCapacity);
+
+    mState.reset();
+    mData = nullptr;
+    mSize = 0;
+    mCapacity = 0;
+}
+
+FramePool::FramePool()
+    : mState(std::make_shared<State>())
+{ }
+
+FramePool::~FramePool()
+{ }
+
+FramePool::Buffer FramePool::acquire(size_t size)
+{
+    Buffer buffer;
+    if (size == 0)
+        return buffer;
+
+    size_t capacity = (size + FRAME_POOL_UNIT - 1) / FRAME_POOL_UNIT * FRAME_POOL_UNIT;
+
+    buffer.mState = mState;
+    buffer.mSize = size;
+    {
+        std::lock_guard<std::mutex> guard(mState->lock);
+
+        // Smallest idle buffer that fits, but don't waste a large one on a small frame
+        for (auto it = mState->idle.lower_bound(capacity);
+                it != mState->idle.end() && it->first <= capacity + capacity / 2; ++it)
+        {
+            if (it->second.empty())
+                continue;
+
+            buffer.mData = it->second.back();
+            buffer.mCapacity = it->first;
+            it->second.pop_back();
+            mState->idleSize -= it->first;
+            return buffer;
+        }
+        ++mState->allocations;
+    }
+
+    buffer.mData = static_cast<uint8_t *>(::operator new[](capacity, FRAME_POOL_ALIGNMENT));
+    buffer.mCapacity = capacity;
+    return buffer;
+}
+
+void FramePool::setMaxIdleSize(size_t bytes)
+{
+    std::lock_guard<std::mutex> guard(mState->lock);
+    mState->maxIdleSize = bytes;
+}
+
+void FramePool::clear()
+{
+    std::map<size_t, std::vector<uint8_t *>> idle;
+    {
+        std::lock_guard<std::mutex> guard(mState->lock);
+        std::swap(idle, mState->idle);
+        mState->idleSize = 0;
+    }
+
+    for (auto &bucket : idle)
+        for (uint8_t *data : bucket.second)
+            ::operator delete[](data, FRAME_POOL_ALIGNMENT);
+}
+
+size_t FramePool::allocations() const
+{
+    std::lock_guard<std::mutex> guard(mState->lock);
+    return mState->allocations;
+}
+
+size_t FramePool::idleSize() const
+{
+    std::lock_guard<std::mutex> guard(mState->lock);
+    return mState->idleSize;
+}
+
+}
@@ -0,0 +1,124 @@
+/*
+    Frame Buffer Pool
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace INDI
+{
+
+/**
+ * @brief The FramePool class recycles frame buffers between the stream threads.
+ *
+ * Idle buffers are kept in buckets by capacity. A buffer goes back to the pool when its handle is
+ * destroyed or reassigned, so once streaming has settled frames no longer touch the heap.
+ * Handles keep the pool state alive, they may outlive the pool itself.
+ */
+class FramePool
+{
+        struct State;
+
+    public:
+        /**
+         * @brief Move-only handle to a pooled buffer.
+         */
+        class Buffer
+        {
+            public:
+                Buffer() = default;
+                ~Buffer();
+
+                Buffer(Buffer &&other) noexcept;
+                Buffer &operator=(Buffer &&other) noexcept;
+
+                Buffer(const Buffer &) = delete;
+                Buffer &operator=(const Buffer &) = delete;
+
+            public:
+                uint8_t *data()
+                {
+                    return mData;
+                }
+
+                const uint8_t *data() const
+                {
+                    return mData;
+                }
+
+                size_t size() const
+                {
+                    return mSize;
+                }
+
+                bool empty() const
+                {
+                    return mSize == 0;
+                }
+
+                /**
+                 * @brief Give the buffer back to the pool now.
+                 */
+                void release();
+
+            private:
+                friend class FramePool;
+                std::shared_ptr<State> mState;
+                uint8_t *mData = nullptr;
+                size_t mSize = 0;
+                size_t mCapacity = 0;
+        };
+
+    public:
+        FramePool();
+        ~FramePool();
+
+    public:
+        /**
+         * @brief Get a buffer of size bytes, its content is undefined.
+         */
+        Buffer acquire(size_t size);
+
+        /**
+         * @brief Limit the memory held by idle buffers, larger surplus is freed when returned.
+         */
+        void setMaxIdleSize(size_t bytes);
+
+        /**
+         * @brief Free all idle buffers.
+         */
+        void clear();
+
+        /**
+         * @return Number of buffers allocated from the heap so far.
+         */
+        size_t allocations() const;
+
+        /**
+         * @return Bytes held by idle buffers.
+         */
+        size_t idleSize() const;
+
+    private:
+        std::shared_ptr<State> mState;
+};
+
+}
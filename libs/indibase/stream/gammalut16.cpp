@@ -53,3 +53,10 @@ void GammaLut16::apply(const uint16_t *first, const uint16_t *last, uint8_t *des
     while (first != last)
         *destination++ = lookUpTable[*first++];
 }
+
+void GammaLut16::apply(const uint16_t *source, size_t width, size_t height, size_t sourceStride,
+                       uint8_t *destination) const
+{
+    for (size_t y = 0; y < height; y++)
+        apply(source + y * sourceStride, width, destination + y * width);
+}
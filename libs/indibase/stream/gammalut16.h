@@ -35,6 +35,16 @@ class GammaLut16
         void apply(const uint16_t *source, size_t count, uint8_t *destination) const;
         void apply(const uint16_t *first, const uint16_t *last, uint8_t *destination) const;
 
+        /**
+         * @brief Convert a rectangle of a larger frame, subframing and downscaling in a single pass.
+         * @param source first sample of the rectangle
+         * @param width samples per row of the rectangle
+         * @param height rows of the rectangle
+         * @param sourceStride samples between the starts of two rows of the source frame
+         * @param destination receives the width x height rectangle, rows packed
+         */
+        void apply(const uint16_t *source, size_t width, size_t height, size_t sourceStride, uint8_t *destination) const;
+
     protected:
         std::vector<uint8_t> mLookUpTable;
 };
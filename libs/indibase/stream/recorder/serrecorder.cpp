@@ -28,9 +28,13 @@
 #include "serrecorder.h"
 #include "jpegutils.h"
 
+#include <algorithm>
 #include <ctime>
 #include <cerrno>
 #include <cstring>
+#include <limits>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/time.h>
 
 
@@ -53,13 +57,13 @@ SER_Recorder::SER_Recorder()
     // always default to. LITTLE_ENDIAN appears to be ignored by them leading to garbled data.
     serh.LittleEndian = SER_BIG_ENDIAN;
     isRecordingActive = false;
-    f = nullptr;
 
     jpegBuffer = static_cast<uint8_t*>(malloc(1));
 }
 
 SER_Recorder::~SER_Recorder()
 {
+    close();
     free(jpegBuffer);
 }
 
@@ -70,49 +74,112 @@ bool SER_Recorder::is_little_endian()
     return black_magic == 0x01;
 }
 
-void SER_Recorder::write_int_le(uint32_t *i)
+uint8_t *SER_Recorder::write_int_le(uint8_t *out, uint32_t i)
 {
-    if (is_little_endian())
-        fwrite((i), sizeof(uint32_t), 1, f);
-    else
-    {
-        unsigned char *c = (unsigned char *)i;
-        fwrite((c + 3), sizeof(char), 1, f);
-        fwrite((c + 2), sizeof(char), 1, f);
-        fwrite((c + 1), sizeof(char), 1, f);
-        fwrite((c), sizeof(char), 1, f);
-    }
+    for (int byte = 0; byte < 4; byte++)
+        *out++ = static_cast<uint8_t>(i >> (8 * byte));
+    return out;
+}
+
+uint8_t *SER_Recorder::write_long_int_le(uint8_t *out, uint64_t i)
+{
+    out = write_int_le(out, static_cast<uint32_t>(i));
+    return write_int_le(out, static_cast<uint32_t>(i >> 32));
+}
+
+void SER_Recorder::write_header(const ser_header *s, uint8_t *out)
+{
+    memcpy(out, s->FileID, 14);
+    out = write_int_le(out + 14, s->LuID);
+    out = write_int_le(out, s->ColorID);
+    out = write_int_le(out, s->LittleEndian);
+    out = write_int_le(out, s->ImageWidth);
+    out = write_int_le(out, s->ImageHeight);
+    out = write_int_le(out, s->PixelDepth);
+    out = write_int_le(out, s->FrameCount);
+    memcpy(out, s->Observer, 40);
+    memcpy(out + 40, s->Instrume, 40);
+    memcpy(out + 80, s->Telescope, 40);
+    out = write_long_int_le(out + 120, s->DateTime);
+    write_long_int_le(out, s->DateTime_UTC);
 }
 
-void SER_Recorder::write_long_int_le(uint64_t *i)
+bool SER_Recorder::writeAt(const uint8_t *data, size_t size, uint64_t offset)
 {
-    if (is_little_endian())
+    while (size > 0)
     {
-        fwrite(((uint32_t *)i), sizeof(int), 1, f);
-        fwrite(((uint32_t *)(i) + 1), sizeof(int), 1, f);
+        ssize_t written = pwrite(fd, data, size, static_cast<off_t>(offset));
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        size -= written;
+        offset += written;
     }
-    else
+    return true;
+}
+
+void SER_Recorder::reserve(uint64_t size)
+{
+    if (size <= reserved)
+        return;
+
+#ifdef __linux__
+    // Keep the file size, so a file left behind by a crash holds no blank frames
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, reserved, size - reserved) == 0)
     {
-        write_int_le((uint32_t *)(i) + 1);
-        write_int_le((uint32_t *)(i));
+        reserved = size;
+        return;
     }
+#endif
+    // Not supported by the file system, or out of space: let the writes report it
+    reserved = std::numeric_limits<uint64_t>::max();
 }
 
-void SER_Recorder::write_header(ser_header *s)
+void SER_Recorder::submitBuffer()
 {
-    fwrite((s->FileID), sizeof(char), 14, f);
-    write_int_le(&(s->LuID));
-    write_int_le(&(s->ColorID));
-    write_int_le(&(s->LittleEndian));
-    write_int_le(&(s->ImageWidth));
-    write_int_le(&(s->ImageHeight));
-    write_int_le(&(s->PixelDepth));
-    write_int_le(&(s->FrameCount));
-    fwrite((s->Observer), sizeof(char), 40, f);
-    fwrite((s->Instrume), sizeof(char), 40, f);
-    fwrite((s->Telescope), sizeof(char), 40, f);
-    write_long_int_le(&(s->DateTime));
-    write_long_int_le(&(s->DateTime_UTC));
+    if (currentLength == 0)
+        return;
+
+    WriteJob job;
+    job.buffer = std::move(current);
+    job.length = currentLength;
+    job.offset = dataOffset;
+    job.header = serh;
+
+    dataOffset += currentLength;
+    currentLength = 0;
+    lastSubmit = std::chrono::steady_clock::now();
+
+    // The pending size limit keeps the queue from filling up
+    while (!writeQueue.push(std::move(job)))
+        writeQueue.waitForEmpty();
+}
+
+void SER_Recorder::writerThread()
+{
+    WriteJob job;
+    while (writeQueue.pop(job) && !job.last)
+    {
+        if (writeError == 0)
+        {
+            uint64_t end = job.offset + job.length;
+            if (end + MAX_PENDING_SIZE > reserved)
+                reserve(end + 4 * MAX_PENDING_SIZE);
+
+            // Frames first, then the header counting them
+            uint8_t header[SER_HEADER_SIZE];
+            write_header(&job.header, header);
+            if (!writeAt(job.buffer.data(), job.length, job.offset) || !writeAt(header, SER_HEADER_SIZE, 0))
+                writeError = errno;
+        }
+
+        pendingBytes -= job.buffer.size();
+        job = WriteJob();
+    }
 }
 
 bool SER_Recorder::setPixelFormat(INDI_PIXEL_FORMAT pixelFormat, uint8_t pixelDepth)
@@ -175,7 +242,7 @@ bool SER_Recorder::open(const char *filename, char *errmsg)
     if (isRecordingActive)
         return false;
     serh.FrameCount = 0;
-    if ((f = fopen(filename, "w")) == nullptr)
+    if ((fd = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0)
     {
         snprintf(errmsg, ERRMSGSIZ, "recorder open error %d, %s\n", errno, strerror(errno));
         return false;
@@ -183,38 +250,83 @@ bool SER_Recorder::open(const char *filename, char *errmsg)
 
     serh.DateTime     = getLocalTimeStamp();
     serh.DateTime_UTC = getUTCTimeStamp();
-    write_header(&serh);
+
+    uint8_t header[SER_HEADER_SIZE];
+    write_header(&serh, header);
+    if (!writeAt(header, SER_HEADER_SIZE, 0))
+    {
+        snprintf(errmsg, ERRMSGSIZ, "recorder write error %d, %s\n", errno, strerror(errno));
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+
     frame_size        = serh.ImageWidth * serh.ImageHeight * (serh.PixelDepth <= 8 ? 1 : 2) * number_of_planes;
-    isRecordingActive = true;
+
+    // Reserve the expected size up to a few GB, the writer thread keeps reserving ahead anyway
+    reserved = 0;
+    reserve(SER_HEADER_SIZE + std::min<uint64_t>(uint64_t(expectedFrames) * frame_size, 16 * MAX_PENDING_SIZE));
 
     frameStamps.clear();
+    frameStamps.reserve(std::min<uint32_t>(expectedFrames, 1 << 20));
+    expectedFrames = 0;
+
+    dataOffset    = SER_HEADER_SIZE;
+    currentLength = 0;
+    pendingBytes  = 0;
+    writeError    = 0;
+    droppedFrames = 0;
+    lastSubmit    = std::chrono::steady_clock::now();
+    bufferPool.setMaxIdleSize(MAX_PENDING_SIZE);
+    writer = std::thread(&SER_Recorder::writerThread, this);
+
+    isRecordingActive = true;
 
     return true;
 }
 
 bool SER_Recorder::close()
 {
-    if (f)
+    bool ok = true;
+
+    if (fd >= 0)
     {
-        // Write all timestamps
+        submitBuffer();
+
+        WriteJob last;
+        last.last = true;
+        while (!writeQueue.push(std::move(last)))
+            writeQueue.waitForEmpty();
+        writer.join();
+
+        // Write all timestamps, drop the reserved space left and write the final header
+        std::vector<uint8_t> trailer(frameStamps.size() * sizeof(uint64_t));
+        uint8_t *out = trailer.data();
         for (auto value : frameStamps)
-            write_long_int_le(&value);
+            out = write_long_int_le(out, value);
 
-        frameStamps.clear();
+        uint8_t header[SER_HEADER_SIZE];
+        write_header(&serh, header);
 
-        fseek(f, 0L, SEEK_SET);
-        write_header(&serh);
-        fclose(f);
-        f = nullptr;
+        ok = writeError == 0 &&
+             writeAt(trailer.data(), trailer.size(), dataOffset) &&
+             ftruncate(fd, static_cast<off_t>(dataOffset + trailer.size())) == 0 &&
+             writeAt(header, SER_HEADER_SIZE, 0);
+
+        std::vector<uint64_t>().swap(frameStamps);
+        bufferPool.clear();
+
+        ::close(fd);
+        fd = -1;
     }
 
     isRecordingActive = false;
-    return true;
+    return ok;
 }
 
 bool SER_Recorder::writeFrame(const uint8_t *frame, uint32_t nbytes, uint64_t timestamp)
 {
-    if (!isRecordingActive)
+    if (!isRecordingActive || writeError != 0)
         return false;
 
 #if 0
@@ -253,11 +365,6 @@ bool SER_Recorder::writeFrame(const uint8_t *frame, uint32_t nbytes, uint64_t ti
     }
 #endif
 
-    if(timestamp)
-        frameStamps.push_back(timestamp * m_sepaseconds_per_microsecond);
-    else
-        frameStamps.push_back(getUTCTimeStamp());
-
     // Not technically pixel format, but let's use this for now.
     if (m_PixelFormat == INDI_JPG)
     {
@@ -269,11 +376,40 @@ bool SER_Recorder::writeFrame(const uint8_t *frame, uint32_t nbytes, uint64_t ti
         serh.ImageWidth = w;
         serh.ImageHeight = h;
         serh.ColorID = (naxis == 3) ? SER_RGB : SER_MONO;
-        fwrite(jpegBuffer, 1, memsize, f);
+        frame = jpegBuffer;
+        nbytes = memsize;
     }
+
+    if (currentLength + nbytes > current.size())
+    {
+        size_t capacity = std::max<size_t>(BUFFER_SIZE, nbytes);
+
+        // The disk fell behind, drop the frame rather than wait for it
+        if (pendingBytes > 0 && pendingBytes + capacity > MAX_PENDING_SIZE)
+        {
+            droppedFrames++;
+            return true;
+        }
+
+        submitBuffer();
+        current = bufferPool.acquire(capacity);
+        pendingBytes += capacity;
+    }
+
+    memcpy(current.data() + currentLength, frame, nbytes);
+    currentLength += nbytes;
+
+    if(timestamp)
+        frameStamps.push_back(timestamp * m_sepaseconds_per_microsecond);
     else
-        fwrite(frame, 1, nbytes, f);
+        frameStamps.push_back(getUTCTimeStamp());
+
     serh.FrameCount += 1;
+
+    // Slow streams get to the disk at least every second
+    if (std::chrono::steady_clock::now() - lastSubmit >= std::chrono::seconds(1))
+        submitBuffer();
+
     return true;
 }
 
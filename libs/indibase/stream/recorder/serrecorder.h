@@ -22,9 +22,14 @@
 #pragma once
 
 #include "recorderinterface.h"
+#include "../framepool.h"
+#include "../spscring.h"
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <stdio.h>
+#include <thread>
 
 typedef struct ser_header
 {
@@ -61,11 +66,18 @@ enum ser_color_id
 #define SER_BIG_ENDIAN    0
 #define SER_LITTLE_ENDIAN 1
 
+#define SER_HEADER_SIZE   178
+
 namespace INDI
 {
 
 /**
  * @brief The SER_Recorder class implements recording of video streams in SER format.
+ *
+ * Frames are copied to large buffers which a writer thread writes to the file, so the stream thread never
+ * waits for the disk. If the disk falls too far behind, frames are dropped rather than stalling the capture.
+ * Disk space is reserved ahead of the writes. The header is rewritten after each buffer with the number of
+ * frames on disk, so the file stays readable if the driver stops before the timestamps trailer is written.
  */
 class SER_Recorder : public RecorderInterface
 {
@@ -88,23 +100,73 @@ class SER_Recorder : public RecorderInterface
             isStreamingActive = enable;
         }
 
+        /**
+         * @brief Set the number of frames expected in the next recording, to reserve disk space. 0 if unknown.
+         */
+        void setExpectedFrameCount(uint32_t count)
+        {
+            expectedFrames = count;
+        }
+
+        /**
+         * @return Number of frames dropped in the last recording because the disk could not keep up.
+         */
+        uint32_t getDroppedFrames() const
+        {
+            return droppedFrames;
+        }
+
         // Public constants
         static const uint64_t C_SEPASECONDS_PER_SECOND = 10000000;
 
+        // Size of the write buffers, and the most memory held by buffers waiting for the disk
+        static constexpr size_t BUFFER_SIZE = 8 * 1024 * 1024;
+        static constexpr size_t MAX_PENDING_SIZE = 256 * 1024 * 1024;
+
     protected:
+        struct WriteJob
+        {
+            FramePool::Buffer buffer;
+            size_t length = 0;
+            uint64_t offset = 0;
+            ser_header header;  // header once the buffer is written
+            bool last = false;
+        };
+
         uint64_t utcTo64BitTS();
         bool is_little_endian();
-        void write_int_le(uint32_t *i);
-        void write_long_int_le(uint64_t *i);
-        void write_header(ser_header *s);
+        uint8_t *write_int_le(uint8_t *out, uint32_t i);
+        uint8_t *write_long_int_le(uint8_t *out, uint64_t i);
+        void write_header(const ser_header *s, uint8_t *out);
+        bool writeAt(const uint8_t *data, size_t size, uint64_t offset);
+        void reserve(uint64_t size);
+        void submitBuffer();
+        void writerThread();
         ser_header serh;
         bool isRecordingActive = false, isStreamingActive = false;
-        FILE *f;
+        int fd = -1;
         uint32_t frame_size;
         uint32_t number_of_planes;
         uint16_t rawWidth = 0, rawHeight = 0;
         std::vector<uint64_t> frameStamps;
 
+        // Buffer being filled by writeFrame, and where it goes in the file
+        FramePool bufferPool;
+        FramePool::Buffer current;
+        size_t currentLength = 0;
+        uint64_t dataOffset = 0;
+        std::chrono::steady_clock::time_point lastSubmit;
+
+        // Writer thread
+        SPSCRing<WriteJob> writeQueue {256};
+        std::thread writer;
+        std::atomic<size_t> pendingBytes {0};
+        std::atomic<int> writeError {0};
+        uint64_t reserved = 0;
+
+        uint32_t expectedFrames = 0;
+        std::atomic<uint32_t> droppedFrames {0};
+
     private:
         // From pipp_timestamp.h
         // Copyright (C) 2015 Chris Garry
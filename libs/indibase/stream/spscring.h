@@ -0,0 +1,233 @@
+/*
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <cstddef>
+
+/**
+ * \class SPSCRing template
+ * \brief The SPSCRing class is a bounded, lock-free FIFO between exactly one producer and one consumer thread.
+ *
+ * Push and pop only touch two atomic indices. A thread only falls back to the mutex and condition variable
+ * after it has spun a little on an empty (pop) or non-empty (waitForEmpty) ring, and the other side only
+ * takes the mutex to wake it up if it is actually sleeping.
+ * Data is moved in and out of the slots, a slot is reset once popped so it doesn't hold resources.
+ */
+template <typename T>
+class SPSCRing
+{
+    public:
+        /**
+         * @param capacity maximum number of elements, rounded up to a power of two
+         */
+        explicit SPSCRing(size_t capacity = 1024);
+
+        /**
+         * @brief Producer: move data to the ring
+         * @return false if the ring is full, data is left untouched
+         */
+        bool push(T &&data);
+
+        /**
+         * @brief Consumer: pop data from the ring, waiting for it
+         * @param dest the data will be moved to dest
+         * @return false if the abort function was called while waiting for data
+         */
+        bool pop(T &dest);
+
+        /**
+         * @brief Consumer: pop data from the ring if there is any
+         * @return false if the ring is empty
+         */
+        bool tryPop(T &dest);
+
+        /**
+         * @brief Producer: wait for the consumer to empty the ring
+         */
+        void waitForEmpty() const;
+
+        /**
+         * @brief Consumer: drop all elements
+         */
+        void clear();
+
+        /**
+         * @brief Exit the waiting pop method with false return, and all later calls of it. Safe from any thread.
+         */
+        void abort();
+
+        /**
+         * @brief Return the number of items in the ring
+         * @return count of elements
+         */
+        size_t size() const;
+
+        /**
+         * @return Maximum number of elements
+         */
+        size_t capacity() const;
+
+    protected:
+        void wake(std::atomic<bool> &sleeping) const;
+
+    protected:
+        std::vector<T> slots;
+        size_t mask;
+
+        alignas(64) std::atomic<size_t> head {0}; // next slot to pop, written by the consumer
+        alignas(64) std::atomic<size_t> tail {0}; // next slot to push, written by the producer
+        alignas(64) std::atomic<bool> aborted {false};
+
+        mutable std::atomic<bool> consumerSleeping {false};
+        mutable std::atomic<bool> producerSleeping {false};
+
+        mutable std::mutex mutex;
+        mutable std::condition_variable increase;
+        mutable std::condition_variable decrease;
+
+        static constexpr int spinCount = 64;
+};
+
+// implementation
+template <typename T>
+inline SPSCRing<T>::SPSCRing(size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    slots.resize(size);
+    mask = size - 1;
+}
+
+template <typename T>
+inline void SPSCRing<T>::wake(std::atomic<bool> &sleeping) const
+{
+    // The index store and this load are sequentially consistent, as are the flag store and the index load
+    // of the sleeping side: either it sees the new index or we see it sleeping.
+    if (sleeping.load())
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        increase.notify_all();
+        decrease.notify_all();
+    }
+}
+
+template <typename T>
+inline bool SPSCRing<T>::push(T &&data)
+{
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) > mask)
+        return false; // full
+
+    slots[t & mask] = std::move(data);
+    tail.store(t + 1);
+    wake(consumerSleeping);
+    return true;
+}
+
+template <typename T>
+inline bool SPSCRing<T>::tryPop(T &dest)
+{
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire))
+        return false; // empty
+
+    dest = std::move(slots[h & mask]);
+    slots[h & mask] = T();
+    head.store(h + 1);
+    wake(producerSleeping);
+    return true;
+}
+
+template <typename T>
+inline bool SPSCRing<T>::pop(T &dest)
+{
+    for (int spin = 0; ; ++spin)
+    {
+        if (aborted.load(std::memory_order_acquire))
+            return false;
+
+        if (tryPop(dest))
+            return true;
+
+        if (spin < spinCount)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        consumerSleeping = true;
+        increase.wait(lock, [this]()
+        {
+            return aborted.load() || head.load(std::memory_order_relaxed) != tail.load();
+        });
+        consumerSleeping.store(false, std::memory_order_relaxed);
+        spin = 0;
+    }
+}
+
+template <typename T>
+inline void SPSCRing<T>::waitForEmpty() const
+{
+    for (int spin = 0; spin < spinCount; ++spin)
+    {
+        if (size() == 0 || aborted.load())
+            return;
+        std::this_thread::yield();
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    producerSleeping = true;
+    decrease.wait(lock, [this]()
+    {
+        return aborted.load() || size() == 0;
+    });
+    producerSleeping.store(false, std::memory_order_relaxed);
+}
+
+template <typename T>
+inline void SPSCRing<T>::clear()
+{
+    T dest;
+    while (tryPop(dest))
+        dest = T();
+}
+
+template <typename T>
+inline void SPSCRing<T>::abort()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    aborted = true;
+    increase.notify_all();
+    decrease.notify_all();
+}
+
+template <typename T>
+inline size_t SPSCRing<T>::size() const
+{
+    size_t h = head.load();
+    return tail.load() - h;
+}
+
+template <typename T>
+inline size_t SPSCRing<T>::capacity() const
+{
+    return slots.size();
+}
@@ -30,6 +30,8 @@
 #include "indiutility.h"
 #include "indisinglethreadpool.h"
 #include "indielapsedtimer.h"
+#include "encoder/mjpegencoder.h"
+#include "recorder/serrecorder.h"
 
 #include <cerrno>
 #include <sys/stat.h>
@@ -62,6 +64,7 @@ StreamManagerPrivate::StreamManagerPrivate(DefaultDevice *defaultDevice)
     LOGF_DEBUG("Using default encoder (%s)", encoder->getName());
 
     framesThread = std::thread(&StreamManagerPrivate::asyncStreamThread, this);
+    fpsPublisher = std::thread(&StreamManagerPrivate::publisherThread, this);
 }
 
 StreamManagerPrivate::~StreamManagerPrivate()
@@ -72,6 +75,16 @@ StreamManagerPrivate::~StreamManagerPrivate()
         framesIncoming.abort();
         framesThread.join();
     }
+
+    if (fpsPublisher.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(fpsPublisherMutex);
+            fpsPublisherTerminate = true;
+        }
+        fpsPublisherCondition.notify_one();
+        fpsPublisher.join();
+    }
 }
 
 StreamManager::StreamManager(DefaultDevice *mainDevice)
@@ -173,6 +186,16 @@ bool StreamManagerPrivate::initProperties()
     LimitsNP[LIMITS_BUFFER_MAX ].fill("LIMITS_BUFFER_MAX",  "Maximum Buffer Size (MB)", "%.0f", 1, 1024 * 64, 1, 512);
     LimitsNP[LIMITS_PREVIEW_FPS].fill("LIMITS_PREVIEW_FPS", "Maximum Preview FPS",      "%.0f", 1, 120,     1,  10);
     LimitsNP.fill(getDeviceName(), "LIMITS", "Limits", STREAM_TAB, IP_RW, 0, IPS_IDLE);
+
+    // Keep no more idle frame buffers than the incoming queue may hold
+    framePool.setMaxIdleSize(static_cast<size_t>(LimitsNP[LIMITS_BUFFER_MAX].getValue()) * 1024 * 1024);
+
+    // MJPEG Options
+    MJPEGOptionsNP[MJPEG_QUALITY  ].fill("MJPEG_QUALITY",   "Quality",           "%.0f", 1, 100,         1, 85);
+    MJPEGOptionsNP[MJPEG_BANDWIDTH].fill("MJPEG_BANDWIDTH", "Bandwidth (KiB/s)", "%.0f", 0, 1024 * 1024, 64, 0);
+    MJPEGOptionsNP[MJPEG_THREADS  ].fill("MJPEG_THREADS",   "Threads",           "%.0f", 1, 16,          1, 1);
+    MJPEGOptionsNP.fill(getDeviceName(), "STREAM_MJPEG_OPTIONS", "MJPEG", STREAM_TAB, IP_RW, 0, IPS_IDLE);
+    applyMJPEGOptions();
     return true;
 }
 
@@ -200,6 +223,7 @@ void StreamManagerPrivate::ISGetProperties(const char *dev)
         currentDevice->defineProperty(EncoderSP);
         currentDevice->defineProperty(RecorderSP);
         currentDevice->defineProperty(LimitsNP);
+        currentDevice->defineProperty(MJPEGOptionsNP);
     }
 }
 
@@ -234,6 +258,7 @@ bool StreamManagerPrivate::updateProperties()
         currentDevice->defineProperty(EncoderSP);
         currentDevice->defineProperty(RecorderSP);
         currentDevice->defineProperty(LimitsNP);
+        currentDevice->defineProperty(MJPEGOptionsNP);
     }
     else
     {
@@ -249,6 +274,7 @@ bool StreamManagerPrivate::updateProperties()
         currentDevice->deleteProperty(EncoderSP.getName());
         currentDevice->deleteProperty(RecorderSP.getName());
         currentDevice->deleteProperty(LimitsNP.getName());
+        currentDevice->deleteProperty(MJPEGOptionsNP.getName());
     }
 
     return true;
@@ -295,12 +321,12 @@ void StreamManagerPrivate::newFrame(const uint8_t * buffer, uint32_t nbytes, uin
     if (FPSFast.newFrame())
     {
         FpsNP[0].setValue(FPSFast.framesPerSecond());
-        if (fastFPSUpdate.try_lock()) // don't block stream thread / record thread
-            std::thread([&]()
+        // don't block stream thread / record thread, updates are merged while one is being sent
+        if (!fpsUpdatePending.exchange(true))
         {
-            FpsNP.apply();
-            fastFPSUpdate.unlock();
-        }).detach();
+            std::lock_guard<std::mutex> lock(fpsPublisherMutex);
+            fpsPublisherCondition.notify_one();
+        }
     }
 
     if (isStreaming || (isRecording && !isRecordingAboutToClose))
@@ -312,9 +338,15 @@ void StreamManagerPrivate::newFrame(const uint8_t * buffer, uint32_t nbytes, uin
             return;
         }
 
-        std::vector<uint8_t> copyBuffer(buffer, buffer + nbytes); // copy the frame
+        FramePool::Buffer copyBuffer = framePool.acquire(nbytes); // copy the frame
+        memcpy(copyBuffer.data(), buffer, nbytes);
 
-        framesIncoming.push(TimeFrame{FPSFast.deltaTime(), timestamp, std::move(copyBuffer)}); // push it into the queue
+        TimeFrame timeFrame {FPSFast.deltaTime(), timestamp, std::move(copyBuffer)};
+        if (framesIncoming.push(std::move(timeFrame)) == false) // push it into the queue
+        {
+            LOG_WARN("Frame queue is full, skipping frame...");
+            return;
+        }
     }
 
     if (isRecording && !isRecordingAboutToClose)
@@ -405,6 +437,13 @@ void StreamManagerPrivate::subframe(
 
     srcBuffer += srcOffset;
 
+    // Full width subframes are contiguous
+    if (srcStride == dstStride)
+    {
+        memcpy(dstBuffer, srcBuffer, dstStride * dstFrameInfo.h);
+        return;
+    }
+
     // Copy line-by-line
     for (size_t i = 0; i < dstFrameInfo.h; ++i)
     {
@@ -419,8 +458,8 @@ void StreamManagerPrivate::asyncStreamThread()
     TimeFrame sourceTimeFrame;
     sourceTimeFrame.time = 0;
 
-    std::vector<uint8_t> subframeBuffer;  // Subframe buffer for recording/streaming
-    std::vector<uint8_t> downscaleBuffer; // Downscale buffer for streaming
+    FramePool::Buffer subframeBuffer;  // Subframe buffer for recording/streaming
+    FramePool::Buffer downscaleBuffer; // Downscale buffer for streaming
 
     INDI::SingleThreadPool previewThreadPool;
     INDI::ElapsedTimer previewElapsed;
@@ -432,7 +471,7 @@ void StreamManagerPrivate::asyncStreamThread()
 
         FrameInfo srcFrameInfo = updateSourceFrameInfo();
 
-        std::vector<uint8_t> *sourceBuffer = &sourceTimeFrame.frame;
+        FramePool::Buffer *sourceBuffer = &sourceTimeFrame.frame;
 
         if (PixelFormat != INDI_JPG && sourceBuffer->size() != srcFrameInfo.totalSize())
         {
@@ -441,23 +480,31 @@ void StreamManagerPrivate::asyncStreamThread()
         }
 
         // Check if we need to subframe
-        if (
-            PixelFormat != INDI_JPG &&
-            dstFrameInfo.pixels() != 0 &&
-            dstFrameInfo != srcFrameInfo
-        )
+        bool needSubframe = (
+                                PixelFormat != INDI_JPG &&
+                                dstFrameInfo.pixels() != 0 &&
+                                dstFrameInfo != srcFrameInfo
+                            );
+
+        // The 8bit preview is subframed while downscaling, a copy of the subframe is only needed
+        // for recording or for a preview that is not downscaled
+        bool downscale = PixelFormat != INDI_JPG && PixelDepth > 8;
+        bool preview = isStreaming && FPSPreview.newFrame();
+
+        if (needSubframe && (isRecording || (preview && !downscale)))
         {
-            subframeBuffer.resize(dstFrameInfo.totalSize());
+            subframeBuffer = framePool.acquire(dstFrameInfo.totalSize());
             subframe(sourceBuffer->data(), srcFrameInfo, subframeBuffer.data(), dstFrameInfo);
 
             sourceBuffer = &subframeBuffer;
+            needSubframe = false;
         }
 
-        // For recording, save immediately.
+        // For recording, save immediately. A recording started since the subframe check begins with the next frame.
         {
             std::lock_guard<std::mutex> lock(recordMutex);
             if (
-                isRecording && !isRecordingAboutToClose &&
+                isRecording && !isRecordingAboutToClose && !needSubframe &&
                 recordStream(sourceBuffer->data(), sourceBuffer->size(), sourceTimeFrame.time, sourceTimeFrame.timestamp) == false
             )
             {
@@ -468,39 +515,75 @@ void StreamManagerPrivate::asyncStreamThread()
 
         // For streaming, downscale to 8bit if higher than 8bit to reduce bandwidth
         // You can reduce the number of frames by setting a frame limit.
-        if (isStreaming && FPSPreview.newFrame())
+        if (preview)
         {
             // Downscale to 8bit always for streaming to reduce bandwidth
-            if (PixelFormat != INDI_JPG && PixelDepth > 8)
+            if (downscale)
             {
-                // Allocale new buffer if size changes
-                downscaleBuffer.resize(dstFrameInfo.pixels());
-
-                // Apply gamma
-                gammaLut16.apply(
-                    reinterpret_cast<const uint16_t*>(sourceBuffer->data()),
-                    downscaleBuffer.size(),
-                    downscaleBuffer.data()
-                );
+                // One sample per color
+                size_t samples = dstFrameInfo.lineSize() / 2;
+                downscaleBuffer = framePool.acquire(samples * dstFrameInfo.h);
+
+                // Apply gamma, straight from the full frame if it wasn't subframed yet
+                const uint16_t *source = reinterpret_cast<const uint16_t*>(sourceBuffer->data());
+                size_t stride = samples;
+                if (needSubframe)
+                {
+                    source += srcFrameInfo.lineSize() / 2 * dstFrameInfo.y + dstFrameInfo.x * srcFrameInfo.bytesPerColor / 2;
+                    stride = srcFrameInfo.lineSize() / 2;
+                }
+                gammaLut16.apply(source, samples, dstFrameInfo.h, stride, downscaleBuffer.data());
 
                 sourceBuffer = &downscaleBuffer;
             }
 
+            // Hand the buffer over without copying, the preview thread returns it to the pool once sent.
+            // If it is still busy with the previous frame, that frame is replaced by this one.
+            {
+                std::lock_guard<std::mutex> lock(previewMutex);
+                previewFrame = std::move(*sourceBuffer);
+            }
+
             //uploadStream(sourceBuffer->data(), sourceBuffer->size());
-            previewThreadPool.start(std::bind([this, &previewElapsed](const std::atomic_bool & isAboutToQuit,
-                                              std::vector<uint8_t> frame)
+            previewThreadPool.start([this, &previewElapsed](const std::atomic_bool & isAboutToQuit)
             {
                 INDI_UNUSED(isAboutToQuit);
+                FramePool::Buffer frame;
+                {
+                    std::lock_guard<std::mutex> lock(previewMutex);
+                    std::swap(frame, previewFrame);
+                }
+                if (frame.empty())
+                    return;
+
                 previewElapsed.start();
                 uploadStream(frame.data(), frame.size());
                 StreamTimeNP[0].setValue(previewElapsed.nsecsElapsed() / 1000000000.0);
                 StreamTimeNP.apply();
-
-            }, std::placeholders::_1, std::move(*sourceBuffer)));
+            });
         }
     }
 }
 
+void StreamManagerPrivate::publisherThread()
+{
+    std::unique_lock<std::mutex> lock(fpsPublisherMutex);
+    for (;;)
+    {
+        fpsPublisherCondition.wait(lock, [this]()
+        {
+            return fpsUpdatePending || fpsPublisherTerminate;
+        });
+        if (fpsPublisherTerminate)
+            break;
+
+        lock.unlock();
+        fpsUpdatePending = false;
+        FpsNP.apply();
+        lock.lock();
+    }
+}
+
 void StreamManagerPrivate::setSize(uint16_t width, uint16_t height)
 {
     if (width != StreamFrameNP[CCDChip::FRAME_W].getValue() || height != StreamFrameNP[CCDChip::FRAME_H].getValue())
@@ -539,6 +622,20 @@ void StreamManagerPrivate::setSize(uint16_t width, uint16_t height)
         oneRecorder->setSize(rawWidth, rawHeight);
 }
 
+void StreamManagerPrivate::applyMJPEGOptions()
+{
+    for (EncoderInterface * oneEncoder : encoderManager.getEncoderList())
+    {
+        MJPEGEncoder *mjpeg = dynamic_cast<MJPEGEncoder *>(oneEncoder);
+        if (mjpeg == nullptr)
+            continue;
+
+        mjpeg->setQuality(static_cast<int>(MJPEGOptionsNP[MJPEG_QUALITY].getValue()));
+        mjpeg->setMaxBandwidth(MJPEGOptionsNP[MJPEG_BANDWIDTH].getValue() * 1024);
+        mjpeg->setThreads(static_cast<int>(MJPEGOptionsNP[MJPEG_THREADS].getValue()));
+    }
+}
+
 bool StreamManager::close()
 {
     D_PTR(StreamManager);
@@ -666,6 +763,18 @@ bool StreamManagerPrivate::startRecording()
                   strerror(errno));
         return false;
     }
+    // Let the SER recorder reserve disk space for the whole record
+    SER_Recorder *serRecorder = dynamic_cast<SER_Recorder *>(recorder);
+    if (serRecorder != nullptr)
+    {
+        uint32_t expectedFrames = 0;
+        if (RecordStreamSP[RECORD_FRAME].getState() == ISS_ON)
+            expectedFrames = static_cast<uint32_t>(RecordOptionsNP[1].getValue());
+        else if (RecordStreamSP[RECORD_TIME].getState() == ISS_ON)
+            expectedFrames = static_cast<uint32_t>(RecordOptionsNP[0].getValue() * FpsNP[FPS_AVERAGE].getValue());
+        serRecorder->setExpectedFrameCount(expectedFrames);
+    }
+
     if (!recorder->open(filename.c_str(), errmsg))
     {
         RecordStreamSP.setState(IPS_ALERT);
@@ -747,11 +856,19 @@ bool StreamManagerPrivate::stopRecording(bool force)
     isRecording = false;
     isRecordingAboutToClose = false;
 
+    bool closed;
     {
         std::lock_guard<std::mutex> lock(recordMutex);
-        recorder->close();
+        closed = recorder->close();
     }
 
+    if (!closed)
+        LOG_ERROR("Failed to write the end of the record file.");
+
+    SER_Recorder *serRecorder = dynamic_cast<SER_Recorder *>(recorder);
+    if (serRecorder != nullptr && serRecorder->getDroppedFrames() > 0)
+        LOGF_WARN("%u frames were dropped, the disk could not keep up.", serRecorder->getDroppedFrames());
+
     if (force)
         return false;
 
@@ -957,11 +1074,23 @@ bool StreamManagerPrivate::ISNewNumber(const char * dev, const char * name, doub
         FPSPreview.setTimeWindow(1000.0 / LimitsNP[LIMITS_PREVIEW_FPS].getValue());
         FPSPreview.reset();
 
+        framePool.setMaxIdleSize(static_cast<size_t>(LimitsNP[LIMITS_BUFFER_MAX].getValue()) * 1024 * 1024);
+
         LimitsNP.setState(IPS_OK);
         LimitsNP.apply();
         return true;
     }
 
+    /* MJPEG Options */
+    if (MJPEGOptionsNP.isNameMatch(name))
+    {
+        MJPEGOptionsNP.update(values, names, n);
+        applyMJPEGOptions();
+        MJPEGOptionsNP.setState(IPS_OK);
+        MJPEGOptionsNP.apply();
+        return true;
+    }
+
     /* Record Options */
     if (RecordOptionsNP.isNameMatch(name))
     {
@@ -1118,6 +1247,10 @@ bool StreamManagerPrivate::setStream(bool enable)
             FpsNP[FPS_INSTANT].setValue(0);
             FpsNP[FPS_AVERAGE].setValue(0);
 
+            // Give the frame buffers back unless recording still needs them
+            if (!isRecording)
+                framePool.clear();
+
             recorder->setStreamEnabled(false);
         }
     }
@@ -1140,6 +1273,7 @@ bool StreamManager::saveConfigItems(FILE * fp)
     d->RecordOptionsNP.save(fp);
     d->RecorderSP.save(fp);
     d->LimitsNP.save(fp);
+    d->MJPEGOptionsNP.save(fp);
     return true;
 }
 
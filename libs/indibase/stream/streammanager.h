@@ -56,6 +56,8 @@
    1. RAW Encoder: Frame is sent as is (lossless). If compression is enabled, the frame is compressed with zlib. Uncompressed format is ".stream"
    and compressed format is ".stream.z"
    2. MJPEG Encoder: Frame is encoded to a JPEG image before being transmitted. Format is ".stream_jpg"
+   The STREAM_MJPEG_OPTIONS property sets the JPEG quality, a bandwidth limit the quality is lowered to fit in, and the number
+   of threads encoding each frame.
 
    \section Recorders
 
@@ -114,6 +116,7 @@ class StreamManager
     public:
         /**
          * @brief newFrame CCD drivers call this function when a new frame is received. It is then streamed, or recorded, or both according to the settings in the streamer.
+         * Frames must be delivered from one thread at a time, they are handed to the stream thread through a single producer ring.
          */
         void newFrame(const uint8_t *buffer, uint32_t nbytes, uint64_t timestamp = 0);
 
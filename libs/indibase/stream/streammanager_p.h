@@ -27,10 +27,12 @@
 #include "recorder/recordermanager.h"
 #include "encoder/encodermanager.h"
 #include "fpsmeter.h"
-#include "uniquequeue.h"
+#include "framepool.h"
+#include "spscring.h"
 #include "gammalut16.h"
 
 #include <atomic>
+#include <condition_variable>
 #include <string>
 #include <map>
 #include <thread>
@@ -125,6 +127,11 @@ class StreamManagerPrivate
          */
         void asyncStreamThread();
 
+        /**
+         * @brief Thread sending the measured FPS, so the camera thread never blocks on the client connection
+         */
+        void publisherThread();
+
         // helpers
         static std::string expand(const std::string &fname, const std::map<std::string, std::string> &patterns);
 
@@ -149,6 +156,9 @@ class StreamManagerPrivate
         bool recordStream(const uint8_t *buffer, uint32_t nbytes, double deltams, uint64_t timestamp);
 
         void getStreamFrame(uint16_t * x, uint16_t * y, uint16_t * w, uint16_t * h) const;
+
+        // Pass the MJPEG options to the MJPEG encoders
+        void applyMJPEGOptions();
         void setStreamFrame(uint16_t x, uint16_t y, uint16_t w, uint16_t h);
         void setStreamFrame(const FrameInfo &frameInfo);
 
@@ -216,6 +226,10 @@ class StreamManagerPrivate
         INDI::PropertyNumber LimitsNP {2};
         enum { LIMITS_BUFFER_MAX, LIMITS_PREVIEW_FPS };
 
+        // MJPEG preview. Highest quality, bandwidth to adapt the quality to (0 to keep it fixed), encoding threads
+        INDI::PropertyNumber MJPEGOptionsNP {3};
+        enum { MJPEG_QUALITY, MJPEG_BANDWIDTH, MJPEG_THREADS };
+
         std::atomic<bool> isStreaming { false };
         std::atomic<bool> isRecording { false };
         std::atomic<bool> isRecordingAboutToClose { false };
@@ -249,14 +263,23 @@ class StreamManagerPrivate
         {
             double time;
             uint64_t timestamp;
-            std::vector<uint8_t> frame;
+            FramePool::Buffer frame;
         } TimeFrame;
 
+        FramePool                framePool;      // recycled buffers of incoming, subframed and preview frames
         std::thread              framesThread;   // async incoming frames processing
         std::atomic<bool>        framesThreadTerminate {false};
-        UniqueQueue<TimeFrame>   framesIncoming;
+        SPSCRing<TimeFrame>      framesIncoming {4096}; // camera thread -> frames thread
+
+        std::mutex               previewMutex;
+        FramePool::Buffer        previewFrame;   // latest frame handed to the preview thread
+
+        std::thread              fpsPublisher;
+        std::mutex               fpsPublisherMutex;
+        std::condition_variable  fpsPublisherCondition;
+        std::atomic<bool>        fpsUpdatePending {false};
+        bool                     fpsPublisherTerminate {false};
 
-        std::mutex               fastFPSUpdate;
         std::mutex               recordMutex;
 
         GammaLut16               gammaLut16;
@@ -389,7 +389,10 @@ int V4L2_Base::connectCam(const char * devpath, char * errmsg, int pixelFormat,
 void V4L2_Base::disconnectCam(bool stopcapture)
 {
     if (selectCallBackID != -1)
+    {
         rmCallback(selectCallBackID);
+        selectCallBackID = -1;
+    }
 
     if (stopcapture)
     {
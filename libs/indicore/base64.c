@@ -39,6 +39,8 @@
 #include "base64.h"
 #include "base64_luts.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 /* 
  * as byteswap.h is not available on macos, add macro here
@@ -56,6 +58,328 @@
 
 #define  IS_LITTLE_ENDIAN  (!IS_BIG_ENDIAN)
 
+/* SIMD kernels, selected at runtime according to the CPU features.
+ * Each kernel handles as many whole groups (3 bytes <-> 4 chars) as it can and
+ * returns the number of groups processed; the scalar code takes care of the rest.
+ * Muła & Lemire, "Faster Base64 Encoding and Decoding using AVX2 Instructions".
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define BASE64_SIMD_X86
+#include <immintrin.h>
+#endif
+
+/* encode ngroups * 3 bytes at in to ngroups * 4 chars at out, scalar version */
+static void enc_groups_scalar(unsigned char *out, const unsigned char *in, size_t ngroups)
+{
+    const uint16_t *b64lut = (const uint16_t *)base64lut;
+
+    for (; ngroups > 0; ngroups--)
+    {
+        uint32_t n = in[0] << 16 | in[1] << 8 | in[2];
+
+        /* out is not aligned when line breaks are inserted */
+        memcpy(out, &b64lut[n >> 12], 2);
+        memcpy(out + 2, &b64lut[n & 0x00000fff], 2);
+
+        out += 4;
+        in += 3;
+    }
+}
+
+/* decode one group of 4 chars at in to 3 bytes at out, scalar version */
+static void dec_group_scalar(char *out, const char *in)
+{
+    uint16_t inp[2];
+    uint16_t s1, s2;
+    uint32_t n32;
+
+    memcpy(inp, in, sizeof(inp));
+    if IS_BIG_ENDIAN
+    {
+        inp[0] = bswap_16(inp[0]);
+        inp[1] = bswap_16(inp[1]);
+    }
+    s1 = rbase64lut[inp[0]];
+    s2 = rbase64lut[inp[1]];
+
+    n32 = s1;
+    n32 <<= 10;
+    n32 |= s2 >> 2;
+
+    out[2] = (n32 & 0x00ff);
+    n32 >>= 8;
+    out[1] = (n32 & 0x00ff);
+    n32 >>= 8;
+    out[0] = (n32 & 0x00ff);
+}
+
+#ifdef BASE64_SIMD_X86
+
+/* 6 bits indexes to base64 alphabet */
+__attribute__((target("ssse3")))
+static __m128i enc_translate_ssse3(__m128i idx)
+{
+    const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    __m128i result = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+    __m128i less   = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+    result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+    return _mm_add_epi8(_mm_shuffle_epi8(shift, result), idx);
+}
+
+/* spread 12 bytes to 16 6 bits indexes */
+__attribute__((target("ssse3")))
+static __m128i enc_reshuffle_ssse3(__m128i in)
+{
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+    __m128i t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(t0, t1);
+}
+
+__attribute__((target("ssse3")))
+static size_t enc_groups_ssse3(unsigned char *out, const unsigned char *in, size_t ngroups)
+{
+    size_t done = 0;
+
+    /* 16 bytes are loaded for 12 used: keep enough input behind */
+    while (ngroups - done >= 6)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)in);
+        _mm_storeu_si128((__m128i *)out, enc_translate_ssse3(enc_reshuffle_ssse3(v)));
+        in += 12;
+        out += 16;
+        done += 4;
+    }
+    return done;
+}
+
+__attribute__((target("avx2")))
+static size_t enc_groups_avx2(unsigned char *out, const unsigned char *in, size_t ngroups)
+{
+    const __m256i shuf = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                                          1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+                                           'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    size_t done = 0;
+
+    /* two lanes of 12 bytes, the second load reads up to in + 28 */
+    while (ngroups - done >= 10)
+    {
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)in)),
+                                            _mm_loadu_si128((const __m128i *)(in + 12)), 1);
+        v = _mm256_shuffle_epi8(v, shuf);
+        __m256i t0  = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)),
+                                         _mm256_set1_epi32(0x04000040));
+        __m256i t1  = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)),
+                                         _mm256_set1_epi32(0x01000010));
+        __m256i idx = _mm256_or_si256(t0, t1);
+
+        __m256i result = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+        __m256i less   = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+        result = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        result = _mm256_add_epi8(_mm256_shuffle_epi8(shift, result), idx);
+
+        _mm256_storeu_si256((__m256i *)out, result);
+        in += 24;
+        out += 32;
+        done += 8;
+    }
+    return done + enc_groups_ssse3(out, in, ngroups - done);
+}
+
+/* Check 16 chars are all in the base64 alphabet and convert them to their 6 bits values.
+ * return 0 if any char is invalid ('=', '\n', ...)
+ */
+__attribute__((target("ssse3")))
+static int dec_translate_ssse3(__m128i *str)
+{
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                         0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                         0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2F  = _mm_set1_epi8(0x2F);
+
+    __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(*str, 4), mask_2F);
+    __m128i lo_nibbles = _mm_and_si128(*str, mask_2F);
+    __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+    __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xFFFF)
+        return 0;
+
+    __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(*str, mask_2F), hi_nibbles));
+    *str = _mm_add_epi8(*str, roll);
+    return 1;
+}
+
+/* pack 16 6 bits values to 12 bytes at the start of the register */
+__attribute__((target("ssse3")))
+static __m128i dec_reshuffle_ssse3(__m128i in)
+{
+    __m128i merged = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+    __m128i out    = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+    return _mm_shuffle_epi8(out, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+/* Decode 4 groups. Stops (returning 0) on invalid chars, that are left to the scalar code */
+__attribute__((target("ssse3")))
+static int dec_block_ssse3(char *out, const char *in)
+{
+    __m128i str = _mm_loadu_si128((const __m128i *)in);
+    if (!dec_translate_ssse3(&str))
+        return 0;
+    _mm_storeu_si128((__m128i *)out, dec_reshuffle_ssse3(str));
+    return 4;
+}
+
+/* Decode 8 groups. */
+__attribute__((target("avx2")))
+static int dec_block_avx2(char *out, const char *in)
+{
+    const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+                                            0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                            0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                              0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2F  = _mm256_set1_epi8(0x2F);
+
+    __m256i str = _mm256_loadu_si256((const __m256i *)in);
+    __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2F);
+    __m256i lo_nibbles = _mm256_and_si256(str, mask_2F);
+    __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+    __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+
+    if (!_mm256_testz_si256(lo, hi))
+        return 0;
+
+    __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(str, mask_2F), hi_nibbles));
+    str = _mm256_add_epi8(str, roll);
+
+    __m256i merged = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+    __m256i packed = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+    packed = _mm256_shuffle_epi8(packed, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    /* each lane holds 12 bytes */
+    _mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(packed));
+    _mm_storeu_si128((__m128i *)(out + 12), _mm256_extracti128_si256(packed, 1));
+    return 8;
+}
+
+/* Decode as many groups as possible out of ngroups, skipping a '\n' at the start of groups
+ * like the scalar code does. Advance in and out accordingly.
+ */
+__attribute__((target("ssse3")))
+static size_t dec_groups_ssse3(char **out, const char **in, size_t ngroups)
+{
+    size_t done = 0;
+
+    /* 16 bytes are stored for 12 used: keep enough output behind */
+    while (ngroups - done >= 6)
+    {
+        if (**in == '\n')
+            (*in)++;
+        if (!dec_block_ssse3(*out, *in))
+            break;
+        *in += 16;
+        *out += 12;
+        done += 4;
+    }
+    return done;
+}
+
+__attribute__((target("avx2")))
+static size_t dec_groups_avx2(char **out, const char **in, size_t ngroups)
+{
+    size_t done = 0;
+
+    while (ngroups - done >= 6)
+    {
+        int n;
+        if (**in == '\n')
+            (*in)++;
+        n = (ngroups - done >= 10) ? dec_block_avx2(*out, *in) : 0;
+        if (n == 0)
+            n = dec_block_ssse3(*out, *in);
+        if (n == 0)
+            break;
+        *in += 4 * n;
+        *out += 3 * n;
+        done += n;
+    }
+    return done;
+}
+
+#endif
+
+static size_t enc_groups_none(unsigned char *out, const unsigned char *in, size_t ngroups)
+{
+    (void)out;
+    (void)in;
+    (void)ngroups;
+    return 0;
+}
+
+static size_t dec_groups_none(char **out, const char **in, size_t ngroups)
+{
+    (void)out;
+    (void)in;
+    (void)ngroups;
+    return 0;
+}
+
+/* resolved once when the library is loaded, before any thread can use them */
+static size_t (*enc_groups_simd)(unsigned char *out, const unsigned char *in, size_t ngroups) = enc_groups_none;
+static size_t (*dec_groups_simd)(char **out, const char **in, size_t ngroups) = dec_groups_none;
+
+#ifdef BASE64_SIMD_X86
+__attribute__((constructor))
+static void select_kernels(void)
+{
+    __builtin_cpu_init();
+    if (getenv("INDI_BASE64_NOSIMD") != NULL)
+        return;
+    if (__builtin_cpu_supports("avx2"))
+    {
+        enc_groups_simd = enc_groups_avx2;
+        dec_groups_simd = dec_groups_avx2;
+    }
+    else if (__builtin_cpu_supports("ssse3"))
+    {
+        enc_groups_simd = enc_groups_ssse3;
+        dec_groups_simd = dec_groups_ssse3;
+    }
+}
+#endif
+
+/* encode ngroups whole groups */
+static void enc_groups(unsigned char *out, const unsigned char *in, size_t ngroups)
+{
+    size_t done = enc_groups_simd(out, in, ngroups);
+    enc_groups_scalar(out + 4 * done, in + 3 * done, ngroups - done);
+}
+
+/* encode the last 1 or 2 bytes, with padding */
+static void enc_tail(unsigned char *out, const unsigned char *in, int inlen)
+{
+    unsigned char fragment;
+    *out++   = base64digits[in[0] >> 2];
+    fragment = (in[0] << 4) & 0x30;
+    if (inlen > 1)
+        fragment |= in[1] >> 4;
+    *out++ = base64digits[fragment];
+    *out++ = (inlen < 2) ? '=' : base64digits[(in[1] << 2) & 0x3c];
+    *out++ = '=';
+}
+
 /* convert inlen raw bytes at in to base64 string (NUL-terminated) at out. 
  * out size should be at least 4*inlen/3 + 4.
  * return length of out (sans trailing NUL).
@@ -76,35 +400,146 @@ int to64frombits_s(unsigned char *out, const unsigned char *in, int inlen, size_
 
 int to64frombits(unsigned char *out, const unsigned char *in, int inlen)
 {
-    uint16_t *b64lut = (uint16_t *)base64lut;
-    int dlen         = ((inlen + 2) / 3) * 4; /* 4/3, rounded up */
-    uint16_t *wbuf   = (uint16_t *)out;
+    int dlen       = ((inlen + 2) / 3) * 4; /* 4/3, rounded up */
+    size_t ngroups = inlen / 3;
+
+    enc_groups(out, in, ngroups);
+    out += 4 * ngroups;
+    in += 3 * ngroups;
+    inlen -= 3 * ngroups;
 
-    for (; inlen > 2; inlen -= 3)
+    if (inlen > 0)
     {
-        uint32_t n = in[0] << 16 | in[1] << 8 | in[2];
+        enc_tail(out, in, inlen);
+        out += 4;
+    }
+    *out = 0; // NULL terminate
+    return dlen;
+}
 
-        wbuf[0] = b64lut[n >> 12];
-        wbuf[1] = b64lut[n & 0x00000fff];
+size_t to64frombits_lines_bound(size_t inlen, int linelen)
+{
+    size_t dlen = ((inlen + 2) / 3) * 4;
+    if (linelen > 0)
+        dlen += (dlen + linelen - 1) / linelen;
+    return dlen;
+}
 
-        wbuf += 2;
-        in += 3;
+int to64frombits_lines_s(unsigned char *out, const unsigned char *in, int inlen, size_t outlen, int linelen)
+{
+    base64_stream stream;
+    size_t l;
+
+    if (to64frombits_lines_bound(inlen, linelen) > outlen)
+        return 0;
+
+    to64frombits_stream_init(&stream, linelen);
+    l = to64frombits_stream_update(&stream, out, in, inlen);
+    l += to64frombits_stream_finish(&stream, out + l);
+    return (int)l;
+}
+
+void to64frombits_stream_init(base64_stream *stream, int linelen)
+{
+    memset(stream, 0, sizeof(*stream));
+    /* lines are made of whole groups */
+    stream->linelen = linelen > 0 ? (linelen / 4) * 4 : 0;
+    if (linelen > 0 && stream->linelen == 0)
+        stream->linelen = 4;
+}
+
+size_t to64frombits_stream_bound(const base64_stream *stream, size_t inlen)
+{
+    size_t groups = (stream->ntail + inlen) / 3;
+    size_t dlen   = 4 * groups;
+    if (stream->linelen > 0)
+        dlen += (stream->column + dlen) / stream->linelen;
+    return dlen;
+}
+
+/* encode whole groups, breaking lines as needed */
+static size_t stream_groups(base64_stream *stream, unsigned char *out, const unsigned char *in, size_t ngroups)
+{
+    unsigned char *start = out;
+
+    if (stream->linelen == 0)
+    {
+        enc_groups(out, in, ngroups);
+        return 4 * ngroups;
     }
 
-    out = (unsigned char *)wbuf;
-    if (inlen > 0)
+    while (ngroups > 0)
     {
-        unsigned char fragment;
-        *out++   = base64digits[in[0] >> 2];
-        fragment = (in[0] << 4) & 0x30;
-        if (inlen > 1)
-            fragment |= in[1] >> 4;
-        *out++ = base64digits[fragment];
-        *out++ = (inlen < 2) ? '=' : base64digits[(in[1] << 2) & 0x3c];
-        *out++ = '=';
+        size_t n = (stream->linelen - stream->column) / 4;
+        if (n > ngroups)
+            n = ngroups;
+
+        enc_groups(out, in, n);
+        out += 4 * n;
+        in += 3 * n;
+        ngroups -= n;
+
+        stream->column += 4 * n;
+        if (stream->column == stream->linelen)
+        {
+            *out++ = '\n';
+            stream->column = 0;
+        }
     }
-    *out = 0; // NULL terminate
-    return dlen;
+    return out - start;
+}
+
+size_t to64frombits_stream_update(base64_stream *stream, unsigned char *out, const unsigned char *in, size_t inlen)
+{
+    size_t l = 0;
+    size_t ngroups;
+
+    /* complete the pending group first */
+    if (stream->ntail > 0)
+    {
+        while (stream->ntail < 3 && inlen > 0)
+        {
+            stream->tail[stream->ntail++] = *in++;
+            inlen--;
+        }
+        if (stream->ntail < 3)
+            return 0;
+
+        l += stream_groups(stream, out, stream->tail, 1);
+        stream->ntail = 0;
+    }
+
+    ngroups = inlen / 3;
+    l += stream_groups(stream, out + l, in, ngroups);
+    in += 3 * ngroups;
+    inlen -= 3 * ngroups;
+
+    /* keep the remaining bytes for next time */
+    memcpy(stream->tail, in, inlen);
+    stream->ntail = inlen;
+
+    return l;
+}
+
+size_t to64frombits_stream_finish(base64_stream *stream, unsigned char *out)
+{
+    size_t l = 0;
+
+    if (stream->ntail > 0)
+    {
+        enc_tail(out, stream->tail, stream->ntail);
+        l += 4;
+        stream->column += 4;
+        stream->ntail = 0;
+    }
+
+    /* every line is terminated, including the last one */
+    if (stream->linelen > 0 && stream->column > 0)
+    {
+        out[l++] = '\n';
+        stream->column = 0;
+    }
+    return l;
 }
 
 /* convert base64 at in to raw bytes out, returning count or <0 on error.
@@ -122,74 +557,50 @@ int from64tobits(char *out, const char *in)
 int from64tobits_fast(char *out, const char *in, int inlen)
 {
     int outlen = 0;
-    uint8_t b1, b2, b3;
-    uint16_t s1, s2;
-    uint32_t n32;
+    uint16_t inp[2];
     int j;
     int n         = (inlen / 4) - 1;
-    uint16_t *inp = (uint16_t *)in;
 
-    for (j = 0; j < n; j++)
+    for (j = 0; j < n;)
     {
+        /* bulk of the work, stops on line breaks and invalid chars */
+        size_t done = dec_groups_simd(&out, &in, n - j);
+        if (done > 0)
+        {
+            j += done;
+            continue;
+        }
+
         if (in[0] == '\n')
             in++;
-        inp = (uint16_t *)in;
-
-        if IS_BIG_ENDIAN {
-         inp[0]=bswap_16(inp[0]);
-         inp[1]=bswap_16(inp[1]);
-       }
-        s1 = rbase64lut[inp[0]];
-        s2 = rbase64lut[inp[1]];
 
-        n32 = s1;
-        n32 <<= 10;
-        n32 |= s2 >> 2;
-
-        b3 = (n32 & 0x00ff);
-        n32 >>= 8;
-        b2 = (n32 & 0x00ff);
-        n32 >>= 8;
-        b1 = (n32 & 0x00ff);
-
-        out[0] = b1;
-        out[1] = b2;
-        out[2] = b3;
+        dec_group_scalar(out, in);
 
         in += 4;
         out += 3;
+        j++;
     }
     outlen = (inlen / 4 - 1) * 3;
     if (in[0] == '\n')
         in++;
-    inp = (uint16_t *)in;
+    memcpy(inp, in, sizeof(inp));
     if IS_BIG_ENDIAN {
       inp[0]=bswap_16(inp[0]);
       inp[1]=bswap_16(inp[1]);
     }
 
-    s1 = rbase64lut[inp[0]];
-    s2 = rbase64lut[inp[1]];
-
-    n32 = s1;
-    n32 <<= 10;
-    n32 |= s2 >> 2;
-
-    b3 = (n32 & 0x00ff);
-    n32 >>= 8;
-    b2 = (n32 & 0x00ff);
-    n32 >>= 8;
-    b1 = (n32 & 0x00ff);
+    char last[3];
+    dec_group_scalar(last, in);
 
-    *out++ = b1;
+    *out++ = last[0];
     outlen++;
     if ((inp[1] & 0x00FF) != 0x003D)
     {
-        *out++ = b2;
+        *out++ = last[1];
         outlen++;
         if ((inp[1] & 0xFF00) != 0x3D00)
         {
-            *out++ = b3;
+            *out++ = last[2];
             outlen++;
         }
     }
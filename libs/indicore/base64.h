@@ -48,6 +48,47 @@ __attribute__((deprecated("unsafe function, use to64frombits_s instead")))
 #endif
 extern int to64frombits(unsigned char *out, const unsigned char *in, int inlen);
 
+/** \brief Convert bytes array to base64, with a newline after every linelen chars.
+    \param out output buffer in base64. The buffer size must be at least to64frombits_lines_bound(inlen, linelen) bytes long.
+    \param in input binary buffer
+    \param inlen number of bytes to convert
+    \param outlen size of out
+    \param linelen line length, rounded down to a multiple of 4. 0 for no line breaks.
+    \return number of chars written, including newlines. 0 if out is too small.
+    \note Every line, including the last one, is terminated by a newline. out is not NUL terminated.
+ */
+extern int to64frombits_lines_s(unsigned char *out, const unsigned char *in, int inlen, size_t outlen, int linelen);
+
+/** \brief Return the size of the output of to64frombits_lines_s. */
+extern size_t to64frombits_lines_bound(size_t inlen, int linelen);
+
+/** \brief State of an incremental base64 encoding. */
+typedef struct
+{
+    unsigned char tail[3]; /* bytes not yet encoded */
+    int ntail;
+    int linelen;           /* 0 for no line breaks */
+    int column;            /* chars in the current line */
+} base64_stream;
+
+/** \brief Start an incremental base64 encoding, with a newline after every linelen chars (0 for none). */
+extern void to64frombits_stream_init(base64_stream *stream, int linelen);
+
+/** \brief Return the maximum number of chars that to64frombits_stream_update can write for inlen more bytes. */
+extern size_t to64frombits_stream_bound(const base64_stream *stream, size_t inlen);
+
+/** \brief Encode inlen more bytes.
+    \param out output buffer, at least to64frombits_stream_bound(stream, inlen) bytes long.
+    \return number of chars written. Up to 2 bytes may be kept in the stream for the next call.
+ */
+extern size_t to64frombits_stream_update(base64_stream *stream, unsigned char *out, const unsigned char *in, size_t inlen);
+
+/** \brief Encode the pending bytes with padding and terminate the last line.
+    \param out output buffer, at least 5 bytes long.
+    \return number of chars written.
+ */
+extern size_t to64frombits_stream_finish(base64_stream *stream, unsigned char *out);
+
 /** \brief Convert base64 to bytes array.
     \param out output buffer in bytes. The buffer size must be at least (3 * size_of_in_buffer / 4) bytes long.
     \param in input base64 buffer
@@ -316,6 +316,8 @@ typedef void(IE_WPF)(void *userpointer);
  *  @param fp a pointer to the callback function.
  *  @param userpointer a pointer to be passed to the callback function when called.
  *  @return a unique callback id for use with IERmCallback().
+ *  @note Remove the callback with IERmCallback() before closing \e readfiledes. If it is closed and
+ *  reopened, even with the same number, it must be registered again.
  */
 extern int IEAddCallback(int readfiledes, IE_CBF *fp, void *userpointer);
 
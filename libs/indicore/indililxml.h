@@ -456,7 +456,9 @@ inline LilXmlElement LilXmlDocument::root() const
 
 inline LilXmlParser::LilXmlParser()
     : mHandle(newLilXML(), [](LilXML *handle) { delLilXML(handle); })
-{ }
+{
+    setArenaLilXML(mHandle.get(), 1);
+}
 
 inline LilXmlDocument LilXmlParser::readFromFile(FILE *file)
 {
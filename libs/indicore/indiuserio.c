@@ -25,6 +25,34 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* inline BLOBs are sent as lines of base64 */
+#define BLOB_LINE_LENGTH  72
+/* number of lines encoded at once */
+#define BLOB_ENCODE_LINES 256
+/* bytes of blob for BLOB_ENCODE_LINES lines */
+#define BLOB_ENCODE_SLICE (BLOB_ENCODE_LINES * BLOB_LINE_LENGTH / 4 * 3)
+
+/* Encode one slice (or the tail, if len is 0) in place when the output allows it, through encbuf otherwise */
+static int s_userio_base64_slice(
+    const userio *io, void *user, base64_stream *stream, unsigned char *encbuf, const unsigned char *src, size_t len
+)
+{
+    size_t l;
+
+    if (io->reserve && io->commit)
+    {
+        unsigned char *dst = io->reserve(user, len ? to64frombits_stream_bound(stream, len) : 5);
+        l = len ? to64frombits_stream_update(stream, dst, src, len) : to64frombits_stream_finish(stream, dst);
+        io->commit(user, l);
+        return 0;
+    }
+
+    l = len ? to64frombits_stream_update(stream, encbuf, src, len) : to64frombits_stream_finish(stream, encbuf);
+    if (l > 0 && userio_write(io, user, encbuf, l) <= 0)
+        return -1;
+    return 0;
+}
+
 static void s_userio_xml_message_vprintf(const userio *io, void *user, const char *fmt, va_list ap)
 {
     char message[MAXINDIMESSAGE];
@@ -103,9 +131,6 @@ void IUUserIOBLOBContextOne(
     const char *name, unsigned int size, unsigned int bloblen, const void *blob, const char *format
 )
 {
-    unsigned char *encblob;
-    int l;
-
     userio_prints    (io, user, "  <oneBLOB\n"
                                 "    name='");
     userio_xml_escape(io, user, name);
@@ -130,39 +155,29 @@ void IUUserIOBLOBContextOne(
 
             io->joinbuff(user, "    attached='true'>\n", (void*)blob, bloblen);
         } else {
-            size_t sz = 4 * bloblen / 3 + 4;
-            assert_mem(encblob = (unsigned char *)malloc(sz)); // #PS: TODO
-            l = to64frombits_s(encblob, blob, bloblen, sz);
-            if (l == 0) {
-                fprintf(stderr, "%s: Not enough memory for decoding.\n", __func__);
-                exit(1);
-            }
-            userio_printf    (io, user, "    enclen='%d'\n", l); // safe
+            /* Encode slices of the blob to a bounded buffer, with line breaks, rather than a full copy */
+            unsigned char encbuf[BLOB_ENCODE_LINES * (BLOB_LINE_LENGTH + 1)];
+            const unsigned char *src = blob;
+            unsigned int remaining = bloblen;
+            base64_stream stream;
+
+            userio_printf    (io, user, "    enclen='%u'\n", 4 * ((bloblen + 2) / 3)); // safe
             userio_prints    (io, user, "    format='");
             userio_xml_escape(io, user, format);
             userio_prints    (io, user, "'>\n");
-            size_t written = 0;
-            // FIXME: this is not efficient. The CR/LF imply one more copy... Do we need them ?
-            while ((int)written < l)
+
+            to64frombits_stream_init(&stream, BLOB_LINE_LENGTH);
+            while (remaining > 0)
             {
-                size_t towrite = ((l - written) > 72) ? 72 : l - written;
-                size_t wr      = userio_write(io, user, encblob + written, towrite);
+                size_t slice = remaining > BLOB_ENCODE_SLICE ? BLOB_ENCODE_SLICE : remaining;
 
-                if (wr == 0)
-                {
-                    free(encblob);
+                if (s_userio_base64_slice(io, user, &stream, encbuf, src, slice) < 0)
                     return;
-                }
 
-                written += wr;
-                if ((written % 72) == 0)
-                    userio_putc(io, user, '\n');
+                src += slice;
+                remaining -= slice;
             }
-
-            if ((written % 72) != 0)
-                userio_putc(io, user, '\n');
-
-            free(encblob);
+            s_userio_base64_slice(io, user, &stream, encbuf, NULL, 0);
         }
     }
 
@@ -45,7 +45,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110 - 1301  USA
 
 #include "lilxml.h"
 
-/* used to efficiently manage growing malloced string space */
+/* used to efficiently manage growing malloced string space.
+ * sm == 0 with s set means s is a slice of an arena, copied out on first change.
+ */
 typedef struct
 {
     char *s; /* malloced memory for string */
@@ -54,6 +56,12 @@ typedef struct
 } String;
 #define MINMEM 64 /* starting string length */
 
+#define ARENA_TEXT_MIN  4096 /* starting size of the text of a document in arena mode */
+#define ARENA_BLOCK_MIN 4096 /* minimum size of extra arena blocks */
+#define BLOB_PREALLOC_MAX (4 << 20) /* enclen is not trusted for more, content grows past it */
+
+typedef struct xml_arena_ XMLArena;
+
 static int oneXMLchar(LilXML *lp, int c, char ynot[]);
 static void initParser(LilXML *lp);
 static void pushXMLEle(LilXML *lp);
@@ -67,8 +75,13 @@ static void growString(String *sp, int c);
 static void appendString(String *sp, const char *str);
 static void freeString(String *sp);
 static void newString(String *sp);
+static void ownString(String *sp, int n);
 static void *moremem(void *old, size_t n);
 static void appXMLEle(XMLEle *ep, XMLEle *newep);
+static void *growList(void *list, int n, size_t size, int *inarena);
+static int scanXMLChunk(LilXML *lp, const char *buf, int size, XMLEle **root, char ynot[]);
+static void resetScanner(LilXML *lp);
+static void freeArena(XMLArena *a);
 
 typedef enum
 {
@@ -89,6 +102,33 @@ typedef enum
     INCLOSETAG      /* reading closing tag */
 } State;            /* parsing states */
 
+typedef enum
+{
+    SCAN_OUT = 0,   /* between documents, looking for < */
+    SCAN_DECL,      /* skipping <? or <! between documents */
+    SCAN_LT,        /* saw < */
+    SCAN_TAG,       /* in an opening tag */
+    SCAN_CLOSETAG,  /* in a closing tag */
+    SCAN_SKIP,      /* skipping <? or <! in a document */
+    SCAN_CONTENT    /* in content, looking for < */
+} ScanState;        /* arena mode scanning states */
+
+/* arena mode: only find where the current document ends, it is parsed at once when complete */
+typedef struct
+{
+    int on;         /* arena mode is enabled */
+    ScanState ss;   /* current state */
+    int delim;      /* attribute value delimiter, 0 if not in a value */
+    int lastc;      /* last char seen in markup */
+    size_t mark;    /* offset of the last < */
+    size_t *open;   /* offsets of the tags of the open elements */
+    int nopen;      /* number of open elements */
+    int mopen;      /* room in open[] */
+    char *text;     /* document read so far */
+    size_t len;     /* bytes in text */
+    size_t size;    /* malloced bytes for text */
+} Scanner;
+
 /* maintain state while parsing */
 struct LilXML_
 {
@@ -101,6 +141,21 @@ struct LilXML_
     int lastc;     /* last char (just used with skipping)*/
     int skipping;  /* in comment or declaration */
     int inblob;    /* in oneBLOB element */
+    Scanner scan;  /* arena mode state, survives initParser */
+};
+
+/* memory of one document parsed in arena mode.
+ * elements, attributes and their lists are carved out of blocks, strings are slices of text.
+ * everything goes at once when the root element is deleted.
+ */
+struct xml_arena_
+{
+    XMLEle *root;       /* element owning the arena */
+    char *text;         /* document text */
+    size_t len;         /* bytes in text */
+    void *blocks;       /* extra blocks, chained by their first word */
+    char *free;         /* next free byte in the current block */
+    size_t left;        /* bytes left in the current block */
 };
 
 /* internal representation of a (possibly nested) XML element */
@@ -116,6 +171,9 @@ struct xml_ele_
     int eit;           /* used to iterate over el[] */
     String pcdata;     /* character data in this element */
     int pcdata_hasent; /* 1 if pcdata contains an entity char*/
+    XMLArena *arena;   /* arena holding this element, NULL if malloced */
+    int atinarena;     /* 1 if at[] is held by the arena */
+    int elinarena;     /* 1 if el[] is held by the arena */
 };
 
 /* internal representation of an attribute */
@@ -124,6 +182,7 @@ struct xml_att_
     String name; /* name */
     String valu; /* value */
     XMLEle *ce;  /* containing element */
+    int inarena; /* 1 if held by the arena of ce */
 };
 
 /* characters that need escaping as "entities" in attr values and pcdata
@@ -155,11 +214,23 @@ LilXML *newLilXML()
     return (lp);
 }
 
+/* switch lp to arena mode, or back to the char by char parser */
+void setArenaLilXML(LilXML *lp, int on)
+{
+    resetScanner(lp);
+    lp->scan.on = on;
+}
+
 /* discard */
 void delLilXML(LilXML *lp)
 {
-    delXMLEle(lp->ce);
+    initParser(lp);
     freeString(&lp->endtag);
+    resetScanner(lp);
+    if (lp->scan.text)
+        (*myfree)(lp->scan.text);
+    if (lp->scan.open)
+        (*myfree)(lp->scan.open);
     (*myfree)(lp);
 }
 
@@ -179,7 +250,8 @@ void delXMLEle(XMLEle *ep)
     {
         for (i = 0; i < ep->nat; i++)
             freeAtt(ep->at[i]);
-        (*myfree)(ep->at);
+        if (!ep->atinarena)
+            (*myfree)(ep->at);
     }
     if (ep->el)
     {
@@ -190,7 +262,8 @@ void delXMLEle(XMLEle *ep)
 
             delXMLEle(ep->el[i]);
         }
-        (*myfree)(ep->el);
+        if (!ep->elinarena)
+            (*myfree)(ep->el);
     }
 
     /* remove from parent's list if known */
@@ -207,11 +280,96 @@ void delXMLEle(XMLEle *ep)
         }
     }
 
-    /* delete ep itself */
-    (*myfree)(ep);
+    /* delete ep itself, arena elements go with their root */
+    if (!ep->arena)
+        (*myfree)(ep);
+    else if (ep->arena->root == ep)
+        freeArena(ep->arena);
+}
+
+/* return the enclen attribute of a oneBLOB element, 0 if none or not a oneBLOB */
+static int blobEnclen(XMLEle *ep)
+{
+    XMLAtt *ap;
+    long enclen;
+
+    if (strcmp(ep->tag.s, "oneBLOB") || !(ap = findXMLAtt(ep, "enclen")))
+        return (0);
+    enclen = strtol(ap->valu.s, NULL, 10);
+    if (enclen <= 0)
+        return (0);
+    return (enclen < BLOB_PREALLOC_MAX ? (int)enclen : BLOB_PREALLOC_MAX);
+}
+
+/* base64 chars plus room for the line breaks */
+static int blobRoom(int enclen)
+{
+    return (enclen + enclen / 72 + 2);
+}
+
+/* called when the opening tag of ce is complete: get ready for a bulk read of BLOB content */
+static void enterBlob(LilXML *lp)
+{
+    int enclen;
+
+    if (lp->ce->nel > 0 || lp->ce->pcdata.sl > 0 || !(enclen = blobEnclen(lp->ce)))
+        return;
+
+    ownString(&lp->ce->pcdata, blobRoom(enclen));
+    lp->inblob = 1;
+}
+
+/* take the content of a BLOB from buf in bulk, up to the next < or any char needing the parser.
+ * return the number of chars used.
+ */
+static int readBlobContent(LilXML *lp, const char *buf, int size)
+{
+    String *sp    = &lp->ce->pcdata;
+    const char *s = buf;
+    const char *e = (const char *)memchr(buf, '<', size);
+    int n;
+
+    if (lp->cs != LOOK4CON && lp->cs != INCON)
+    {
+        lp->inblob = 0;
+        return (0);
+    }
+    if (!e)
+        e = buf + size;
+    else
+        lp->inblob = 0;
+
+    /* entities and EOF go through the parser */
+    if (memchr(s, '&', e - s) || memchr(s, '\0', e - s))
+    {
+        lp->inblob = 0;
+        return (0);
+    }
+
+    for (const char *nl = s; (nl = (const char *)memchr(nl, '\n', e - nl)) != NULL; nl++)
+        lp->ln++;
+
+    if (lp->cs == LOOK4CON)
+    {
+        while (s < e && isspace(*s))
+            s++;
+        if (s == e)
+            return (int)(e - buf);
+        lp->cs = INCON;
+    }
+
+    n = (int)(e - s);
+    if (sp->sl + n + 1 > sp->sm)
+        ownString(sp, sp->sl + n + 1 > 2 * sp->sm ? sp->sl + n + 1 : 2 * sp->sm);
+    memcpy(sp->s + sp->sl, s, n);
+    sp->sl += n;
+    sp->s[sp->sl] = '\0';
+    if (n > 0)
+        lp->lastc = e[-1];
+
+    return (int)(e - buf);
 }
 
-//#define WITH_MEMCHR
 XMLEle **parseXMLChunk(LilXML *lp, char *buf, int size, char ynot[])
 {
     unsigned int nnodes     = 1;
@@ -221,81 +379,38 @@ XMLEle **parseXMLChunk(LilXML *lp, char *buf, int size, char ynot[])
     int s;
     ynot[0] = '\0';
 
-    if (lp->inblob)
-    {
-#ifdef WITH_ENCLEN
-        if (size < lp->ce->pcdata.sm - lp->ce->pcdata.sl)
-        {
-            memcpy((void *)(lp->ce->pcdata.s + lp->ce->pcdata.sl), (const void *)buf, size);
-            lp->ce->pcdata.sl += size;
-            return nodes;
-        }
-        else
-            lp->inblob = 0;
-#endif
-#ifdef WITH_MEMCHR
-        char *ltpos = memchr(buf, '<', size);
-        if (!ltpos)
-        {
-            lp->ce->pcdata.s = (char *)moremem(lp->ce->pcdata.s, lp->ce->pcdata.sm + size);
-            lp->ce->pcdata.sm += size;
-            memcpy((void *)(lp->ce->pcdata.s + lp->ce->pcdata.sl), (const void *)buf, size);
-            lp->ce->pcdata.sl += size;
-            return nodes;
-        }
-        else
-            lp->inblob = 0;
-#endif
-    }
-    else
+    if (lp->scan.on)
     {
-        if (lp->ce)
+        while (curr - buf < size)
         {
-            char *ctag = tagXMLEle(lp->ce);
-            if (ctag && !(strcmp(ctag, "oneBLOB")) && (lp->cs == INCON))
+            XMLEle *root;
+            curr += scanXMLChunk(lp, curr, size - (int)(curr - buf), &root, ynot);
+            if (root)
             {
-#ifdef WITH_ENCLEN
-                XMLAtt *blenatt = findXMLAtt(lp->ce, "enclen");
-                if (blenatt)
-                {
-                    int blen;
-                    sscanf(valuXMLAtt(blenatt), "%d", &blen);
-
-                    // Add room for those '\n' on every 72 character line + extra half-full line.
-                    blen += (blen / 72) + 1;
-
-                    lp->ce->pcdata.s  = (char *)moremem(lp->ce->pcdata.s, blen);
-                    lp->ce->pcdata.sm = blen; // always set sm
-
-                    if (size <= blen - lp->ce->pcdata.sl)
-                    {
-                        memcpy((void *)(lp->ce->pcdata.s + lp->ce->pcdata.sl), (const void *)buf, size);
-                        lp->ce->pcdata.sl += size;
-                        lp->inblob = 1;
-                        return nodes;
-                    }
-                }
-#endif
-#ifdef WITH_MEMCHR
-                char *ltpos = memchr(buf, '<', size);
-                if (!ltpos)
-                {
-                    lp->ce->pcdata.s = (char *)moremem(lp->ce->pcdata.s, lp->ce->pcdata.sm + size);
-                    lp->ce->pcdata.sm += size;
-                    memcpy((void *)(lp->ce->pcdata.s + lp->ce->pcdata.sl), (const void *)buf, size);
-                    lp->ce->pcdata.sl += size;
-                    lp->inblob = 1;
-                    return nodes;
-                }
-                else
-                    lp->inblob = 0;
-#endif
+                nodes[nnodes - 1] = root;
+                nodes             = (XMLEle **)realloc(nodes, (nnodes + 1) * sizeof * nodes);
+                nodes[nnodes]     = NULL;
+                nnodes += 1;
             }
         }
+        return nodes;
     }
+
     while (curr - buf < size)
     {
         char newc = *curr;
+
+        /* BLOB content goes in bulk up to the next < */
+        if (lp->inblob && !lp->skipping && lp->lastc != '<')
+        {
+            int n = readBlobContent(lp, curr, size - (int)(curr - buf));
+            if (n > 0)
+            {
+                curr += n;
+                continue;
+            }
+        }
+
         /* EOF? */
         if (newc == 0)
         {
@@ -350,6 +465,8 @@ XMLEle **parseXMLChunk(LilXML *lp, char *buf, int size, char ynot[])
         {
             lp->lastc = newc;
             curr++;
+            if (lp->cs == LOOK4CON && newc == '>')
+                enterBlob(lp);
             continue;
         }
         if (s < 0)
@@ -395,9 +512,17 @@ XMLEle *readXMLEle(LilXML *lp, int newc, char ynot[])
     {
         sprintf(ynot, "Line %d: early XML EOF", lp->ln);
         initParser(lp);
+        resetScanner(lp);
         return (NULL);
     }
 
+    if (lp->scan.on)
+    {
+        char c = (char)newc;
+        scanXMLChunk(lp, &c, 1, &root, ynot);
+        return (root);
+    }
+
     /* new line? */
     if (newc == '\n')
         lp->ln++;
@@ -679,7 +804,7 @@ XMLEle *addXMLEle(XMLEle *parent, const char *tag)
  */
 static void appXMLEle(XMLEle *ep, XMLEle *newep)
 {
-    ep->el            = (XMLEle **)moremem(ep->el, (ep->nel + 1) * sizeof(XMLEle *));
+    ep->el            = (XMLEle **)growList(ep->el, ep->nel, sizeof(XMLEle *), &ep->elinarena);
     ep->el[ep->nel++] = newep;
 }
 
@@ -1035,16 +1160,17 @@ char *entityXML(char *s)
 /* if ent is a recognized xml entity sequence, set *cp to char and return 1
  * else return 0
  */
+static struct
+{
+    const char *ent;
+    char c;
+} enttable[] =
+{
+    { "&amp;", '&' }, { "&apos;", '\'' }, { "&lt;", '<' }, { "&gt;", '>' }, { "&quot;", '"' },
+};
+
 static int decodeEntity(char *ent, int *cp)
 {
-    static struct
-    {
-        const char *ent;
-        char c;
-    } enttable[] =
-    {
-        { "&amp;", '&' }, { "&apos;", '\'' }, { "&lt;", '<' }, { "&gt;", '>' }, { "&quot;", '"' },
-    };
     for (size_t i = 0; i < (sizeof(enttable) / sizeof(enttable[0])); i++)
     {
         if (strcmp(ent, enttable[i].ent) == 0)
@@ -1057,6 +1183,21 @@ static int decodeEntity(char *ent, int *cp)
     return (0);
 }
 
+/* same as decodeEntity for the n chars at ent */
+static int decodeEntityN(const char *ent, size_t n, int *cp)
+{
+    for (size_t i = 0; i < (sizeof(enttable) / sizeof(enttable[0])); i++)
+    {
+        if (strlen(enttable[i].ent) == n && memcmp(ent, enttable[i].ent, n) == 0)
+        {
+            *cp = enttable[i].c;
+            return (1);
+        }
+    }
+
+    return (0);
+}
+
 /* process one more char in XML file.
  * if find final closure, return 1 and tree is in ce.
  * if need more, return 0.
@@ -1189,6 +1330,12 @@ static int oneXMLchar(LilXML *lp, int c, char ynot[])
         case LOOK4CON: /* skipping leading content whitespace*/
             if (c == '<')
                 lp->cs = SAWLTINCON;
+            else if (c == '&')
+            {
+                newString(&lp->entity);
+                growString(&lp->entity, c);
+                lp->cs = ENTINCON;
+            }
             else if (!isspace(c))
             {
                 growString(&lp->ce->pcdata, c);
@@ -1303,9 +1450,17 @@ static int oneXMLchar(LilXML *lp, int c, char ynot[])
 /* set up for a fresh start again */
 static void initParser(LilXML *lp)
 {
-    delXMLEle(lp->ce);
+    Scanner scan = lp->scan;
+    XMLEle *root = lp->ce;
+
+    /* drop the whole partial tree, not only the innermost element */
+    while (root && root->pe)
+        root = root->pe;
+    delXMLEle(root);
     freeString(&lp->endtag);
+    freeString(&lp->entity);
     memset(lp, 0, sizeof(*lp));
+    lp->scan = scan;
     newString(&lp->endtag);
     lp->cs = LOOK4START;
     lp->ln = 1;
@@ -1343,7 +1498,7 @@ static XMLEle *growEle(XMLEle *pe)
 
     if (pe)
     {
-        pe->el            = (XMLEle **)moremem(pe->el, (pe->nel + 1) * sizeof(XMLEle *));
+        pe->el            = (XMLEle **)growList(pe->el, pe->nel, sizeof(XMLEle *), &pe->elinarena);
         pe->el[pe->nel++] = newe;
     }
 
@@ -1360,7 +1515,7 @@ static XMLAtt *growAtt(XMLEle *ep)
     newString(&newa->valu);
     newa->ce = ep;
 
-    ep->at            = (XMLAtt **)moremem(ep->at, (ep->nat + 1) * sizeof(XMLAtt *));
+    ep->at            = (XMLAtt **)growList(ep->at, ep->nat, sizeof(XMLAtt *), &ep->atinarena);
     ep->at[ep->nat++] = newa;
 
     return (newa);
@@ -1373,7 +1528,8 @@ static void freeAtt(XMLAtt *a)
         return;
     freeString(&a->name);
     freeString(&a->valu);
-    (*myfree)(a);
+    if (!a->inarena)
+        (*myfree)(a);
 }
 
 /* reset endtag */
@@ -1400,6 +1556,8 @@ static void growString(String *sp, int c)
     {
         if (!sp->s)
             newString(sp);
+        else if (!sp->sm)
+            ownString(sp, l < MINMEM ? MINMEM : 2 * l);
         else
         {
             sp->s = (char *)moremem(sp->s, sp->sm *= 2);
@@ -1425,7 +1583,7 @@ static void appendString(String *sp, const char *str)
             newString(sp);
         if (l > sp->sm)
         {
-            sp->s = (char *)moremem(sp->s, (sp->sm = l));
+            ownString(sp, l);
         }
     }
     if (sp->s)
@@ -1447,10 +1605,26 @@ static void newString(String *sp)
     sp->sl = 0;
 }
 
+/* make sp hold a malloced copy of its string, with room for n bytes.
+ * n must be larger than sp->sl.
+ */
+static void ownString(String *sp, int n)
+{
+    if (sp->sm)
+        sp->s = (char *)moremem(sp->s, n);
+    else
+    {
+        char *s = (char *)moremem(NULL, n);
+        memcpy(s, sp->s, sp->sl + 1);
+        sp->s = s;
+    }
+    sp->sm = n;
+}
+
 /* free memory used by the given String */
 static void freeString(String *sp)
 {
-    if (sp->s)
+    if (sp->s && sp->sm)
         (*myfree)(sp->s);
     sp->s  = NULL;
     sp->sl = 0;
@@ -1469,6 +1643,634 @@ static void *moremem(void *old, size_t n)
     return p;
 }
 
+/* return list, with n entries of size bytes, grown to hold one more.
+ * a list held by an arena is copied out of it.
+ */
+static void *growList(void *list, int n, size_t size, int *inarena)
+{
+    if (*inarena)
+    {
+        void *l = moremem(NULL, (n + 1) * size);
+        memcpy(l, list, n * size);
+        *inarena = 0;
+        return l;
+    }
+    return moremem(list, (n + 1) * size);
+}
+
+/* arena mode.
+ * the scanner copies the raw text of a document until it has seen its closing tag, skipping
+ * content with memchr. The complete text is then parsed in one pass, in place: strings are
+ * slices of the text, zero terminated over the delimiter that follows them.
+ */
+
+/* forget the document being scanned */
+static void resetScanner(LilXML *lp)
+{
+    Scanner *sc = &lp->scan;
+
+    sc->ss    = SCAN_OUT;
+    sc->delim = 0;
+    sc->nopen = 0;
+    sc->len   = 0;
+}
+
+/* append n bytes to the document text, keeping room for a trailing \0 */
+static void appendText(Scanner *sc, const char *buf, size_t n)
+{
+    if (sc->len + n + 1 > sc->size)
+    {
+        size_t size = sc->size ? sc->size : ARENA_TEXT_MIN;
+        while (size < sc->len + n + 1)
+            size *= 2;
+        sc->text = (char *)moremem(sc->text, size);
+        sc->size = size;
+    }
+    memcpy(sc->text + sc->len, buf, n);
+    sc->len += n;
+}
+
+/* if the innermost open element is a oneBLOB, make room in the text for its content */
+static void reserveBlob(Scanner *sc)
+{
+    const char *tag = sc->text + sc->open[sc->nopen - 1];
+    const char *att;
+    long enclen;
+    size_t size;
+
+    if (strncmp(tag, "oneBLOB", 7) || isTokenChar(0, tag[7]))
+        return;
+
+    sc->text[sc->len] = '\0';
+    for (att = tag + 7; (att = strstr(att, "enclen")) != NULL; att += 6)
+    {
+        if (isTokenChar(0, att[-1]) || isTokenChar(0, att[6]))
+            continue;
+        att += 6;
+        while (isspace(*att) || *att == '=')
+            att++;
+        if (*att != '\'' && *att != '"')
+            return;
+        enclen = strtol(att + 1, NULL, 10);
+        if (enclen <= 0)
+            return;
+        if (enclen > BLOB_PREALLOC_MAX)
+            enclen = BLOB_PREALLOC_MAX;
+
+        /* base64 chars, line breaks and closing tags */
+        size = sc->len + enclen + enclen / 72 + 256;
+        if (size > sc->size)
+        {
+            sc->text = (char *)moremem(sc->text, size);
+            sc->size = size;
+        }
+        return;
+    }
+}
+
+/* record the tag at offset off as open */
+static void pushOpen(Scanner *sc, size_t off)
+{
+    if (sc->nopen == sc->mopen)
+    {
+        sc->mopen = sc->mopen ? 2 * sc->mopen : 16;
+        sc->open  = (size_t *)moremem(sc->open, sc->mopen * sizeof(size_t));
+    }
+    sc->open[sc->nopen++] = off;
+}
+
+/* 1 if the closing tag at offset close of the text matches the innermost open element */
+static int closeMatches(Scanner *sc, size_t close)
+{
+    const char *ct = sc->text + close + 2; /* past </ */
+    const char *ot = sc->text + sc->open[sc->nopen - 1];
+
+    while (isspace(*ct))
+        ct++;
+    while (isTokenChar(0, *ot) && *ot == *ct)
+        ot++, ct++;
+    return (!isTokenChar(0, *ot) && !isTokenChar(0, *ct));
+}
+
+static void *arenaAlloc(XMLArena *a, size_t n)
+{
+    void *p;
+
+    n = (n + 7) & ~(size_t)7;
+    if (n > a->left)
+    {
+        size_t size  = n + sizeof(void *) > ARENA_BLOCK_MIN ? n + sizeof(void *) : ARENA_BLOCK_MIN;
+        void **block = (void **)moremem(NULL, size);
+        *block    = a->blocks;
+        a->blocks = block;
+        a->free   = (char *)(block + 1);
+        a->left   = size - sizeof(void *);
+    }
+    p = a->free;
+    a->free += n;
+    a->left -= n;
+    return (p);
+}
+
+/* take over the text of the scanner, with a first block sized for its markup */
+static XMLArena *newArena(Scanner *sc)
+{
+    size_t nlt = 0, room;
+    XMLArena *a;
+
+    for (const char *p = sc->text; (p = (const char *)memchr(p, '<', sc->text + sc->len - p)) != NULL; p++)
+        nlt++;
+
+    /* about one element with two attributes every two < */
+    room = (nlt / 2 + 1) * (sizeof(XMLEle) + 2 * sizeof(XMLAtt) + 4 * sizeof(void *) + 16);
+    a    = (XMLArena *)moremem(NULL, sizeof(XMLArena) + room);
+    a->root   = NULL;
+    a->text   = sc->text;
+    a->len    = sc->len;
+    a->blocks = NULL;
+    a->free   = (char *)(a + 1);
+    a->left   = room;
+
+    /* give back what the document did not use */
+    if (sc->size > 2 * (sc->len + 1))
+        a->text = (char *)moremem(a->text, sc->len + 1);
+    a->text[a->len] = '\0';
+    sc->text = NULL;
+    sc->size = 0;
+    sc->len  = 0;
+    return (a);
+}
+
+static void freeArena(XMLArena *a)
+{
+    void **block = (void **)a->blocks;
+
+    while (block)
+    {
+        void **next = (void **)*block;
+        (*myfree)(block);
+        block = next;
+    }
+    (*myfree)(a->text);
+    (*myfree)(a);
+}
+
+/* return list, an arena list of n entries, with room for one more.
+ * lists grow by doubling from 4 entries, abandoning the previous copy.
+ */
+static void **arenaList(XMLArena *a, void **list, int n)
+{
+    if (n == 0 || (n >= 4 && (n & (n - 1)) == 0))
+    {
+        void **l = (void **)arenaAlloc(a, (n ? 2 * n : 4) * sizeof(void *));
+        if (n)
+            memcpy(l, list, n * sizeof(void *));
+        return (l);
+    }
+    return (list);
+}
+
+static XMLEle *arenaEle(XMLArena *a, XMLEle *pe)
+{
+    XMLEle *ep = (XMLEle *)arenaAlloc(a, sizeof(XMLEle));
+
+    memset(ep, 0, sizeof(*ep));
+    ep->pcdata.s  = (char *)arenaAlloc(a, 1);
+    *ep->pcdata.s = '\0';
+    ep->pe        = pe;
+    ep->arena     = a;
+    if (pe)
+    {
+        pe->el            = (XMLEle **)arenaList(a, (void **)pe->el, pe->nel);
+        pe->el[pe->nel++] = ep;
+        pe->elinarena     = 1;
+    }
+    return (ep);
+}
+
+static XMLAtt *arenaAtt(XMLArena *a, XMLEle *ep)
+{
+    XMLAtt *ap = (XMLAtt *)arenaAlloc(a, sizeof(XMLAtt));
+
+    memset(ap, 0, sizeof(*ap));
+    ap->ce      = ep;
+    ap->inarena = 1;
+
+    ep->at            = (XMLAtt **)arenaList(a, (void **)ep->at, ep->nat);
+    ep->at[ep->nat++] = ap;
+    ep->atinarena     = 1;
+    return (ap);
+}
+
+/* decode the entities of the n chars at s in place, dropping control chars if nocntrl.
+ * return the new length, *hasent is set if any entity was found.
+ */
+static size_t decodeRun(char *s, size_t n, int nocntrl, int *hasent)
+{
+    char *r = s, *w = s, *end = s + n;
+
+    while (r < end)
+    {
+        if (*r == '&')
+        {
+            char *semi = (char *)memchr(r, ';', end - r);
+            int c;
+            if (semi)
+            {
+                *hasent = 1;
+                if (decodeEntityN(r, semi - r + 1, &c))
+                    *w++ = (char)c;
+                else
+                {
+                    memmove(w, r, semi - r + 1);
+                    w += semi - r + 1;
+                }
+                r = semi + 1;
+                continue;
+            }
+        }
+        if (!nocntrl || !iscntrl(*r))
+            *w++ = *r;
+        r++;
+    }
+    return (w - s);
+}
+
+/* line of p in the text of a, for diags */
+static int arenaLine(XMLArena *a, const char *p)
+{
+    int ln = 1;
+
+    for (const char *q = a->text; (q = (const char *)memchr(q, '\n', p - q)) != NULL; q++)
+        ln++;
+    return (ln);
+}
+
+/* parse the complete document held in a.
+ * return its root else NULL with reason why in ynot[].
+ */
+static XMLEle *parseArena(XMLArena *a, char ynot[])
+{
+    char *end = a->text + a->len;
+    char *p   = a->text + 1; /* past the leading < */
+    XMLEle *root = NULL;
+    XMLEle *ce   = NULL;
+    int c;
+
+    while (1)
+    {
+        if (*p == '?' || *p == '!')
+        {
+            /* comment or declaration */
+            p = (char *)memchr(p, '>', end - p);
+            if (!p)
+                goto early;
+            p++;
+        }
+        else if (*p == '/' && ce)
+        {
+            /* closing tag */
+            char *tag;
+            p++;
+            while (isspace(*p))
+                p++;
+            if (!isTokenChar(1, *p))
+            {
+                sprintf(ynot, "Line %d: Bogus preend tag char %c", arenaLine(a, p), *p);
+                goto fail;
+            }
+            tag = p;
+            while (isTokenChar(0, *p))
+                p++;
+            c  = *p;
+            *p = '\0';
+            if (strcmp(ce->tag.s, tag))
+            {
+                sprintf(ynot, "Line %d: closing tag %s does not match %s", arenaLine(a, p), tag, ce->tag.s);
+                goto fail;
+            }
+            while (isspace(c))
+                c = *++p;
+            if (c != '>')
+            {
+                sprintf(ynot, "Line %d: Bogus end tag char %c", arenaLine(a, p), c);
+                goto fail;
+            }
+            if (!ce->pe)
+                return (root); /* yes! */
+            ce = ce->pe;
+            p++;
+        }
+        else
+        {
+            /* opening tag */
+            XMLEle *ep;
+            while (isspace(*p))
+                p++;
+            if (!isTokenChar(1, *p))
+            {
+                sprintf(ynot, "Line %d: Bogus tag char %c", arenaLine(a, p), *p);
+                goto fail;
+            }
+            ep = arenaEle(a, ce);
+            if (!root)
+                root = a->root = ep;
+            ce = ep;
+
+            ep->tag.s = p;
+            while (isTokenChar(0, *p))
+                p++;
+            ep->tag.sl = (int)(p - ep->tag.s);
+            c          = *p;
+            *p++       = '\0';
+
+            /* attributes, until > or / */
+            while (c != '>' && c != '/')
+            {
+                XMLAtt *ap;
+                int delim, hasent = 0;
+                char *q;
+
+                c = *p++;
+                if (c == '>' || c == '/')
+                    break;
+                if (isspace(c))
+                    continue;
+                if (!isTokenChar(1, c))
+                {
+                    sprintf(ynot, "Line %d: Bogus leading attr name char: %c", arenaLine(a, p - 1), c);
+                    goto fail;
+                }
+
+                ap         = arenaAtt(a, ep);
+                ap->name.s = p - 1;
+                while (isTokenChar(0, *p))
+                    p++;
+                ap->name.sl = (int)(p - ap->name.s);
+                c           = *p;
+                *p++        = '\0';
+                if (!(isspace(c) || c == '='))
+                {
+                    sprintf(ynot, "Line %d: Bogus attr name char: %c", arenaLine(a, p - 1), c);
+                    goto fail;
+                }
+
+                while (isspace(*p) || *p == '=')
+                    p++;
+                if (*p != '\'' && *p != '"')
+                {
+                    sprintf(ynot, "Line %d: No value for attribute %s", arenaLine(a, p), ap->name.s);
+                    goto fail;
+                }
+                delim = *p++;
+                q     = (char *)memchr(p, delim, end - p);
+                if (!q)
+                    goto early;
+                ap->valu.s  = p;
+                ap->valu.sl = (int)decodeRun(p, q - p, 1, &hasent);
+                ap->valu.s[ap->valu.sl] = '\0';
+                p = q + 1;
+                c = ' ';
+            }
+
+            if (c == '/')
+            {
+                if (*p != '>')
+                {
+                    sprintf(ynot, "Line %d: Bogus char %c before >", arenaLine(a, p), *p);
+                    goto fail;
+                }
+                if (!ce->pe)
+                    return (root); /* root has no content */
+                ce = ce->pe;
+                p++;
+            }
+        }
+
+        if (!ce)
+        {
+            /* only declarations so far */
+            p = (char *)memchr(p, '<', end - p);
+            if (!p)
+                goto early;
+            p++;
+            continue;
+        }
+
+        /* content, sans leading and trailing whitespace, up to the next < */
+        {
+            char *lt = (char *)memchr(p, '<', end - p);
+            char *s  = p;
+            char *e  = lt;
+            if (!lt)
+                goto early;
+            while (s < e && isspace(*s))
+                s++;
+            while (e > s && isspace(e[-1]))
+                e--;
+            if (e > s)
+            {
+                size_t n = e - s;
+                if (memchr(s, '\0', n))
+                {
+                    sprintf(ynot, "Line %d: early XML EOF", arenaLine(a, s));
+                    goto fail;
+                }
+                if (memchr(s, '&', n))
+                    n = decodeRun(s, n, 0, &ce->pcdata_hasent);
+                s[n] = '\0';
+                if (ce->pcdata.sl == 0)
+                {
+                    ce->pcdata.s  = s;
+                    ce->pcdata.sl = (int)n;
+                }
+                else
+                    appendString(&ce->pcdata, s);
+            }
+            p = lt + 1;
+        }
+    }
+
+early:
+    sprintf(ynot, "Line %d: early XML EOF", arenaLine(a, end));
+fail:
+    if (root)
+        delXMLEle(root);
+    else
+        freeArena(a);
+    return (NULL);
+}
+
+/* scan up to size bytes of buf in arena mode, stopping after the first complete document.
+ * return the number of bytes used. *root is set to the document if one was completed,
+ * else to NULL with reason why in ynot[] if it was found broken.
+ */
+static int scanXMLChunk(LilXML *lp, const char *buf, int size, XMLEle **root, char ynot[])
+{
+    Scanner *sc       = &lp->scan;
+    const char *p     = buf;
+    const char *end   = buf + size;
+    const char *start = (sc->ss == SCAN_OUT || sc->ss == SCAN_DECL) ? NULL : buf;
+    int done          = 0;
+
+#define SCANOFF(q) (sc->len + (size_t)((q) - start))
+
+    *root = NULL;
+    while (p < end && !done)
+    {
+        switch (sc->ss)
+        {
+            case SCAN_OUT:
+                p = (const char *)memchr(p, '<', end - p);
+                if (!p)
+                {
+                    p = end;
+                    break;
+                }
+                start     = p;
+                sc->len   = 0;
+                sc->nopen = 0;
+                sc->mark  = 0;
+                sc->lastc = '<';
+                sc->ss    = SCAN_LT;
+                p++;
+                break;
+
+            case SCAN_DECL:
+                p = (const char *)memchr(p, '>', end - p);
+                if (!p)
+                {
+                    p = end;
+                    break;
+                }
+                sc->ss = SCAN_OUT;
+                p++;
+                break;
+
+            case SCAN_LT:
+                if (sc->lastc == '<' && (*p == '?' || *p == '!'))
+                {
+                    if (sc->nopen == 0)
+                    {
+                        /* not a document */
+                        start   = NULL;
+                        sc->len = 0;
+                        sc->ss  = SCAN_DECL;
+                    }
+                    else
+                        sc->ss = SCAN_SKIP;
+                }
+                else if (sc->lastc == '<' && *p == '/' && sc->nopen > 0)
+                    sc->ss = SCAN_CLOSETAG;
+                else if (isTokenChar(1, *p))
+                {
+                    pushOpen(sc, SCANOFF(p));
+                    sc->lastc = *p;
+                    sc->ss    = SCAN_TAG;
+                }
+                else if (isspace(*p))
+                    sc->lastc = ' ';
+                else
+                    done = 1; /* broken, let the parser tell */
+                p++;
+                break;
+
+            case SCAN_TAG:
+                for (; p < end; p++)
+                {
+                    if (sc->delim)
+                    {
+                        const char *q = (const char *)memchr(p, sc->delim, end - p);
+                        if (!q)
+                        {
+                            p = end;
+                            break;
+                        }
+                        p         = q;
+                        sc->delim = 0;
+                        sc->lastc = *p;
+                    }
+                    else if (*p == '\'' || *p == '"')
+                        sc->delim = sc->lastc = *p;
+                    else if (*p == '>')
+                    {
+                        p++;
+                        if (sc->lastc == '/')
+                            done = (--sc->nopen == 0);
+                        else
+                        {
+                            /* the tag is checked in the text */
+                            appendText(sc, start, p - start);
+                            start = p;
+                            reserveBlob(sc);
+                        }
+                        sc->ss = SCAN_CONTENT;
+                        break;
+                    }
+                    else
+                        sc->lastc = *p;
+                }
+                break;
+
+            case SCAN_CLOSETAG:
+                p = (const char *)memchr(p, '>', end - p);
+                if (!p)
+                {
+                    p = end;
+                    break;
+                }
+                p++;
+                /* the names are compared in the text */
+                appendText(sc, start, p - start);
+                start = p;
+                if (!closeMatches(sc, sc->mark))
+                    done = 1; /* broken, let the parser tell */
+                else
+                    done = (--sc->nopen == 0);
+                sc->ss = SCAN_CONTENT;
+                break;
+
+            case SCAN_SKIP:
+                p = (const char *)memchr(p, '>', end - p);
+                if (!p)
+                {
+                    p = end;
+                    break;
+                }
+                sc->ss = SCAN_CONTENT;
+                p++;
+                break;
+
+            case SCAN_CONTENT:
+                p = (const char *)memchr(p, '<', end - p);
+                if (!p)
+                {
+                    p = end;
+                    break;
+                }
+                sc->mark  = SCANOFF(p);
+                sc->lastc = '<';
+                sc->ss    = SCAN_LT;
+                p++;
+                break;
+        }
+    }
+
+#undef SCANOFF
+
+    if (start)
+        appendText(sc, start, p - start);
+
+    if (done)
+    {
+        XMLArena *a = newArena(sc);
+        resetScanner(lp);
+        *root = parseArena(a, ynot);
+    }
+
+    return (int)(p - buf);
+}
+
 #if defined(MAIN_TST)
 int main(int ac, char *av[])
 {
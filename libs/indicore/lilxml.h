@@ -87,6 +87,15 @@ typedef struct LilXML_ LilXML;
 */
 extern LilXML *newLilXML();
 
+/** \brief Switch a lilxml parser to arena mode, or back to the default char by char parser.
+    In arena mode, input is scanned in bulk and each document is parsed at once when complete. All the elements,
+    attributes and strings of a document then live in one arena, freed at once by delXMLEle() on its root.
+    Returned elements can be read and edited as usual.
+    \param lp a pointer to a lilxml parser. Any partially read document is dropped.
+    \param on 1 for arena mode, 0 for the default parser.
+*/
+extern void setArenaLilXML(LilXML *lp, int on);
+
 /** \brief Delete a lilxml parser.
     \param lp a pointer to a lilxml parser to be deleted.
 */
@@ -34,6 +34,8 @@ static const struct userio s_userio_file = {
     .write = s_file_write,
     .vprintf = s_file_printf,
     .joinbuff = NULL,
+    .reserve = NULL,
+    .commit = NULL,
 };
 
 const struct userio *userio_file()
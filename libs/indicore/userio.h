@@ -32,6 +32,10 @@ typedef struct userio
 
     // join the given shared buffer as ancillary data. xml must be at least one char - optional
     void (*joinbuff)(void * user, const char * xml, void * buffer, size_t bloblen);
+
+    // return room for count bytes to be written in place, then published with commit - optional
+    void *(*reserve)(void *user, size_t count);
+    void (*commit)(void *user, size_t count);
 } userio;
 
 const struct userio *userio_file();
@@ -20,6 +20,7 @@
 #include "basedevice_p.h"
 
 #include "base64.h"
+#include "indiblobcodec.h"
 #include "config.h"
 #include "indicom.h"
 #include "sharedblob.h"
@@ -781,7 +782,35 @@ int BaseDevicePrivate::setBLOB(INDI::PropertyBlob property, const LilXmlElement
             widget->setBlobLen(blobLen);
         }
 
-        if (format.endsWith(".z"))
+        if (format.endsWith(INDI::BLOB_CHUNKED_SUFFIX))
+        {
+            widget->setFormat(format.toString().substr(0, format.lastIndexOf(INDI::BLOB_CHUNKED_SUFFIX)));
+
+            size_t dataSize = INDI::blobUncompressedSize(widget->getBlob(), widget->getBlobLen());
+            void *dataBuffer = malloc(dataSize > 0 ? dataSize : 1);
+
+            if (dataBuffer == nullptr)
+            {
+                strncpy(errmsg, "Unable to allocate memory for data buffer", MAXRBUF);
+                return -1;
+            }
+            if (!INDI::decompressBlob(widget->getBlob(), widget->getBlobLen(), dataBuffer, dataSize))
+            {
+                snprintf(errmsg, MAXRBUF, "INDI: %s.%s.%s invalid or unsupported chunked compression",
+                         property.getDeviceName(), property.getName(), widget->getName());
+                free(dataBuffer);
+                return -1;
+            }
+            widget->setSize(dataSize);
+            widget->setBlobLen(dataSize);
+#ifdef ENABLE_INDI_SHARED_MEMORY
+            IDSharedBlobFree(widget->getBlob());
+#else
+            free(widget->getBlob());
+#endif
+            widget->setBlob(dataBuffer);
+        }
+        else if (format.endsWith(".z"))
         {
             widget->setFormat(format.toString().substr(0, format.lastIndexOf(".z")));
 
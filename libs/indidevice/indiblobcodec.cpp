@@ -0,0 +1,367 @@
+/*******************************************************************************
+  Chunked BLOB compression
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#include "indiblobcodec.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * Layout, all integers little endian:
+ *
+ *   0  "IZC1"
+ *   4  codec (uint8), element size (uint8), reserved (uint16)
+ *   8  uncompressed size (uint64)
+ *  16  chunk size (uint32), number of chunks (uint32)
+ *  24  compressed size of each chunk (uint32), the top bit set if the chunk is stored as is
+ *      followed by the chunks
+ */
+
+namespace
+{
+
+constexpr uint8_t MAGIC[4] = { 'I', 'Z', 'C', '1' };
+constexpr size_t HEADER_SIZE = 24;
+constexpr uint32_t CHUNK_SIZE = 1 << 20;
+constexpr uint32_t CHUNK_STORED = 0x80000000u;
+
+void put32(uint8_t *p, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = static_cast<uint8_t>(value >> (8 * i));
+}
+
+void put64(uint8_t *p, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = static_cast<uint8_t>(value >> (8 * i));
+}
+
+uint32_t get32(const uint8_t *p)
+{
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; i--)
+        value = value << 8 | p[i];
+    return value;
+}
+
+uint64_t get64(const uint8_t *p)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--)
+        value = value << 8 | p[i];
+    return value;
+}
+
+// Group byte b of every sample into plane b, trailing bytes are left as they are
+template <size_t N>
+void shuffle(const uint8_t *in, uint8_t *out, size_t size)
+{
+    size_t count = size / N;
+    for (size_t i = 0; i < count; i++)
+        for (size_t b = 0; b < N; b++)
+            out[b * count + i] = in[i * N + b];
+    memcpy(out + count * N, in + count * N, size - count * N);
+}
+
+template <size_t N>
+void unshuffle(const uint8_t *in, uint8_t *out, size_t size)
+{
+    size_t count = size / N;
+    for (size_t i = 0; i < count; i++)
+        for (size_t b = 0; b < N; b++)
+            out[i * N + b] = in[b * count + i];
+    memcpy(out + count * N, in + count * N, size - count * N);
+}
+
+void shuffle(const uint8_t *in, uint8_t *out, size_t size, size_t elementSize)
+{
+    switch (elementSize)
+    {
+        case 2:
+            shuffle<2>(in, out, size);
+            break;
+        case 4:
+            shuffle<4>(in, out, size);
+            break;
+        case 8:
+            shuffle<8>(in, out, size);
+            break;
+        default:
+            memcpy(out, in, size);
+            break;
+    }
+}
+
+void unshuffle(const uint8_t *in, uint8_t *out, size_t size, size_t elementSize)
+{
+    switch (elementSize)
+    {
+        case 2:
+            unshuffle<2>(in, out, size);
+            break;
+        case 4:
+            unshuffle<4>(in, out, size);
+            break;
+        case 8:
+            unshuffle<8>(in, out, size);
+            break;
+        default:
+            memcpy(out, in, size);
+            break;
+    }
+}
+
+bool compressChunk(INDI::BlobCodec codec, int level, const uint8_t *in, size_t size, std::vector<uint8_t> &out)
+{
+    switch (codec)
+    {
+        case INDI::BLOB_CODEC_ZLIB:
+        {
+            uLongf length = compressBound(size);
+            out.resize(length);
+            if (compress2(out.data(), &length, in, size, std::clamp(level, 1, 9)) != Z_OK)
+                return false;
+            out.resize(length);
+            return true;
+        }
+
+#ifdef HAVE_ZSTD
+        case INDI::BLOB_CODEC_ZSTD:
+        {
+            out.resize(ZSTD_compressBound(size));
+            size_t length = ZSTD_compress(out.data(), out.size(), in, size, std::clamp(level, -7, 19));
+            if (ZSTD_isError(length))
+                return false;
+            out.resize(length);
+            return true;
+        }
+#endif
+
+        default:
+            return false;
+    }
+}
+
+bool decompressChunk(INDI::BlobCodec codec, const uint8_t *in, size_t size, uint8_t *out, size_t outSize)
+{
+    switch (codec)
+    {
+        case INDI::BLOB_CODEC_ZLIB:
+        {
+            uLongf length = outSize;
+            return uncompress(out, &length, in, size) == Z_OK && length == outSize;
+        }
+
+#ifdef HAVE_ZSTD
+        case INDI::BLOB_CODEC_ZSTD:
+        {
+            size_t length = ZSTD_decompress(out, outSize, in, size);
+            return !ZSTD_isError(length) && length == outSize;
+        }
+#endif
+
+        default:
+            return false;
+    }
+}
+
+// Run job(chunk) for every chunk, spread over the available cores
+void forEachChunk(size_t chunks, const std::function<void(size_t)> &job)
+{
+    size_t threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), chunks);
+    auto worker = [&](size_t first)
+    {
+        for (size_t chunk = first; chunk < chunks; chunk += threads)
+            job(chunk);
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threads; t++)
+        workers.emplace_back(worker, t);
+    worker(0);
+    for (auto &thread : workers)
+        thread.join();
+}
+
+}
+
+namespace INDI
+{
+
+bool isBlobCodecAvailable(BlobCodec codec)
+{
+    switch (codec)
+    {
+        case BLOB_CODEC_ZLIB:
+            return true;
+#ifdef HAVE_ZSTD
+        case BLOB_CODEC_ZSTD:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+bool compressBlob(const void *data, size_t size, std::vector<uint8_t> &out, BlobCodec codec, int level,
+                  size_t elementSize)
+{
+    if (!isBlobCodecAvailable(codec) || (elementSize != 1 && elementSize != 2 && elementSize != 4 && elementSize != 8))
+        return false;
+
+    const uint8_t *in = static_cast<const uint8_t *>(data);
+    size_t chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    std::vector<std::vector<uint8_t>> compressed(chunks);
+    std::vector<char> stored(chunks, 0), failed(chunks, 0);
+
+    forEachChunk(chunks, [&](size_t chunk)
+    {
+        const uint8_t *source = in + chunk * CHUNK_SIZE;
+        size_t length = std::min<size_t>(CHUNK_SIZE, size - chunk * CHUNK_SIZE);
+
+        std::vector<uint8_t> shuffled;
+        if (elementSize > 1)
+        {
+            shuffled.resize(length);
+            shuffle(source, shuffled.data(), length, elementSize);
+            source = shuffled.data();
+        }
+
+        if (!compressChunk(codec, level, source, length, compressed[chunk]))
+            failed[chunk] = 1;
+        // Incompressible data is kept as is
+        else if (compressed[chunk].size() >= length)
+            stored[chunk] = 1;
+    });
+
+    if (std::find(failed.begin(), failed.end(), 1) != failed.end())
+        return false;
+
+    size_t total = HEADER_SIZE + 4 * chunks;
+    for (size_t chunk = 0; chunk < chunks; chunk++)
+        total += stored[chunk] ? std::min<size_t>(CHUNK_SIZE, size - chunk * CHUNK_SIZE) : compressed[chunk].size();
+
+    out.resize(total);
+    uint8_t *p = out.data();
+    memcpy(p, MAGIC, 4);
+    p[4] = static_cast<uint8_t>(codec);
+    p[5] = static_cast<uint8_t>(elementSize);
+    p[6] = p[7] = 0;
+    put64(p + 8, size);
+    put32(p + 16, CHUNK_SIZE);
+    put32(p + 20, static_cast<uint32_t>(chunks));
+
+    uint8_t *body = p + HEADER_SIZE + 4 * chunks;
+    for (size_t chunk = 0; chunk < chunks; chunk++)
+    {
+        size_t length = std::min<size_t>(CHUNK_SIZE, size - chunk * CHUNK_SIZE);
+        if (stored[chunk])
+        {
+            memcpy(body, in + chunk * CHUNK_SIZE, length);
+            put32(p + HEADER_SIZE + 4 * chunk, static_cast<uint32_t>(length) | CHUNK_STORED);
+        }
+        else
+        {
+            length = compressed[chunk].size();
+            memcpy(body, compressed[chunk].data(), length);
+            put32(p + HEADER_SIZE + 4 * chunk, static_cast<uint32_t>(length));
+        }
+        body += length;
+    }
+
+    return true;
+}
+
+size_t blobUncompressedSize(const void *data, size_t size)
+{
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    if (size < HEADER_SIZE || memcmp(p, MAGIC, 4) != 0)
+        return 0;
+    return get64(p + 8);
+}
+
+bool decompressBlob(const void *data, size_t size, void *out, size_t outSize)
+{
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    if (size < HEADER_SIZE || memcmp(p, MAGIC, 4) != 0)
+        return false;
+
+    BlobCodec codec    = static_cast<BlobCodec>(p[4]);
+    size_t elementSize = p[5];
+    uint64_t rawSize   = get64(p + 8);
+    uint32_t chunkSize = get32(p + 16);
+    uint32_t chunks    = get32(p + 20);
+
+    if (!isBlobCodecAvailable(codec) || rawSize > outSize || chunkSize == 0 ||
+            (rawSize + chunkSize - 1) / chunkSize != chunks || size < HEADER_SIZE + 4 * uint64_t(chunks))
+        return false;
+
+    // Locate the chunks
+    std::vector<size_t> offsets(chunks + 1);
+    offsets[0] = HEADER_SIZE + 4 * size_t(chunks);
+    for (uint32_t chunk = 0; chunk < chunks; chunk++)
+    {
+        offsets[chunk + 1] = offsets[chunk] + (get32(p + HEADER_SIZE + 4 * chunk) & ~CHUNK_STORED);
+        if (offsets[chunk + 1] > size)
+            return false;
+    }
+
+    uint8_t *dst = static_cast<uint8_t *>(out);
+    std::vector<char> failed(chunks, 0);
+
+    forEachChunk(chunks, [&](size_t chunk)
+    {
+        const uint8_t *source = p + offsets[chunk];
+        size_t compressedLength = offsets[chunk + 1] - offsets[chunk];
+        size_t length = std::min<uint64_t>(chunkSize, rawSize - chunk * uint64_t(chunkSize));
+        uint8_t *target = dst + chunk * size_t(chunkSize);
+
+        if (get32(p + HEADER_SIZE + 4 * chunk) & CHUNK_STORED)
+        {
+            if (compressedLength != length)
+                failed[chunk] = 1;
+            else
+                memcpy(target, source, length);
+            return;
+        }
+
+        if (elementSize <= 1)
+        {
+            failed[chunk] = !decompressChunk(codec, source, compressedLength, target, length);
+            return;
+        }
+
+        std::vector<uint8_t> shuffled(length);
+        if (!decompressChunk(codec, source, compressedLength, shuffled.data(), length))
+            failed[chunk] = 1;
+        else
+            unshuffle(shuffled.data(), target, length, elementSize);
+    });
+
+    return std::find(failed.begin(), failed.end(), 1) == failed.end();
+}
+
+}
@@ -0,0 +1,73 @@
+/*******************************************************************************
+  Chunked BLOB compression
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Library General Public
+ License version 2 as published by the Free Software Foundation.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Library General Public License for more details.
+
+ You should have received a copy of the GNU Library General Public License
+ along with this library; see the file COPYING.LIB.  If not, write to
+ the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ Boston, MA 02110-1301, USA.
+*******************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace INDI
+{
+
+/**
+ * @brief Format suffix of chunked compressed BLOBs, appended to the format of the data, e.g. ".fits.zc".
+ *
+ * The data is cut into chunks that are compressed independently, and in parallel. Within each chunk the
+ * bytes of the samples are grouped by significance first, which makes images far more compressible for
+ * fast codecs. BaseDevice decodes such BLOBs transparently on the client side.
+ */
+constexpr const char *BLOB_CHUNKED_SUFFIX = ".zc";
+
+enum BlobCodec
+{
+    BLOB_CODEC_ZLIB = 0, /*!< Always available */
+    BLOB_CODEC_ZSTD = 1  /*!< Available if built with zstd */
+};
+
+/**
+ * @return True if the codec is built in.
+ */
+bool isBlobCodecAvailable(BlobCodec codec);
+
+/**
+ * @brief Compress data into the chunked format.
+ * @param data Data to compress.
+ * @param size Size of data in bytes.
+ * @param out Receives the compressed BLOB, its capacity is reused.
+ * @param codec Codec of the chunks.
+ * @param level Codec level, clamped to the range of the codec (1 to 9 for zlib, -7 to 19 for zstd).
+ * @param elementSize Size of the samples in data, 1, 2, 4 or 8 bytes.
+ * @return True if successful, false if the codec is unavailable or failed.
+ */
+bool compressBlob(const void *data, size_t size, std::vector<uint8_t> &out, BlobCodec codec, int level,
+                  size_t elementSize);
+
+/**
+ * @return Uncompressed size of a chunked BLOB, or 0 if data is not a valid chunked BLOB.
+ */
+size_t blobUncompressedSize(const void *data, size_t size);
+
+/**
+ * @brief Decompress a chunked BLOB.
+ * @param out Buffer of blobUncompressedSize() bytes.
+ * @return True if successful, false if the data is corrupt or its codec unavailable.
+ */
+bool decompressBlob(const void *data, size_t size, void *out, size_t outSize);
+
+}
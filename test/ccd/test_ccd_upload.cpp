@@ -0,0 +1,426 @@
+/*
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "indiccd.h"
+
+namespace
+{
+
+// Stands in for the client: the driver's stdout is redirected into a pipe read here.
+// If asked to, the reader stops at the start of each BLOB until resumed, so a frame
+// larger than the pipe keeps the upload thread in the middle of sending it.
+class ClientPipe
+{
+    public:
+        explicit ClientPipe(bool pauseOnBLOB = false) : pauseOnBLOB(pauseOnBLOB)
+        {
+            fflush(stdout);
+            savedStdout = dup(STDOUT_FILENO);
+            EXPECT_EQ(pipe(fds), 0);
+            dup2(fds[1], STDOUT_FILENO);
+            reader = std::thread(&ClientPipe::run, this);
+        }
+
+        ~ClientPipe()
+        {
+            fflush(stdout);
+            dup2(savedStdout, STDOUT_FILENO);
+            close(savedStdout);
+            close(fds[1]);
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                pauseOnBLOB = false;
+                paused = false;
+            }
+            condition.notify_all();
+            reader.join();
+            close(fds[0]);
+        }
+
+        // Waits until the start of BLOB number count was read
+        bool waitForBLOB(int count)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            return condition.wait_for(lock, std::chrono::seconds(10), [&]
+            {
+                return blobs >= count;
+            });
+        }
+
+        // Waits until text was received
+        bool waitFor(const std::string &text)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            return condition.wait_for(lock, std::chrono::seconds(10), [&]
+            {
+                return received.find(text) != std::string::npos;
+            });
+        }
+
+        bool hasReceived(const std::string &text)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            return received.find(text) != std::string::npos;
+        }
+
+        void resume()
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                paused = false;
+            }
+            condition.notify_all();
+        }
+
+    private:
+        void run()
+        {
+            static const std::string tag = "<setBLOBVector";
+            std::string text;
+            char buffer[4096];
+
+            for (;;)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    condition.wait(lock, [&]
+                    {
+                        return !paused;
+                    });
+                }
+
+                ssize_t n = read(fds[0], buffer, sizeof(buffer));
+                if (n <= 0)
+                    return;
+
+                text.append(buffer, n);
+                int found = 0;
+                for (size_t pos = text.find(tag); pos != std::string::npos; pos = text.find(tag, pos + 1))
+                    found++;
+                if (text.size() >= tag.size())
+                    text.erase(0, text.size() - tag.size() + 1);
+
+                std::unique_lock<std::mutex> lock(mutex);
+                received.append(buffer, n);
+                blobs += found;
+                if (found)
+                    paused = pauseOnBLOB;
+                condition.notify_all();
+            }
+        }
+
+        int fds[2] {-1, -1};
+        int savedStdout {-1};
+        std::thread reader;
+        std::mutex mutex;
+        std::condition_variable condition;
+        bool pauseOnBLOB;
+        bool paused {false};
+        int blobs {0};
+        std::string received;
+};
+
+// Local uploads go into a fifo, so the upload thread blocks writing a frame until drained
+class FrameFifo
+{
+    public:
+        FrameFifo()
+        {
+            char templ[] = "/tmp/indi_upload_XXXXXX";
+            EXPECT_NE(mkdtemp(templ), nullptr);
+            dir = templ;
+            path = dir + "/frame.fits";
+            EXPECT_EQ(mkfifo(path.c_str(), 0600), 0);
+            fd = open(path.c_str(), O_RDONLY | O_NONBLOCK);
+            EXPECT_GE(fd, 0);
+        }
+
+        ~FrameFifo()
+        {
+            draining = false;
+            if (drainer.joinable())
+                drainer.join();
+            close(fd);
+            unlink(path.c_str());
+            rmdir(dir.c_str());
+        }
+
+        // Waits until the upload thread started writing a frame
+        bool waitForWriter()
+        {
+            pollfd pfd {fd, POLLIN, 0};
+            return poll(&pfd, 1, 10000) == 1 && (pfd.revents & POLLIN);
+        }
+
+        // Reads everything written from now on
+        void drain()
+        {
+            draining = true;
+            drainer = std::thread([this]
+            {
+                char buffer[65536];
+                while (draining)
+                {
+                    pollfd pfd {fd, POLLIN, 0};
+                    poll(&pfd, 1, 10);
+                    // Between frames there is no writer, poll does not wait then
+                    if (read(fd, buffer, sizeof(buffer)) <= 0)
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            });
+        }
+
+        std::string dir;
+
+    private:
+        std::string path;
+        int fd {-1};
+        std::atomic<bool> draining {false};
+        std::thread drainer;
+};
+
+class UploadTestCCD : public INDI::CCD
+{
+    public:
+        UploadTestCCD()
+        {
+            initProperties();
+
+            // 512 KiB frames, much larger than a pipe
+            SetCCDParams(512, 512, 16, 5, 5);
+            PrimaryCCD.setFrameBufferSize(512 * 512 * 2);
+        }
+
+        ~UploadTestCCD()
+        {
+            // Not to be saved into the configuration on destruction
+            setFastExposure(false);
+        }
+
+        const char *getDefaultName() override
+        {
+            return "Upload Test CCD";
+        }
+
+        bool StartExposure(float duration) override
+        {
+            PrimaryCCD.setExposureDuration(duration);
+            std::unique_lock<std::mutex> lock(mutex);
+            started++;
+            condition.notify_all();
+            return true;
+        }
+
+        void UploadComplete(INDI::CCDChip *) override
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            uploads++;
+            condition.notify_all();
+        }
+
+        void startExposure(double duration)
+        {
+            double values[] = {duration};
+            char name[] = "CCD_EXPOSURE_VALUE";
+            char *names[] = {name};
+            ISNewNumber(getDeviceName(), "CCD_EXPOSURE", values, names, 1);
+        }
+
+        // Read out by the camera
+        void completeExposure()
+        {
+            ExposureComplete(&PrimaryCCD);
+        }
+
+        // Frames are saved to dir/frame.fits instead of sent
+        void saveLocally(const std::string &dir)
+        {
+            IUResetSwitch(&UploadSP);
+            UploadS[UPLOAD_LOCAL].s = ISS_ON;
+            IUSaveText(&UploadSettingsT[UPLOAD_DIR], dir.c_str());
+            IUSaveText(&UploadSettingsT[UPLOAD_PREFIX], "frame");
+        }
+
+        void setUploadQueue(int frames)
+        {
+            UploadQueueNP[0].setValue(frames);
+        }
+
+        // One frame per exposure, the exposure is complete once read out
+        void setFastExposure(bool enabled)
+        {
+            IUResetSwitch(&FastExposureToggleSP);
+            FastExposureToggleS[enabled ? INDI_ENABLED : INDI_DISABLED].s = ISS_ON;
+            FastExposureCountN[0].value = 1;
+        }
+
+        // Never connected, the properties go as on disconnect
+        void disconnect()
+        {
+            updateProperties();
+        }
+
+        bool waitForStarted(int count)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            return condition.wait_for(lock, std::chrono::seconds(10), [&]
+            {
+                return started >= count;
+            });
+        }
+
+        bool waitForUploads(int count)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            return condition.wait_for(lock, std::chrono::seconds(10), [&]
+            {
+                return uploads >= count;
+            });
+        }
+
+        int uploadCount()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            return uploads;
+        }
+
+        bool isExposing() const
+        {
+            return PrimaryCCD.isExposing();
+        }
+
+        double exposureLeft() const
+        {
+            return PrimaryCCD.getExposureLeft();
+        }
+
+    private:
+        std::mutex mutex;
+        std::condition_variable condition;
+        int started {0};
+        int uploads {0};
+};
+
+}
+
+TEST(CCD_UPLOAD, exposure_started_from_blob)
+{
+    // Destroyed before the device, so that the upload thread is never left waiting for the client
+    UploadTestCCD ccd;
+    ClientPipe client(true);
+
+    ccd.startExposure(1);
+    ccd.completeExposure();
+    ASSERT_TRUE(client.waitForBLOB(1));
+
+    // The client starts the next exposure as soon as it sees the frame, while the upload thread is still sending it
+    auto next = std::async(std::launch::async, [&]
+    {
+        ccd.startExposure(2);
+    });
+    ASSERT_TRUE(ccd.waitForStarted(2));
+    client.resume();
+    next.get();
+    ASSERT_TRUE(ccd.waitForUploads(1));
+
+    // The first frame must not report on the second exposure
+    EXPECT_TRUE(ccd.isExposing());
+    EXPECT_EQ(ccd.exposureLeft(), 2);
+}
+
+TEST(CCD_UPLOAD, frames_wait_for_room)
+{
+    UploadTestCCD ccd;
+    ClientPipe client;
+    FrameFifo fifo;
+
+    ccd.saveLocally(fifo.dir);
+    ccd.setUploadQueue(1);
+    ccd.startExposure(1);
+    ccd.completeExposure();
+    ASSERT_TRUE(fifo.waitForWriter());
+
+    // The first frame is being saved, the second one fills the queue and the third one waits
+    ccd.completeExposure();
+    ccd.completeExposure();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    fifo.drain();
+
+    EXPECT_TRUE(ccd.waitForUploads(3));
+    EXPECT_FALSE(client.hasReceived("name='CCD_UPLOAD_QUEUE'\n  state='Alert'"));
+}
+
+TEST(CCD_UPLOAD, frame_dropped_with_fast_exposure)
+{
+    UploadTestCCD ccd;
+    ClientPipe client;
+    FrameFifo fifo;
+
+    ccd.saveLocally(fifo.dir);
+    ccd.setUploadQueue(1);
+    ccd.setFastExposure(true);
+    ccd.startExposure(1);
+    ccd.completeExposure();
+    ASSERT_TRUE(fifo.waitForWriter());
+
+    // The camera does not wait for the upload, one of the next two frames finds the queue full
+    ccd.completeExposure();
+    ccd.completeExposure();
+    EXPECT_TRUE(client.waitFor("name='CCD_UPLOAD_QUEUE'\n  state='Alert'"));
+    fifo.drain();
+
+    ccd.disconnect();
+    EXPECT_EQ(ccd.uploadCount(), 2);
+}
+
+TEST(CCD_UPLOAD, queue_drained_on_disconnect)
+{
+    UploadTestCCD ccd;
+    ClientPipe client;
+    FrameFifo fifo;
+
+    ccd.saveLocally(fifo.dir);
+    ccd.startExposure(1);
+    ccd.completeExposure();
+    ASSERT_TRUE(fifo.waitForWriter());
+    ccd.completeExposure();
+    ccd.completeExposure();
+
+    // Disconnecting waits for every frame read out so far
+    auto disconnected = std::async(std::launch::async, [&]
+    {
+        ccd.disconnect();
+    });
+    fifo.drain();
+    disconnected.get();
+    EXPECT_EQ(ccd.uploadCount(), 3);
+}
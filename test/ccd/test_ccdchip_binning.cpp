@@ -0,0 +1,113 @@
+/*
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "indiccdchip.h"
+
+// Reference software binning, the straightforward per pixel version
+template <typename T>
+static std::vector<T> referenceBin(const std::vector<T> &raw, uint32_t w, uint32_t h, int binX, int binY, bool bayer)
+{
+    std::vector<T> out(raw.size(), 0);
+    uint32_t outW = w / binX, outH = bayer ? h / binY : h / binX;
+    uint64_t max = std::numeric_limits<T>::max();
+
+    for (uint32_t i = 0; i < h; i++)
+    {
+        for (uint32_t j = 0; j < w; j++)
+        {
+            uint32_t r = bayer ? ((i / binY) & ~1u) + (i & 1) : i / binX;
+            uint32_t c = bayer ? ((j / binX) & ~1u) + (j & 1) : j / binX;
+            if (r >= outH || c >= outW)
+                continue;
+            uint64_t v = raw[i * w + j];
+            if (sizeof(T) == 1 && bayer)
+                v /= uint8_t(binX * binY);
+            // 8 bit mono frames are summed here and averaged below
+            uint64_t limit = (sizeof(T) == 1 && !bayer) ? UINT64_MAX : max;
+            out[r * outW + c] = std::min<uint64_t>(out[r * outW + c] + v, limit);
+        }
+    }
+
+    if (sizeof(T) == 1 && !bayer)
+    {
+        // recompute with the full sum, averaged and capped
+        std::vector<uint64_t> sum(outW * outH, 0);
+        for (uint32_t i = 0; i < outH * binX; i++)
+            for (uint32_t j = 0; j < outW * binX; j++)
+                sum[(i / binX) * outW + j / binX] += raw[i * w + j];
+        uint64_t factor = binX * binX / 2;
+        for (size_t k = 0; k < sum.size(); k++)
+            out[k] = sum[k] / factor > 255 ? 255 : sum[k] / factor;
+    }
+
+    return out;
+}
+
+template <typename T>
+static void testBinning(uint32_t w, uint32_t h, int binX, int binY, bool bayer)
+{
+    INDI::CCDChip chip;
+    chip.setResolution(w, h);
+    chip.setFrame(0, 0, w, h);
+    chip.setBPP(sizeof(T) * 8);
+    chip.setFrameBufferSize(w * h * sizeof(T));
+
+    std::vector<T> raw(w * h);
+    uint64_t max = std::numeric_limits<T>::max();
+    for (size_t k = 0; k < raw.size(); k++)
+        raw[k] = T((k * 2654435761u >> 7) % (k % 5 == 0 ? max : max / 3));
+    memcpy(chip.getFrameBuffer(), raw.data(), raw.size() * sizeof(T));
+
+    chip.setBin(binX, binY);
+    if (bayer)
+        chip.binBayerFrame();
+    else
+        chip.binFrame();
+
+    std::vector<T> expected = referenceBin(raw, w, h, binX, binY, bayer);
+    std::vector<T> binned(raw.size());
+    memcpy(binned.data(), chip.getFrameBuffer(), binned.size() * sizeof(T));
+
+    EXPECT_EQ(binned, expected) << w << "x" << h << " bin " << binX << "x" << binY << " bpp " << sizeof(T) * 8
+                                << (bayer ? " bayer" : " mono");
+}
+
+TEST(CCDChipTest, test_bin_frame)
+{
+    for (int bin : { 2, 3, 4, 5 })
+    {
+        testBinning<uint8_t>(120, 60, bin, bin, false);
+        testBinning<uint16_t>(120, 60, bin, bin, false);
+        testBinning<uint32_t>(120, 60, bin, bin, false);
+        testBinning<uint8_t>(120, 60, bin, bin, true);
+        testBinning<uint16_t>(120, 60, bin, bin, true);
+        testBinning<uint32_t>(120, 60, bin, bin, true);
+    }
+
+    // odd sizes, non square Bayer binning and frames large enough to be split over threads
+    testBinning<uint16_t>(61, 37, 2, 2, true);
+    testBinning<uint8_t>(61, 37, 2, 3, true);
+    testBinning<uint16_t>(2048, 1200, 2, 2, false);
+    testBinning<uint16_t>(2048, 1200, 4, 4, true);
+}
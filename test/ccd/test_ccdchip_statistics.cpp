@@ -0,0 +1,85 @@
+/*
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "indiccdchip.h"
+
+template <typename T>
+static void testStatistics(uint32_t w, uint32_t h, int naxis)
+{
+    INDI::CCDChip chip;
+    chip.setResolution(w, h);
+    chip.setFrame(0, 0, w, h);
+    chip.setBPP(sizeof(T) * 8);
+    chip.setNAxis(naxis);
+
+    std::vector<T> raw(size_t(w) * h * (naxis == 3 ? 3 : 1));
+    chip.setFrameBufferSize(raw.size() * sizeof(T));
+    T max = std::numeric_limits<T>::max();
+    for (size_t k = 0; k < raw.size(); k++)
+        raw[k] = k % 97 == 0 ? max : T((k * 2654435761u >> 7) % (max / 3) + 10);
+    memcpy(chip.getFrameBuffer(), raw.data(), raw.size() * sizeof(T));
+
+    double sum = 0, sumsq = 0;
+    uint64_t saturated = 0;
+    for (T v : raw)
+    {
+        sum += v;
+        sumsq += double(v) * v;
+        saturated += v == max;
+    }
+    double mean = sum / raw.size();
+    std::vector<T> sorted = raw;
+    std::sort(sorted.begin(), sorted.end());
+
+    ASSERT_TRUE(chip.updateImageStatistics());
+    const INDI::CCDChip::ImageStatistics &stats = chip.getImageStatistics();
+    // deep frames have their median computed to within a histogram bin
+    double medianTolerance = sizeof(T) == 4 ? 65536 : 0;
+
+    EXPECT_EQ(stats.count, raw.size());
+    EXPECT_EQ(stats.min, sorted.front());
+    EXPECT_EQ(stats.max, sorted.back());
+    EXPECT_NEAR(stats.mean, mean, mean * 1e-9);
+    EXPECT_NEAR(stats.stddev, std::sqrt(sumsq / raw.size() - mean * mean), mean * 1e-6);
+    EXPECT_NEAR(stats.median, sorted[(sorted.size() - 1) / 2], medianTolerance);
+    EXPECT_EQ(stats.saturated, saturated);
+    EXPECT_EQ(stats.histogram.size(), sizeof(T) == 1 ? 256u : 65536u);
+}
+
+TEST(CCDChipTest, test_image_statistics)
+{
+    testStatistics<uint8_t>(61, 37, 2);
+    testStatistics<uint16_t>(61, 37, 2);
+    testStatistics<uint32_t>(61, 37, 2);
+    testStatistics<uint16_t>(120, 60, 3);
+
+    // large enough to be split over threads
+    testStatistics<uint16_t>(4096, 3000, 2);
+    testStatistics<uint32_t>(4096, 3000, 2);
+
+    INDI::CCDChip empty;
+    EXPECT_FALSE(empty.updateImageStatistics());
+    EXPECT_EQ(empty.getImageStatistics().count, 0u);
+}
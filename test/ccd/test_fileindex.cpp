@@ -0,0 +1,94 @@
+/*
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <unistd.h>
+
+#include "fileindex.h"
+
+static void touch(const std::string &path)
+{
+    FILE *fp = fopen(path.c_str(), "w");
+    ASSERT_NE(fp, nullptr) << path;
+    fclose(fp);
+}
+
+TEST(CCDFileIndexTest, test_next_file_index)
+{
+    char base[] = "/tmp/indi_fileindex_XXXXXX";
+    ASSERT_NE(mkdtemp(base), nullptr);
+    std::string dir = std::string(base) + "/lights";
+
+    // the directory is created and scanned once
+    EXPECT_EQ(INDI::nextFileIndex(dir, "IMAGE_XXX"), 1);
+    touch(dir + "/IMAGE_001.fits");
+    touch(dir + "/IMAGE_002.fits");
+    EXPECT_EQ(INDI::nextFileIndex(dir, "IMAGE_XXX"), 2);
+    EXPECT_EQ(INDI::nextFileIndex(dir, "IMAGE_XXX"), 3);
+
+    // files saved behind the cache are only seen after a reset
+    touch(dir + "/IMAGE_010.fits");
+    EXPECT_EQ(INDI::nextFileIndex(dir, "IMAGE_XXX"), 4);
+    INDI::resetFileIndex(dir, "IMAGE_XXX");
+    EXPECT_EQ(INDI::nextFileIndex(dir, "IMAGE_XXX"), 11);
+
+    // placeholders are ignored when matching, other prefixes have their own sequence
+    EXPECT_EQ(INDI::nextFileIndex(dir, "IMAGE_ISO8601_XXX"), 12);
+    EXPECT_EQ(INDI::nextFileIndex(dir, "FLAT_XXX"), 1);
+
+    EXPECT_EQ(INDI::expandFilePrefix("IMAGE_ISO8601_XXX", "2024-01-01T00-00-00", 7), "IMAGE_2024-01-01T00-00-00_007");
+    EXPECT_EQ(INDI::expandFilePrefix("IMAGE_XXX", "", 1234), "IMAGE_1234");
+
+    for (const char *name : { "IMAGE_001.fits", "IMAGE_002.fits", "IMAGE_010.fits" })
+        unlink((dir + "/" + name).c_str());
+    rmdir(dir.c_str());
+    rmdir(base);
+}
+
+TEST(CCDFileIndexTest, test_suffixed_file_index)
+{
+    char base[] = "/tmp/indi_fileindex_XXXXXX";
+    ASSERT_NE(mkdtemp(base), nullptr);
+    std::string dir = base;
+
+    // a CCD and a DSP plugin saving alternately with one prefix each keep their own sequence
+    touch(dir + "/IMAGE_004.fits");
+    touch(dir + "/IMAGE_001_dft.fits");
+    touch(dir + "/IMAGE_002_dft.fits");
+    touch(dir + "/IMAGE_007_histogram.fits");
+    EXPECT_EQ(INDI::nextFileIndex(dir, "IMAGE_XXX"), 5);
+    EXPECT_EQ(INDI::nextFileIndex(dir, "IMAGE_XXX", "_dft"), 3);
+    EXPECT_EQ(INDI::nextFileIndex(dir, "IMAGE_XXX"), 6);
+    EXPECT_EQ(INDI::nextFileIndex(dir, "IMAGE_XXX", "_dft"), 4);
+    EXPECT_EQ(INDI::nextFileIndex(dir, "IMAGE_XXX", "_histogram"), 8);
+    EXPECT_EQ(INDI::nextFileIndex(dir, "IMAGE_XXX", "_spectrum"), 1);
+
+    // resetting one sequence leaves the others alone
+    touch(dir + "/IMAGE_009_dft.fits");
+    INDI::resetFileIndex(dir, "IMAGE_XXX", "_dft");
+    EXPECT_EQ(INDI::nextFileIndex(dir, "IMAGE_XXX", "_dft"), 10);
+    EXPECT_EQ(INDI::nextFileIndex(dir, "IMAGE_XXX"), 7);
+
+    for (const char *name : { "IMAGE_004.fits", "IMAGE_001_dft.fits", "IMAGE_002_dft.fits", "IMAGE_007_histogram.fits",
+                              "IMAGE_009_dft.fits" })
+        unlink((dir + "/" + name).c_str());
+    rmdir(base);
+}
@@ -0,0 +1,120 @@
+/*
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "fitsdirect.h"
+
+static std::string card(const std::string &text)
+{
+    return text + std::string(80 - text.size(), ' ');
+}
+
+template <typename T>
+static void testFITSDirect(const std::string &path, INDI::FITSDirectMode mode)
+{
+    std::string header = card("SIMPLE  =                    T") + card("BITPIX  = " + std::to_string(sizeof(T) * 8)) +
+                         card("END");
+    std::vector<T> samples(61 * 37);
+    for (size_t k = 0; k < samples.size(); k++)
+        samples[k] = T(k * 2654435761u);
+
+    ASSERT_EQ(INDI::writeFITSDirect(path.c_str(), header.data(), header.size(), samples.data(), samples.size(),
+                                    sizeof(T) * 8, mode), 0) << strerror(errno);
+
+    std::vector<uint8_t> file;
+    FILE *fp = fopen(path.c_str(), "rb");
+    ASSERT_NE(fp, nullptr);
+    uint8_t buffer[4096];
+    for (size_t n; (n = fread(buffer, 1, sizeof(buffer), fp)) > 0;)
+        file.insert(file.end(), buffer, buffer + n);
+    fclose(fp);
+    unlink(path.c_str());
+
+    size_t dataSize = samples.size() * sizeof(T);
+    ASSERT_EQ(file.size(), 2880 + (dataSize + 2879) / 2880 * 2880) << "bpp " << sizeof(T) * 8 << " mode " << mode;
+    EXPECT_EQ(std::string(file.begin(), file.begin() + 2880), header + std::string(2880 - header.size(), ' '));
+
+    // big endian, unsigned samples are offset by BZERO
+    bool same = true;
+    for (size_t k = 0; k < samples.size(); k++)
+    {
+        uint64_t value = 0;
+        for (size_t b = 0; b < sizeof(T); b++)
+            value = value << 8 | file[2880 + k * sizeof(T) + b];
+        same &= T(value) == T(samples[k] ^ (sizeof(T) == 1 ? 0 : T(1) << (sizeof(T) * 8 - 1)));
+    }
+    EXPECT_TRUE(same) << "bpp " << sizeof(T) * 8 << " mode " << mode;
+    EXPECT_EQ(std::count(file.begin() + 2880 + dataSize, file.end(), 0), long(file.size() - 2880 - dataSize));
+}
+
+TEST(CCDFitsDirectTest, test_write_fits_direct)
+{
+    char base[] = "/tmp/indi_fitsdirect_XXXXXX";
+    ASSERT_NE(mkdtemp(base), nullptr);
+    std::string path = std::string(base) + "/frame.fits";
+
+    for (INDI::FITSDirectMode mode : { INDI::FITS_DIRECT_MAPPED, INDI::FITS_DIRECT_IO })
+    {
+        testFITSDirect<uint8_t>(path, mode);
+        testFITSDirect<uint16_t>(path, mode);
+        testFITSDirect<uint32_t>(path, mode);
+    }
+
+    // the header must be whole cards
+    EXPECT_EQ(INDI::writeFITSDirect(path.c_str(), "END", 3, base, 1, 8, INDI::FITS_DIRECT_MAPPED), -1);
+    rmdir(base);
+}
+
+TEST(CCDFitsDirectTest, test_writer_abort)
+{
+    char base[] = "/tmp/indi_fitsdirect_XXXXXX";
+    ASSERT_NE(mkdtemp(base), nullptr);
+    std::string path = std::string(base) + "/frame.fits";
+    std::string header = card("SIMPLE  =                    T") + card("BITPIX  = 16") + card("END");
+    std::vector<uint16_t> samples(64, 1);
+
+    for (INDI::FITSDirectMode mode : { INDI::FITS_DIRECT_MAPPED, INDI::FITS_DIRECT_IO })
+    {
+        // converted but never closed, the file goes away with the writer
+        {
+            INDI::FITSDirectWriter writer;
+            ASSERT_EQ(writer.open(path.c_str(), header.data(), header.size(), samples.size(), 16, mode), 0);
+            writer.convert(samples.data());
+            EXPECT_EQ(access(path.c_str(), F_OK), 0);
+        }
+        EXPECT_NE(access(path.c_str(), F_OK), 0) << "mode " << mode;
+
+        INDI::FITSDirectWriter writer;
+        ASSERT_EQ(writer.open(path.c_str(), header.data(), header.size(), samples.size(), 16, mode), 0);
+        writer.convert(samples.data());
+        EXPECT_EQ(writer.close(), 0);
+        EXPECT_EQ(access(path.c_str(), F_OK), 0) << "mode " << mode;
+        unlink(path.c_str());
+    }
+    rmdir(base);
+}
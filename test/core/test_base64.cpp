@@ -21,8 +21,11 @@
 #include "config.h"
 #endif
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
+#include <string>
+#include <vector>
 
 #include "base64.h"
 
@@ -115,3 +118,109 @@ TEST(CORE_BASE64, Test_from64tobits_fast_with_bug_time)
     }
 }
 
+
+// Straightforward reference encoder
+static std::string reference_to64(const std::vector<unsigned char> &in)
+{
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    size_t i = 0;
+    for (; i + 2 < in.size(); i += 3)
+    {
+        uint32_t n = in[i] << 16 | in[i + 1] << 8 | in[i + 2];
+        out += digits[(n >> 18) & 63];
+        out += digits[(n >> 12) & 63];
+        out += digits[(n >> 6) & 63];
+        out += digits[n & 63];
+    }
+    if (i < in.size())
+    {
+        uint32_t n = in[i] << 16 | (i + 1 < in.size() ? in[i + 1] << 8 : 0);
+        out += digits[(n >> 18) & 63];
+        out += digits[(n >> 12) & 63];
+        out += (i + 1 < in.size()) ? digits[(n >> 6) & 63] : '=';
+        out += '=';
+    }
+    return out;
+}
+
+static std::vector<unsigned char> random_bytes(size_t len, unsigned int seed)
+{
+    std::vector<unsigned char> result(len);
+    srand(seed);
+    for (auto &c : result)
+        c = rand() & 0xff;
+    return result;
+}
+
+TEST(CORE_BASE64, Test_roundtrip_sizes)
+{
+    for (size_t len = 0; len < 300; len++)
+    {
+        auto in = random_bytes(len, len);
+        std::string expected = reference_to64(in);
+
+        std::vector<unsigned char> enc(4 * len / 3 + 4);
+        int enclen = to64frombits_s(enc.data(), in.data(), len, enc.size());
+        ASSERT_EQ(expected.size(), size_t(enclen));
+        ASSERT_EQ(expected, std::string(reinterpret_cast<char *>(enc.data()), enclen));
+
+        if (len == 0)
+            continue;
+
+        std::vector<char> dec(3 * enclen / 4 + 1);
+        int declen = from64tobits_fast(dec.data(), reinterpret_cast<char *>(enc.data()), enclen);
+        ASSERT_EQ(len, size_t(declen));
+        ASSERT_EQ(0, memcmp(dec.data(), in.data(), len));
+    }
+}
+
+TEST(CORE_BASE64, Test_lines)
+{
+    auto in = random_bytes(1000, 42);
+    std::string expected = reference_to64(in);
+
+    // Same layout as the one sent by drivers: 72 chars per line, each line terminated
+    std::string lines;
+    for (size_t i = 0; i < expected.size(); i += 72)
+        lines += expected.substr(i, 72) + "\n";
+
+    std::vector<unsigned char> enc(to64frombits_lines_bound(in.size(), 72));
+    int enclen = to64frombits_lines_s(enc.data(), in.data(), in.size(), enc.size(), 72);
+    ASSERT_EQ(lines, std::string(reinterpret_cast<char *>(enc.data()), enclen));
+
+    // Decoder skips line breaks when given the length without them
+    std::vector<char> dec(in.size() + 3);
+    int declen = from64tobits_fast(dec.data(), reinterpret_cast<char *>(enc.data()), expected.size());
+    ASSERT_EQ(in.size(), size_t(declen));
+    ASSERT_EQ(0, memcmp(dec.data(), in.data(), in.size()));
+}
+
+TEST(CORE_BASE64, Test_stream)
+{
+    auto in = random_bytes(5000, 7);
+
+    std::vector<unsigned char> expected(to64frombits_lines_bound(in.size(), 72));
+    expected.resize(to64frombits_lines_s(expected.data(), in.data(), in.size(), expected.size(), 72));
+
+    // Feed the encoder with odd sized slices
+    base64_stream stream;
+    to64frombits_stream_init(&stream, 72);
+    std::vector<unsigned char> out;
+    size_t pos = 0, slice = 1;
+    while (pos < in.size())
+    {
+        size_t len = std::min(slice, in.size() - pos);
+        std::vector<unsigned char> buf(to64frombits_stream_bound(&stream, len));
+        size_t l = to64frombits_stream_update(&stream, buf.data(), in.data() + pos, len);
+        ASSERT_LE(l, buf.size());
+        out.insert(out.end(), buf.begin(), buf.begin() + l);
+        pos += len;
+        slice = slice * 3 + 1;
+    }
+    unsigned char last[5];
+    size_t l = to64frombits_stream_finish(&stream, last);
+    out.insert(out.end(), last, last + l);
+
+    ASSERT_EQ(expected, out);
+}
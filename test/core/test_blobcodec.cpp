@@ -0,0 +1,106 @@
+/*
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "indiblobcodec.h"
+
+/* a smooth 16 bit frame with some noise, as cameras produce */
+static std::vector<uint8_t> frame(size_t size)
+{
+    std::vector<uint8_t> data(size);
+    uint32_t seed = 1;
+    for (size_t i = 0; i < size / 2; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        uint16_t value = uint16_t(1000 + (i % 4096) / 8 + (seed >> 28));
+        data[2 * i] = uint8_t(value);
+        data[2 * i + 1] = uint8_t(value >> 8);
+    }
+    if (size % 2)
+        data.back() = 0x5a;
+    return data;
+}
+
+static void roundTrip(INDI::BlobCodec codec, size_t size, size_t elementSize, int level)
+{
+    std::vector<uint8_t> data = frame(size), compressed;
+    ASSERT_TRUE(INDI::compressBlob(data.data(), data.size(), compressed, codec, level, elementSize));
+
+    ASSERT_EQ(INDI::blobUncompressedSize(compressed.data(), compressed.size()), size);
+    std::vector<uint8_t> result(size + 1, 0xff);
+    ASSERT_TRUE(INDI::decompressBlob(compressed.data(), compressed.size(), result.data(), size));
+    result.pop_back();
+    EXPECT_EQ(result, data) << "size " << size << " element " << elementSize;
+}
+
+TEST(CORE_BLOBCODEC, Test_zlib_round_trip)
+{
+    for (size_t elementSize : { 1, 2, 4, 8 })
+        for (size_t size : { 0, 1, 3, 4095, 1 << 20, (3 << 20) + 7 })
+            roundTrip(INDI::BLOB_CODEC_ZLIB, size, elementSize, 1);
+}
+
+TEST(CORE_BLOBCODEC, Test_zstd_round_trip)
+{
+    if (!INDI::isBlobCodecAvailable(INDI::BLOB_CODEC_ZSTD))
+        GTEST_SKIP() << "built without zstd";
+
+    for (int level : { -7, 1, 19 })
+        for (size_t size : { 0, 5, (2 << 20) + 3 })
+            roundTrip(INDI::BLOB_CODEC_ZSTD, size, 2, level);
+}
+
+TEST(CORE_BLOBCODEC, Test_shuffle_helps)
+{
+    std::vector<uint8_t> data = frame(4 << 20), plain, shuffled;
+    ASSERT_TRUE(INDI::compressBlob(data.data(), data.size(), plain, INDI::BLOB_CODEC_ZLIB, 1, 1));
+    ASSERT_TRUE(INDI::compressBlob(data.data(), data.size(), shuffled, INDI::BLOB_CODEC_ZLIB, 1, 2));
+    EXPECT_LT(shuffled.size(), plain.size());
+}
+
+TEST(CORE_BLOBCODEC, Test_incompressible_and_corrupt)
+{
+    std::vector<uint8_t> data(100000), compressed;
+    uint32_t seed = 7;
+    for (auto &byte : data)
+        byte = uint8_t((seed = seed * 1664525 + 1013904223) >> 24);
+
+    ASSERT_TRUE(INDI::compressBlob(data.data(), data.size(), compressed, INDI::BLOB_CODEC_ZLIB, 9, 1));
+    EXPECT_LE(compressed.size(), data.size() + 64);
+
+    std::vector<uint8_t> result(data.size());
+    ASSERT_TRUE(INDI::decompressBlob(compressed.data(), compressed.size(), result.data(), result.size()));
+    EXPECT_EQ(result, data);
+
+    /* too small an output buffer, truncated data, bad magic */
+    EXPECT_FALSE(INDI::decompressBlob(compressed.data(), compressed.size(), result.data(), result.size() - 1));
+    EXPECT_FALSE(INDI::decompressBlob(compressed.data(), compressed.size() - 1, result.data(), result.size()));
+    compressed[0] = 'X';
+    EXPECT_EQ(INDI::blobUncompressedSize(compressed.data(), compressed.size()), 0u);
+    EXPECT_FALSE(INDI::decompressBlob(compressed.data(), compressed.size(), result.data(), result.size()));
+
+    /* damaged compressed chunk */
+    std::vector<uint8_t> smooth = frame(100000);
+    ASSERT_TRUE(INDI::compressBlob(smooth.data(), smooth.size(), compressed, INDI::BLOB_CODEC_ZLIB, 1, 2));
+    compressed[compressed.size() / 2] ^= 0xff;
+    EXPECT_FALSE(INDI::decompressBlob(compressed.data(), compressed.size(), result.data(), result.size()));
+
+    EXPECT_FALSE(INDI::compressBlob(data.data(), data.size(), compressed, INDI::BLOB_CODEC_ZLIB, 1, 3));
+}
@@ -0,0 +1,280 @@
+/*
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <gtest/gtest.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "eventloop.h"
+
+namespace
+{
+
+struct Recorder
+{
+    std::vector<int> calls;
+    int done = 0;
+};
+
+struct Tagged
+{
+    Recorder *recorder;
+    int tag;
+    int id;
+};
+
+void record(void *p)
+{
+    Tagged *t = static_cast<Tagged *>(p);
+    t->recorder->calls.push_back(t->tag);
+}
+
+void recordAndFinish(void *p)
+{
+    record(p);
+    static_cast<Tagged *>(p)->recorder->done = 1;
+}
+
+// Removes its own timer after the third call
+void tickThenRemove(void *p)
+{
+    Tagged *t = static_cast<Tagged *>(p);
+    t->recorder->calls.push_back(t->tag);
+    if (t->recorder->calls.size() == 3)
+    {
+        rmTimer(t->id);
+        t->recorder->done = 1;
+    }
+}
+
+// Removes its own single shot timer while it runs
+void removeSelf(void *p)
+{
+    Tagged *t = static_cast<Tagged *>(p);
+    rmTimer(t->id);
+    t->recorder->calls.push_back(t->tag);
+    t->recorder->done = 1;
+}
+
+void readByte(int fd, void *p)
+{
+    char c;
+    ASSERT_EQ(read(fd, &c, 1), 1);
+    Tagged *t = static_cast<Tagged *>(p);
+    t->recorder->calls.push_back(t->tag);
+    t->recorder->done = 1;
+}
+
+// Reads one byte and removes its own callback
+void readByteAndRemove(int fd, void *p)
+{
+    readByte(fd, p);
+    rmCallback(static_cast<Tagged *>(p)->id);
+}
+
+// Runs the loop until a callback sets recorder.done, -1 if ms elapsed first
+int waitFor(Recorder &recorder, int ms = 1000)
+{
+    recorder.done = 0;
+    return deferLoop(ms, &recorder.done);
+}
+
+}
+
+TEST(CORE_EVENTLOOP, timers_run_in_order)
+{
+    Recorder recorder;
+    Tagged t30 {&recorder, 30, 0}, t10 {&recorder, 10, 0}, t20a {&recorder, 20, 0}, t20b {&recorder, 21, 0};
+
+    addTimer(30, recordAndFinish, &t30);
+    addTimer(10, record, &t10);
+    addTimer(20, record, &t20a);
+    addTimer(20, record, &t20b);
+
+    EXPECT_EQ(waitFor(recorder), 0);
+    // same delay: first registered runs first
+    EXPECT_EQ(recorder.calls, std::vector<int>({10, 20, 21, 30}));
+}
+
+TEST(CORE_EVENTLOOP, removed_timer_does_not_run)
+{
+    Recorder recorder;
+    Tagged removed {&recorder, 1, 0}, kept {&recorder, 2, 0};
+
+    removed.id = addTimer(5, record, &removed);
+    kept.id = addTimer(20, recordAndFinish, &kept);
+    EXPECT_GE(remainingTimer(removed.id), 0);
+    rmTimer(removed.id);
+    EXPECT_EQ(remainingTimer(removed.id), -1);
+
+    EXPECT_EQ(waitFor(recorder), 0);
+    EXPECT_EQ(recorder.calls, std::vector<int>({2}));
+    EXPECT_EQ(remainingTimer(kept.id), -1);
+}
+
+TEST(CORE_EVENTLOOP, periodic_timer_removed_from_its_callback)
+{
+    Recorder recorder;
+    Tagged periodic {&recorder, 1, 0};
+
+    periodic.id = addPeriodicTimer(5, tickThenRemove, &periodic);
+    EXPECT_EQ(waitFor(recorder), 0);
+    EXPECT_EQ(recorder.calls.size(), 3u);
+    EXPECT_EQ(remainingTimer(periodic.id), -1);
+
+    // no more ticks
+    EXPECT_EQ(waitFor(recorder, 30), -1);
+    EXPECT_EQ(recorder.calls.size(), 3u);
+}
+
+TEST(CORE_EVENTLOOP, single_shot_timer_removed_from_its_callback)
+{
+    Recorder recorder;
+    Tagged once {&recorder, 1, 0}, other {&recorder, 2, 0};
+
+    once.id = addTimer(5, removeSelf, &once);
+    other.id = addTimer(10, record, &other);
+    EXPECT_EQ(waitFor(recorder), 0);
+    EXPECT_EQ(remainingTimer(once.id), -1);
+
+    // removing it again is ignored, the other timer still runs
+    rmTimer(once.id);
+    EXPECT_EQ(waitFor(recorder, 30), -1);
+    EXPECT_EQ(recorder.calls, std::vector<int>({1, 2}));
+}
+
+TEST(CORE_EVENTLOOP, callback_removed_from_its_callback)
+{
+    Recorder recorder;
+    Tagged cb {&recorder, 1, 0};
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+
+    cb.id = addCallback(fds[0], readByteAndRemove, &cb);
+    ASSERT_EQ(write(fds[1], "ab", 2), 2);
+    EXPECT_EQ(waitFor(recorder), 0);
+
+    // the second byte is left unread
+    EXPECT_EQ(waitFor(recorder, 30), -1);
+    EXPECT_EQ(recorder.calls, std::vector<int>({1}));
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST(CORE_EVENTLOOP, callback_slot_reuse)
+{
+    Recorder recorder;
+    Tagged first {&recorder, 1, 0}, second {&recorder, 2, 0};
+    int a[2], b[2];
+    ASSERT_EQ(pipe(a), 0);
+    ASSERT_EQ(pipe(b), 0);
+
+    first.id = addCallback(a[0], readByte, &first);
+    rmCallback(first.id);
+    second.id = addCallback(b[0], readByte, &second);
+    EXPECT_EQ(second.id, first.id);
+
+    // the removed registration does not fire any more
+    ASSERT_EQ(write(a[1], "a", 1), 1);
+    EXPECT_EQ(waitFor(recorder, 30), -1);
+    EXPECT_TRUE(recorder.calls.empty());
+
+    ASSERT_EQ(write(b[1], "b", 1), 1);
+    EXPECT_EQ(waitFor(recorder), 0);
+    EXPECT_EQ(recorder.calls, std::vector<int>({2}));
+
+    rmCallback(second.id);
+    for (int fd : {a[0], a[1], b[0], b[1]})
+        close(fd);
+}
+
+TEST(CORE_EVENTLOOP, callbacks_sharing_an_fd)
+{
+    Recorder recorder;
+    Tagged first {&recorder, 1, 0}, second {&recorder, 2, 0};
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+
+    first.id = addCallback(fds[0], readByte, &first);
+    second.id = addCallback(fds[0], readByte, &second);
+
+    // they take turns
+    ASSERT_EQ(write(fds[1], "ab", 2), 2);
+    EXPECT_EQ(waitFor(recorder), 0);
+    EXPECT_EQ(waitFor(recorder), 0);
+    std::vector<int> calls = recorder.calls;
+    std::sort(calls.begin(), calls.end());
+    EXPECT_EQ(calls, std::vector<int>({1, 2}));
+
+    // removing one keeps the fd watched for the other
+    rmCallback(first.id);
+    recorder.calls.clear();
+    ASSERT_EQ(write(fds[1], "c", 1), 1);
+    EXPECT_EQ(waitFor(recorder), 0);
+    EXPECT_EQ(recorder.calls, std::vector<int>({2}));
+
+    rmCallback(second.id);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST(CORE_EVENTLOOP, fd_closed_and_reopened)
+{
+    Recorder recorder;
+    Tagged cb {&recorder, 1, 0};
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+
+    cb.id = addCallback(fds[0], readByte, &cb);
+    rmCallback(cb.id);
+    close(fds[0]);
+    close(fds[1]);
+
+    // same fd numbers, registered again
+    ASSERT_EQ(pipe(fds), 0);
+    cb.id = addCallback(fds[0], readByte, &cb);
+    ASSERT_EQ(write(fds[1], "a", 1), 1);
+    EXPECT_EQ(waitFor(recorder), 0);
+    EXPECT_EQ(recorder.calls, std::vector<int>({1}));
+
+    rmCallback(cb.id);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST(CORE_EVENTLOOP, watched_fd_is_not_held_open)
+{
+    Recorder recorder;
+    Tagged cb {&recorder, 1, 0};
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+
+    // closing a watched fd closes the file: the writer sees the reader gone
+    cb.id = addCallback(fds[0], readByte, &cb);
+    close(fds[0]);
+    signal(SIGPIPE, SIG_IGN);
+    EXPECT_EQ(write(fds[1], "a", 1), -1);
+    EXPECT_EQ(errno, EPIPE);
+
+    rmCallback(cb.id);
+    close(fds[1]);
+}
@@ -0,0 +1,311 @@
+/*
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "lilxml.h"
+
+static const char *messages =
+    "<?xml version='1.0'?>\n"
+    "<defNumberVector device='CCD Simulator' name='CCD_EXPOSURE' label='Expose' group='Main Control' state='Idle' perm='rw' timeout='60' timestamp='2023-01-01T00:00:00'>\n"
+    "    <defNumber name='CCD_EXPOSURE_VALUE' label='Duration (s)' format='%5.2f' min='0.01' max='3600' step='1'>\n"
+    "      1\n"
+    "    </defNumber>\n"
+    "</defNumberVector>\n"
+    "<setTextVector device=\"Dev\" name=\"TXT\" state=\"Ok\">\n"
+    "  <oneText name=\"T\">\n"
+    "      a &lt;b&gt; &amp; &apos;c&apos; &quot;d&quot; &unknown; e\n"
+    "  </oneText>\n"
+    "  <oneText name='attr &amp; &lt;'/>\n"
+    "</setTextVector>\n"
+    "<!-- a comment -->\n"
+    "<getProperties version='1.7'/>\n"
+    "<message device='x' message='hello &gt; world'/>\n"
+    "<delProperty device = 'x'  name= 'y' />\n"
+    "<newSwitchVector device='S' name='CONNECTION'>\n"
+    "  <oneSwitch name='CONNECT'>On</oneSwitch><oneSwitch name='DISCONNECT'>Off</oneSwitch>\n"
+    "</newSwitchVector>\n"
+    "<setBLOBVector device='CCD' name='CCD1'>\n"
+    "  <oneBLOB name='CCD1' size='12' enclen='16' format='.fits'>\n"
+    "QUJDREVGR0hJSktM\n"
+    "  </oneBLOB>\n"
+    "</setBLOBVector>\n"
+    "<mixed> head <child/> tail </mixed>\n";
+
+static std::string print(XMLEle *root)
+{
+    std::string s(sprlXMLEle(root, 0) + 1, '\0');
+    s.resize(sprXMLEle(&s[0], root, 0));
+    return s;
+}
+
+/* parse data, cut in chunks of the given size (all at once if 0) */
+static std::vector<std::string> parse(const std::string &data, bool arena, size_t chunk, std::string *errors = nullptr)
+{
+    std::vector<std::string> result;
+    LilXML *lp = newLilXML();
+    char ynot[1024];
+
+    setArenaLilXML(lp, arena);
+    for (size_t pos = 0; pos < data.size();)
+    {
+        size_t len = chunk ? std::min(chunk, data.size() - pos) : data.size() - pos;
+        std::string copy = data.substr(pos, len);
+        XMLEle **nodes = parseXMLChunk(lp, &copy[0], int(len), ynot);
+        if (ynot[0] && errors)
+            *errors += std::string(ynot) + "\n";
+        for (XMLEle **node = nodes; *node; ++node)
+        {
+            result.push_back(print(*node));
+            delXMLEle(*node);
+        }
+        free(nodes);
+        pos += len;
+    }
+    delLilXML(lp);
+    return result;
+}
+
+TEST(CORE_LILXML, Test_arena_same_as_default)
+{
+    std::vector<std::string> expected = parse(messages, false, 0);
+    ASSERT_EQ(expected.size(), 8u);
+
+    for (size_t chunk : { 0, 1, 2, 3, 7, 13, 64, 1000 })
+    {
+        EXPECT_EQ(parse(messages, true, chunk), expected) << "chunk " << chunk;
+        EXPECT_EQ(parse(messages, false, chunk), expected) << "chunk " << chunk;
+    }
+}
+
+TEST(CORE_LILXML, Test_arena_accessors)
+{
+    LilXML *lp = newLilXML();
+    char ynot[1024];
+    std::string data = messages;
+
+    setArenaLilXML(lp, 1);
+    XMLEle **nodes = parseXMLChunk(lp, &data[0], int(data.size()), ynot);
+    ASSERT_EQ(ynot[0], '\0');
+
+    XMLEle *text = nodes[1];
+    EXPECT_STREQ(tagXMLEle(text), "setTextVector");
+    EXPECT_STREQ(findXMLAttValu(text, "state"), "Ok");
+    EXPECT_EQ(nXMLEle(text), 2);
+    EXPECT_EQ(nXMLAtt(text), 3);
+    EXPECT_STREQ(pcdataXMLEle(text), "");
+
+    XMLEle *one = findXMLEle(text, "oneText");
+    ASSERT_NE(one, nullptr);
+    EXPECT_STREQ(pcdataXMLEle(one), "a <b> & 'c' \"d\" &unknown; e");
+    EXPECT_EQ(pcdatalenXMLEle(one), int(strlen(pcdataXMLEle(one))));
+    EXPECT_EQ(parentXMLEle(one), text);
+    EXPECT_STREQ(findXMLAttValu(nextXMLEle(text, 0) ? nextXMLEle(text, 1) : one, "name"), "T");
+
+    XMLEle *blob = findXMLEle(nodes[6], "oneBLOB");
+    ASSERT_NE(blob, nullptr);
+    EXPECT_STREQ(pcdataXMLEle(blob), "QUJDREVGR0hJSktM");
+    EXPECT_STREQ(findXMLAttValu(blob, "enclen"), "16");
+
+    EXPECT_STREQ(pcdataXMLEle(nodes[7]), "headtail");
+
+    for (XMLEle **node = nodes; *node; ++node)
+        delXMLEle(*node);
+    free(nodes);
+    delLilXML(lp);
+}
+
+TEST(CORE_LILXML, Test_arena_editing)
+{
+    std::string data = "<a x='1' y='2'><b>text</b><c/></a>";
+    LilXML *lp = newLilXML();
+    char ynot[1024];
+
+    setArenaLilXML(lp, 1);
+    XMLEle **nodes = parseXMLChunk(lp, &data[0], int(data.size()), ynot);
+    XMLEle *root = nodes[0];
+    ASSERT_NE(root, nullptr);
+    free(nodes);
+
+    /* grow every list and string past what the arena holds */
+    for (int i = 0; i < 20; i++)
+    {
+        addXMLAtt(root, ("n" + std::to_string(i)).c_str(), "v");
+        addXMLEle(root, "d");
+    }
+    editXMLEle(findXMLEle(root, "b"), "a longer text & more");
+    editXMLAtt(findXMLAtt(root, "x"), "3");
+    rmXMLAtt(root, "y");
+    setXMLEleTag(root, "aa");
+    delXMLEle(findXMLEle(root, "c"));
+
+    EXPECT_STREQ(tagXMLEle(root), "aa");
+    EXPECT_EQ(nXMLAtt(root), 21);
+    EXPECT_EQ(nXMLEle(root), 21);
+    EXPECT_STREQ(findXMLAttValu(root, "x"), "3");
+    EXPECT_STREQ(pcdataXMLEle(findXMLEle(root, "b")), "a longer text & more");
+    EXPECT_EQ(findXMLEle(root, "c"), nullptr);
+
+    XMLEle *clone = cloneXMLEle(root, nullptr, nullptr);
+    EXPECT_EQ(print(clone), print(root));
+    delXMLEle(clone);
+
+    delXMLEle(root);
+    delLilXML(lp);
+}
+
+TEST(CORE_LILXML, Test_arena_errors)
+{
+    const std::string bad[] =
+    {
+        "<a><b></c></a>",
+        "<a x=1/>",
+        "<a>< 1</a>",
+        "<a x='1' !/>",
+        "</a>",
+    };
+    const std::string good = "<ok/>";
+
+    for (const std::string &b : bad)
+    {
+        for (bool arena : { false, true })
+        {
+            std::string errors;
+            std::vector<std::string> result = parse(b + good, arena, 0, &errors);
+            EXPECT_NE(errors, "") << b << " arena " << arena;
+            ASSERT_FALSE(result.empty()) << b << " arena " << arena;
+            EXPECT_EQ(result.back(), "<ok/>\n") << b << " arena " << arena;
+        }
+    }
+}
+
+TEST(CORE_LILXML, Test_arena_readXMLEle)
+{
+    LilXML *lp = newLilXML();
+    char ynot[1024];
+    std::vector<std::string> result;
+
+    setArenaLilXML(lp, 1);
+    for (const char *c = messages; *c; c++)
+    {
+        XMLEle *root = readXMLEle(lp, *c, ynot);
+        ASSERT_EQ(ynot[0], '\0');
+        if (root)
+        {
+            result.push_back(print(root));
+            delXMLEle(root);
+        }
+    }
+    delLilXML(lp);
+
+    EXPECT_EQ(result, parse(messages, false, 0));
+}
+
+TEST(CORE_LILXML, Test_blob_content)
+{
+    std::string base64;
+    for (int i = 0; base64.size() < 200000; i++)
+        base64 += std::string(71, char('A' + i % 26)) + "=\n";
+    base64.pop_back();
+
+    std::string data =
+        "<setBLOBVector device='CCD' name='CCD1'>\n"
+        "  <oneBLOB name='CCD1' size='1' enclen='" + std::to_string(base64.size()) + "' format='.fits'>\n"
+        "   " + base64 + "\n  \n"
+        "  </oneBLOB>\n"
+        "</setBLOBVector>\n"
+        "<setBLOBVector device='CCD' name='CCD1'><oneBLOB name='CCD1' enclen='8'>QU&amp;JD</oneBLOB></setBLOBVector>\n"
+        "<setBLOBVector device='CCD' name='CCD1'><oneBLOB name='CCD1' enclen='4'>QUJD\n</bogus>";
+
+    for (bool arena : { false, true })
+    {
+        for (size_t chunk : { 1, 100, 4096, 1 << 20 })
+        {
+            std::string errors;
+            std::vector<std::string> result = parse(data, arena, chunk, &errors);
+            ASSERT_EQ(result.size(), 2u);
+            EXPECT_NE(result[0].find("\n" + base64 + "\n"), std::string::npos);
+            EXPECT_NE(result[1].find("QU&amp;JD"), std::string::npos);
+            EXPECT_NE(errors.find("closing tag bogus does not match oneBLOB"), std::string::npos) << errors;
+        }
+    }
+}
+
+TEST(CORE_LILXML, Test_blob_content_split)
+{
+    // chunks in exactly sized buffers, so that reading outside them is caught by sanitizers
+    std::string data =
+        "<setBLOBVector device='CCD' name='CCD1'>\n"
+        "  <oneBLOB name='CCD1' size='12' enclen='16' format='.fits'>\n"
+        "QUJDREVGR0hJSktM\n"
+        "QUJDREVGR0hJSktM</oneBLOB>\n"
+        "</setBLOBVector>\n";
+    std::vector<std::string> expected = parse(data, false, 0);
+    ASSERT_EQ(expected.size(), 1u);
+
+    for (bool arena : { false, true })
+    {
+        for (size_t split = 1; split < data.size(); split++)
+        {
+            std::vector<std::string> result;
+            LilXML *lp = newLilXML();
+            char ynot[1024];
+
+            setArenaLilXML(lp, arena);
+            for (size_t pos : { size_t(0), split })
+            {
+                size_t len = pos ? data.size() - pos : split;
+                char *chunk = (char *)malloc(len);
+                memcpy(chunk, data.data() + pos, len);
+                XMLEle **nodes = parseXMLChunk(lp, chunk, int(len), ynot);
+                EXPECT_EQ(ynot[0], '\0') << ynot;
+                for (XMLEle **node = nodes; *node; ++node)
+                {
+                    result.push_back(print(*node));
+                    delXMLEle(*node);
+                }
+                free(nodes);
+                free(chunk);
+            }
+            delLilXML(lp);
+
+            EXPECT_EQ(result, expected) << "split at " << split;
+        }
+    }
+}
+
+TEST(CORE_LILXML, Test_blob_untrusted_enclen)
+{
+    // preallocation is capped, content still grows past it
+    std::string base64(5 << 20, 'Q');
+    std::string data =
+        "<setBLOBVector device='CCD' name='CCD1'><oneBLOB name='CCD1' enclen='2000000000'>" + base64 + "</oneBLOB></setBLOBVector>\n";
+
+    for (bool arena : { false, true })
+    {
+        for (size_t chunk : { 4096, 0 })
+        {
+            std::vector<std::string> result = parse(data, arena, chunk);
+            ASSERT_EQ(result.size(), 1u);
+            EXPECT_NE(result[0].find(base64), std::string::npos);
+        }
+    }
+}
@@ -0,0 +1,74 @@
+/*
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "stream/framepool.h"
+
+TEST(StreamFramePoolTest, test_recycle_buffers)
+{
+    INDI::FramePool pool;
+    const size_t frameSize = 640 * 480;
+
+    // steady state streaming: a few frames in flight, no new allocations
+    {
+        std::vector<INDI::FramePool::Buffer> inFlight;
+        for (int i = 0; i < 1000; i++)
+        {
+            inFlight.push_back(pool.acquire(frameSize));
+            ASSERT_EQ(inFlight.back().size(), frameSize);
+            memset(inFlight.back().data(), i, frameSize);
+            if (inFlight.size() > 3)
+                inFlight.erase(inFlight.begin());
+        }
+    }
+    EXPECT_EQ(pool.allocations(), 4u);
+
+    // similar sizes share buckets, far larger buffers are not wasted on small frames
+    INDI::FramePool::Buffer smaller = pool.acquire(frameSize - 1000);
+    EXPECT_EQ(pool.allocations(), 4u);
+    INDI::FramePool::Buffer tiny = pool.acquire(1000);
+    EXPECT_EQ(pool.allocations(), 5u);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(tiny.data()) % 64, 0u);
+
+    // moved from handles are empty, released buffers go back once
+    INDI::FramePool::Buffer moved = std::move(smaller);
+    EXPECT_TRUE(smaller.empty());
+    moved.release();
+    moved.release();
+    EXPECT_EQ(pool.acquire(0).data(), nullptr);
+
+    // idle memory is bounded
+    pool.clear();
+    EXPECT_EQ(pool.idleSize(), 0u);
+    pool.setMaxIdleSize(frameSize);
+    {
+        INDI::FramePool::Buffer a = pool.acquire(frameSize), b = pool.acquire(frameSize);
+    }
+    EXPECT_LE(pool.idleSize(), frameSize);
+
+    // buffers may outlive the pool
+    INDI::FramePool::Buffer orphan;
+    {
+        INDI::FramePool temporary;
+        orphan = temporary.acquire(frameSize);
+    }
+    memset(orphan.data(), 0, orphan.size());
+}
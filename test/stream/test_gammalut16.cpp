@@ -0,0 +1,50 @@
+/*
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "stream/gammalut16.h"
+
+TEST(StreamGammaLutTest, test_subframe_downscale)
+{
+    GammaLut16 lut;
+    const size_t width = 1500, height = 1000, channels = 3;
+
+    std::vector<uint16_t> frame(width * height * channels);
+    for (size_t i = 0; i < frame.size(); i++)
+        frame[i] = uint16_t(i * 2654435761u >> 7);
+
+    std::vector<uint8_t> full(frame.size()), rect;
+    lut.apply(frame.data(), frame.size(), full.data());
+    EXPECT_EQ(full[0], 0);
+
+    // whole frame and a subframe of an RGB frame, in samples
+    for (auto box : std::vector<std::vector<size_t>> { { 0, 0, width, height }, { 17, 333, 1001, 555 } })
+    {
+        size_t x = box[0], y = box[1], w = box[2] * channels, h = box[3];
+        rect.assign(w * h, 0);
+        lut.apply(frame.data() + (y * width + x) * channels, w, h, width * channels, rect.data());
+
+        bool same = true;
+        for (size_t row = 0; row < h; row++)
+            same &= memcmp(rect.data() + row * w, full.data() + ((y + row) * width + x) * channels, w) == 0;
+        EXPECT_TRUE(same) << "subframe " << x << "," << y;
+    }
+}
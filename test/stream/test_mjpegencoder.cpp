@@ -0,0 +1,90 @@
+/*
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include <jpeglib.h>
+
+#include "stream/encoder/mjpegencoder.h"
+
+static std::vector<uint8_t> decodeJPEG(const uint8_t *data, size_t size, size_t *width, size_t *height)
+{
+    jpeg_decompress_struct cinfo;
+    jpeg_error_mgr error;
+    cinfo.err = jpeg_std_error(&error);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, const_cast<uint8_t *>(data), size);
+    jpeg_read_header(&cinfo, TRUE);
+    jpeg_start_decompress(&cinfo);
+
+    *width = cinfo.output_width;
+    *height = cinfo.output_height;
+    size_t stride = size_t(cinfo.output_width) * cinfo.output_components;
+    std::vector<uint8_t> image(stride * cinfo.output_height);
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+        JSAMPROW row = image.data() + cinfo.output_scanline * stride;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    EXPECT_EQ(error.num_warnings, 0);
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return image;
+}
+
+TEST(StreamMJPEGEncoderTest, test_stripes)
+{
+    // Wide enough for a preview scaled down 2x if the encoder scaled, it must not
+    const size_t width = 1400, height = 437;
+
+    for (INDI_PIXEL_FORMAT format : { INDI_MONO, INDI_RGB })
+    {
+        size_t channels = format == INDI_RGB ? 3 : 1;
+        std::vector<uint8_t> frame(width * height * channels);
+        for (size_t i = 0; i < frame.size(); i++)
+            frame[i] = uint8_t((i % (width * channels)) / 5 + (i / width) / 3 + (i * 2654435761u >> 28));
+
+        // One piece and stripes joined with restart markers must decode to the same image
+        std::vector<std::vector<uint8_t>> images;
+        for (int threads : { 1, 3, 12 })
+        {
+            INDI::MJPEGEncoder encoder;
+            encoder.setSize(width, height);
+            encoder.setPixelFormat(format, 8);
+            encoder.setQuality(80);
+            encoder.setThreads(threads);
+
+            for (int i = 0; i < 2; i++)
+            {
+                INDI::WidgetViewBlob blob;
+                ASSERT_TRUE(encoder.upload(&blob, frame.data(), frame.size()));
+                EXPECT_STREQ(blob.getFormat(), ".stream_jpg");
+
+                size_t w = 0, h = 0;
+                images.push_back(decodeJPEG(static_cast<const uint8_t *>(blob.getBlob()), blob.getBlobLen(), &w, &h));
+                EXPECT_EQ(w, width);
+                EXPECT_EQ(h, height);
+            }
+        }
+
+        for (const auto &image : images)
+            EXPECT_TRUE(image == images[0]) << "format " << format;
+    }
+}
@@ -0,0 +1,89 @@
+/*
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "stream/recorder/serrecorder.h"
+
+static uint64_t readLE(const std::vector<uint8_t> &file, size_t offset, size_t size)
+{
+    uint64_t value = 0;
+    for (size_t b = size; b-- > 0;)
+        value = value << 8 | file[offset + b];
+    return value;
+}
+
+TEST(StreamSERRecorderTest, test_write_frames)
+{
+    char path[] = "/tmp/indi_ser_XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+
+    // Frames larger than a write buffer in total, and a second record with the same recorder
+    const uint16_t width = 1024, height = 700;
+    const size_t frameSize = size_t(width) * height * 2;
+    for (uint32_t frames : { 13u, 2u })
+    {
+        INDI::SER_Recorder recorder;
+        char errmsg[1024];
+        ASSERT_TRUE(recorder.setPixelFormat(INDI_MONO, 16));
+        ASSERT_TRUE(recorder.setSize(width, height));
+        recorder.setExpectedFrameCount(frames);
+        ASSERT_TRUE(recorder.open(path, errmsg)) << errmsg;
+
+        std::vector<uint8_t> frame(frameSize);
+        for (uint32_t i = 0; i < frames; i++)
+        {
+            std::fill(frame.begin(), frame.end(), uint8_t(i + 1));
+            ASSERT_TRUE(recorder.writeFrame(frame.data(), frame.size(), 1000000 + i));
+        }
+        EXPECT_TRUE(recorder.close());
+        EXPECT_EQ(recorder.getDroppedFrames(), 0u);
+
+        std::vector<uint8_t> file;
+        FILE *fp = fopen(path, "rb");
+        ASSERT_NE(fp, nullptr);
+        uint8_t buffer[65536];
+        for (size_t n; (n = fread(buffer, 1, sizeof(buffer), fp)) > 0;)
+            file.insert(file.end(), buffer, buffer + n);
+        fclose(fp);
+
+        ASSERT_EQ(file.size(), SER_HEADER_SIZE + frames * (frameSize + 8));
+        EXPECT_EQ(std::string(file.begin(), file.begin() + 13), "INDI-RECORDER");
+        EXPECT_EQ(readLE(file, 26, 4), width);
+        EXPECT_EQ(readLE(file, 30, 4), height);
+        EXPECT_EQ(readLE(file, 34, 4), 16u);
+        EXPECT_EQ(readLE(file, 38, 4), frames);
+
+        for (uint32_t i = 0; i < frames; i++)
+        {
+            auto begin = file.begin() + SER_HEADER_SIZE + i * frameSize;
+            EXPECT_EQ(std::count(begin, begin + frameSize, uint8_t(i + 1)), long(frameSize)) << "frame " << i;
+            EXPECT_EQ(readLE(file, SER_HEADER_SIZE + frames * frameSize + i * 8, 8), (1000000u + i) * 10) << "frame " << i;
+        }
+    }
+    unlink(path);
+}
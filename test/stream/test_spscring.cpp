@@ -0,0 +1,74 @@
+/*
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "stream/spscring.h"
+
+TEST(StreamSPSCRingTest, test_producer_consumer)
+{
+    SPSCRing<std::vector<int>> ring(5);
+    EXPECT_EQ(ring.capacity(), 8u);
+
+    // bounded, data is kept when full
+    for (int i = 0; i < 8; i++)
+        EXPECT_TRUE(ring.push(std::vector<int>(1, i)));
+    std::vector<int> rejected(1, 8);
+    EXPECT_FALSE(ring.push(std::move(rejected)));
+    EXPECT_EQ(rejected.size(), 1u);
+    EXPECT_EQ(ring.size(), 8u);
+    ring.clear();
+    EXPECT_EQ(ring.size(), 0u);
+
+    // in order across threads, with the consumer both spinning and sleeping
+    const int count = 200000;
+    std::thread producer([&ring]()
+    {
+        for (int i = 0; i < count; i++)
+        {
+            std::vector<int> value(1, i);
+            while (!ring.push(std::move(value)))
+                std::this_thread::yield();
+            if (i % 50000 == 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        ring.waitForEmpty();
+    });
+
+    bool ordered = true;
+    std::vector<int> value;
+    for (int i = 0; i < count; i++)
+    {
+        ASSERT_TRUE(ring.pop(value));
+        ordered &= value.size() == 1 && value[0] == i;
+    }
+    producer.join();
+    EXPECT_TRUE(ordered);
+    EXPECT_EQ(ring.size(), 0u);
+
+    // abort wakes up a waiting consumer
+    std::thread aborter([&ring]()
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        ring.abort();
+    });
+    EXPECT_FALSE(ring.pop(value));
+    aborter.join();
+}